@@ -0,0 +1,180 @@
+#include "allocator.h"
+
+namespace mdb {
+
+RowAllocator::RowAllocator(size_t slab_size /* =? */)
+        : slab_size_(slab_size), all_(nullptr), slab_count_(0), live_blocks_(0), bytes_used_(0) {
+    verify(slab_size_ >= sizeof(slab) + 4 * MAX_BLOCK_SIZE);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        partial_[i] = nullptr;
+    }
+}
+
+RowAllocator::~RowAllocator() {
+    // all blocks must have been freed, otherwise they will be dangling
+    verify(live_blocks_ == 0);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        while (partial_[i] != nullptr) {
+            free_slab(partial_[i]);
+        }
+    }
+    verify(slab_count_ == 0);
+}
+
+void* RowAllocator::allocate(RowAllocator* allocator, size_t size) {
+    size_t block_size = size + sizeof(block_header);
+    block_header* hdr = nullptr;
+    if (allocator != nullptr && block_size <= MAX_BLOCK_SIZE) {
+        hdr = (block_header *) allocator->alloc_block(block_size);
+    } else {
+        hdr = (block_header *) ::operator new(block_size);
+        hdr->owner = nullptr;
+    }
+    return hdr + 1;
+}
+
+void RowAllocator::deallocate(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    block_header* hdr = ((block_header *) ptr) - 1;
+    if (hdr->owner == nullptr) {
+        ::operator delete(hdr);
+    } else {
+        hdr->owner->owner->free_block_in_slab(hdr->owner, hdr);
+    }
+}
+
+const RowAllocator* RowAllocator::owner_of(const void* ptr) {
+    const block_header* hdr = ((const block_header *) ptr) - 1;
+    return (hdr->owner == nullptr) ? nullptr : hdr->owner->owner;
+}
+
+void RowAllocator::release_all() {
+    while (all_ != nullptr) {
+        slab* s = all_;
+        all_ = s->all_next;
+        ::operator delete(s);
+    }
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        partial_[i] = nullptr;
+    }
+    slab_count_ = 0;
+    live_blocks_ = 0;
+    bytes_used_ = 0;
+}
+
+RowAllocator::slab* RowAllocator::new_slab(int size_class) {
+    char* mem = (char *) ::operator new(slab_size_);
+    slab* s = (slab *) mem;
+    size_t header_size = (sizeof(slab) + SIZE_ALIGN - 1) / SIZE_ALIGN * SIZE_ALIGN;
+    s->owner = this;
+    s->size_class = size_class;
+    s->live = 0;
+    s->capacity = (slab_size_ - header_size) / class_block_size(size_class);
+    s->bump = mem + header_size;
+    s->free_list = nullptr;
+    s->prev = nullptr;
+    s->next = nullptr;
+    s->in_partial_list = false;
+    s->all_prev = nullptr;
+    s->all_next = all_;
+    if (all_ != nullptr) {
+        all_->all_prev = s;
+    }
+    all_ = s;
+    slab_count_++;
+    return s;
+}
+
+void RowAllocator::free_slab(slab* s) {
+    verify(s->live == 0);
+    if (s->in_partial_list) {
+        unlink_partial(s);
+    }
+    if (s->all_prev != nullptr) {
+        s->all_prev->all_next = s->all_next;
+    } else {
+        all_ = s->all_next;
+    }
+    if (s->all_next != nullptr) {
+        s->all_next->all_prev = s->all_prev;
+    }
+    ::operator delete(s);
+    slab_count_--;
+}
+
+void RowAllocator::link_partial(slab* s) {
+    assert(!s->in_partial_list);
+    s->prev = nullptr;
+    s->next = partial_[s->size_class];
+    if (s->next != nullptr) {
+        s->next->prev = s;
+    }
+    partial_[s->size_class] = s;
+    s->in_partial_list = true;
+}
+
+void RowAllocator::unlink_partial(slab* s) {
+    assert(s->in_partial_list);
+    if (s->prev != nullptr) {
+        s->prev->next = s->next;
+    } else {
+        partial_[s->size_class] = s->next;
+    }
+    if (s->next != nullptr) {
+        s->next->prev = s->prev;
+    }
+    s->prev = nullptr;
+    s->next = nullptr;
+    s->in_partial_list = false;
+}
+
+void* RowAllocator::alloc_block(size_t block_size) {
+    int cls = size_class(block_size);
+    slab* s = partial_[cls];
+    if (s == nullptr) {
+        s = new_slab(cls);
+        link_partial(s);
+    }
+
+    block_header* hdr = nullptr;
+    if (s->free_list != nullptr) {
+        // recycle a freed block
+        hdr = (block_header *) s->free_list;
+        s->free_list = s->free_list->next;
+    } else {
+        hdr = (block_header *) s->bump;
+        s->bump += class_block_size(cls);
+    }
+    hdr->owner = s;
+    s->live++;
+
+    if (s->live == s->capacity) {
+        // slab is full, don't look at it until some block is freed
+        unlink_partial(s);
+    }
+
+    live_blocks_++;
+    bytes_used_ += class_block_size(cls);
+    return hdr;
+}
+
+void RowAllocator::free_block_in_slab(slab* s, void* block) {
+    free_block* fb = (free_block *) block;
+    fb->next = s->free_list;
+    s->free_list = fb;
+    s->live--;
+
+    live_blocks_--;
+    bytes_used_ -= class_block_size(s->size_class);
+
+    if (s->live == 0 && (s->in_partial_list == false || partial_[s->size_class] != s || s->next != nullptr)) {
+        // the whole slab is free, give it back, unless it's the only slab left for the size class
+        free_slab(s);
+    } else if (!s->in_partial_list) {
+        link_partial(s);
+    }
+}
+
+} // namespace mdb
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <assert.h>
+
+#include "utils.h"
+
+namespace mdb {
+
+// Slab allocator for Row blocks, opt-in by attaching it to a Schema (see Schema::set_allocator).
+//
+// Blocks are carved out of fixed size slabs, grouped by size class. Freed blocks are recycled
+// within their slab, and a slab is handed back to the system as soon as all its blocks are freed,
+// so dropping or clearing a table gives back whole slabs instead of millions of small chunks.
+// When a table holds everything allocated from it, release_all() skips freeing its rows one by one.
+//
+// Every block (including those allocated without an allocator) is prefixed with a pointer to its
+// slab, so deallocate() does not need to know where the block came from.
+//
+// NOTE: not thread safe, and the allocator must outlive all blocks allocated from it.
+class RowAllocator: public NoCopy {
+    struct free_block {
+        free_block* next;
+    };
+
+    struct slab {
+        RowAllocator* owner;
+        int size_class;
+        int live;           // blocks handed out
+        int capacity;       // total blocks in this slab
+        char* bump;         // next never-used block
+        free_block* free_list;
+
+        // doubly linked list of slabs with free blocks, per size class
+        slab* prev;
+        slab* next;
+        bool in_partial_list;
+
+        // doubly linked list of all slabs
+        slab* all_prev;
+        slab* all_next;
+    };
+
+    // header in front of each block
+    struct block_header {
+        slab* owner;    // nullptr if block is allocated from heap
+    };
+
+    enum {
+        SIZE_ALIGN = 16,
+        MAX_BLOCK_SIZE = 2048,
+        NUM_SIZE_CLASSES = MAX_BLOCK_SIZE / SIZE_ALIGN
+    };
+
+    size_t slab_size_;
+    slab* partial_[NUM_SIZE_CLASSES];
+    slab* all_;
+
+    size_t slab_count_;
+    size_t live_blocks_;
+    size_t bytes_used_;
+
+    static int size_class(size_t block_size) {
+        return (block_size + SIZE_ALIGN - 1) / SIZE_ALIGN - 1;
+    }
+    static size_t class_block_size(int size_class) {
+        return (size_class + 1) * SIZE_ALIGN;
+    }
+
+    slab* new_slab(int size_class);
+    void free_slab(slab* s);
+    void link_partial(slab* s);
+    void unlink_partial(slab* s);
+
+    void* alloc_block(size_t block_size);
+    void free_block_in_slab(slab* s, void* block);
+
+public:
+
+    // slab_size should be much larger than typical row size
+    explicit RowAllocator(size_t slab_size = 64 * 1024);
+    ~RowAllocator();
+
+    // allocate from allocator, or from heap if allocator is nullptr
+    static void* allocate(RowAllocator* allocator, size_t size);
+
+    // free a block returned by allocate(), no matter where it came from
+    static void deallocate(void* ptr);
+
+    // allocator of a block returned by allocate(), nullptr if it came from heap
+    static const RowAllocator* owner_of(const void* ptr);
+
+    // free every slab at once, together with all blocks still handed out
+    // NOTE: no destructor runs, so those blocks must own nothing else, and nothing may use them anymore
+    void release_all();
+
+    // number of blocks handed out, and not freed yet
+    size_t live_blocks() const {
+        return live_blocks_;
+    }
+
+    // bytes occupied by live blocks (including per-block header and size class rounding)
+    size_t bytes_used() const {
+        return bytes_used_;
+    }
+
+    // bytes held by slabs
+    size_t bytes_reserved() const {
+        return slab_count_ * slab_size_;
+    }
+
+    size_t slab_count() const {
+        return slab_count_;
+    }
+};
+
+} // namespace mdb
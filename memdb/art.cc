@@ -0,0 +1,683 @@
+#include <algorithm>
+
+#include "art.h"
+
+using namespace std;
+
+namespace mdb {
+
+art_engine::art_engine(const Schema* schema)
+    : schema_(schema), root_(nullptr), head_(nullptr), tail_(nullptr), size_(0) {}
+
+art_engine::~art_engine() {
+    clear();
+}
+
+art_engine::leaf* art_engine::new_leaf(const std::string& key) {
+    leaf* l = (leaf *) malloc(sizeof(leaf) + key.size());
+    l->type = LEAF;
+    l->prev = nullptr;
+    l->next = nullptr;
+    l->rows = &l->inline_row;
+    l->n_rows = 0;
+    l->capacity = 1;
+    l->inline_row = nullptr;
+    l->key_len = key.size();
+    memcpy((unsigned char *) l->key(), key.data(), key.size());
+    return l;
+}
+
+void art_engine::free_leaf(leaf* l) {
+    if (l->rows != &l->inline_row) {
+        delete[] l->rows;
+    }
+    free(l);
+}
+
+void art_engine::add_row(leaf* l, Row* row) {
+    if (l->n_rows == l->capacity) {
+        Row** rows = new Row*[l->capacity * 2];
+        memcpy(rows, l->rows, l->n_rows * sizeof(Row*));
+        if (l->rows != &l->inline_row) {
+            delete[] l->rows;
+        }
+        l->rows = rows;
+        l->capacity *= 2;
+    }
+    l->rows[l->n_rows++] = row;
+}
+
+void art_engine::free_tree(art_node* n) {
+    switch (n->type) {
+    case LEAF:
+        free_leaf((leaf *) n);
+        return;
+    case NODE4:
+        for (int i = 0; i < ((node4 *) n)->count; i++) {
+            free_tree(((node4 *) n)->child[i]);
+        }
+        delete (node4 *) n;
+        return;
+    case NODE16:
+        for (int i = 0; i < ((node16 *) n)->count; i++) {
+            free_tree(((node16 *) n)->child[i]);
+        }
+        delete (node16 *) n;
+        return;
+    case NODE48:
+        for (int i = 0; i < ((node48 *) n)->count; i++) {
+            free_tree(((node48 *) n)->child[i]);
+        }
+        delete (node48 *) n;
+        return;
+    case NODE256:
+        for (int i = 0; i < 256; i++) {
+            if (((node256 *) n)->child[i] != nullptr) {
+                free_tree(((node256 *) n)->child[i]);
+            }
+        }
+        delete (node256 *) n;
+        return;
+    }
+}
+
+int art_engine::compare(const leaf* l, const std::string& key) {
+    int cmp = memcmp(l->key(), key.data(), min((size_t) l->key_len, key.size()));
+    if (cmp == 0) {
+        cmp = l->key_len - (int) key.size();
+    }
+    return (cmp < 0) ? -1 : ((cmp > 0) ? 1 : 0);
+}
+
+art_engine::art_node** art_engine::find_child(inner_node* n, unsigned char c) {
+    switch (n->type) {
+    case NODE4: {
+        node4* n4 = (node4 *) n;
+        for (int i = 0; i < n4->count; i++) {
+            if (n4->keys[i] == c) {
+                return &n4->child[i];
+            }
+        }
+        return nullptr;
+    }
+    case NODE16: {
+        node16* n16 = (node16 *) n;
+#ifdef __SSE2__
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) c), _mm_loadu_si128((const __m128i *) n16->keys));
+        int mask = _mm_movemask_epi8(cmp) & ((1 << n16->count) - 1);
+        return (mask != 0) ? &n16->child[__builtin_ctz(mask)] : nullptr;
+#else
+        for (int i = 0; i < n16->count; i++) {
+            if (n16->keys[i] == c) {
+                return &n16->child[i];
+            }
+        }
+        return nullptr;
+#endif // __SSE2__
+    }
+    case NODE48: {
+        node48* n48 = (node48 *) n;
+        return (n48->index[c] != 0) ? &n48->child[n48->index[c] - 1] : nullptr;
+    }
+    case NODE256: {
+        node256* n256 = (node256 *) n;
+        return (n256->child[c] != nullptr) ? &n256->child[c] : nullptr;
+    }
+    default:
+        verify(0);
+    }
+    return nullptr;
+}
+
+art_engine::art_node* art_engine::next_child(const inner_node* n, unsigned char c) {
+    switch (n->type) {
+    case NODE4: {
+        const node4* n4 = (const node4 *) n;
+        for (int i = 0; i < n4->count; i++) {
+            if (n4->keys[i] > c) {
+                return n4->child[i];
+            }
+        }
+        return nullptr;
+    }
+    case NODE16: {
+        const node16* n16 = (const node16 *) n;
+        for (int i = 0; i < n16->count; i++) {
+            if (n16->keys[i] > c) {
+                return n16->child[i];
+            }
+        }
+        return nullptr;
+    }
+    case NODE48: {
+        const node48* n48 = (const node48 *) n;
+        for (int b = c + 1; b < 256; b++) {
+            if (n48->index[b] != 0) {
+                return n48->child[n48->index[b] - 1];
+            }
+        }
+        return nullptr;
+    }
+    case NODE256: {
+        const node256* n256 = (const node256 *) n;
+        for (int b = c + 1; b < 256; b++) {
+            if (n256->child[b] != nullptr) {
+                return n256->child[b];
+            }
+        }
+        return nullptr;
+    }
+    default:
+        verify(0);
+    }
+    return nullptr;
+}
+
+art_engine::leaf* art_engine::minimum(const art_node* n) {
+    while (n->type != LEAF) {
+        switch (n->type) {
+        case NODE4:
+            n = ((const node4 *) n)->child[0];
+            break;
+        case NODE16:
+            n = ((const node16 *) n)->child[0];
+            break;
+        case NODE48: {
+            const node48* n48 = (const node48 *) n;
+            int b = 0;
+            while (n48->index[b] == 0) {
+                b++;
+            }
+            n = n48->child[n48->index[b] - 1];
+            break;
+        }
+        case NODE256: {
+            const node256* n256 = (const node256 *) n;
+            int b = 0;
+            while (n256->child[b] == nullptr) {
+                b++;
+            }
+            n = n256->child[b];
+            break;
+        }
+        default:
+            verify(0);
+        }
+    }
+    return (leaf *) n;
+}
+
+int art_engine::prefix_mismatch(const inner_node* n, const unsigned char* key, int key_len, int depth) {
+    int max_cmp = min(min(n->prefix_len, (int) MAX_PREFIX), key_len - depth);
+    int idx = 0;
+    for (; idx < max_cmp; idx++) {
+        if (n->partial[idx] != key[depth + idx]) {
+            return idx;
+        }
+    }
+    if (n->prefix_len > MAX_PREFIX) {
+        // bytes past MAX_PREFIX are only kept in leaves
+        const leaf* l = minimum(n);
+        max_cmp = min(n->prefix_len, key_len - depth);
+        for (; idx < max_cmp; idx++) {
+            if (l->key()[depth + idx] != key[depth + idx]) {
+                return idx;
+            }
+        }
+    }
+    return idx;
+}
+
+void art_engine::add_child(art_node** ref, inner_node* n, unsigned char c, art_node* child) {
+    switch (n->type) {
+    case NODE4: {
+        node4* n4 = (node4 *) n;
+        if (n4->count < 4) {
+            int i = 0;
+            while (i < n4->count && n4->keys[i] < c) {
+                i++;
+            }
+            memmove(n4->keys + i + 1, n4->keys + i, n4->count - i);
+            memmove(n4->child + i + 1, n4->child + i, (n4->count - i) * sizeof(art_node*));
+            n4->keys[i] = c;
+            n4->child[i] = child;
+            n4->count++;
+        } else {
+            node16* n16 = new node16;
+            *(inner_node *) n16 = *n4;
+            n16->type = NODE16;
+            memcpy(n16->keys, n4->keys, 4);
+            memcpy(n16->child, n4->child, 4 * sizeof(art_node*));
+            *ref = n16;
+            delete n4;
+            add_child(ref, n16, c, child);
+        }
+        return;
+    }
+    case NODE16: {
+        node16* n16 = (node16 *) n;
+        if (n16->count < 16) {
+            int i = 0;
+            while (i < n16->count && n16->keys[i] < c) {
+                i++;
+            }
+            memmove(n16->keys + i + 1, n16->keys + i, n16->count - i);
+            memmove(n16->child + i + 1, n16->child + i, (n16->count - i) * sizeof(art_node*));
+            n16->keys[i] = c;
+            n16->child[i] = child;
+            n16->count++;
+        } else {
+            node48* n48 = new node48;
+            *(inner_node *) n48 = *n16;
+            n48->type = NODE48;
+            memset(n48->index, 0, sizeof(n48->index));
+            for (int i = 0; i < 16; i++) {
+                n48->child[i] = n16->child[i];
+                n48->index[n16->keys[i]] = i + 1;
+            }
+            *ref = n48;
+            delete n16;
+            add_child(ref, n48, c, child);
+        }
+        return;
+    }
+    case NODE48: {
+        node48* n48 = (node48 *) n;
+        if (n48->count < 48) {
+            // slots are kept dense, see remove_child()
+            n48->child[n48->count] = child;
+            n48->index[c] = n48->count + 1;
+            n48->count++;
+        } else {
+            node256* n256 = new node256;
+            *(inner_node *) n256 = *n48;
+            n256->type = NODE256;
+            memset(n256->child, 0, sizeof(n256->child));
+            for (int b = 0; b < 256; b++) {
+                if (n48->index[b] != 0) {
+                    n256->child[b] = n48->child[n48->index[b] - 1];
+                }
+            }
+            *ref = n256;
+            delete n48;
+            add_child(ref, n256, c, child);
+        }
+        return;
+    }
+    case NODE256: {
+        node256* n256 = (node256 *) n;
+        n256->child[c] = child;
+        n256->count++;
+        return;
+    }
+    default:
+        verify(0);
+    }
+}
+
+void art_engine::remove_child(art_node** ref, inner_node* n, unsigned char c, art_node** child_ref) {
+    switch (n->type) {
+    case NODE4: {
+        node4* n4 = (node4 *) n;
+        int i = child_ref - n4->child;
+        memmove(n4->keys + i, n4->keys + i + 1, n4->count - i - 1);
+        memmove(n4->child + i, n4->child + i + 1, (n4->count - i - 1) * sizeof(art_node*));
+        n4->count--;
+        if (n4->count == 1) {
+            // single child left, merge this node's path into it
+            art_node* child = n4->child[0];
+            if (child->type != LEAF) {
+                inner_node* inner = (inner_node *) child;
+                int prefix = n4->prefix_len;
+                if (prefix < MAX_PREFIX) {
+                    n4->partial[prefix] = n4->keys[0];
+                    prefix++;
+                }
+                if (prefix < MAX_PREFIX) {
+                    int sub = min(inner->prefix_len, MAX_PREFIX - prefix);
+                    memcpy(n4->partial + prefix, inner->partial, sub);
+                    prefix += sub;
+                }
+                memcpy(inner->partial, n4->partial, min(prefix, (int) MAX_PREFIX));
+                inner->prefix_len += n4->prefix_len + 1;
+            }
+            *ref = child;
+            delete n4;
+        }
+        return;
+    }
+    case NODE16: {
+        node16* n16 = (node16 *) n;
+        int i = child_ref - n16->child;
+        memmove(n16->keys + i, n16->keys + i + 1, n16->count - i - 1);
+        memmove(n16->child + i, n16->child + i + 1, (n16->count - i - 1) * sizeof(art_node*));
+        n16->count--;
+        if (n16->count == 3) {
+            node4* n4 = new node4;
+            *(inner_node *) n4 = *n16;
+            n4->type = NODE4;
+            memcpy(n4->keys, n16->keys, 3);
+            memcpy(n4->child, n16->child, 3 * sizeof(art_node*));
+            *ref = n4;
+            delete n16;
+        }
+        return;
+    }
+    case NODE48: {
+        node48* n48 = (node48 *) n;
+        // keep slots dense: move the last child into the freed slot
+        int slot = n48->index[c] - 1;
+        int last = n48->count - 1;
+        if (slot != last) {
+            for (int b = 0; b < 256; b++) {
+                if (n48->index[b] == last + 1) {
+                    n48->index[b] = slot + 1;
+                    break;
+                }
+            }
+            n48->child[slot] = n48->child[last];
+        }
+        n48->index[c] = 0;
+        n48->count--;
+        if (n48->count == 12) {
+            node16* n16 = new node16;
+            *(inner_node *) n16 = *n48;
+            n16->type = NODE16;
+            int i = 0;
+            for (int b = 0; b < 256; b++) {
+                if (n48->index[b] != 0) {
+                    n16->keys[i] = b;
+                    n16->child[i] = n48->child[n48->index[b] - 1];
+                    i++;
+                }
+            }
+            *ref = n16;
+            delete n48;
+        }
+        return;
+    }
+    case NODE256: {
+        node256* n256 = (node256 *) n;
+        n256->child[c] = nullptr;
+        n256->count--;
+        if (n256->count == 37) {
+            node48* n48 = new node48;
+            *(inner_node *) n48 = *n256;
+            n48->type = NODE48;
+            memset(n48->index, 0, sizeof(n48->index));
+            int slot = 0;
+            for (int b = 0; b < 256; b++) {
+                if (n256->child[b] != nullptr) {
+                    n48->child[slot] = n256->child[b];
+                    n48->index[b] = slot + 1;
+                    slot++;
+                }
+            }
+            *ref = n48;
+            delete n256;
+        }
+        return;
+    }
+    default:
+        verify(0);
+    }
+}
+
+art_engine::leaf* art_engine::seek(const art_node* n, const std::string& key, int depth) const {
+    if (n->type == LEAF) {
+        return (compare((const leaf *) n, key) >= 0) ? (leaf *) n : nullptr;
+    }
+    const inner_node* inner = (const inner_node *) n;
+    const unsigned char* k = (const unsigned char *) key.data();
+    int key_len = key.size();
+
+    const leaf* min_leaf = nullptr;
+    for (int i = 0; i < inner->prefix_len; i++) {
+        if (depth + i >= key_len) {
+            // key ends inside the path, everything below is longer
+            return minimum(n);
+        }
+        unsigned char p = 0;
+        if (i < MAX_PREFIX) {
+            p = inner->partial[i];
+        } else {
+            if (min_leaf == nullptr) {
+                min_leaf = minimum(n);
+            }
+            p = min_leaf->key()[depth + i];
+        }
+        if (p < k[depth + i]) {
+            return nullptr;
+        } else if (p > k[depth + i]) {
+            return minimum(n);
+        }
+    }
+    depth += inner->prefix_len;
+    if (depth >= key_len) {
+        return minimum(n);
+    }
+
+    unsigned char c = k[depth];
+    art_node** child = find_child(const_cast<inner_node *>(inner), c);
+    if (child != nullptr) {
+        leaf* l = seek(*child, key, depth + 1);
+        if (l != nullptr) {
+            return l;
+        }
+    }
+    art_node* next = next_child(inner, c);
+    return (next != nullptr) ? minimum(next) : nullptr;
+}
+
+void art_engine::insert_leaf(art_node** ref, leaf* l, int depth) {
+    art_node* n = *ref;
+    if (n == nullptr) {
+        *ref = l;
+        return;
+    }
+    const unsigned char* key = l->key();
+
+    if (n->type == LEAF) {
+        // split the leaf into a node4 holding both leaves, after their common prefix
+        const leaf* other = (const leaf *) n;
+        int lcp = 0;
+        while (depth + lcp < l->key_len && depth + lcp < other->key_len
+                && key[depth + lcp] == other->key()[depth + lcp]) {
+            lcp++;
+        }
+        // normalized keys are prefix free, so they differ before either one ends
+        verify(depth + lcp < l->key_len && depth + lcp < other->key_len);
+        node4* n4 = new node4;
+        n4->type = NODE4;
+        n4->count = 0;
+        n4->prefix_len = lcp;
+        memcpy(n4->partial, key + depth, min(lcp, (int) MAX_PREFIX));
+        *ref = n4;
+        add_child(ref, n4, other->key()[depth + lcp], n);
+        add_child(ref, n4, key[depth + lcp], l);
+        return;
+    }
+
+    inner_node* inner = (inner_node *) n;
+    if (inner->prefix_len > 0) {
+        int idx = prefix_mismatch(inner, key, l->key_len, depth);
+        if (idx < inner->prefix_len) {
+            // split the path at the mismatch
+            node4* n4 = new node4;
+            n4->type = NODE4;
+            n4->count = 0;
+            n4->prefix_len = idx;
+            memcpy(n4->partial, inner->partial, min(idx, (int) MAX_PREFIX));
+            *ref = n4;
+            if (inner->prefix_len <= MAX_PREFIX) {
+                add_child(ref, n4, inner->partial[idx], inner);
+                inner->prefix_len -= idx + 1;
+                memmove(inner->partial, inner->partial + idx + 1, min(inner->prefix_len, (int) MAX_PREFIX));
+            } else {
+                const leaf* min_leaf = minimum(inner);
+                add_child(ref, n4, min_leaf->key()[depth + idx], inner);
+                inner->prefix_len -= idx + 1;
+                memcpy(inner->partial, min_leaf->key() + depth + idx + 1, min(inner->prefix_len, (int) MAX_PREFIX));
+            }
+            add_child(ref, n4, key[depth + idx], l);
+            return;
+        }
+        depth += inner->prefix_len;
+    }
+
+    verify(depth < l->key_len);
+    art_node** child = find_child(inner, key[depth]);
+    if (child != nullptr) {
+        insert_leaf(child, l, depth + 1);
+    } else {
+        add_child(ref, inner, key[depth], l);
+    }
+}
+
+void art_engine::remove_leaf(art_node** ref, const leaf* l, int depth) {
+    art_node* n = *ref;
+    if (n->type == LEAF) {
+        verify(n == l);
+        *ref = nullptr;
+        return;
+    }
+    inner_node* inner = (inner_node *) n;
+    depth += inner->prefix_len;
+    unsigned char c = l->key()[depth];
+    art_node** child = find_child(inner, c);
+    verify(child != nullptr);
+    if ((*child)->type == LEAF) {
+        verify(*child == l);
+        remove_child(ref, inner, c, child);
+    } else {
+        remove_leaf(child, l, depth + 1);
+    }
+}
+
+void art_engine::make_key(const SortedMultiKey& key, std::string* normalized) const {
+    if (schema_->normalized_key()) {
+        *normalized = key.normalized();
+    } else {
+        SortedMultiKey::normalize(key.get_multi_blob(), schema_, normalized);
+    }
+}
+
+void art_engine::insert(const SortedMultiKey& key, Row* row) {
+    string normalized;
+    make_key(key, &normalized);
+    leaf* succ = (root_ != nullptr) ? seek(root_, normalized, 0) : nullptr;
+    if (succ != nullptr && compare(succ, normalized) == 0) {
+        add_row(succ, row);
+        size_++;
+        return;
+    }
+
+    leaf* l = new_leaf(normalized);
+    add_row(l, row);
+    insert_leaf(&root_, l, 0);
+
+    // link in front of the first leaf with a bigger key
+    l->next = succ;
+    l->prev = (succ != nullptr) ? succ->prev : tail_;
+    if (l->prev != nullptr) {
+        l->prev->next = l;
+    } else {
+        head_ = l;
+    }
+    if (succ != nullptr) {
+        succ->prev = l;
+    } else {
+        tail_ = l;
+    }
+    size_++;
+}
+
+sorted_pos art_engine::erase(const sorted_pos& pos) {
+    leaf* l = (leaf *) pos.node;
+    int slot = pos.slot;
+    verify(l != nullptr && slot < l->n_rows);
+    memmove(l->rows + slot, l->rows + slot + 1, (l->n_rows - slot - 1) * sizeof(Row*));
+    l->n_rows--;
+    size_--;
+    if (l->n_rows > 0) {
+        return (slot < l->n_rows) ? make_pos(l, slot) : make_pos(l->next, 0);
+    }
+
+    leaf* next = l->next;
+    if (l->prev != nullptr) {
+        l->prev->next = l->next;
+    } else {
+        head_ = l->next;
+    }
+    if (l->next != nullptr) {
+        l->next->prev = l->prev;
+    } else {
+        tail_ = l->prev;
+    }
+    remove_leaf(&root_, l, 0);
+    free_leaf(l);
+    return make_pos(next, 0);
+}
+
+void art_engine::clear() {
+    if (root_ != nullptr) {
+        free_tree(root_);
+    }
+    root_ = nullptr;
+    head_ = tail_ = nullptr;
+    size_ = 0;
+}
+
+sorted_pos art_engine::lower_bound(const SortedMultiKey& key) const {
+    if (root_ == nullptr) {
+        return end();
+    }
+    string normalized;
+    make_key(key, &normalized);
+    return make_pos(seek(root_, normalized, 0), 0);
+}
+
+sorted_pos art_engine::upper_bound(const SortedMultiKey& key) const {
+    if (root_ == nullptr) {
+        return end();
+    }
+    string normalized;
+    make_key(key, &normalized);
+    if (key.partial()) {
+        // first key after all those starting with the prefix bytes, none if they are all 0xFF
+        while (!normalized.empty() && (unsigned char) normalized.back() == 0xFF) {
+            normalized.pop_back();
+        }
+        if (normalized.empty()) {
+            return end();
+        }
+        normalized.back() = (char) ((unsigned char) normalized.back() + 1);
+        return make_pos(seek(root_, normalized, 0), 0);
+    }
+    leaf* l = seek(root_, normalized, 0);
+    if (l != nullptr && compare(l, normalized) == 0) {
+        l = l->next;
+    }
+    return make_pos(l, 0);
+}
+
+void art_engine::next(sorted_pos* pos) const {
+    const leaf* l = (const leaf *) pos->node;
+    if (pos->slot + 1 < l->n_rows) {
+        pos->slot++;
+    } else {
+        *pos = make_pos(l->next, 0);
+    }
+}
+
+void art_engine::prev(sorted_pos* pos) const {
+    const leaf* l = (const leaf *) pos->node;
+    if (l != nullptr && pos->slot > 0) {
+        pos->slot--;
+    } else {
+        l = (l == nullptr) ? tail_ : l->prev;
+        *pos = make_pos(l, l->n_rows - 1);
+    }
+}
+
+} // namespace mdb
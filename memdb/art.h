@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "table.h"
+
+namespace mdb {
+
+// Adaptive radix tree engine for SortedTable (ENG_ART)
+//
+// The tree is keyed by the normalized key (see SortedMultiKey::normalize), one byte per level.
+// Inner nodes grow from 4 to 16, 48 and 256 children as needed, and shrink back on removal, so
+// sparse and dense levels both stay compact. Paths with a single child are compressed into the
+// node below: the first MAX_PREFIX bytes are kept in the node, the rest are read from any leaf
+// under it. Normalized keys are prefix free, so every key ends in its own leaf.
+//
+// A lookup costs O(key length), independent of the number of rows, and never compares full keys
+// except once at the leaf. i64 keys take at most 8 levels.
+//
+// Each leaf holds all rows with its key, in insertion order, and leaves are linked in key order
+// for scans. Positions are (leaf, index of row in leaf).
+class art_engine: public sorted_engine {
+    enum {
+        MAX_PREFIX = 10,
+    };
+
+    enum node_type: uint8_t {
+        LEAF,
+        NODE4,
+        NODE16,
+        NODE48,
+        NODE256,
+    };
+
+    struct art_node {
+        node_type type;
+    };
+
+    struct inner_node: public art_node {
+        uint16_t count;
+        int prefix_len;
+        unsigned char partial[MAX_PREFIX];
+    };
+
+    // keys are sorted
+    struct node4: public inner_node {
+        unsigned char keys[4];
+        art_node* child[4];
+    };
+
+    // keys are sorted
+    struct node16: public inner_node {
+        unsigned char keys[16];
+        art_node* child[16];
+    };
+
+    // index[c] is 1 + slot of child for byte c, 0 if none
+    struct node48: public inner_node {
+        unsigned char index[256];
+        art_node* child[48];
+    };
+
+    struct node256: public inner_node {
+        art_node* child[256];
+    };
+
+    struct leaf: public art_node {
+        leaf* prev;
+        leaf* next;
+        // rows with this key, rows == &inline_row while there is only room for one
+        Row** rows;
+        int n_rows;
+        int capacity;
+        Row* inline_row;
+        int key_len;
+        // key_len bytes follow
+
+        const unsigned char* key() const {
+            return (const unsigned char *) (this + 1);
+        }
+    };
+
+    const Schema* schema_;
+    art_node* root_;
+    leaf* head_;
+    leaf* tail_;
+    size_t size_;
+
+    static leaf* new_leaf(const std::string& key);
+    static void free_leaf(leaf* l);
+    static void add_row(leaf* l, Row* row);
+    static void free_tree(art_node* n);
+
+    // -1, 0, 1 comparing leaf key against key
+    static int compare(const leaf* l, const std::string& key);
+
+    static art_node** find_child(inner_node* n, unsigned char c);
+    // child with the smallest byte > c, nullptr if none
+    static art_node* next_child(const inner_node* n, unsigned char c);
+    static leaf* minimum(const art_node* n);
+
+    // number of prefix bytes of n which match key from depth
+    static int prefix_mismatch(const inner_node* n, const unsigned char* key, int key_len, int depth);
+
+    // add child under byte c, *ref points to n and is updated if n has to grow
+    static void add_child(art_node** ref, inner_node* n, unsigned char c, art_node* child);
+    // remove child under byte c, *ref points to n and is updated if n shrinks or collapses
+    static void remove_child(art_node** ref, inner_node* n, unsigned char c, art_node** child_ref);
+
+    // first leaf >= key under n, nullptr if all are < key
+    leaf* seek(const art_node* n, const std::string& key, int depth) const;
+    // l's key must not be in the tree yet
+    void insert_leaf(art_node** ref, leaf* l, int depth);
+    void remove_leaf(art_node** ref, const leaf* l, int depth);
+
+    void make_key(const SortedMultiKey& key, std::string* normalized) const;
+
+    static sorted_pos make_pos(const leaf* l, int slot) {
+        sorted_pos pos;
+        pos.node = (void *) l;
+        pos.slot = slot;
+        return pos;
+    }
+
+public:
+
+    explicit art_engine(const Schema* schema);
+    ~art_engine();
+
+    symbol_t rtti() const {
+        return symbol_t::ENG_ART;
+    }
+    size_t size() const {
+        return size_;
+    }
+
+    void insert(const SortedMultiKey& key, Row* row);
+    sorted_pos erase(const sorted_pos& pos);
+    void clear();
+
+    sorted_pos begin() const {
+        return make_pos(head_, 0);
+    }
+    sorted_pos end() const {
+        return make_pos(nullptr, 0);
+    }
+    sorted_pos lower_bound(const SortedMultiKey& key) const;
+    sorted_pos upper_bound(const SortedMultiKey& key) const;
+    void next(sorted_pos* pos) const;
+    void prev(sorted_pos* pos) const;
+    Row* row_at(const sorted_pos& pos) const {
+        const leaf* l = (const leaf *) pos.node;
+        assert(l != nullptr && pos.slot < l->n_rows);
+        return l->rows[pos.slot];
+    }
+    bool stored_key(const sorted_pos& pos, blob* key) const {
+        const leaf* l = (const leaf *) pos.node;
+        key->data = (const char *) l->key();
+        key->len = l->key_len;
+        return true;
+    }
+};
+
+} // namespace mdb
@@ -24,34 +24,69 @@ struct blob {
 };
 
 class MultiBlob {
+    enum {
+        // keys with up to this many parts are stored inline, without touching heap
+        INLINE_BLOBS = 4
+    };
+
     struct blob* blobs_;
     int count_;
+    struct blob inline_[INLINE_BLOBS];
 
-public:
-    explicit MultiBlob(int n = 0): blobs_(nullptr), count_(n) {
-        if (count_ > 0) {
+    void alloc_blobs(int n) {
+        count_ = n;
+        if (count_ <= INLINE_BLOBS) {
+            blobs_ = inline_;
+        } else {
             blobs_ = new blob[count_];
         }
     }
 
-    MultiBlob(const blob& b): count_(1) {
-        blobs_ = new blob[count_];
-        blobs_[0] = b;
+    void free_blobs() {
+        if (blobs_ != inline_) {
+            delete[] blobs_;
+        }
+        blobs_ = inline_;
+        count_ = 0;
     }
 
-    MultiBlob(const MultiBlob& mb): blobs_(nullptr), count_(mb.count_) {
-        if (count_ > 0) {
-            blobs_ = new blob[count_];
+    void steal_blobs(MultiBlob& o) {
+        if (o.blobs_ == o.inline_) {
+            alloc_blobs(o.count_);
+            for (int i = 0; i < count_; i++) {
+                blobs_[i] = o.inline_[i];
+            }
+        } else {
+            blobs_ = o.blobs_;
+            count_ = o.count_;
         }
+        o.blobs_ = o.inline_;
+        o.count_ = 0;
+    }
+
+public:
+    explicit MultiBlob(int n = 0) {
+        alloc_blobs(n);
+    }
+
+    MultiBlob(const blob& b) {
+        alloc_blobs(1);
+        blobs_[0] = b;
+    }
+
+    MultiBlob(const MultiBlob& mb) {
+        alloc_blobs(mb.count_);
         for (int i = 0; i < count_; i++) {
             blobs_[i] = mb.blobs_[i];
         }
     }
 
+    MultiBlob(MultiBlob&& mb) noexcept {
+        steal_blobs(mb);
+    }
+
     ~MultiBlob() {
-        if (blobs_ != nullptr) {
-            delete[] blobs_;
-        }
+        free_blobs();
     }
 
     int count() const {
@@ -60,13 +95,8 @@ public:
 
     const MultiBlob& operator= (const MultiBlob& o) {
         if (this != &o) {
-            if (blobs_ != nullptr) {
-                delete[] blobs_;
-            }
-            count_ = o.count_;
-            if (count_ > 0) {
-                blobs_ = new blob[count_];
-            }
+            free_blobs();
+            alloc_blobs(o.count_);
             for (int i = 0; i < count_; i++) {
                 blobs_[i] = o.blobs_[i];
             }
@@ -74,6 +104,14 @@ public:
         return *this;
     }
 
+    const MultiBlob& operator= (MultiBlob&& o) noexcept {
+        if (this != &o) {
+            free_blobs();
+            steal_blobs(o);
+        }
+        return *this;
+    }
+
     blob& operator[] (int idx) const {
         return blobs_[idx];
     }
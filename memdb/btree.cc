@@ -0,0 +1,624 @@
+#include <utility>
+
+#include "btree.h"
+
+using namespace std;
+
+namespace mdb {
+
+btree_engine::btree_engine(const Schema* schema): schema_(schema), store_keys_(false), size_(0) {
+    int key_bytes = 0;
+    prefix_is_key_ = true;
+    for (column_id_t col_id : schema_->key_columns_id()) {
+        const Schema::column_info* info = schema_->get_column_info(col_id);
+        if (info->type == Value::I32) {
+            key_bytes += sizeof(i32);
+        } else if (info->type == Value::I64) {
+            key_bytes += sizeof(i64);
+        } else if (info->type == Value::DOUBLE) {
+            key_bytes += sizeof(double);
+        } else {
+            prefix_is_key_ = false;
+        }
+    }
+    if (key_bytes > (int) sizeof(uint64_t)) {
+        prefix_is_key_ = false;
+    }
+
+    init_root();
+}
+
+void btree_engine::init_root() {
+    leaf_node* leaf = new_leaf();
+    leaf->count = 0;
+    leaf->subtree_rows = 0;
+    leaf->parent = nullptr;
+    leaf->prev = nullptr;
+    leaf->next = nullptr;
+    root_ = head_ = tail_ = leaf;
+}
+
+btree_engine::leaf_node* btree_engine::new_leaf() const {
+    leaf_node* leaf = new leaf_node;
+    leaf->leaf = true;
+    leaf->keys = store_keys_ ? new char*[LEAF_SLOTS + 1] : nullptr;
+    return leaf;
+}
+
+char* btree_engine::copy_key(const std::string& normalized) {
+    int len = normalized.size();
+    char* key = (char *) malloc(sizeof(int) + len);
+    memcpy(key, &len, sizeof(int));
+    memcpy(key + sizeof(int), normalized.data(), len);
+    return key;
+}
+
+void btree_engine::store_keys() {
+    verify(size_ == 0);
+    if (!store_keys_) {
+        store_keys_ = true;
+        free_node(root_);
+        init_root();
+    }
+}
+
+btree_engine::~btree_engine() {
+    free_node(root_);
+}
+
+void btree_engine::free_node(node* n) {
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        if (leaf->keys != nullptr) {
+            for (int i = 0; i < leaf->count; i++) {
+                free(leaf->keys[i]);
+            }
+            delete[] leaf->keys;
+        }
+        delete leaf;
+    } else {
+        inner_node* inner = (inner_node *) n;
+        for (int i = 0; i <= inner->count; i++) {
+            free_node(inner->child[i]);
+        }
+        delete inner;
+    }
+}
+
+uint64_t btree_engine::key_prefix(const std::string& normalized) {
+    // first 8 bytes, big-endian and zero padded, so prefixes order the same as the full key
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        prefix <<= 8;
+        if (i < normalized.size()) {
+            prefix |= (uint8_t) normalized[i];
+        }
+    }
+    return prefix;
+}
+
+void btree_engine::make_search_key(const SortedMultiKey& key, search_key* sk) const {
+    if (schema_->normalized_key()) {
+        sk->normalized = key.normalized();
+    } else {
+        SortedMultiKey::normalize(key.get_multi_blob(), schema_, &sk->normalized);
+    }
+    sk->prefix = key_prefix(sk->normalized);
+    sk->partial = key.partial();
+    sk->prefix_mask = ~uint64_t(0);
+    if (sk->partial && sk->normalized.size() < sizeof(uint64_t)) {
+        sk->prefix_mask = (sk->normalized.size() == 0) ? 0 : ~uint64_t(0) << (8 * (sizeof(uint64_t) - sk->normalized.size()));
+    }
+    sk->mb = &key.get_multi_blob();
+}
+
+int btree_engine::compare_sep(const search_key& sk, const inner_node* n, int i) {
+    uint64_t sep_prefix = n->sep_prefix[i] & sk.prefix_mask;
+    if (sk.prefix < sep_prefix) {
+        return -1;
+    } else if (sk.prefix > sep_prefix) {
+        return 1;
+    }
+    int cmp = 0;
+    if (sk.partial) {
+        // a key prefix equals every separator starting with its bytes
+        cmp = -n->sep[i].compare(0, sk.normalized.size(), sk.normalized);
+    } else {
+        cmp = sk.normalized.compare(n->sep[i]);
+    }
+    if (cmp < 0) {
+        return -1;
+    } else if (cmp > 0) {
+        return 1;
+    }
+    return 0;
+}
+
+int btree_engine::compare_row(const search_key& sk, const leaf_node* n, int i) const {
+    uint64_t row_prefix = n->prefix[i] & sk.prefix_mask;
+    if (sk.prefix < row_prefix) {
+        return -1;
+    } else if (sk.prefix > row_prefix) {
+        return 1;
+    }
+    if (prefix_is_key_ || (sk.partial && sk.normalized.size() <= sizeof(uint64_t))) {
+        return 0;
+    }
+    if (n->keys != nullptr) {
+        blob key = key_blob(n->keys[i]);
+        int len = (int) sk.normalized.size();
+        int cmp = memcmp(sk.normalized.data(), key.data, std::min(len, key.len));
+        if (cmp == 0 && !(sk.partial && key.len >= len)) {
+            cmp = len - key.len;
+        }
+        return (cmp < 0) ? -1 : (cmp > 0) ? 1 : 0;
+    }
+    return SortedMultiKey::compare(*sk.mb, key_of(n->rows[i]), schema_);
+}
+
+btree_engine::leaf_node* btree_engine::find_leaf(const search_key& sk, bool upper, const node* from /* =? */) const {
+    node* n = (from == nullptr) ? root_ : const_cast<node *>(from);
+    while (!n->leaf) {
+        inner_node* inner = (inner_node *) n;
+        // first separator >= sk (or > sk if upper)
+        int lo = 0, hi = inner->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            int cmp = compare_sep(sk, inner, mid);
+            if (cmp > 0 || (upper && cmp == 0)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        n = inner->child[lo];
+    }
+    return (leaf_node *) n;
+}
+
+int btree_engine::find_slot(const search_key& sk, const leaf_node* leaf, bool upper, int from_slot /* =? */) const {
+    int lo = from_slot, hi = leaf->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = compare_row(sk, leaf, mid);
+        if (cmp > 0 || (upper && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+sorted_pos btree_engine::make_pos(const leaf_node* leaf, int slot) {
+    sorted_pos pos;
+    pos.node = const_cast<leaf_node *>(leaf);
+    pos.slot = (leaf == nullptr) ? 0 : slot;
+    return pos;
+}
+
+sorted_pos btree_engine::bound(const SortedMultiKey& key, bool upper) const {
+    search_key sk;
+    make_search_key(key, &sk);
+    leaf_node* leaf = find_leaf(sk, upper);
+    int slot = find_slot(sk, leaf, upper);
+    if (slot == leaf->count) {
+        return make_pos(leaf->next, 0);
+    }
+    return make_pos(leaf, slot);
+}
+
+sorted_pos btree_engine::bound_from(const sorted_pos& hint, const search_key& sk, bool upper) const {
+    const leaf_node* leaf = (const leaf_node *) hint.node;
+    if (leaf == nullptr) {
+        // nothing at or after hint
+        return end();
+    }
+    int cmp = compare_row(sk, leaf, leaf->count - 1);
+    if (cmp < 0 || (!upper && cmp == 0)) {
+        return make_pos(leaf, find_slot(sk, leaf, upper, hint.slot));
+    }
+
+    // rows before hint are all below the result, so any subtree holding hint, and a row past sk
+    // (the last child starts at the last separator), holds the result as well
+    // erases may leave inner nodes with a single child and no separator, which tell nothing
+    const node* from = nullptr;
+    for (const inner_node* n = leaf->parent; n != nullptr; n = n->parent) {
+        if (n->count == 0) {
+            continue;
+        }
+        cmp = compare_sep(sk, n, n->count - 1);
+        if (cmp < 0 || (!upper && cmp == 0)) {
+            from = n;
+            break;
+        }
+    }
+    leaf_node* found = find_leaf(sk, upper, from);
+    int slot = find_slot(sk, found, upper);
+    if (slot == found->count) {
+        return make_pos(found->next, 0);
+    }
+    return make_pos(found, slot);
+}
+
+void btree_engine::equal_range_from(const sorted_pos& hint, const SortedMultiKey& key,
+                                    sorted_pos* low, sorted_pos* high) const {
+    search_key sk;
+    make_search_key(key, &sk);
+    *low = bound_from(hint, sk, false);
+    *high = bound_from(*low, sk, true);
+}
+
+sorted_pos btree_engine::begin() const {
+    if (size_ == 0) {
+        return end();
+    }
+    return make_pos(head_, 0);
+}
+
+void btree_engine::next(sorted_pos* pos) const {
+    const leaf_node* leaf = (const leaf_node *) pos->node;
+    assert(leaf != nullptr);
+    if (pos->slot + 1 < leaf->count) {
+        pos->slot++;
+    } else {
+        *pos = make_pos(leaf->next, 0);
+    }
+}
+
+void btree_engine::prev(sorted_pos* pos) const {
+    const leaf_node* leaf = (const leaf_node *) pos->node;
+    if (leaf == nullptr) {
+        verify(size_ > 0);
+        *pos = make_pos(tail_, tail_->count - 1);
+    } else if (pos->slot > 0) {
+        pos->slot--;
+    } else {
+        verify(leaf->prev != nullptr);
+        *pos = make_pos(leaf->prev, leaf->prev->count - 1);
+    }
+}
+
+int btree_engine::child_index(const inner_node* parent, const node* child) {
+    for (int i = 0; i <= parent->count; i++) {
+        if (parent->child[i] == child) {
+            return i;
+        }
+    }
+    verify(0);
+    return -1;
+}
+
+void btree_engine::add_rows(node* n, int delta) {
+    for (; n != nullptr; n = n->parent) {
+        n->subtree_rows += delta;
+    }
+}
+
+size_t btree_engine::rank(const sorted_pos& pos) const {
+    const leaf_node* leaf = (const leaf_node *) pos.node;
+    if (leaf == nullptr) {
+        return size_;
+    }
+    // rows on the left of pos in each level
+    size_t rank = pos.slot;
+    for (const node* n = leaf; n->parent != nullptr; n = n->parent) {
+        const inner_node* parent = n->parent;
+        for (int i = 0; parent->child[i] != n; i++) {
+            rank += parent->child[i]->subtree_rows;
+        }
+    }
+    return rank;
+}
+
+sorted_pos btree_engine::select(size_t rank) const {
+    if (rank >= size_) {
+        return end();
+    }
+    const node* n = root_;
+    while (!n->leaf) {
+        const inner_node* inner = (const inner_node *) n;
+        int i = 0;
+        while (rank >= inner->child[i]->subtree_rows) {
+            rank -= inner->child[i]->subtree_rows;
+            i++;
+        }
+        n = inner->child[i];
+    }
+    return make_pos((const leaf_node *) n, rank);
+}
+
+void btree_engine::insert(const SortedMultiKey& key, Row* row) {
+    search_key sk;
+    make_search_key(key, &sk);
+
+    // equal keys go after existing ones
+    leaf_node* leaf = find_leaf(sk, true);
+    int slot = find_slot(sk, leaf, true);
+    for (int i = leaf->count; i > slot; i--) {
+        leaf->prefix[i] = leaf->prefix[i - 1];
+        leaf->rows[i] = leaf->rows[i - 1];
+    }
+    leaf->prefix[slot] = sk.prefix;
+    leaf->rows[slot] = row;
+    if (leaf->keys != nullptr) {
+        memmove(&leaf->keys[slot + 1], &leaf->keys[slot], (leaf->count - slot) * sizeof(char *));
+        leaf->keys[slot] = copy_key(sk.normalized);
+    }
+    leaf->count++;
+    add_rows(leaf, 1);
+    size_++;
+
+    if (leaf->count > LEAF_SLOTS) {
+        split_leaf(leaf);
+    }
+}
+
+void btree_engine::split_leaf(leaf_node* leaf) {
+    leaf_node* right = new_leaf();
+    right->parent = leaf->parent;
+
+    int mid = leaf->count / 2;
+    right->count = leaf->count - mid;
+    for (int i = 0; i < right->count; i++) {
+        right->prefix[i] = leaf->prefix[mid + i];
+        right->rows[i] = leaf->rows[mid + i];
+    }
+    if (leaf->keys != nullptr) {
+        memcpy(right->keys, &leaf->keys[mid], right->count * sizeof(char *));
+    }
+    leaf->count = mid;
+    leaf->subtree_rows = leaf->count;
+    right->subtree_rows = right->count;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr) {
+        leaf->next->prev = right;
+    } else {
+        tail_ = right;
+    }
+    leaf->next = right;
+
+    std::string sep;
+    if (right->keys != nullptr) {
+        blob key = key_blob(right->keys[0]);
+        sep.assign(key.data, key.len);
+    } else {
+        SortedMultiKey::normalize(key_of(right->rows[0]), schema_, &sep);
+    }
+    insert_into_parent(leaf, sep, right);
+}
+
+void btree_engine::split_inner(inner_node* n) {
+    inner_node* right = new inner_node;
+    right->leaf = false;
+    right->parent = n->parent;
+
+    // separator in the middle moves up
+    int mid = n->count / 2;
+    std::string up = std::move(n->sep[mid]);
+    right->count = n->count - mid - 1;
+    for (int i = 0; i < right->count; i++) {
+        right->sep_prefix[i] = n->sep_prefix[mid + 1 + i];
+        right->sep[i] = std::move(n->sep[mid + 1 + i]);
+    }
+    right->subtree_rows = 0;
+    for (int i = 0; i <= right->count; i++) {
+        right->child[i] = n->child[mid + 1 + i];
+        right->child[i]->parent = right;
+        right->subtree_rows += right->child[i]->subtree_rows;
+    }
+    n->count = mid;
+    n->subtree_rows -= right->subtree_rows;
+
+    insert_into_parent(n, up, right);
+}
+
+void btree_engine::insert_into_parent(node* left, const std::string& sep, node* right) {
+    inner_node* parent = left->parent;
+    if (parent == nullptr) {
+        inner_node* root = new inner_node;
+        root->leaf = false;
+        root->parent = nullptr;
+        root->count = 1;
+        root->subtree_rows = left->subtree_rows + right->subtree_rows;
+        root->sep_prefix[0] = key_prefix(sep);
+        root->sep[0] = sep;
+        root->child[0] = left;
+        root->child[1] = right;
+        left->parent = right->parent = root;
+        root_ = root;
+        return;
+    }
+
+    int idx = child_index(parent, left);
+    for (int i = parent->count; i > idx; i--) {
+        parent->sep_prefix[i] = parent->sep_prefix[i - 1];
+        parent->sep[i] = std::move(parent->sep[i - 1]);
+        parent->child[i + 1] = parent->child[i];
+    }
+    parent->sep_prefix[idx] = key_prefix(sep);
+    parent->sep[idx] = sep;
+    parent->child[idx + 1] = right;
+    right->parent = parent;
+    parent->count++;
+
+    if (parent->count > INNER_SLOTS) {
+        split_inner(parent);
+    }
+}
+
+sorted_pos btree_engine::erase(const sorted_pos& pos) {
+    leaf_node* leaf = (leaf_node *) pos.node;
+    int slot = pos.slot;
+    verify(leaf != nullptr && slot < leaf->count);
+
+    for (int i = slot; i < leaf->count - 1; i++) {
+        leaf->prefix[i] = leaf->prefix[i + 1];
+        leaf->rows[i] = leaf->rows[i + 1];
+    }
+    if (leaf->keys != nullptr) {
+        free(leaf->keys[slot]);
+        memmove(&leaf->keys[slot], &leaf->keys[slot + 1], (leaf->count - 1 - slot) * sizeof(char *));
+    }
+    leaf->count--;
+    add_rows(leaf, -1);
+    size_--;
+
+    if (leaf->count > 0) {
+        if (slot < leaf->count) {
+            return make_pos(leaf, slot);
+        }
+        return make_pos(leaf->next, 0);
+    }
+    if (leaf == root_) {
+        return end();
+    }
+
+    // unlink empty leaf, no merging of half empty nodes
+    leaf_node* next = leaf->next;
+    if (leaf->prev != nullptr) {
+        leaf->prev->next = leaf->next;
+    } else {
+        head_ = leaf->next;
+    }
+    if (leaf->next != nullptr) {
+        leaf->next->prev = leaf->prev;
+    } else {
+        tail_ = leaf->prev;
+    }
+    remove_from_parent(leaf);
+
+    // root with a single child is replaced by the child
+    while (!root_->leaf && root_->count == 0) {
+        inner_node* old_root = (inner_node *) root_;
+        root_ = old_root->child[0];
+        root_->parent = nullptr;
+        delete old_root;
+    }
+
+    return make_pos(next, 0);
+}
+
+void btree_engine::remove_from_parent(node* n) {
+    inner_node* parent = n->parent;
+    verify(parent != nullptr);
+    int idx = child_index(parent, n);
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        delete[] leaf->keys;
+        delete leaf;
+    } else {
+        delete (inner_node *) n;
+    }
+
+    if (parent->count == 0) {
+        // n was the only child, root always has at least 2 children
+        verify(parent != root_);
+        remove_from_parent(parent);
+        return;
+    }
+
+    // drop child idx together with the separator on its left (or right, for the first child)
+    int sep_idx = (idx == 0) ? 0 : idx - 1;
+    for (int i = sep_idx; i < parent->count - 1; i++) {
+        parent->sep_prefix[i] = parent->sep_prefix[i + 1];
+        parent->sep[i] = std::move(parent->sep[i + 1]);
+    }
+    parent->sep[parent->count - 1].clear();
+    for (int i = idx; i < parent->count; i++) {
+        parent->child[i] = parent->child[i + 1];
+    }
+    parent->count--;
+}
+
+bool btree_engine::bulk_load(const std::vector<keyed_row>& rows) {
+    verify(size_ == 0);
+    if (rows.empty()) {
+        return true;
+    }
+    free_node(root_);
+
+    // nodes of the level being built, and the first key under each of them
+    vector<node*> level;
+    vector<string> first_keys;
+
+    // rows are spread evenly, so no leaf is left with a handful of rows at the end
+    size_t n_leaves = (rows.size() + LEAF_SLOTS - 1) / LEAF_SLOTS;
+    leaf_node* prev = nullptr;
+    for (size_t i = 0; i < n_leaves; i++) {
+        size_t from = rows.size() * i / n_leaves;
+        size_t to = rows.size() * (i + 1) / n_leaves;
+        leaf_node* leaf = new_leaf();
+        leaf->count = to - from;
+        leaf->subtree_rows = leaf->count;
+        leaf->parent = nullptr;
+        for (size_t j = from; j < to; j++) {
+            leaf->prefix[j - from] = rows[j].prefix;
+            leaf->rows[j - from] = rows[j].row;
+            if (leaf->keys != nullptr) {
+                leaf->keys[j - from] = copy_key(rows[j].key);
+            }
+        }
+        leaf->prev = prev;
+        leaf->next = nullptr;
+        if (prev != nullptr) {
+            prev->next = leaf;
+        } else {
+            head_ = leaf;
+        }
+        prev = leaf;
+        level.push_back(leaf);
+        first_keys.push_back(rows[from].key);
+    }
+    tail_ = prev;
+
+    while (level.size() > 1) {
+        vector<node*> upper;
+        vector<string> upper_first_keys;
+        size_t n_inner = (level.size() + INNER_SLOTS) / (INNER_SLOTS + 1);
+        for (size_t i = 0; i < n_inner; i++) {
+            size_t from = level.size() * i / n_inner;
+            size_t to = level.size() * (i + 1) / n_inner;
+            inner_node* inner = new inner_node;
+            inner->leaf = false;
+            inner->parent = nullptr;
+            inner->count = to - from - 1;
+            inner->subtree_rows = 0;
+            for (size_t j = from; j < to; j++) {
+                inner->child[j - from] = level[j];
+                level[j]->parent = inner;
+                inner->subtree_rows += level[j]->subtree_rows;
+                if (j > from) {
+                    // same separator a split would have made, the first key of the right child
+                    inner->sep_prefix[j - from - 1] = key_prefix(first_keys[j]);
+                    inner->sep[j - from - 1] = std::move(first_keys[j]);
+                }
+            }
+            upper.push_back(inner);
+            upper_first_keys.push_back(std::move(first_keys[from]));
+        }
+        level.swap(upper);
+        first_keys.swap(upper_first_keys);
+    }
+    root_ = level[0];
+    size_ = rows.size();
+    return true;
+}
+
+void btree_engine::clear() {
+    free_node(root_);
+    init_root();
+    size_ = 0;
+}
+
+int btree_engine::height() const {
+    int h = 1;
+    for (node* n = root_; !n->leaf; n = ((inner_node *) n)->child[0]) {
+        h++;
+    }
+    return h;
+}
+
+} // namespace mdb
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "table.h"
+
+namespace mdb {
+
+// B+tree engine for SortedTable (ENG_BTREE)
+//
+// Wide nodes keep a scan or a lookup on a few cache lines per level, instead of one heap node
+// per row. Leaves store (8 byte key prefix, Row*) pairs and are linked for range scans. Inner
+// nodes store the full normalized key (see SortedMultiKey::normalize) as separators, next to
+// their 8 byte prefix, so most comparisons are a single integer compare.
+//
+// Leaves only fall back to comparing the full key of the stored Row when prefixes are equal.
+// After store_keys(), leaves keep a copy of the full normalized key of every row as well, and
+// compare against that instead, so the rows are never read.
+//
+// Every node keeps the number of rows in its subtree, so rank() and select() cost O(log n).
+//
+// Deletion frees a node when it becomes empty, and does not merge half-empty nodes.
+class btree_engine: public sorted_engine {
+    enum {
+        LEAF_SLOTS = 64,
+        INNER_SLOTS = 32,
+    };
+
+    struct inner_node;
+
+    struct node {
+        bool leaf;
+        int count;          // leaf: number of rows, inner: number of separators
+        size_t subtree_rows;
+        inner_node* parent;
+    };
+
+    struct leaf_node: public node {
+        leaf_node* prev;
+        leaf_node* next;
+        // one extra slot, nodes are split right after overflowing
+        uint64_t prefix[LEAF_SLOTS + 1];
+        Row* rows[LEAF_SLOTS + 1];
+        // full normalized keys of rows if store_keys_ (see copy_key()), nullptr otherwise
+        char** keys;
+    };
+
+    // child[i] holds keys in [sep[i - 1], sep[i]]
+    struct inner_node: public node {
+        uint64_t sep_prefix[INNER_SLOTS + 1];
+        std::string sep[INNER_SLOTS + 1];
+        node* child[INNER_SLOTS + 2];
+    };
+
+    struct search_key {
+        uint64_t prefix;
+        // prefixes of stored keys are masked to the bytes a key prefix has (all ones for full keys)
+        uint64_t prefix_mask;
+        bool partial;
+        std::string normalized;
+        const MultiBlob* mb;
+    };
+
+    const Schema* schema_;
+    // key columns are fixed size and fit in 8 bytes, so equal prefixes mean equal keys
+    bool prefix_is_key_;
+    bool store_keys_;
+    node* root_;
+    leaf_node* head_;
+    leaf_node* tail_;
+    size_t size_;
+
+    // empty leaf as root
+    void init_root();
+    leaf_node* new_leaf() const;
+
+    // heap copy of a normalized key for leaf_node::keys: int length, then the bytes
+    static char* copy_key(const std::string& normalized);
+    static blob key_blob(const char* key) {
+        blob b;
+        memcpy(&b.len, key, sizeof(int));
+        b.data = key + sizeof(int);
+        return b;
+    }
+
+    static uint64_t key_prefix(const std::string& normalized);
+    void make_search_key(const SortedMultiKey& key, search_key* sk) const;
+
+    // -1, 0, 1 comparing sk against separator or row
+    static int compare_sep(const search_key& sk, const inner_node* n, int i);
+    int compare_row(const search_key& sk, const leaf_node* n, int i) const;
+
+    // leaf and slot of the first row >= sk (upper == false) or > sk (upper == true)
+    // find_leaf() descends from root, or from the subtree at from if given
+    leaf_node* find_leaf(const search_key& sk, bool upper, const node* from = nullptr) const;
+    int find_slot(const search_key& sk, const leaf_node* leaf, bool upper, int from_slot = 0) const;
+    sorted_pos bound(const SortedMultiKey& key, bool upper) const;
+    // searches the rest of hint's leaf, or climbs from it to the lowest subtree holding the result
+    sorted_pos bound_from(const sorted_pos& hint, const search_key& sk, bool upper) const;
+
+    static sorted_pos make_pos(const leaf_node* leaf, int slot);
+
+    void insert_into_parent(node* left, const std::string& sep, node* right);
+    void split_leaf(leaf_node* leaf);
+    void split_inner(inner_node* n);
+    void remove_from_parent(node* n);
+
+    static int child_index(const inner_node* parent, const node* child);
+    // add delta to row count of n and all its ancestors
+    static void add_rows(node* n, int delta);
+    static void free_node(node* n);
+
+public:
+
+    explicit btree_engine(const Schema* schema);
+    ~btree_engine();
+
+    symbol_t rtti() const {
+        return symbol_t::ENG_BTREE;
+    }
+    size_t size() const {
+        return size_;
+    }
+
+    void insert(const SortedMultiKey& key, Row* row);
+    sorted_pos erase(const sorted_pos& pos);
+    void clear();
+    // builds full leaves, then each inner level on top of them, in O(n)
+    bool bulk_load(const std::vector<keyed_row>& rows);
+
+    sorted_pos begin() const;
+    sorted_pos end() const {
+        return make_pos(nullptr, 0);
+    }
+    sorted_pos lower_bound(const SortedMultiKey& key) const {
+        return bound(key, false);
+    }
+    sorted_pos upper_bound(const SortedMultiKey& key) const {
+        return bound(key, true);
+    }
+    void equal_range_from(const sorted_pos& hint, const SortedMultiKey& key, sorted_pos* low, sorted_pos* high) const;
+    void next(sorted_pos* pos) const;
+    void prev(sorted_pos* pos) const;
+    Row* row_at(const sorted_pos& pos) const {
+        const leaf_node* leaf = (const leaf_node *) pos.node;
+        assert(leaf != nullptr && pos.slot < leaf->count);
+        return leaf->rows[pos.slot];
+    }
+
+    bool counted() const {
+        return true;
+    }
+    size_t rank(const sorted_pos& pos) const;
+    sorted_pos select(size_t rank) const;
+
+    void store_keys();
+    bool stored_key(const sorted_pos& pos, blob* key) const {
+        const leaf_node* leaf = (const leaf_node *) pos.node;
+        if (leaf->keys == nullptr) {
+            return false;
+        }
+        *key = key_blob(leaf->keys[pos.slot]);
+        return true;
+    }
+
+    // number of levels, 1 if root is a leaf
+    int height() const;
+};
+
+} // namespace mdb
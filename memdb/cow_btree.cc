@@ -0,0 +1,365 @@
+#include <string.h>
+
+#include "cow_btree.h"
+
+using namespace std;
+
+namespace mdb {
+
+cow_btree::cow_btree(): root_(new_leaf()) {
+}
+
+cow_btree::cow_btree(const cow_btree& o): root_(o.root_) {
+    ref(root_);
+}
+
+const cow_btree& cow_btree::operator= (const cow_btree& o) {
+    ref(o.root_);
+    unref(root_);
+    root_ = o.root_;
+    return *this;
+}
+
+cow_btree::leaf_node* cow_btree::new_leaf() {
+    leaf_node* leaf = new leaf_node;
+    leaf->refs.store(1);
+    leaf->leaf = true;
+    leaf->count = 0;
+    leaf->subtree_rows = 0;
+    return leaf;
+}
+
+cow_btree::node* cow_btree::copy_node(const node* n) {
+    node* copy;
+    if (n->leaf) {
+        const leaf_node* leaf = (const leaf_node *) n;
+        leaf_node* l = new leaf_node;
+        for (int i = 0; i < leaf->count; i++) {
+            l->key[i] = leaf->key[i];
+            l->rows[i] = (Row *) leaf->rows[i]->ref_copy();
+        }
+        copy = l;
+    } else {
+        const inner_node* inner = (const inner_node *) n;
+        inner_node* in = new inner_node;
+        for (int i = 0; i < inner->count; i++) {
+            in->key[i] = inner->key[i];
+            in->child[i] = inner->child[i];
+            ref(in->child[i]);
+        }
+        copy = in;
+    }
+    copy->refs.store(1);
+    copy->leaf = n->leaf;
+    copy->count = n->count;
+    copy->subtree_rows = n->subtree_rows;
+    return copy;
+}
+
+void cow_btree::unref(node* n) {
+    if (--n->refs > 0) {
+        return;
+    }
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        for (int i = 0; i < leaf->count; i++) {
+            leaf->rows[i]->release();
+        }
+        delete leaf;
+    } else {
+        inner_node* inner = (inner_node *) n;
+        for (int i = 0; i < inner->count; i++) {
+            unref(inner->child[i]);
+        }
+        delete inner;
+    }
+}
+
+int cow_btree::compare(const std::string& stored, const std::string& key, bool partial) {
+    int cmp = memcmp(stored.data(), key.data(), min(stored.size(), key.size()));
+    if (cmp == 0 && !(partial && stored.size() >= key.size())) {
+        cmp = (int) stored.size() - (int) key.size();
+    }
+    if (cmp < 0) {
+        return -1;
+    } else if (cmp > 0) {
+        return 1;
+    }
+    return 0;
+}
+
+size_t cow_btree::rank(const std::string& key, bool partial, bool upper) const {
+    // rows before the result are < key, or <= key if upper
+    int limit = upper ? 0 : -1;
+    size_t r = 0;
+    const node* n = root_;
+    while (!n->leaf) {
+        const inner_node* inner = (const inner_node *) n;
+        // last child starting before the result, every child before it is all before the result
+        int i = 0;
+        while (i + 1 < inner->count && compare(inner->key[i + 1], key, partial) <= limit) {
+            r += inner->child[i]->subtree_rows;
+            i++;
+        }
+        n = inner->child[i];
+    }
+    const leaf_node* leaf = (const leaf_node *) n;
+    int low = 0, high = leaf->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compare(leaf->key[mid], key, partial) <= limit) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return r + low;
+}
+
+cow_btree::node* cow_btree::own(node** ref) {
+    node* n = *ref;
+    if (n->refs.load() == 1) {
+        return n;
+    }
+    node* copy = copy_node(n);
+    // drops the reference *ref held, freeing n if its other owners let go meanwhile
+    unref(n);
+    *ref = copy;
+    return copy;
+}
+
+cow_btree::node* cow_btree::insert_at(node** ref, size_t rank, const std::string& key, Row* row) {
+    node* n = own(ref);
+    n->subtree_rows++;
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        for (int i = leaf->count; i > (int) rank; i--) {
+            leaf->key[i].swap(leaf->key[i - 1]);
+            leaf->rows[i] = leaf->rows[i - 1];
+        }
+        leaf->key[rank] = key;
+        leaf->rows[rank] = row;
+        leaf->count++;
+        return (leaf->count > LEAF_SLOTS) ? split(leaf) : nullptr;
+    }
+
+    inner_node* inner = (inner_node *) n;
+    // at the end of a child rather than at the front of the next one
+    int i = 0;
+    while (i + 1 < inner->count && rank > inner->child[i]->subtree_rows) {
+        rank -= inner->child[i]->subtree_rows;
+        i++;
+    }
+    node* right = insert_at(&inner->child[i], rank, key, row);
+    if (rank == 0) {
+        inner->key[i] = key;
+    }
+    if (right != nullptr) {
+        for (int j = inner->count; j > i + 1; j--) {
+            inner->key[j].swap(inner->key[j - 1]);
+            inner->child[j] = inner->child[j - 1];
+        }
+        inner->key[i + 1] = first_key(right);
+        inner->child[i + 1] = right;
+        inner->count++;
+    }
+    return (inner->count > INNER_SLOTS) ? split(inner) : nullptr;
+}
+
+cow_btree::node* cow_btree::split(node* n) {
+    int half = n->count / 2;
+    node* right;
+    size_t moved_rows = 0;
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        leaf_node* r = new_leaf();
+        for (int i = half; i < leaf->count; i++) {
+            r->key[i - half].swap(leaf->key[i]);
+            r->rows[i - half] = leaf->rows[i];
+        }
+        moved_rows = leaf->count - half;
+        right = r;
+    } else {
+        inner_node* inner = (inner_node *) n;
+        inner_node* r = new inner_node;
+        r->refs.store(1);
+        r->leaf = false;
+        for (int i = half; i < inner->count; i++) {
+            r->key[i - half].swap(inner->key[i]);
+            r->child[i - half] = inner->child[i];
+            moved_rows += inner->child[i]->subtree_rows;
+        }
+        right = r;
+    }
+    right->count = n->count - half;
+    right->subtree_rows = moved_rows;
+    n->count = half;
+    n->subtree_rows -= moved_rows;
+    return right;
+}
+
+Row* cow_btree::remove_at(node** ref, size_t rank) {
+    node* n = own(ref);
+    n->subtree_rows--;
+    if (n->leaf) {
+        leaf_node* leaf = (leaf_node *) n;
+        Row* row = leaf->rows[rank];
+        for (int i = rank; i + 1 < leaf->count; i++) {
+            leaf->key[i].swap(leaf->key[i + 1]);
+            leaf->rows[i] = leaf->rows[i + 1];
+        }
+        leaf->count--;
+        leaf->key[leaf->count].clear();
+        return row;
+    }
+
+    inner_node* inner = (inner_node *) n;
+    int i = 0;
+    while (rank >= inner->child[i]->subtree_rows) {
+        rank -= inner->child[i]->subtree_rows;
+        i++;
+    }
+    Row* row = remove_at(&inner->child[i], rank);
+    node* child = inner->child[i];
+    if (child->subtree_rows == 0) {
+        // owned by this node alone after remove_at(), so this frees it
+        unref(child);
+        for (int j = i; j + 1 < inner->count; j++) {
+            inner->key[j].swap(inner->key[j + 1]);
+            inner->child[j] = inner->child[j + 1];
+        }
+        inner->count--;
+        inner->key[inner->count].clear();
+    } else if (rank == 0) {
+        inner->key[i] = first_key(child);
+    }
+    return row;
+}
+
+Row* cow_btree::remove_rank(size_t rank) {
+    Row* row = remove_at(&root_, rank);
+    // drop levels with a single child, or none
+    while (!root_->leaf && root_->count <= 1) {
+        inner_node* old = (inner_node *) root_;
+        if (old->count == 0) {
+            root_ = new_leaf();
+        } else {
+            root_ = old->child[0];
+            ref(root_);
+        }
+        unref(old);
+    }
+    return row;
+}
+
+void cow_btree::insert(const std::string& key, Row* row) {
+    node* right = insert_at(&root_, rank(key, false, true), key, row);
+    if (right != nullptr) {
+        inner_node* root = new inner_node;
+        root->refs.store(1);
+        root->leaf = false;
+        root->count = 2;
+        root->subtree_rows = root_->subtree_rows + right->subtree_rows;
+        root->key[0] = first_key(root_);
+        root->key[1] = first_key(right);
+        root->child[0] = root_;
+        root->child[1] = right;
+        root_ = root;
+    }
+}
+
+size_t cow_btree::erase(const std::string& key, bool partial) {
+    size_t low = rank(key, partial, false);
+    size_t n = rank(key, partial, true) - low;
+    for (size_t i = 0; i < n; i++) {
+        remove_rank(low)->release();
+    }
+    return n;
+}
+
+bool cow_btree::erase(const std::string& key, const Row* row) {
+    size_t low = rank(key, false, false);
+    size_t high = rank(key, false, true);
+    const leaf_node* leaf = nullptr;
+    size_t first = 0;
+    for (size_t r = low; r < high; r++) {
+        if (leaf == nullptr || r >= first + leaf->count) {
+            leaf = find_leaf(root_, r, &first);
+        }
+        if (leaf->rows[r - first] == row) {
+            remove_rank(r)->release();
+            return true;
+        }
+    }
+    return false;
+}
+
+void cow_btree::clear() {
+    unref(root_);
+    root_ = new_leaf();
+}
+
+const cow_btree::leaf_node* cow_btree::find_leaf(const node* root, size_t rank, size_t* first) {
+    *first = 0;
+    const node* n = root;
+    while (!n->leaf) {
+        const inner_node* inner = (const inner_node *) n;
+        int i = 0;
+        while (rank >= inner->child[i]->subtree_rows) {
+            rank -= inner->child[i]->subtree_rows;
+            *first += inner->child[i]->subtree_rows;
+            i++;
+        }
+        n = inner->child[i];
+    }
+    return (const leaf_node *) n;
+}
+
+int cow_btree::height() const {
+    int h = 1;
+    for (const node* n = root_; !n->leaf; n = ((const inner_node *) n)->child[0]) {
+        h++;
+    }
+    return h;
+}
+
+cow_btree::cursor::cursor(node* root, size_t low, size_t high, bool reverse)
+        : root_(root), reverse_(reverse), leaf_(nullptr), leaf_first_(0) {
+    ref(root_);
+    if (high < low) {
+        high = low;
+    }
+    count_ = high - low;
+    next_ = reverse ? high : low;
+    end_ = reverse ? low : high;
+}
+
+cow_btree::cursor::cursor(const cursor& o)
+        : root_(o.root_), next_(o.next_), end_(o.end_), count_(o.count_), reverse_(o.reverse_),
+          leaf_(o.leaf_), leaf_first_(o.leaf_first_) {
+    ref(root_);
+}
+
+const cow_btree::cursor& cow_btree::cursor::operator= (const cursor& o) {
+    ref(o.root_);
+    unref(root_);
+    root_ = o.root_;
+    next_ = o.next_;
+    end_ = o.end_;
+    count_ = o.count_;
+    reverse_ = o.reverse_;
+    leaf_ = o.leaf_;
+    leaf_first_ = o.leaf_first_;
+    return *this;
+}
+
+Row* cow_btree::cursor::next() {
+    verify(has_next());
+    size_t r = reverse_ ? --next_ : next_++;
+    if (leaf_ == nullptr || r < leaf_first_ || r >= leaf_first_ + leaf_->count) {
+        leaf_ = find_leaf(root_, r, &leaf_first_);
+    }
+    return leaf_->rows[r - leaf_first_];
+}
+
+} // namespace mdb
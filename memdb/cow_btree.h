@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "row.h"
+
+namespace mdb {
+
+// Persistent (copy-on-write) B+tree, the SnapshotTable engine for ENG_BTREE
+//
+// Nodes are reference counted and never changed once shared: a write copies the nodes on its
+// path that are referenced more than once, and updates the ones only reachable from this tree in
+// place. A snapshot is a reference to the root, taken in O(1), and reads it like any other tree,
+// without version checks. Nodes no tree references anymore are freed at once, together with the
+// rows only they hold, so there is nothing to garbage collect.
+//
+// Keys are normalized keys (see SortedMultiKey::normalize), compared with memcmp, so the tree
+// never reads its rows. Leaves keep the key of every row next to it, and hold a reference to it.
+//
+// There are no sibling links, since they could not be shared between versions: every node keeps
+// the number of rows under it instead, and a cursor is a range of row ranks [low, high) holding a
+// reference to its root, finding each next leaf from there.
+//
+// The tree itself must only be written from one thread at a time, but other copies of it (and
+// their cursors) may be read or released from any thread meanwhile.
+class cow_btree {
+    enum {
+        LEAF_SLOTS = 32,
+        INNER_SLOTS = 32,
+    };
+
+    struct node {
+        std::atomic<int> refs;
+        bool leaf;
+        int count;          // leaf: number of rows, inner: number of children
+        size_t subtree_rows;
+        // key[0] is the smallest key under the node
+    };
+
+    struct leaf_node: public node {
+        // one extra slot, nodes are split right after overflowing
+        std::string key[LEAF_SLOTS + 1];
+        Row* rows[LEAF_SLOTS + 1];
+    };
+
+    // key[i] is the smallest key under child[i]
+    struct inner_node: public node {
+        std::string key[INNER_SLOTS + 1];
+        node* child[INNER_SLOTS + 1];
+    };
+
+    node* root_;
+
+    static leaf_node* new_leaf();
+    static node* copy_node(const node* n);
+    static void ref(node* n) {
+        n->refs++;
+    }
+    // frees n once nothing references it, releasing its rows and children
+    static void unref(node* n);
+
+    static const std::string& first_key(const node* n) {
+        if (n->leaf) {
+            return ((const leaf_node *) n)->key[0];
+        } else {
+            return ((const inner_node *) n)->key[0];
+        }
+    }
+    // -1, 0, 1 comparing stored against key, a key prefix if partial
+    static int compare(const std::string& stored, const std::string& key, bool partial);
+
+    // number of rows < key (upper == false) or <= key (upper == true)
+    size_t rank(const std::string& key, bool partial, bool upper) const;
+
+    // *ref, copied first (and stored back in *ref) if anything else references it
+    static node* own(node** ref);
+    // returns the new right sibling if *ref had to split
+    static node* insert_at(node** ref, size_t rank, const std::string& key, Row* row);
+    // returns the row, whose reference now belongs to the caller
+    static Row* remove_at(node** ref, size_t rank);
+    static node* split(node* n);
+    Row* remove_rank(size_t rank);
+
+    // leaf holding the row at rank, with the rank of its first row in *first
+    static const leaf_node* find_leaf(const node* root, size_t rank, size_t* first);
+
+public:
+
+    class cursor {
+        node* root_;
+        // ranks of the rows still to go: [next_, end_) forward, [end_, next_) backwards
+        size_t next_;
+        size_t end_;
+        size_t count_;
+        bool reverse_;
+        // leaf last read from, and rank of its first row
+        const leaf_node* leaf_;
+        size_t leaf_first_;
+
+        friend class cow_btree;
+        cursor(node* root, size_t low, size_t high, bool reverse);
+
+    public:
+        cursor(const cursor& o);
+        ~cursor() {
+            unref(root_);
+        }
+        const cursor& operator= (const cursor& o);
+
+        bool has_next() const {
+            return next_ != end_;
+        }
+        Row* next();
+        // back to the first row of the range
+        void rewind() {
+            next_ = reverse_ ? end_ + count_ : end_ - count_;
+        }
+        // number of rows in the whole range, like snapshot_sortedmap ranges
+        size_t count() const {
+            return count_;
+        }
+    };
+
+    cow_btree();
+    // O(1), both trees share all nodes until either is written
+    cow_btree(const cow_btree& o);
+    const cow_btree& operator= (const cow_btree& o);
+    ~cow_btree() {
+        unref(root_);
+    }
+
+    size_t size() const {
+        return root_->subtree_rows;
+    }
+
+    // takes over the caller's reference to row, rows with equal keys stay in insertion order
+    void insert(const std::string& key, Row* row);
+    // rows with key, or starting with key if partial, returns how many
+    size_t erase(const std::string& key, bool partial);
+    // the row with key, false if not found
+    bool erase(const std::string& key, const Row* row);
+    void clear();
+
+    // rows with key, or starting with key if partial
+    cursor query(const std::string& key, bool partial, bool reverse = false) const {
+        return cursor(root_, rank(key, partial, false), rank(key, partial, true), reverse);
+    }
+    cursor query_lt(const std::string& key, bool partial, bool reverse = false) const {
+        return cursor(root_, 0, rank(key, partial, false), reverse);
+    }
+    cursor query_gt(const std::string& key, bool partial, bool reverse = false) const {
+        return cursor(root_, rank(key, partial, true), size(), reverse);
+    }
+    // (low, high) not inclusive
+    cursor query_in(const std::string& low, bool low_partial, const std::string& high, bool high_partial,
+                    bool reverse = false) const {
+        return cursor(root_, rank(low, low_partial, true), rank(high, high_partial, false), reverse);
+    }
+    cursor all(bool reverse = false) const {
+        return cursor(root_, 0, size(), reverse);
+    }
+
+    // number of levels, 1 if root is a leaf
+    int height() const;
+};
+
+} // namespace mdb
@@ -0,0 +1,101 @@
+#include <functional>
+#include <thread>
+
+#include "epoch.h"
+
+using namespace std;
+
+namespace mdb {
+
+epoch_manager::epoch_manager(): epoch_(0), retired_since_advance_(0) {
+    for (auto& counter : active_) {
+        counter.n = 0;
+    }
+}
+
+epoch_manager::~epoch_manager() {
+    flush();
+}
+
+int epoch_manager::stripe() {
+    static thread_local int s = std::hash<std::thread::id>()(std::this_thread::get_id()) % N_STRIPES;
+    return s;
+}
+
+int epoch_manager::enter() {
+    int s = stripe();
+    for (;;) {
+        uint64_t e = epoch_;
+        int slot = (e % N_EPOCHS) * N_STRIPES + s;
+        active_[slot].n++;
+        // the epoch might have moved on before we got counted, memory retired before it could be freed
+        if (epoch_ == e) {
+            return slot;
+        }
+        active_[slot].n--;
+    }
+}
+
+void epoch_manager::retire(free_fn fn, void* ptr) {
+    vector<retired> to_free;
+    {
+        ScopedLock sl(retire_mutex_);
+        retired r;
+        r.fn = fn;
+        r.ptr = ptr;
+        retired_[epoch_ % N_EPOCHS].push_back(r);
+        retired_since_advance_++;
+        if (retired_since_advance_ >= ADVANCE_EVERY) {
+            advance_locked(&to_free);
+        }
+    }
+    free_all(to_free);
+}
+
+bool epoch_manager::try_advance() {
+    vector<retired> to_free;
+    bool advanced = false;
+    {
+        ScopedLock sl(retire_mutex_);
+        advanced = advance_locked(&to_free);
+    }
+    free_all(to_free);
+    return advanced;
+}
+
+bool epoch_manager::advance_locked(vector<retired>* to_free) {
+    // readers are pinned in e or e - 1, and moving to e + 1 needs e - 1 to be empty
+    uint64_t e = epoch_;
+    int oldest = (e + N_EPOCHS - 1) % N_EPOCHS;
+    for (int s = 0; s < N_STRIPES; s++) {
+        if (active_[oldest * N_STRIPES + s].n != 0) {
+            return false;
+        }
+    }
+    epoch_ = e + 1;
+    retired_since_advance_ = 0;
+    // retired in e - 1, everyone who could see it has left, and its slot is reused by e + 2
+    to_free->swap(retired_[oldest]);
+    return true;
+}
+
+void epoch_manager::free_all(const vector<retired>& to_free) {
+    for (auto& r : to_free) {
+        r.fn(r.ptr);
+    }
+}
+
+void epoch_manager::flush() {
+    vector<retired> to_free;
+    {
+        ScopedLock sl(retire_mutex_);
+        for (int i = 0; i < N_EPOCHS; i++) {
+            to_free.insert(to_free.end(), retired_[i].begin(), retired_[i].end());
+            retired_[i].clear();
+        }
+        retired_since_advance_ = 0;
+    }
+    free_all(to_free);
+}
+
+} // namespace mdb
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "utils.h"
+
+namespace mdb {
+
+// Epoch based reclamation, for structures that are read and written by many threads without locks.
+//
+// Readers pin the current epoch (see epoch_guard) while they may hold pointers into the structure.
+// Writers unlink memory first, then retire() it. Retired memory is freed once the epoch has
+// advanced twice since it was retired, as every reader that could still see it has unpinned by then.
+//
+// Pinned readers are counted per epoch, over a few padded stripes picked by thread, so that
+// readers on different cores do not fight over a single cache line.
+class epoch_manager: public NoCopy {
+public:
+    typedef void (*free_fn)(void* ptr);
+
+private:
+    enum {
+        N_EPOCHS = 3,
+        N_STRIPES = 16,
+        CACHE_LINE = 64,
+
+        // try to advance the epoch after this many retires
+        ADVANCE_EVERY = 64,
+    };
+
+    struct active_counter {
+        std::atomic<int> n;
+        char pad[CACHE_LINE - sizeof(std::atomic<int>)];
+    };
+
+    struct retired {
+        free_fn fn;
+        void* ptr;
+    };
+
+    std::atomic<uint64_t> epoch_;
+    active_counter active_[N_EPOCHS * N_STRIPES];
+
+    // protects retired_, and advancing the epoch
+    Mutex retire_mutex_;
+    std::vector<retired> retired_[N_EPOCHS];
+    int retired_since_advance_;
+
+    static int stripe();
+
+    // requires retire_mutex_, moves memory which is safe to free into *to_free
+    bool advance_locked(std::vector<retired>* to_free);
+    static void free_all(const std::vector<retired>& to_free);
+
+public:
+
+    epoch_manager();
+
+    // NOTE: frees all retired memory, no reader should be pinned
+    ~epoch_manager();
+
+    // pin the current epoch, returns slot to pass to exit()
+    int enter();
+    // pin again the epoch of a slot which is already pinned
+    void reenter(int slot) {
+        active_[slot].n++;
+    }
+    void exit(int slot) {
+        active_[slot].n--;
+    }
+
+    // free ptr by calling fn(ptr), once no pinned reader can see it
+    void retire(free_fn fn, void* ptr);
+
+    // try to advance the epoch and free what became safe, returns false if readers are in the way
+    bool try_advance();
+
+    // free everything retired so far
+    // NOTE: no reader should be pinned
+    void flush();
+
+    uint64_t epoch() const {
+        return epoch_;
+    }
+};
+
+// pins an epoch for its lifetime, no-op if constructed with nullptr
+class epoch_guard {
+    epoch_manager* mgr_;
+    int slot_;
+
+public:
+    explicit epoch_guard(epoch_manager* mgr = nullptr): mgr_(mgr), slot_(-1) {
+        if (mgr_ != nullptr) {
+            slot_ = mgr_->enter();
+        }
+    }
+    // copies pin the same epoch as the original
+    epoch_guard(const epoch_guard& o): mgr_(o.mgr_), slot_(o.slot_) {
+        if (mgr_ != nullptr) {
+            mgr_->reenter(slot_);
+        }
+    }
+    const epoch_guard& operator= (const epoch_guard& o) {
+        if (this != &o) {
+            if (o.mgr_ != nullptr) {
+                o.mgr_->reenter(o.slot_);
+            }
+            if (mgr_ != nullptr) {
+                mgr_->exit(slot_);
+            }
+            mgr_ = o.mgr_;
+            slot_ = o.slot_;
+        }
+        return *this;
+    }
+    ~epoch_guard() {
+        if (mgr_ != nullptr) {
+            mgr_->exit(slot_);
+        }
+    }
+};
+
+} // namespace mdb
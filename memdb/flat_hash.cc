@@ -0,0 +1,195 @@
+#include <string.h>
+#include <algorithm>
+
+#include "flat_hash.h"
+
+namespace mdb {
+
+flat_row_map::~flat_row_map() {
+    delete[] ctrl_;
+    delete[] slots_;
+    delete[] old_ctrl_;
+    delete[] old_slots_;
+}
+
+size_t flat_row_map::capacity_for(size_t n_rows) {
+    size_t capacity = GROUP_SIZE;
+    while (capacity * 7 / 8 < n_rows) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void flat_row_map::reserve(size_t n) {
+    size_t new_capacity = capacity_for(n);
+    if (new_capacity > capacity_) {
+        rehash(new_capacity, incremental_);
+    }
+}
+
+void flat_row_map::rehash(size_t new_capacity, bool incremental /* =? */) {
+    verify(new_capacity >= GROUP_SIZE && (new_capacity & (new_capacity - 1)) == 0);
+    verify(new_capacity * 7 / 8 >= size_);
+
+    // at most one resize in flight
+    finish_resize();
+
+    old_ctrl_ = ctrl_;
+    old_slots_ = slots_;
+    old_capacity_ = capacity_;
+    migrated_ = 0;
+
+    ctrl_ = new int8_t[new_capacity];
+    memset(ctrl_, EMPTY, new_capacity);
+    slots_ = new Row*[new_capacity];
+    capacity_ = new_capacity;
+    // room for all rows, including those still in the old arrays
+    growth_left_ = new_capacity * 7 / 8 - size_;
+
+    if (!incremental || old_capacity_ == 0) {
+        finish_resize();
+    }
+}
+
+void flat_row_map::place(Row* row, size_t hash) {
+    size_t mask = group_mask();
+    size_t group = hash & mask;
+    for (size_t step = 1; ; step++) {
+        uint32_t m = probe_group(ctrl_ + group * GROUP_SIZE).match_empty_or_deleted();
+        if (m != 0) {
+            size_t slot = group * GROUP_SIZE + __builtin_ctz(m);
+            ctrl_[slot] = hash_tag(hash);
+            slots_[slot] = row;
+            return;
+        }
+        verify(step <= mask);
+        group = (group + step) & mask;
+    }
+}
+
+void flat_row_map::migrate(size_t n_groups) {
+    size_t end = std::min(old_capacity_, migrated_ + n_groups * GROUP_SIZE);
+    for (size_t i = migrated_; i < end; i++) {
+        if (old_ctrl_[i] < 0) {
+            continue;
+        }
+        Row* row = old_slots_[i];
+        place(row, hash_key(key_of(row)));
+        // DELETED, not EMPTY, so probes for rows not moved yet still go past this slot
+        old_ctrl_[i] = DELETED;
+    }
+    migrated_ = end;
+    if (migrated_ == old_capacity_) {
+        delete[] old_ctrl_;
+        delete[] old_slots_;
+        old_ctrl_ = nullptr;
+        old_slots_ = nullptr;
+        old_capacity_ = 0;
+        migrated_ = 0;
+    }
+}
+
+void flat_row_map::insert(Row* row) {
+    if (old_ctrl_ != nullptr) {
+        migrate(MIGRATE_GROUPS);
+    }
+    if (growth_left_ == 0) {
+        if (capacity_ > 0 && size_ <= capacity_ * 7 / 16) {
+            // mostly DELETED slots, clean them up without growing
+            rehash(capacity_, incremental_);
+        } else {
+            rehash(capacity_ == 0 ? (size_t) GROUP_SIZE : capacity_ * 2, incremental_);
+        }
+    }
+
+    size_t hash = hash_key(key_of(row));
+    size_t mask = group_mask();
+    size_t group = hash & mask;
+    for (size_t step = 1; ; step++) {
+        uint32_t m = probe_group(ctrl_ + group * GROUP_SIZE).match_empty_or_deleted();
+        if (m != 0) {
+            size_t slot = group * GROUP_SIZE + __builtin_ctz(m);
+            if (ctrl_[slot] == EMPTY) {
+                growth_left_--;
+            }
+            ctrl_[slot] = hash_tag(hash);
+            slots_[slot] = row;
+            size_++;
+            return;
+        }
+        verify(step <= mask);
+        group = (group + step) & mask;
+    }
+}
+
+size_t flat_row_map::find_slot(const int8_t* ctrl, Row* const* slots, size_t capacity, Row* row, size_t hash) {
+    int8_t tag = hash_tag(hash);
+    size_t mask = capacity / GROUP_SIZE - 1;
+    size_t group = hash & mask;
+    for (size_t step = 1; ; step++) {
+        probe_group g(ctrl + group * GROUP_SIZE);
+        for (uint32_t m = g.match(tag); m != 0; m &= m - 1) {
+            size_t slot = group * GROUP_SIZE + __builtin_ctz(m);
+            if (slots[slot] == row) {
+                return slot;
+            }
+        }
+        if (g.match_empty() != 0 || step > mask) {
+            return capacity;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+bool flat_row_map::remove(Row* row) {
+    if (size_ == 0) {
+        return false;
+    }
+    // NOTE: no migration here, so rows can be removed while walking the map
+    size_t hash = hash_key(key_of(row));
+    size_t slot = find_slot(ctrl_, slots_, capacity_, row, hash);
+    if (slot < capacity_) {
+        erase_slot(ctrl_, slot, &growth_left_);
+        size_--;
+        return true;
+    }
+    if (old_ctrl_ != nullptr) {
+        slot = find_slot(old_ctrl_, old_slots_, old_capacity_, row, hash);
+        if (slot < old_capacity_) {
+            size_t old_growth_left = 0;
+            erase_slot(old_ctrl_, slot, &old_growth_left);
+            size_--;
+            // new arrays had room reserved for this row
+            growth_left_++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void flat_row_map::erase_slot(int8_t* ctrl, size_t slot, size_t* growth_left) {
+    size_t group = slot / GROUP_SIZE;
+    // if the group still has an EMPTY slot, no probe ever went past it, so the slot can be EMPTY again
+    if (probe_group(ctrl + group * GROUP_SIZE).match_empty() != 0) {
+        ctrl[slot] = EMPTY;
+        (*growth_left)++;
+    } else {
+        ctrl[slot] = DELETED;
+    }
+}
+
+void flat_row_map::clear() {
+    delete[] old_ctrl_;
+    delete[] old_slots_;
+    old_ctrl_ = nullptr;
+    old_slots_ = nullptr;
+    old_capacity_ = 0;
+    migrated_ = 0;
+    if (capacity_ > 0) {
+        memset(ctrl_, EMPTY, capacity_);
+    }
+    size_ = 0;
+    growth_left_ = capacity_ * 7 / 8;
+}
+
+} // namespace mdb
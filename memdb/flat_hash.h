@@ -0,0 +1,279 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blob.h"
+#include "row.h"
+
+namespace mdb {
+
+// Open addressing hash multimap from row key to Row*, used by UnsortedTable.
+//
+// Swiss table layout: one control byte per slot, holding 7 bits of the hash (or EMPTY/DELETED),
+// next to a flat array of Row*. Slots are probed 16 at a time, by comparing a whole group of
+// control bytes at once, and only slots with a matching tag get their key compared. Keys are
+// not stored, they are rebuilt from the row on demand.
+//
+// Rows with equal keys are kept as separate entries, removing a row leaves other slots in place.
+// They all probe the same slots, so the map is meant for keys with few rows each.
+class flat_row_map: public NoCopy {
+public:
+    enum {
+        GROUP_SIZE = 16,
+    };
+
+private:
+    enum ctrl_t: int8_t {
+        EMPTY = -128,
+        DELETED = -2,
+    };
+
+    // one group of control bytes
+    struct probe_group {
+#ifdef __SSE2__
+        __m128i ctrl;
+
+        explicit probe_group(const int8_t* p): ctrl(_mm_loadu_si128((const __m128i *) p)) {}
+
+        uint32_t match(int8_t tag) const {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl));
+        }
+        uint32_t match_empty_or_deleted() const {
+            // EMPTY and DELETED are the only values below -1
+            return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl));
+        }
+#else
+        const int8_t* ctrl;
+
+        explicit probe_group(const int8_t* p): ctrl(p) {}
+
+        uint32_t match(int8_t tag) const {
+            uint32_t mask = 0;
+            for (int i = 0; i < GROUP_SIZE; i++) {
+                mask |= uint32_t(ctrl[i] == tag) << i;
+            }
+            return mask;
+        }
+        uint32_t match_empty_or_deleted() const {
+            uint32_t mask = 0;
+            for (int i = 0; i < GROUP_SIZE; i++) {
+                mask |= uint32_t(ctrl[i] < -1) << i;
+            }
+            return mask;
+        }
+#endif
+        uint32_t match_empty() const {
+            return match(EMPTY);
+        }
+    };
+
+    int8_t* ctrl_;
+    Row** slots_;
+    size_t capacity_;       // number of slots, 0 or a power of 2 (at least GROUP_SIZE)
+    size_t size_;           // including rows not migrated yet
+    size_t growth_left_;    // inserts allowed before rehash, counting DELETED slots as used
+
+    // incremental resize: rows still in the old arrays are moved over a few groups per operation
+    bool incremental_;
+    int8_t* old_ctrl_;
+    Row** old_slots_;
+    size_t old_capacity_;
+    size_t migrated_;       // old slots below this are already moved
+
+    // see set_key_columns(), empty if rows are keyed by their own key
+    std::vector<column_id_t> key_cols_;
+
+    enum {
+        MIGRATE_GROUPS = 2,  // per insert, enough to finish before the new arrays fill up
+    };
+
+    // keys find_batch() prefetches ahead of the one it probes, enough to cover a miss to memory
+    enum {
+        PREFETCH_AHEAD = 8,
+    };
+
+    // first group probed for hash: its control bytes, and the slots they stand for
+    void prefetch_group(size_t hash) const {
+        size_t slot = (hash & group_mask()) * GROUP_SIZE;
+        __builtin_prefetch(ctrl_ + slot);
+        __builtin_prefetch(slots_ + slot);
+        __builtin_prefetch(slots_ + slot + GROUP_SIZE / 2);
+    }
+
+    static size_t hash_key(const MultiBlob& key) {
+        return MultiBlob::hash()(key);
+    }
+    // 7 bit tag stored in control byte, taken from the high bits so it is independent of the group
+    static int8_t hash_tag(size_t hash) {
+        return (int8_t) ((uint64_t(hash) * 0x9e3779b97f4a7c15) >> 57);
+    }
+    size_t group_mask() const {
+        return capacity_ / GROUP_SIZE - 1;
+    }
+
+    static size_t capacity_for(size_t n_rows);
+
+    // allocate new arrays, and either move all rows now or leave them for migrate()
+    void rehash(size_t new_capacity, bool incremental = false);
+    void place(Row* row, size_t hash);
+    void migrate(size_t n_groups);
+    void finish_resize() {
+        if (old_ctrl_ != nullptr) {
+            migrate(old_capacity_ / GROUP_SIZE);
+        }
+    }
+
+    // probe for the slot holding row, returns capacity if not found
+    static size_t find_slot(const int8_t* ctrl, Row* const* slots, size_t capacity, Row* row, size_t hash);
+    static void erase_slot(int8_t* ctrl, size_t slot, size_t* growth_left);
+
+    template <class Func>
+    void find_in(const int8_t* ctrl, Row* const* slots, size_t capacity,
+                 const MultiBlob& key, size_t hash, const Func& f) const {
+        int8_t tag = hash_tag(hash);
+        size_t mask = capacity / GROUP_SIZE - 1;
+        size_t group = hash & mask;
+        // triangular probing visits every group once
+        for (size_t step = 1; ; step++) {
+            probe_group g(ctrl + group * GROUP_SIZE);
+            for (uint32_t m = g.match(tag); m != 0; m &= m - 1) {
+                Row* row = slots[group * GROUP_SIZE + __builtin_ctz(m)];
+                if (key_of(row) == key) {
+                    f(row);
+                }
+            }
+            if (g.match_empty() != 0 || step > mask) {
+                break;
+            }
+            group = (group + step) & mask;
+        }
+    }
+
+public:
+
+    flat_row_map(): ctrl_(nullptr), slots_(nullptr), capacity_(0), size_(0), growth_left_(0),
+                    incremental_(false), old_ctrl_(nullptr), old_slots_(nullptr), old_capacity_(0), migrated_(0) {}
+    ~flat_row_map();
+
+    size_t size() const {
+        return size_;
+    }
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // key rows by these columns of them instead of their own key, for maps holding rows of another
+    // table (see HashIndex). must be called before any row is inserted
+    void set_key_columns(const std::vector<column_id_t>& cols) {
+        verify(size_ == 0);
+        key_cols_ = cols;
+    }
+    MultiBlob key_of(const Row* row) const {
+        if (key_cols_.empty()) {
+            return row->get_key();
+        }
+        MultiBlob mb(key_cols_.size());
+        for (size_t i = 0; i < key_cols_.size(); i++) {
+            mb[i] = row->get_blob(key_cols_[i]);
+        }
+        return mb;
+    }
+
+    // make room for n rows, so inserting up to n rows does not rehash
+    void reserve(size_t n);
+
+    // grow by moving rows a few at a time on later inserts, instead of all at once
+    void set_incremental_resize(bool incremental) {
+        if (!incremental) {
+            finish_resize();
+        }
+        incremental_ = incremental;
+    }
+    bool incremental_resize() const {
+        return incremental_;
+    }
+    // true while rows are being moved to new arrays
+    bool resizing() const {
+        return old_ctrl_ != nullptr;
+    }
+
+    void insert(Row* row);
+
+    // remove the entry of row, using key_of(row) to locate it
+    bool remove(Row* row);
+
+    // removes all entries, keeps capacity
+    void clear();
+
+    // calls f(Row*) on all rows with given key
+    template <class Func>
+    void find(const MultiBlob& key, const Func& f) const {
+        if (size_ == 0) {
+            return;
+        }
+        size_t hash = hash_key(key);
+        find_in(ctrl_, slots_, capacity_, key, hash, f);
+        if (old_ctrl_ != nullptr) {
+            find_in(old_ctrl_, old_slots_, old_capacity_, key, hash, f);
+        }
+    }
+
+    // calls f(i, Row*) on all rows with key keys[i], for i in [0, n). keys are hashed first, then
+    // probed in order while the first group of the key PREFETCH_AHEAD places on is prefetched
+    template <class Func>
+    void find_batch(const MultiBlob* keys, size_t n, const Func& f) const {
+        if (size_ == 0 || n == 0) {
+            return;
+        }
+        std::vector<size_t> hashes(n);
+        for (size_t i = 0; i < n; i++) {
+            hashes[i] = hash_key(keys[i]);
+        }
+        for (size_t i = 0; i < n && i < PREFETCH_AHEAD; i++) {
+            prefetch_group(hashes[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (i + PREFETCH_AHEAD < n) {
+                prefetch_group(hashes[i + PREFETCH_AHEAD]);
+            }
+            auto fi = [&f, i] (Row* row) {
+                f(i, row);
+            };
+            find_in(ctrl_, slots_, capacity_, keys[i], hashes[i], fi);
+            if (old_ctrl_ != nullptr) {
+                find_in(old_ctrl_, old_slots_, old_capacity_, keys[i], hashes[i], fi);
+            }
+        }
+    }
+
+    // slots are numbered over the current arrays, then the old ones if resizing
+    size_t end_slot() const {
+        return capacity_ + old_capacity_;
+    }
+    // first used slot >= slot, or end_slot() if none
+    size_t next_used(size_t slot) const {
+        while (slot < capacity_ && ctrl_[slot] < 0) {
+            slot++;
+        }
+        if (slot >= capacity_) {
+            while (slot < capacity_ + old_capacity_ && old_ctrl_[slot - capacity_] < 0) {
+                slot++;
+            }
+        }
+        return slot;
+    }
+    Row* row_at(size_t slot) const {
+        if (slot < capacity_) {
+            return slots_[slot];
+        }
+        return old_slots_[slot - capacity_];
+    }
+};
+
+} // namespace mdb
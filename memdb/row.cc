@@ -6,36 +6,63 @@
 namespace mdb {
 
 Row::~Row() {
-    delete[] fixed_part_;
-    if (schema_->var_size_cols_ > 0) {
-        if (kind_ == DENSE) {
-            delete[] dense_var_part_;
-            delete[] dense_var_idx_;
-        } else {
-            verify(kind_ == SPARSE);
-            delete[] sparse_var_;
+    // fixed part and dense var part live in the same block as the Row itself,
+    // unless var part has grown out of the row block
+    if (kind_ == SPARSE && schema_->var_size_cols_ > 0) {
+        delete[] sparse_var_;
+    } else if (kind_ == DENSE) {
+        free_outlined_var_part();
+    }
+}
+
+void Row::attach_payload(char* payload, const Schema* schema, int var_part_size) {
+    schema_ = schema;
+    dense_var_idx_ = (int *) payload;
+    fixed_part_ = payload + schema->var_size_cols_ * sizeof(int);
+    dense_var_part_ = fixed_part_ + schema->fixed_part_size_;
+    var_cap_ = var_part_size;
+    inline_var_cap_ = var_part_size;
+}
+
+void Row::free_outlined_var_part() {
+    if (var_part_outlined()) {
+        RowAllocator::deallocate(dense_var_part_);
+        dense_var_part_ = fixed_part_ + schema_->fixed_part_size_;
+        var_cap_ = inline_var_cap_;
+    }
+}
+
+int Row::var_part_size() const {
+    if (kind_ == DENSE) {
+        if (schema_->var_size_cols_ == 0) {
+            return 0;
+        }
+        return dense_var_idx_[schema_->var_size_cols_ - 1];
+    }
+    int var_size = 0;
+    for (int i = 0; i < schema_->var_size_cols_; i++) {
+        var_size += sparse_var_[i].size();
+    }
+    return var_size;
+}
+
+int Row::var_part_size(const std::vector<const Value*>& values) {
+    int var_size = 0;
+    for (auto& it : values) {
+        if (it->get_kind() == Value::STR) {
+            var_size += it->get_str().size();
         }
     }
+    return var_size;
 }
 
 void Row::copy_into(Row* row) const {
-    row->fixed_part_ = new char[this->schema_->fixed_part_size_];
+    // row is allocated by alloc_row(), with enough space for our var part
+    verify(row->schema_ == this->schema_);
     memcpy(row->fixed_part_, this->fixed_part_, this->schema_->fixed_part_size_);
 
     row->kind_ = DENSE; // always make a dense copy
 
-    int var_part_size = 0;
-    int var_count = 0;
-    for (auto& it : *this->schema_) {
-        if (it.type != Value::STR) {
-            continue;
-        }
-        var_part_size += this->get_blob(it.id).len;
-        var_count++;
-    }
-    row->dense_var_part_ = new char[var_part_size];
-    row->dense_var_idx_ = new int[var_count];
-
     int var_idx = 0;
     int var_pos = 0;
     for (auto& it : *this->schema_) {
@@ -48,14 +75,21 @@ void Row::copy_into(Row* row) const {
         row->dense_var_idx_[var_idx] = var_pos;
         var_idx++;
     }
+    for (; var_idx < schema_->var_size_cols_; var_idx++) {
+        // hidden var columns are always empty in a copy
+        row->dense_var_idx_[var_idx] = var_pos;
+    }
 
     row->tbl_ = nullptr;    // do not mark it as inside some table
 
     row->rdonly_ = false;   // always make it writable
-    row->schema_ = this->schema_;
 }
 
 void Row::make_sparse() {
+    relocate_var_part(false);
+}
+
+void Row::spread_var_part() {
     if (kind_ == SPARSE) {
         // already sparse data
         return;
@@ -73,16 +107,128 @@ void Row::make_sparse() {
     int* var_idx = dense_var_idx_;
 
     assert(schema_->var_size_cols_ > 0);
-    sparse_var_ = new std::string[schema_->var_size_cols_];
-    sparse_var_[0] = std::string(var_data, var_idx[0]);
+    std::string* sparse_var = new std::string[schema_->var_size_cols_];
+    sparse_var[0] = std::string(var_data, var_idx[0]);
     for (int i = 1; i < schema_->var_size_cols_; i++) {
         int var_start = var_idx[i - 1];
         int var_len = var_idx[i] - var_idx[i - 1];
-        sparse_var_[i] = std::string(&var_data[var_start], var_len);
+        sparse_var[i] = std::string(&var_data[var_start], var_len);
     }
 
-    delete[] var_data;
-    delete[] var_idx;
+    // the inline dense var part stays in the row block, and is simply unused from now on
+    free_outlined_var_part();
+    sparse_var_ = sparse_var;
+}
+
+void Row::make_dense() {
+    relocate_var_part(true);
+}
+
+void Row::relocate_var_part(bool to_dense) {
+    // going dense moves sparse strings and outlined var parts, going sparse frees outlined ones
+    // the inline var part stays where it is either way
+    bool moves = (kind_ == DENSE) ? var_part_outlined() : to_dense;
+    int key_col = -1;
+    if (tbl_ != nullptr && schema_->var_size_cols_ > 0 && moves) {
+        key_col = var_key_column();
+    }
+    // save tbl_, because tbl_->remove() will set it to nullptr
+    Table* tbl = tbl_;
+    if (key_col >= 0) {
+        verify(!rdonly_);
+        tbl->notify_before_update(this, key_col);
+        tbl->remove(this, false);
+    }
+    if (to_dense) {
+        compact_var_part();
+    } else {
+        spread_var_part();
+    }
+    if (key_col >= 0) {
+        tbl->insert(this);
+        tbl->notify_after_update(this, key_col);
+    }
+}
+
+void Row::compact_var_part() {
+    if (schema_->var_size_cols_ == 0) {
+        // special case, no memory copying required
+        kind_ = DENSE;
+        return;
+    }
+
+    char* inline_var = fixed_part_ + schema_->fixed_part_size_;
+    int var_size = var_part_size();
+
+    if (kind_ == DENSE) {
+        if (var_part_outlined() && var_size <= inline_var_cap_) {
+            // shrunk enough, move back into the row block
+            memcpy(inline_var, dense_var_part_, var_size);
+            free_outlined_var_part();
+        }
+        return;
+    }
+
+    std::string* sparse_var = sparse_var_;
+    char* var_data = inline_var;
+    int var_cap = inline_var_cap_;
+    if (var_size > inline_var_cap_) {
+        var_cap = var_size;
+        var_data = (char *) RowAllocator::allocate(schema_->allocator(), var_cap);
+    }
+
+    // var idx table is right in front of fixed part, see attach_payload()
+    dense_var_idx_ = ((int *) fixed_part_) - schema_->var_size_cols_;
+    int var_pos = 0;
+    for (int i = 0; i < schema_->var_size_cols_; i++) {
+        memcpy(&var_data[var_pos], sparse_var[i].data(), sparse_var[i].size());
+        var_pos += sparse_var[i].size();
+        dense_var_idx_[i] = var_pos;
+    }
+    delete[] sparse_var;
+
+    kind_ = DENSE;
+    dense_var_part_ = var_data;
+    var_cap_ = var_cap;
+}
+
+int Row::var_key_column() const {
+    for (auto& col_id : schema_->key_columns_id()) {
+        if (schema_->get_column_info(col_id)->type == Value::STR) {
+            return col_id;
+        }
+    }
+    return -1;
+}
+
+void Row::update_dense_var(const Schema::column_info* col, const std::string& v) {
+    verify(kind_ == DENSE);
+    int var_cols = schema_->var_size_cols_;
+    int var_idx = col->var_size_idx;
+    int var_start = (var_idx == 0) ? 0 : dense_var_idx_[var_idx - 1];
+    int old_len = dense_var_idx_[var_idx] - var_start;
+    int var_size = dense_var_idx_[var_cols - 1];
+    int tail_len = var_size - var_start - old_len;
+    int delta = int(v.size()) - old_len;
+    int new_size = var_size + delta;
+
+    if (new_size <= var_cap_) {
+        // enough room, shift the following columns in place
+        memmove(&dense_var_part_[var_start + v.size()], &dense_var_part_[var_start + old_len], tail_len);
+    } else {
+        // out of room, move var part out of the row block, leaving some slack for growing further
+        int new_cap = new_size + new_size / 2;
+        char* var_data = (char *) RowAllocator::allocate(schema_->allocator(), new_cap);
+        memcpy(var_data, dense_var_part_, var_start);
+        memcpy(&var_data[var_start + v.size()], &dense_var_part_[var_start + old_len], tail_len);
+        free_outlined_var_part();
+        dense_var_part_ = var_data;
+        var_cap_ = new_cap;
+    }
+    memcpy(&dense_var_part_[var_start], v.data(), v.size());
+    for (int i = var_idx; i < var_cols; i++) {
+        dense_var_idx_[i] += delta;
+    }
 }
 
 Value Row::get_column(int column_id) const {
@@ -167,20 +313,21 @@ blob Row::get_blob(int column_id) const {
 void Row::update_fixed(const Schema::column_info* col, void* ptr, int len) {
     verify(!rdonly_);
     // check if really updating (new data!), and if necessary to remove/insert into table
-    bool re_insert = false;
     if (memcmp(&fixed_part_[col->fixed_size_offst], ptr, len) == 0) {
         // not really updating
         return;
     }
 
-    if (col->indexed) {
-        re_insert = true;
-    }
+    // only a key column moves the row in the table, secondary indexes are left to the table
+    bool re_insert = col->key;
+    bool notify = col->indexed;
 
     // save tbl_, because tbl_->remove() will set it to nullptr
     Table* tbl = tbl_;
-    if (re_insert && tbl != nullptr) {
+    if (notify && tbl != nullptr) {
         tbl->notify_before_update(this, col->id);
+    }
+    if (re_insert && tbl != nullptr) {
         tbl->remove(this, false);
     }
 
@@ -188,6 +335,8 @@ void Row::update_fixed(const Schema::column_info* col, void* ptr, int len) {
 
     if (re_insert && tbl != nullptr) {
         tbl->insert(this);
+    }
+    if (notify && tbl != nullptr) {
         tbl->notify_after_update(this, col->id);
     }
 }
@@ -213,27 +362,40 @@ void Row::update(int column_id, const std::string& v) {
         }
     }
 
-    if (col->indexed) {
+    if (col->key) {
+        re_insert = true;
+    } else if (kind_ == DENSE && size_t(b.len) != v.size() && has_var_key()) {
+        // other var columns will be shifted or moved out of the row block, and tables
+        // keep pointers to key data inside the row, so the row has to be re-inserted
         re_insert = true;
     }
+    // the table hears about every update it sees a remove/insert for, so IndexedTable can leave
+    // the entries of secondary indexes not covering the column in place
+    bool notify = col->indexed || re_insert;
 
     // save tbl_, because tbl_->remove() will set it to nullptr
     Table* tbl = tbl_;
-    if (re_insert && tbl != nullptr) {
+    if (notify && tbl != nullptr) {
         tbl->notify_before_update(this, column_id);
+    }
+    if (re_insert && tbl != nullptr) {
         tbl->remove(this, false);
     }
 
     if (kind_ == DENSE && size_t(b.len) == v.size()) {
         // tiny optimization: in-place update if string size is not changed
         memcpy(const_cast<char *>(b.data), &v[0], b.len);
+    } else if (kind_ == DENSE) {
+        // keep the row dense, instead of allocating a string for every var column
+        this->update_dense_var(col, v);
     } else {
-        this->make_sparse();
         this->sparse_var_[col->var_size_idx] = v;
     }
 
     if (re_insert && tbl != nullptr) {
         tbl->insert(this);
+    }
+    if (notify && tbl != nullptr) {
         tbl->notify_after_update(this, column_id);
     }
 }
@@ -274,15 +436,11 @@ int Row::compare(const Row& o) const {
 
 Row* Row::create(Row* raw_row, const Schema* schema, const std::vector<const Value*>& values) {
     Row* row = raw_row;
-    row->schema_ = schema;
-    row->fixed_part_ = new char[schema->fixed_part_size_];
+    verify(row->schema_ == schema);
     memset(row->fixed_part_, 0, schema->fixed_part_size_);
-    if (schema->var_size_cols_ > 0) {
-        row->dense_var_idx_ = new int[schema->var_size_cols_];
-    }
 
     // 1st pass, write fixed part, and calculate var part size
-    int var_part_size = 0;
+    int var_size = 0;
     int fixed_pos = 0;
     for (auto& it: values) {
         switch (it->get_kind()) {
@@ -299,7 +457,7 @@ Row* Row::create(Row* raw_row, const Schema* schema, const std::vector<const Val
             fixed_pos += sizeof(double);
             break;
         case Value::STR:
-            var_part_size += it->get_str().size();
+            var_size += it->get_str().size();
             break;
         default:
             Log::fatal("unexpected value type %d", it->get_kind());
@@ -333,7 +491,6 @@ Row* Row::create(Row* raw_row, const Schema* schema, const std::vector<const Val
         // 2nd pass, write var part
         int var_counter = 0;
         int var_pos = 0;
-        row->dense_var_part_ = new char[var_part_size];
         for (auto& it: values) {
             if (it->get_kind() == Value::STR) {
                 it->write_binary(&row->dense_var_part_[var_pos]);
@@ -342,7 +499,7 @@ Row* Row::create(Row* raw_row, const Schema* schema, const std::vector<const Val
                 var_counter++;
             }
         }
-        verify(var_part_size == var_pos);
+        verify(var_size == var_pos);
         for (size_t i = values.size(); i < schema->col_info_.size(); i++) {
             if (schema->col_info_[i].type == Value::STR) {
                 // create an empty var column
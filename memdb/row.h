@@ -1,11 +1,13 @@
 #pragma once
 
 #include <map>
+#include <new>
 #include <unordered_map>
 #include <vector>
 #include <string>
 
 #include "utils.h"
+#include "allocator.h"
 #include "schema.h"
 #include "locking.h"
 
@@ -26,6 +28,11 @@ class Row: public RefCounted {
 
     int kind_;
 
+    // capacity of dense var part, and how much of it fits in the row block (DENSE rows only)
+    // var part is moved out of the row block when it outgrows the inline space
+    int var_cap_;
+    int inline_var_cap_;
+
     union {
         // for DENSE rows
         struct {
@@ -42,6 +49,28 @@ class Row: public RefCounted {
 
     Table* tbl_;
 
+    bool var_part_outlined() const {
+        return var_cap_ > inline_var_cap_;
+    }
+    void free_outlined_var_part();
+
+    const char* fixed_column(int column_id, Value::kind type) const {
+        const Schema::column_info* info = schema_->get_column_info(column_id);
+        verify(info->type == type);
+        return &fixed_part_[info->fixed_size_offst];
+    }
+    void update_dense_var(const Schema::column_info* col, const std::string& v);
+    void spread_var_part();
+    void compact_var_part();
+    // spread (to_dense == false) or compact the var part, re-inserting the row into its table if
+    // string key data moves, as tables keep pointers to it
+    void relocate_var_part(bool to_dense);
+    // first string key column, -1 if none
+    int var_key_column() const;
+    bool has_var_key() const {
+        return var_key_column() >= 0;
+    }
+
 protected:
 
     void update_fixed(const Schema::column_info* col, void* ptr, int len);
@@ -50,16 +79,48 @@ protected:
     const Schema* schema_;
 
     // hidden ctor, factory model
-    Row(): fixed_part_(nullptr), kind_(DENSE),
+    Row(): fixed_part_(nullptr), kind_(DENSE), var_cap_(0), inline_var_cap_(0),
            dense_var_part_(nullptr), dense_var_idx_(nullptr),
            tbl_(nullptr), rdonly_(false), schema_(nullptr) {}
 
     // RefCounted should have protected dtor
     virtual ~Row();
 
+    // Rows are allocated as a single block, with data following the Row object:
+    //   [ RowType | extra part | var idx | fixed part | var part ]
+    // The extra part is reserved for subclasses (e.g. per-column versions).
+    static size_t extra_part_offset(size_t row_size) {
+        return (row_size + 7) & ~size_t(7);
+    }
+    static size_t payload_size(const Schema* schema, int var_part_size) {
+        return schema->var_size_cols_ * sizeof(int) + schema->fixed_part_size_ + var_part_size;
+    }
+
+    void attach_payload(char* payload, const Schema* schema, int var_part_size);
+
+    template <class RowType>
+    static RowType* alloc_row(const Schema* schema, int var_part_size, size_t extra_size = 0) {
+        size_t extra_offst = extra_part_offset(sizeof(RowType));
+        size_t payload_offst = extra_offst + extra_part_offset(extra_size);
+        char* block = (char *) RowAllocator::allocate(schema->allocator(),
+                                                      payload_offst + payload_size(schema, var_part_size));
+        RowType* row = new (block) RowType();
+        row->attach_payload(block + payload_offst, schema, var_part_size);
+        return row;
+    }
+
+    template <class RowType>
+    static char* extra_part(RowType* row) {
+        return ((char *) row) + extra_part_offset(sizeof(RowType));
+    }
+
+    // total size of var size columns
+    int var_part_size() const;
+    static int var_part_size(const std::vector<const Value*>& values);
+
     void copy_into(Row* row) const;
 
-    // generic row creation
+    // generic row creation, raw_row must come from alloc_row()
     static Row* create(Row* raw_row, const Schema* schema, const std::vector<const Value*>& values);
 
     // helper function for row creation
@@ -76,8 +137,25 @@ protected:
         values_ptr[col_id] = &pair.second;
     }
 
+    template <class Container>
+    static std::vector<const Value*> values_ptr(const Schema* schema, const Container& values) {
+        verify(values.size() == schema->columns_count());
+        std::vector<const Value*> ptrs(values.size(), nullptr);
+        size_t fill_counter = 0;
+        for (auto it = values.begin(); it != values.end(); ++it) {
+            fill_values_ptr(schema, ptrs, *it, fill_counter);
+            fill_counter++;
+        }
+        return ptrs;
+    }
+
 public:
 
+    // rows are allocated by alloc_row(), and freed by RefCounted::release()
+    static void operator delete(void* ptr) {
+        RowAllocator::deallocate(ptr);
+    }
+
     virtual symbol_t rtti() const {
         return symbol_t::ROW_BASIC;
     }
@@ -91,7 +169,19 @@ public:
     void make_readonly() {
         rdonly_ = true;
     }
+    // the row is re-inserted into its table if string key data moves
     void make_sparse();
+
+    // re-compact var size columns into a single buffer, back into the row block if possible
+    // the row is re-inserted into its table if string key data moves
+    void make_dense();
+
+    // releasing the row would only hand its block back to allocator: it is a plain row which
+    // nobody else references, and owns nothing outside its block (see RowAllocator::release_all)
+    bool only_block_from(const RowAllocator* allocator) {
+        return rtti() == symbol_t::ROW_BASIC && ref_count() == 1 && kind_ == DENSE && !var_part_outlined()
+               && RowAllocator::owner_of(this) == allocator;
+    }
     void set_table(Table* tbl) {
         if (tbl != nullptr) {
             verify(tbl_ == nullptr);
@@ -113,6 +203,41 @@ public:
         return get_blob(schema_->get_column_id(col_name));
     }
 
+    // typed accessors, reading directly from row data without constructing a Value
+    i32 get_i32(int column_id) const {
+        i32 v;
+        memcpy(&v, fixed_column(column_id, Value::I32), sizeof(v));
+        return v;
+    }
+    i64 get_i64(int column_id) const {
+        i64 v;
+        memcpy(&v, fixed_column(column_id, Value::I64), sizeof(v));
+        return v;
+    }
+    double get_double(int column_id) const {
+        double v;
+        memcpy(&v, fixed_column(column_id, Value::DOUBLE), sizeof(v));
+        return v;
+    }
+    // the view is only valid until the column is updated, or the row is released
+    blob get_str_view(int column_id) const {
+        verify(schema_->get_column_info(column_id)->type == Value::STR);
+        return get_blob(column_id);
+    }
+
+    i32 get_i32(const std::string& col_name) const {
+        return get_i32(schema_->get_column_id(col_name));
+    }
+    i64 get_i64(const std::string& col_name) const {
+        return get_i64(schema_->get_column_id(col_name));
+    }
+    double get_double(const std::string& col_name) const {
+        return get_double(schema_->get_column_id(col_name));
+    }
+    blob get_str_view(const std::string& col_name) const {
+        return get_str_view(schema_->get_column_id(col_name));
+    }
+
     void update(int column_id, i32 v) {
         const Schema::column_info* info = schema_->get_column_info(column_id);
         verify(info->type == Value::I32);
@@ -171,21 +296,16 @@ public:
     }
 
     virtual Row* copy() const {
-        Row* row = new Row();
+        Row* row = alloc_row<Row>(schema_, var_part_size());
         copy_into(row);
         return row;
     }
 
     template <class Container>
     static Row* create(const Schema* schema, const Container& values) {
-        verify(values.size() == schema->columns_count());
-        std::vector<const Value*> values_ptr(values.size(), nullptr);
-        size_t fill_counter = 0;
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            fill_values_ptr(schema, values_ptr, *it, fill_counter);
-            fill_counter++;
-        }
-        return Row::create(new Row(), schema, values_ptr);
+        std::vector<const Value*> ptrs = values_ptr(schema, values);
+        Row* raw_row = alloc_row<Row>(schema, var_part_size(ptrs));
+        return Row::create(raw_row, schema, ptrs);
     }
 };
 
@@ -220,42 +340,47 @@ public:
     }
 
     virtual Row* copy() const {
-        CoarseLockedRow* row = new CoarseLockedRow();
+        CoarseLockedRow* row = alloc_row<CoarseLockedRow>(schema_, var_part_size());
         copy_into(row);
         return row;
     }
 
     template <class Container>
     static CoarseLockedRow* create(const Schema* schema, const Container& values) {
-        verify(values.size() == schema->columns_count());
-        std::vector<const Value*> values_ptr(values.size(), nullptr);
-        size_t fill_counter = 0;
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            fill_values_ptr(schema, values_ptr, *it, fill_counter);
-            fill_counter++;
-        }
-        return (CoarseLockedRow * ) Row::create(new CoarseLockedRow(), schema, values_ptr);
+        std::vector<const Value*> ptrs = values_ptr(schema, values);
+        CoarseLockedRow* raw_row = alloc_row<CoarseLockedRow>(schema, var_part_size(ptrs));
+        return (CoarseLockedRow * ) Row::create(raw_row, schema, ptrs);
     }
 };
 
 
 class FineLockedRow: public Row {
     RWLock* lock_;
-    void init_lock(int n_columns) {
-        lock_ = new RWLock[n_columns];
+
+    // locks are stored in the extra part of the row block
+    static FineLockedRow* alloc(const Schema* schema, int var_part_size) {
+        int n_columns = schema->columns_count();
+        FineLockedRow* row = alloc_row<FineLockedRow>(schema, var_part_size, n_columns * sizeof(RWLock));
+        row->lock_ = (RWLock *) extra_part(row);
+        for (int i = 0; i < n_columns; i++) {
+            new (&row->lock_[i]) RWLock();
+        }
+        return row;
     }
 
 protected:
 
     // protected dtor as required by RefCounted
     ~FineLockedRow() {
-        delete[] lock_;
+        int n_columns = schema_->columns_count();
+        for (int i = 0; i < n_columns; i++) {
+            lock_[i].~RWLock();
+        }
     }
 
     void copy_into(FineLockedRow* row) const {
         this->Row::copy_into((Row *) row);
         int n_columns = schema_->columns_count();
-        row->init_lock(n_columns);
         for (int i = 0; i < n_columns; i++) {
             row->lock_[i] = lock_[i];
         }
@@ -290,23 +415,16 @@ public:
     }
 
     virtual Row* copy() const {
-        FineLockedRow* row = new FineLockedRow();
+        FineLockedRow* row = alloc(schema_, var_part_size());
         copy_into(row);
         return row;
     }
 
     template <class Container>
     static FineLockedRow* create(const Schema* schema, const Container& values) {
-        verify(values.size() == schema->columns_count());
-        std::vector<const Value*> values_ptr(values.size(), nullptr);
-        size_t fill_counter = 0;
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            fill_values_ptr(schema, values_ptr, *it, fill_counter);
-            fill_counter++;
-        }
-        FineLockedRow* raw_row = new FineLockedRow();
-        raw_row->init_lock(schema->columns_count());
-        return (FineLockedRow * ) Row::create(raw_row, schema, values_ptr);
+        std::vector<const Value*> ptrs = values_ptr(schema, values);
+        FineLockedRow* raw_row = alloc(schema, var_part_size(ptrs));
+        return (FineLockedRow * ) Row::create(raw_row, schema, ptrs);
     }
 };
 
@@ -314,22 +432,24 @@ public:
 // inherit from CoarseLockedRow since we need locking on commit phase, when doing 2 phase commit
 class VersionedRow: public CoarseLockedRow {
     version_t* ver_;
-    void init_ver(int n_columns) {
-        ver_ = new version_t[n_columns];
-        memset(ver_, 0, sizeof(version_t) * n_columns);
+
+    // versions are stored in the extra part of the row block
+    static VersionedRow* alloc(const Schema* schema, int var_part_size) {
+        int n_columns = schema->columns_count();
+        VersionedRow* row = alloc_row<VersionedRow>(schema, var_part_size, n_columns * sizeof(version_t));
+        row->ver_ = (version_t *) extra_part(row);
+        memset(row->ver_, 0, sizeof(version_t) * n_columns);
+        return row;
     }
 
 protected:
 
     // protected dtor as required by RefCounted
-    ~VersionedRow() {
-        delete[] ver_;
-    }
+    ~VersionedRow() {}
 
     void copy_into(VersionedRow* row) const {
         this->CoarseLockedRow::copy_into((CoarseLockedRow *)row);
         int n_columns = schema_->columns_count();
-        row->init_ver(n_columns);
         memcpy(row->ver_, this->ver_, n_columns * sizeof(version_t));
     }
 
@@ -348,23 +468,32 @@ public:
     }
 
     virtual Row* copy() const {
-        VersionedRow* row = new VersionedRow();
+        VersionedRow* row = alloc(schema_, var_part_size());
         copy_into(row);
         return row;
     }
 
     template <class Container>
     static VersionedRow* create(const Schema* schema, const Container& values) {
-        verify(values.size() == schema->columns_count());
-        std::vector<const Value*> values_ptr(values.size(), nullptr);
-        size_t fill_counter = 0;
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            fill_values_ptr(schema, values_ptr, *it, fill_counter);
-            fill_counter++;
+        std::vector<const Value*> ptrs = values_ptr(schema, values);
+        VersionedRow* raw_row = alloc(schema, var_part_size(ptrs));
+        return (VersionedRow * ) Row::create(raw_row, schema, ptrs);
+    }
+};
+
+
+// rows returned by a query, which can also count and skip them
+class RowCursor: public Enumerator<const Row*> {
+public:
+    // number of rows in the whole range, including the ones already returned
+    virtual int count() = 0;
+
+    // skip the next n rows (or all that are left), by walking them unless the cursor knows better
+    virtual void skip(int n) {
+        verify(n >= 0);
+        for (int i = 0; i < n && has_next(); i++) {
+            next();
         }
-        VersionedRow* raw_row = new VersionedRow();
-        raw_row->init_ver(schema->columns_count());
-        return (VersionedRow * ) Row::create(raw_row, schema, values_ptr);
     }
 };
 
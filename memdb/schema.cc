@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <set>
 
 #include "schema.h"
@@ -16,10 +17,11 @@ int Schema::do_add_column(const char* name, Value::kind type, bool key) {
     column_info col_info;
     col_info.name = name;
     col_info.id = this_column_id;
+    col_info.key = key;
     col_info.indexed = key;
     col_info.type = type;
 
-    if (col_info.indexed) {
+    if (col_info.key) {
         key_cols_id_.push_back(col_info.id);
     }
 
@@ -60,8 +62,13 @@ void IndexedSchema::index_sanity_check(const std::vector<column_id_t>& idx) {
     }
 }
 
-int IndexedSchema::add_index(const char* name, const std::vector<column_id_t>& idx) {
+int IndexedSchema::do_add_index(const char* name, const std::vector<column_id_t>& idx, symbol_t kind,
+                                const std::vector<column_id_t>& include /* =? */) {
     index_sanity_check(idx);
+    for (auto& column_id : include) {
+        verify(column_id >= 0 && column_id < (column_id_t) columns_count());
+        verify(std::find(idx.begin(), idx.end(), column_id) == idx.end());
+    }
     int this_idx_id = all_idx_.size();
     if (idx_name_.find(name) != idx_name_.end()) {
         return -1;
@@ -70,11 +77,31 @@ int IndexedSchema::add_index(const char* name, const std::vector<column_id_t>& i
         // set up the indexed mark
         col_info_[col_id].indexed = true;
     }
+    for (auto& col_id : include) {
+        // entries hold them as well, and have to be updated with them
+        col_info_[col_id].indexed = true;
+    }
     idx_name_[name] = this_idx_id;
     all_idx_.push_back(idx);
+    idx_include_.push_back(include);
+    idx_kind_.push_back(kind);
     return this_idx_id;
 }
 
+void IndexedSchema::mark_indexed(const std::vector<column_id_t>& cols) {
+    index_sanity_check(cols);
+    for (auto& col_id : cols) {
+        col_info_[col_id].indexed = true;
+    }
+}
+
+void IndexedSchema::unmark_indexed(const std::vector<column_id_t>& cols) {
+    index_sanity_check(cols);
+    for (auto& col_id : cols) {
+        col_info_[col_id].indexed = false;
+    }
+}
+
 int IndexedSchema::add_index_by_column_names(const char* name, const std::vector<std::string>& named_idx) {
     std::vector<column_id_t> idx;
     for (auto& col_name : named_idx) {
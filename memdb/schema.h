@@ -11,6 +11,7 @@
 namespace mdb {
 
 class Row;
+class RowAllocator;
 
 class Schema {
     friend class Row;
@@ -18,10 +19,11 @@ class Schema {
 public:
 
     struct column_info {
-        column_info(): id(-1), indexed(false), type(Value::UNKNOWN), fixed_size_offst(-1) {}
+        column_info(): id(-1), key(false), indexed(false), type(Value::UNKNOWN), fixed_size_offst(-1) {}
 
         column_id_t id;
         std::string name;
+        bool key;       // primary index only
         bool indexed;   // primary index or secondary index
         Value::kind type;
 
@@ -35,7 +37,8 @@ public:
         };
     };
 
-    Schema(): var_size_cols_(0), fixed_part_size_(0), hidden_fixed_(0), hidden_var_(0), frozen_(false) {}
+    Schema(): var_size_cols_(0), fixed_part_size_(0), hidden_fixed_(0), hidden_var_(0), frozen_(false),
+              allocator_(nullptr), normalized_key_(false) {}
     virtual ~Schema() {}
 
     int add_column(const char* name, Value::kind type, bool key = false) {
@@ -86,6 +89,24 @@ public:
         frozen_ = true;
     }
 
+    // rows of this schema will be allocated from the allocator (not owned), nullptr means heap
+    // NOTE: must be set before any row is created, and the allocator must outlive those rows
+    void set_allocator(RowAllocator* allocator) {
+        allocator_ = allocator;
+    }
+    RowAllocator* allocator() const {
+        return allocator_;
+    }
+
+    // sorted tables compare keys in a normalized, memcmp-comparable form (see SortedMultiKey)
+    // NOTE: must be set before any key is built on this schema
+    void set_normalized_key(bool normalized) {
+        normalized_key_ = normalized;
+    }
+    bool normalized_key() const {
+        return normalized_key_;
+    }
+
 protected:
 
     int add_hidden_column(const char* name, Value::kind type) {
@@ -113,6 +134,9 @@ protected:
     int hidden_var_;
     bool frozen_;
 
+    RowAllocator* allocator_;
+    bool normalized_key_;
+
 private:
 
     int do_add_column(const char* name, Value::kind type, bool key);
@@ -120,22 +144,46 @@ private:
 
 
 class IndexedSchema: public Schema {
-    int idx_col_;
-
     std::vector<std::vector<column_id_t>> all_idx_;
+    std::vector<std::vector<column_id_t>> idx_include_;
+    std::vector<symbol_t> idx_kind_;
     std::map<std::string, int> idx_name_;
 
     void index_sanity_check(const std::vector<column_id_t>& idx);
+    int do_add_index(const char* name, const std::vector<column_id_t>& idx, symbol_t kind,
+                     const std::vector<column_id_t>& include = std::vector<column_id_t>());
 
 public:
-    IndexedSchema(): idx_col_(-1) {}
+    // ordered index, supports range and prefix queries
+    int add_index(const char* name, const std::vector<column_id_t>& idx) {
+        return do_add_index(name, idx, symbol_t::IDX_SORTED);
+    }
+    // covering ordered index, entries keep a copy of the include columns (not part of the index key)
+    // next to the indexed ones, so Index::Cursor::next_values() reads them without the base row
+    int add_index(const char* name, const std::vector<column_id_t>& idx, const std::vector<column_id_t>& include) {
+        return do_add_index(name, idx, symbol_t::IDX_SORTED, include);
+    }
+    int add_index_by_column_names(const char* name, const std::vector<std::string>& named_idx);
 
-    int index_column_id() const {
-        return idx_col_;
+    // unordered index, only for equality lookups on all its columns, which are O(1). if unique, inserting
+    // a row with the same values as another one in the table is rejected (see IndexedTable::try_insert)
+    int add_hash_index(const char* name, const std::vector<column_id_t>& idx, bool unique = false) {
+        return do_add_index(name, idx, unique ? symbol_t::IDX_UNIQUE_HASH : symbol_t::IDX_HASH);
     }
 
-    int add_index(const char* name, const std::vector<column_id_t>& idx);
-    int add_index_by_column_names(const char* name, const std::vector<std::string>& named_idx);
+    // IDX_SORTED, IDX_HASH or IDX_UNIQUE_HASH
+    symbol_t get_index_kind(int idx_id) const {
+        return idx_kind_[idx_id];
+    }
+
+    bool has_index(const std::string& name) const {
+        return idx_name_.find(name) != idx_name_.end();
+    }
+    // updates of these columns are reported to tables (see Table::notify_before_update()) from now on,
+    // before an index on them is added (see IndexedTable::begin_create_index())
+    void mark_indexed(const std::vector<column_id_t>& cols);
+    // undoes mark_indexed() when the index is not added after all (see IndexedTable::abort_create_index())
+    void unmark_indexed(const std::vector<column_id_t>& cols);
 
     int get_index_id(const std::string& name) {
         auto it = idx_name_.find(name);
@@ -148,13 +196,8 @@ public:
     const std::vector<column_id_t>& get_index(int idx_id) {
         return all_idx_[idx_id];
     }
-
-    virtual void freeze() {
-        if (!frozen_) {
-            idx_col_ = this->add_hidden_column(".index", Value::I64);
-            verify(idx_col_ >= 0);
-        }
-        Schema::freeze();
+    const std::vector<column_id_t>& get_index_include(int idx_id) const {
+        return idx_include_[idx_id];
     }
 
     std::vector<std::vector<column_id_t>>::const_iterator index_begin() const {
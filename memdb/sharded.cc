@@ -0,0 +1,393 @@
+#include <algorithm>
+
+#include "sharded.h"
+
+using namespace std;
+
+namespace mdb {
+
+void key_copy::assign(const MultiBlob& mb) {
+    size_t total = 0;
+    for (int i = 0; i < mb.count(); i++) {
+        total += mb[i].len;
+    }
+    data_.resize(total);
+    MultiBlob copy(mb.count());
+    size_t offst = 0;
+    for (int i = 0; i < mb.count(); i++) {
+        memcpy(&data_[0] + offst, mb[i].data, mb[i].len);
+        copy[i].data = &data_[0] + offst;
+        copy[i].len = mb[i].len;
+        offst += mb[i].len;
+    }
+    mb_ = std::move(copy);
+}
+
+
+ShardedTable::ShardedTable(const Schema* _schema, int n_shards, symbol_t engine /* =? */): Table(_schema) {
+    verify(n_shards > 0);
+    // rows are created and freed by many threads, RowAllocator is not thread safe
+    verify(_schema->allocator() == nullptr);
+    for (int i = 0; i < n_shards; i++) {
+        shards_.push_back(new shard(_schema, engine));
+    }
+}
+
+ShardedTable::ShardedTable(const Schema* _schema, const std::vector<MultiBlob>& split_keys,
+                           symbol_t engine /* =? */): Table(_schema) {
+    verify(!split_keys.empty());
+    verify(_schema->allocator() == nullptr);
+    for (size_t i = 0; i < split_keys.size(); i++) {
+        if (i > 0) {
+            verify(SortedMultiKey::compare(split_keys[i - 1], split_keys[i], _schema) < 0);
+        }
+        split_.push_back(key_copy(split_keys[i]));
+    }
+    for (size_t i = 0; i <= split_keys.size(); i++) {
+        shards_.push_back(new shard(_schema, engine));
+    }
+}
+
+ShardedTable::~ShardedTable() {
+    for (auto& sh : shards_) {
+        delete sh;
+    }
+}
+
+int ShardedTable::shard_of(const MultiBlob& key) const {
+    if (split_.empty()) {
+        return MultiBlob::hash()(key) % shards_.size();
+    }
+    // number of split keys <= key
+    int low = 0, high = split_.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (SortedMultiKey::compare(split_[mid].get(), key, schema_) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+size_t ShardedTable::size() const {
+    size_t n = 0;
+    for (auto& sh : shards_) {
+        ScopedLock sl(sh->latch);
+        n += sh->table->size();
+    }
+    return n;
+}
+
+void ShardedTable::insert(Row* row) {
+    verify(row->schema() == schema_);
+    shard* sh = shards_[shard_of(row->get_key())];
+    ScopedLock sl(sh->latch);
+    sh->table->insert(row);
+    // updates on the row should come back to the sharded table, not the shard
+    row->set_table(nullptr);
+    row->set_table(this);
+}
+
+void ShardedTable::remove(Row* row, bool do_free /* =? */) {
+    shard* sh = shards_[shard_of(row->get_key())];
+    {
+        ScopedLock sl(sh->latch);
+        sh->table->remove(row, false);
+    }
+    // the shard only clears the table of rows it has found
+    if (row->get_table() == nullptr && do_free) {
+        row->release();
+    }
+}
+
+void ShardedTable::remove(const MultiBlob& mb) {
+    verify(mb.count() == (int) schema_->key_columns_id().size());
+    shard* sh = shards_[shard_of(mb)];
+    vector<Row*> removed;
+    {
+        ScopedLock sl(sh->latch);
+        for (SortedTable::Cursor cur = sh->table->query(mb); cur; ) {
+            removed.push_back(cur.next());
+        }
+        for (auto& row : removed) {
+            sh->table->remove(row, false);
+        }
+    }
+    for (auto& row : removed) {
+        row->release();
+    }
+}
+
+void ShardedTable::clear() {
+    for (auto& sh : shards_) {
+        ScopedLock sl(sh->latch);
+        sh->table->clear();
+    }
+}
+
+ShardedTable::Cursor ShardedTable::query(const MultiBlob& mb) const {
+    // a key prefix may span shards, and can not be routed to one
+    verify(mb.count() == (int) schema_->key_columns_id().size());
+    return Cursor(schema_, shards_[shard_of(mb)], mb);
+}
+
+ShardedTable::Cursor ShardedTable::query_lt(const MultiBlob& mb, symbol_t order /* =? */) const {
+    key_copy high(mb);
+    return range(nullptr, &high, order);
+}
+
+ShardedTable::Cursor ShardedTable::query_gt(const MultiBlob& mb, symbol_t order /* =? */) const {
+    key_copy low(mb);
+    return range(&low, nullptr, order);
+}
+
+ShardedTable::Cursor ShardedTable::query_in(const MultiBlob& low, const MultiBlob& high,
+                                            symbol_t order /* =? */) const {
+    verify(SortedMultiKey::compare(low, high, schema_) < 0);
+    key_copy low_copy(low);
+    key_copy high_copy(high);
+    return range(&low_copy, &high_copy, order);
+}
+
+ShardedTable::Cursor ShardedTable::all(symbol_t order /* =? */) const {
+    return range(nullptr, nullptr, order);
+}
+
+ShardedTable::Cursor ShardedTable::range(const key_copy* low, const key_copy* high, symbol_t order) const {
+    verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
+    bool reverse = (order == symbol_t::ORD_DESC);
+    if (split_.empty()) {
+        // every shard may hold keys in range
+        return Cursor(schema_, shards_, low, high, reverse, order != symbol_t::ORD_ANY);
+    }
+    int first = (low == nullptr) ? 0 : shard_of(low->get());
+    int last = (high == nullptr) ? shards_.size() - 1 : shard_of(high->get());
+    vector<shard*> in_range;
+    for (int i = first; i <= last; i++) {
+        in_range.push_back(shards_[i]);
+    }
+    if (reverse) {
+        std::reverse(in_range.begin(), in_range.end());
+    }
+    // shards hold disjoint ranges, in order
+    return Cursor(schema_, in_range, low, high, reverse, false);
+}
+
+
+ShardedTable::Cursor::Cursor(const Schema* schema, const std::vector<shard*>& shards, const key_copy* low,
+                             const key_copy* high, bool reverse, bool merge)
+        : schema_(schema), point_(false), reverse_(reverse), merge_(merge), has_low_(low != nullptr),
+          has_high_(high != nullptr), count_(-1), current_(0), last_(nullptr) {
+    if (has_low_) {
+        low_ = *low;
+    }
+    if (has_high_) {
+        high_ = *high;
+    }
+    streams_.reserve(shards.size());
+    for (auto& sh : shards) {
+        add_stream(sh, low, high);
+    }
+    start();
+}
+
+ShardedTable::Cursor::Cursor(const Schema* schema, shard* sh, const MultiBlob& key)
+        : schema_(schema), point_(true), point_key_(key), reverse_(false), merge_(false), has_low_(false),
+          has_high_(false), count_(-1), current_(0), last_(nullptr) {
+    add_stream(sh, nullptr, nullptr);
+    start();
+}
+
+ShardedTable::Cursor::Cursor(Cursor&& o)
+        : schema_(o.schema_), point_(o.point_), point_key_(o.point_key_), reverse_(o.reverse_),
+          merge_(o.merge_), has_low_(o.has_low_), has_high_(o.has_high_), low_(o.low_), high_(o.high_),
+          count_(o.count_), streams_(std::move(o.streams_)), heap_(std::move(o.heap_)),
+          current_(o.current_), last_(o.last_) {
+    o.streams_.clear();
+    o.heap_.clear();
+    o.last_ = nullptr;
+}
+
+ShardedTable::Cursor::~Cursor() {
+    for (auto& s : streams_) {
+        release_rows(&s);
+    }
+    if (last_ != nullptr) {
+        last_->release();
+    }
+}
+
+void ShardedTable::Cursor::add_stream(shard* sh, const key_copy* low, const key_copy* high) {
+    shard_stream s;
+    s.sh = sh;
+    s.next = 0;
+    s.done = false;
+    s.has_low = (low != nullptr);
+    if (s.has_low) {
+        s.low = *low;
+    }
+    s.has_high = (high != nullptr);
+    if (s.has_high) {
+        s.high = *high;
+    }
+    streams_.push_back(s);
+}
+
+void ShardedTable::Cursor::start() {
+    if (merge_) {
+        for (size_t i = 0; i < streams_.size(); i++) {
+            fill(&streams_[i]);
+            if (streams_[i].has_row()) {
+                heap_push(i);
+            }
+        }
+    }
+    // otherwise streams are filled when reached
+}
+
+void ShardedTable::Cursor::release_rows(shard_stream* s) {
+    for (size_t i = s->next; i < s->rows.size(); i++) {
+        s->rows[i]->release();
+    }
+    s->rows.clear();
+    s->next = 0;
+}
+
+void ShardedTable::Cursor::fill(shard_stream* s) {
+    verify(!s->has_row() && !s->done);
+    s->rows.clear();
+    s->next = 0;
+
+    ScopedLock sl(s->sh->latch);
+    SortedTable* t = s->sh->table;
+    symbol_t order = reverse_ ? symbol_t::ORD_DESC : symbol_t::ORD_ASC;
+    if (point_) {
+        for (SortedTable::Cursor cur = t->query(point_key_.get()); cur; ) {
+            Row* row = cur.next();
+            row->ref_copy();
+            s->rows.push_back(row);
+        }
+        s->done = true;
+        return;
+    }
+    if (s->has_low && s->has_high
+            && SortedMultiKey::compare(s->low.get(), s->high.get(), schema_) >= 0) {
+        s->done = true;
+        return;
+    }
+
+    SortedTable::Cursor cur = s->has_low
+        ? (s->has_high ? t->query_in(s->low.get(), s->high.get(), order) : t->query_gt(s->low.get(), order))
+        : (s->has_high ? t->query_lt(s->high.get(), order) : t->all(order));
+
+    s->done = true;
+    while (cur) {
+        Row* row = cur.next();
+        // a batch always ends after the last row of a key, so the next one can start after that key
+        if (s->rows.size() >= BATCH_ROWS
+                && SortedMultiKey::compare(row->get_key(), s->rows.back()->get_key(), schema_) != 0) {
+            s->done = false;
+            break;
+        }
+        row->ref_copy();
+        s->rows.push_back(row);
+    }
+    if (!s->done) {
+        if (reverse_) {
+            s->has_high = true;
+            s->high.assign(s->rows.back()->get_key());
+        } else {
+            s->has_low = true;
+            s->low.assign(s->rows.back()->get_key());
+        }
+    }
+}
+
+bool ShardedTable::Cursor::heap_after(int a, int b) const {
+    int cmp = SortedMultiKey::compare(streams_[a].row()->get_key(), streams_[b].row()->get_key(), schema_);
+    return reverse_ ? (cmp < 0) : (cmp > 0);
+}
+
+void ShardedTable::Cursor::heap_push(int i) {
+    heap_.push_back(i);
+    std::push_heap(heap_.begin(), heap_.end(), [this] (int a, int b) {
+        return heap_after(a, b);
+    });
+}
+
+void ShardedTable::Cursor::heap_pop() {
+    std::pop_heap(heap_.begin(), heap_.end(), [this] (int a, int b) {
+        return heap_after(a, b);
+    });
+    heap_.pop_back();
+}
+
+bool ShardedTable::Cursor::has_next() {
+    if (merge_) {
+        return !heap_.empty();
+    }
+    while (current_ < streams_.size()) {
+        shard_stream* s = &streams_[current_];
+        if (s->has_row()) {
+            return true;
+        }
+        if (s->done) {
+            current_++;
+        } else {
+            fill(s);
+        }
+    }
+    return false;
+}
+
+Row* ShardedTable::Cursor::next() {
+    verify(has_next());
+    int i = merge_ ? heap_[0] : current_;
+    shard_stream* s = &streams_[i];
+    Row* row = s->row();
+    s->next++;
+    if (merge_) {
+        heap_pop();
+        if (!s->has_row() && !s->done) {
+            fill(s);
+        }
+        if (s->has_row()) {
+            heap_push(i);
+        }
+    }
+    // keep the returned row alive until the next call, and drop the reference on the previous one
+    if (last_ != nullptr) {
+        last_->release();
+    }
+    last_ = row;
+    return row;
+}
+
+int ShardedTable::Cursor::count() {
+    if (count_ >= 0) {
+        return count_;
+    }
+    count_ = 0;
+    for (auto& s : streams_) {
+        ScopedLock sl(s.sh->latch);
+        SortedTable* t = s.sh->table;
+        if (point_) {
+            count_ += t->query(point_key_.get()).count();
+        } else if (has_low_ && has_high_) {
+            if (SortedMultiKey::compare(low_.get(), high_.get(), schema_) < 0) {
+                count_ += t->query_in(low_.get(), high_.get()).count();
+            }
+        } else if (has_low_) {
+            count_ += t->query_gt(low_.get()).count();
+        } else if (has_high_) {
+            count_ += t->query_lt(high_.get()).count();
+        } else {
+            count_ += t->size();
+        }
+    }
+    return count_;
+}
+
+} // namespace mdb
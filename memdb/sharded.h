@@ -0,0 +1,231 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "table.h"
+
+namespace mdb {
+
+// copy of a key, which does not point into any row
+class key_copy {
+    std::string data_;
+    MultiBlob mb_;
+
+public:
+    key_copy() {}
+    explicit key_copy(const MultiBlob& mb) {
+        assign(mb);
+    }
+    key_copy(const key_copy& o) {
+        assign(o.mb_);
+    }
+    const key_copy& operator= (const key_copy& o) {
+        if (this != &o) {
+            assign(o.mb_);
+        }
+        return *this;
+    }
+
+    void assign(const MultiBlob& mb);
+
+    const MultiBlob& get() const {
+        return mb_;
+    }
+};
+
+// Table that spreads rows over N SortedTables (shards), each guarded by its own latch, so
+// different threads can work on the same table at the same time.
+//
+// Rows are placed by hash of the key, or by key range (split points given to the ctor). Point
+// queries, inserts and removes latch a single shard. Range queries and all() walk every shard
+// that may hold matching rows, merging them in key order (range partitioned shards are simply
+// walked one after another).
+//
+// Cursors never hold a latch between calls: rows are copied out of a shard in small batches, with
+// a reference taken on each row, and the next batch starts after the last key seen. A cursor thus
+// sees rows inserted or removed concurrently in the part of the range it has not reached yet.
+// A row returned by Cursor::next() stays valid until the following call to next(), or until the
+// cursor is destroyed, even if it is removed from the table in the meantime.
+//
+// NOTE: only the table is thread safe. Updating rows, and the TxnMgr classes, still need
+// external synchronization. The schema must not use a RowAllocator, which is not thread safe.
+class ShardedTable: public Table {
+
+    struct shard {
+        SortedTable* table;
+        Mutex latch;
+
+        shard(const Schema* schema, symbol_t engine): table(new SortedTable(schema, engine)) {}
+        ~shard() {
+            delete table;
+        }
+    };
+
+    std::vector<shard*> shards_;
+
+    // range partitioning: shard i holds keys in [split_[i - 1], split_[i])
+    std::vector<key_copy> split_;
+
+    int shard_of(const MultiBlob& key) const;
+
+public:
+
+    class Cursor: public RowCursor {
+
+        enum {
+            BATCH_ROWS = 64,
+        };
+
+        // rows of a single shard, in the cursor's order
+        struct shard_stream {
+            shard* sh;
+            // referenced rows copied from the shard, consumed from next
+            std::vector<Row*> rows;
+            size_t next;
+            bool done;
+            // part of the range not copied yet, both ends exclusive
+            bool has_low, has_high;
+            key_copy low, high;
+
+            bool has_row() const {
+                return next < rows.size();
+            }
+            Row* row() const {
+                return rows[next];
+            }
+        };
+
+        const Schema* schema_;
+        bool point_;
+        key_copy point_key_;
+        bool reverse_;
+        // merge streams by key, or walk them one after another
+        bool merge_;
+
+        // the whole range, as given to the ctor, for count()
+        bool has_low_, has_high_;
+        key_copy low_, high_;
+        int count_;
+
+        std::vector<shard_stream> streams_;
+        // merge_: heap of streams with rows left, otherwise index of the current stream
+        std::vector<int> heap_;
+        size_t current_;
+
+        // returned by last next(), still referenced
+        Row* last_;
+
+        void add_stream(shard* sh, const key_copy* low, const key_copy* high);
+        // copy the next batch of rows from the shard, under its latch
+        void fill(shard_stream* s);
+        void release_rows(shard_stream* s);
+        void start();
+
+        // true if stream a should come after stream b
+        bool heap_after(int a, int b) const;
+        void heap_push(int i);
+        void heap_pop();
+
+    public:
+        // rows with key in (low, high) of the given shards, nullptr low or high means unbounded
+        Cursor(const Schema* schema, const std::vector<shard*>& shards, const key_copy* low,
+               const key_copy* high, bool reverse, bool merge);
+
+        // rows of a single shard with given key
+        Cursor(const Schema* schema, shard* sh, const MultiBlob& key);
+
+        Cursor(Cursor&& o);
+        Cursor(const Cursor&) = delete;
+        const Cursor& operator= (const Cursor&) = delete;
+
+        ~Cursor();
+
+        bool has_next();
+        operator bool () {
+            return has_next();
+        }
+        Row* next();
+        // number of rows in the whole range, counted shard by shard under its latch
+        int count();
+    };
+
+    // hash partitioned over n_shards SortedTables
+    ShardedTable(const Schema* _schema, int n_shards, symbol_t engine = symbol_t::ENG_RBTREE);
+
+    // range partitioned by split keys (ascending), giving split_keys.size() + 1 shards
+    ShardedTable(const Schema* _schema, const std::vector<MultiBlob>& split_keys,
+                 symbol_t engine = symbol_t::ENG_RBTREE);
+
+    ~ShardedTable();
+
+    virtual symbol_t rtti() const {
+        return TBL_SHARDED;
+    }
+
+    int n_shards() const {
+        return shards_.size();
+    }
+    bool range_partitioned() const {
+        return !split_.empty();
+    }
+
+    // total over all shards, each shard is latched in turn
+    size_t size() const;
+
+    void insert(Row* row);
+
+    Cursor query(const Value& kv) const {
+        return query(kv.get_blob());
+    }
+    Cursor query(const MultiBlob& mb) const;
+    Cursor query(const SortedMultiKey& smk) const {
+        return query(smk.get_multi_blob());
+    }
+
+    Cursor query_lt(const Value& kv, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_lt(kv.get_blob(), order);
+    }
+    Cursor query_lt(const MultiBlob& mb, symbol_t order = symbol_t::ORD_ASC) const;
+    Cursor query_lt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_lt(smk.get_multi_blob(), order);
+    }
+
+    Cursor query_gt(const Value& kv, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_gt(kv.get_blob(), order);
+    }
+    Cursor query_gt(const MultiBlob& mb, symbol_t order = symbol_t::ORD_ASC) const;
+    Cursor query_gt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_gt(smk.get_multi_blob(), order);
+    }
+
+    // (low, high) not inclusive
+    Cursor query_in(const Value& low, const Value& high, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_in(low.get_blob(), high.get_blob(), order);
+    }
+    Cursor query_in(const MultiBlob& low, const MultiBlob& high, symbol_t order = symbol_t::ORD_ASC) const;
+    Cursor query_in(const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_in(low.get_multi_blob(), high.get_multi_blob(), order);
+    }
+
+    // ORD_ANY skips merging, rows come shard by shard
+    Cursor all(symbol_t order = symbol_t::ORD_ASC) const;
+
+    void clear();
+
+    void remove(const Value& kv) {
+        remove(kv.get_blob());
+    }
+    void remove(const MultiBlob& mb);
+    void remove(const SortedMultiKey& smk) {
+        remove(smk.get_multi_blob());
+    }
+    void remove(Row* row, bool do_free = true);
+
+private:
+
+    // cursor over (low, high) on the shards which may hold such keys
+    Cursor range(const key_copy* low, const key_copy* high, symbol_t order) const;
+};
+
+} // namespace mdb
@@ -0,0 +1,343 @@
+#include <limits>
+
+#include "skiplist.h"
+
+using namespace std;
+
+namespace mdb {
+
+skiplist_engine::skiplist_engine(const Schema* schema): schema_(schema), size_(0), next_seq_(1) {
+    // retired rows are freed by whichever thread reclaims them, RowAllocator is not thread safe
+    verify(schema->allocator() == nullptr);
+    head_ = new_node(MAX_LEVEL, string(), nullptr, 0);
+}
+
+skiplist_engine::~skiplist_engine() {
+    clear();
+    free_node(head_);
+}
+
+skiplist_engine::node* skiplist_engine::new_node(int height, const std::string& key, Row* row, uint64_t seq) {
+    size_t size = sizeof(node) + (height - 1) * sizeof(std::atomic<uintptr_t>) + key.size();
+    node* n = (node *) malloc(size);
+    n->row = row;
+    n->seq = seq;
+    new (&n->state) std::atomic<int>(0);
+    n->height = height;
+    n->key_len = key.size();
+    for (int level = 0; level < height; level++) {
+        new (&n->next[level]) std::atomic<uintptr_t>(0);
+    }
+    memcpy((char *) n->key(), key.data(), key.size());
+    return n;
+}
+
+void skiplist_engine::free_node(void* ptr) {
+    node* n = (node *) ptr;
+    if (n->state & RELEASE_ROW) {
+        n->row->release();
+    }
+    free(n);
+}
+
+int skiplist_engine::random_height() {
+    // xorshift, one level up with probability 1/4
+    static thread_local uint64_t x = (uint64_t) &x | 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    int height = 1;
+    uint64_t bits = x;
+    while (height < MAX_LEVEL && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+int skiplist_engine::compare(const node* n, const target& t) {
+    int cmp = memcmp(n->key(), t.key, min(n->key_len, t.key_len));
+    if (cmp == 0 && !(t.partial && n->key_len >= t.key_len)) {
+        cmp = n->key_len - t.key_len;
+    }
+    if (cmp < 0) {
+        return -1;
+    } else if (cmp > 0) {
+        return 1;
+    }
+    if (n->seq < t.seq) {
+        return -1;
+    } else if (n->seq > t.seq) {
+        return 1;
+    }
+    return 0;
+}
+
+void skiplist_engine::make_key(const SortedMultiKey& key, std::string* normalized) const {
+    if (schema_->normalized_key()) {
+        *normalized = key.normalized();
+    } else {
+        SortedMultiKey::normalize(key.get_multi_blob(), schema_, normalized);
+    }
+}
+
+void skiplist_engine::find(const target& t, node** preds, node** succs) const {
+retry:
+    node* pred = head_;
+    for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+        node* curr = ptr(pred->next[level].load());
+        while (curr != nullptr) {
+            uintptr_t succ = curr->next[level].load();
+            if (is_marked(succ)) {
+                // unlink curr, fails if pred changed or is being removed as well
+                uintptr_t expected = (uintptr_t) curr;
+                if (!pred->next[level].compare_exchange_strong(expected, succ & ~MARK)) {
+                    goto retry;
+                }
+                curr = ptr(succ);
+            } else if (compare(curr, t) < 0) {
+                pred = curr;
+                curr = ptr(succ);
+            } else {
+                break;
+            }
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+}
+
+skiplist_engine::node* skiplist_engine::last_before(const target& t) const {
+    node* pred = head_;
+    for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+        node* curr = ptr(pred->next[level].load());
+        while (curr != nullptr && compare(curr, t) < 0) {
+            pred = curr;
+            curr = ptr(curr->next[level].load());
+        }
+    }
+    return pred;
+}
+
+sorted_pos skiplist_engine::first_from(const target& t) const {
+    node* pred = last_before(t);
+    node* n = ptr(pred->next[0].load());
+    while (n != nullptr && (is_removed(n) || compare(n, t) < 0)) {
+        if (compare(n, t) < 0) {
+            pred = n;
+        }
+        n = ptr(n->next[0].load());
+    }
+    return make_bound(n, pred);
+}
+
+void skiplist_engine::insert(const SortedMultiKey& key, Row* row) {
+    epoch_guard guard(&epochs_);
+    string normalized;
+    make_key(key, &normalized);
+    int height = random_height();
+    node* n = new_node(height, normalized, row, next_seq_++);
+    target t = target_of(n);
+
+    node* preds[MAX_LEVEL];
+    node* succs[MAX_LEVEL];
+    // the node is in the table once linked on the bottom level
+    for (;;) {
+        find(t, preds, succs);
+        n->next[0].store((uintptr_t) succs[0]);
+        uintptr_t expected = (uintptr_t) succs[0];
+        if (preds[0]->next[0].compare_exchange_strong(expected, (uintptr_t) n)) {
+            break;
+        }
+    }
+    size_++;
+
+    // upper levels only speed up searches, stop if the node gets removed meanwhile
+    for (int level = 1; level < height; level++) {
+        bool removed = false;
+        for (;;) {
+            uintptr_t succ = n->next[level].load();
+            if (is_marked(succ)) {
+                removed = true;
+                break;
+            }
+            if (ptr(succ) != succs[level]
+                    && !n->next[level].compare_exchange_strong(succ, (uintptr_t) succs[level])) {
+                continue;
+            }
+            uintptr_t expected = (uintptr_t) succs[level];
+            if (preds[level]->next[level].compare_exchange_strong(expected, (uintptr_t) n)) {
+                break;
+            }
+            find(t, preds, succs);
+        }
+        if (removed) {
+            break;
+        }
+    }
+
+    if (n->state.fetch_or(LINKED) & REMOVED) {
+        // removed while we were linking upper levels, and left the cleanup to us
+        unlink_and_retire(n);
+    }
+}
+
+sorted_pos skiplist_engine::remove(const sorted_pos& pos, bool release_row) {
+    epoch_guard guard(&epochs_);
+    node* n = (node *) pos.node;
+    verify(n != nullptr);
+
+    for (int level = n->height - 1; level >= 1; level--) {
+        uintptr_t succ = n->next[level].load();
+        while (!is_marked(succ) && !n->next[level].compare_exchange_weak(succ, succ | MARK)) {
+        }
+    }
+    bool owner = false;
+    uintptr_t succ = n->next[0].load();
+    while (!is_marked(succ)) {
+        if (n->next[0].compare_exchange_weak(succ, succ | MARK)) {
+            owner = true;
+            break;
+        }
+    }
+
+    if (owner) {
+        size_--;
+        int state = REMOVED | (release_row ? RELEASE_ROW : 0);
+        if (n->state.fetch_or(state) & LINKED) {
+            unlink_and_retire(n);
+        }
+    }
+
+    sorted_pos next_pos = make_pos(n);
+    next(&next_pos);
+    return next_pos;
+}
+
+void skiplist_engine::unlink_and_retire(node* n) const {
+    node* preds[MAX_LEVEL];
+    node* succs[MAX_LEVEL];
+    // every level of n is marked, so a search for it unlinks it on all of them
+    find(target_of(n), preds, succs);
+    epochs_.retire(&skiplist_engine::free_node, n);
+}
+
+void skiplist_engine::clear() {
+    node* n = ptr(head_->next[0].load());
+    while (n != nullptr) {
+        node* next_node = ptr(n->next[0].load());
+        free(n);
+        n = next_node;
+    }
+    for (int level = 0; level < MAX_LEVEL; level++) {
+        head_->next[level].store(0);
+    }
+    size_ = 0;
+    epochs_.flush();
+}
+
+sorted_pos skiplist_engine::begin() const {
+    sorted_pos pos = make_pos(head_);
+    next(&pos);
+    return pos;
+}
+
+sorted_pos skiplist_engine::lower_bound(const SortedMultiKey& key) const {
+    string normalized;
+    make_key(key, &normalized);
+    target t;
+    t.key = normalized.data();
+    t.key_len = normalized.size();
+    t.seq = 0;
+    t.partial = key.partial();
+    return first_from(t);
+}
+
+sorted_pos skiplist_engine::upper_bound(const SortedMultiKey& key) const {
+    string normalized;
+    make_key(key, &normalized);
+    target t;
+    t.key = normalized.data();
+    t.key_len = normalized.size();
+    t.seq = std::numeric_limits<uint64_t>::max();
+    t.partial = key.partial();
+    return first_from(t);
+}
+
+void skiplist_engine::next(sorted_pos* pos) const {
+    node* n = (node *) pos->node;
+    verify(n != nullptr);
+    // removed nodes keep pointing forward, so this works from a removed node as well
+    do {
+        n = ptr(n->next[0].load());
+    } while (n != nullptr && is_removed(n));
+    *pos = make_pos(n);
+}
+
+void skiplist_engine::prev(sorted_pos* pos) const {
+    node* n = (node *) pos->node;
+    verify(n != head_);
+    node* p = nullptr;
+    if (pos->slot != 0) {
+        // a bound: nodes inserted right before it since may be past the searched key
+        p = (node *) pos->slot;
+    } else if (n == nullptr) {
+        // last node on the bottom level
+        p = head_;
+        for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+            node* curr = ptr(p->next[level].load());
+            while (curr != nullptr) {
+                p = curr;
+                curr = ptr(curr->next[level].load());
+            }
+        }
+    } else {
+        p = last_before(target_of(n));
+    }
+    // skip removed nodes, searching again before each of them
+    while (p != head_ && is_removed(p)) {
+        p = last_before(target_of(p));
+    }
+    *pos = make_pos(p);
+}
+
+bool skiplist_engine::before(const sorted_pos& pos, const sorted_pos& bound) const {
+    const node* n = (const node *) pos.node;
+    const node* b = (const node *) bound.node;
+    if (bound.slot != 0) {
+        // only nodes up to the last one found before the searched key are known to be before it
+        const node* pred = (const node *) bound.slot;
+        if (n == nullptr || pred == head_) {
+            return n == head_;
+        } else if (n == head_) {
+            return true;
+        }
+        return compare(n, target_of(pred)) <= 0;
+    }
+    if (n == b) {
+        return false;
+    } else if (b == nullptr || n == head_) {
+        // end() is after everything, head_ (from prev() at the front) before everything
+        return true;
+    } else if (n == nullptr || b == head_) {
+        return false;
+    }
+    return compare(n, target_of(b)) < 0;
+}
+
+bool skiplist_engine::at_or_after(const sorted_pos& pos, const sorted_pos& bound) const {
+    if (bound.slot == 0) {
+        return !before(pos, bound);
+    }
+    // only nodes from the one found by the search on are known to be at or after the searched key
+    const node* n = (const node *) pos.node;
+    const node* b = (const node *) bound.node;
+    if (n == nullptr) {
+        return true;
+    } else if (b == nullptr || n == head_) {
+        return false;
+    }
+    return compare(n, target_of(b)) >= 0;
+}
+
+} // namespace mdb
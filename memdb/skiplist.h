@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "epoch.h"
+#include "table.h"
+
+namespace mdb {
+
+// Lock-free skiplist engine for SortedTable (ENG_SKIPLIST)
+//
+// insert(), remove() and all reads may run from many threads at the same time, without any lock.
+// Nodes keep a copy of the normalized key (see SortedMultiKey::normalize), so searches are plain
+// memcmp, and never look into rows that may be updated or freed concurrently. Rows with equal keys
+// are ordered by a per-node sequence number, which keeps them in insertion order.
+//
+// Removal marks the next pointers of a node (low bit), from top level down. Whoever marks the
+// bottom level owns the removal, and searches unlink marked nodes on their way. Unlinked nodes,
+// and rows removed with release_row, are retired to an epoch_manager, and only freed once no
+// pinned reader can still reach them. SortedTable cursors pin an epoch for their lifetime.
+//
+// Positions stay valid while their epoch is pinned, even if their row is removed, so cursor bounds
+// are checked by order (see before()) instead of by identity. Bounds from lower_bound() and
+// upper_bound() also keep the last node found before the searched key, as rows may be inserted
+// right before the bound node later on, which may or may not be in range. There are no back
+// pointers: prev() searches from the top, costing O(log n) per row on reverse scans.
+//
+// NOTE: clear() and the destructor must not run concurrently with anything else. The schema must
+// not use a RowAllocator, which is not thread safe.
+class skiplist_engine: public sorted_engine {
+    enum {
+        MAX_LEVEL = 20,
+    };
+
+    // bit 0 of a next pointer: the node holding it is being removed
+    static const uintptr_t MARK = 1;
+
+    // node::state
+    enum {
+        LINKED = 1,         // insert() is done linking the node
+        REMOVED = 2,        // remove() has marked the node
+        RELEASE_ROW = 4,    // release the row when the node is freed
+    };
+
+    struct node {
+        Row* row;
+        uint64_t seq;
+        std::atomic<int> state;
+        int height;
+        int key_len;
+        // height pointers, followed by key_len bytes of normalized key
+        std::atomic<uintptr_t> next[1];
+
+        const char* key() const {
+            return (const char *) &next[height];
+        }
+    };
+
+    // (key, seq) to search for
+    struct target {
+        const char* key;
+        int key_len;
+        uint64_t seq;
+        // key is a key prefix, equal to every node key starting with it
+        bool partial;
+    };
+
+    const Schema* schema_;
+    node* head_;
+    std::atomic<size_t> size_;
+    std::atomic<uint64_t> next_seq_;
+    mutable epoch_manager epochs_;
+
+    static node* new_node(int height, const std::string& key, Row* row, uint64_t seq);
+    static void free_node(void* ptr);
+    static int random_height();
+
+    static node* ptr(uintptr_t p) {
+        return (node *) (p & ~MARK);
+    }
+    static bool is_marked(uintptr_t p) {
+        return (p & MARK) != 0;
+    }
+    static bool is_removed(const node* n) {
+        return is_marked(n->next[0].load());
+    }
+    static target target_of(const node* n) {
+        target t;
+        t.key = n->key();
+        t.key_len = n->key_len;
+        t.seq = n->seq;
+        t.partial = false;
+        return t;
+    }
+    // -1, 0, 1 comparing node n against t
+    static int compare(const node* n, const target& t);
+
+    void make_key(const SortedMultiKey& key, std::string* normalized) const;
+
+    // preds and succs around t on every level, unlinking marked nodes on the way
+    void find(const target& t, node** preds, node** succs) const;
+    // last node < t (maybe removed) on the bottom level, head_ if none, without writing anything
+    node* last_before(const target& t) const;
+    // first node >= t which is not removed, as a bound (see make_bound())
+    sorted_pos first_from(const target& t) const;
+
+    // both insert() and remove() are done with the node, unlink it everywhere and retire it
+    void unlink_and_retire(node* n) const;
+
+    static sorted_pos make_pos(const node* n) {
+        sorted_pos pos;
+        pos.node = (void *) n;
+        pos.slot = 0;
+        return pos;
+    }
+    // n, found by a search whose last node before the key was pred (maybe head_)
+    static sorted_pos make_bound(const node* n, const node* pred) {
+        sorted_pos pos;
+        pos.node = (void *) n;
+        pos.slot = (intptr_t) pred;
+        return pos;
+    }
+
+public:
+
+    explicit skiplist_engine(const Schema* schema);
+    ~skiplist_engine();
+
+    symbol_t rtti() const {
+        return symbol_t::ENG_SKIPLIST;
+    }
+    size_t size() const {
+        return size_;
+    }
+
+    void insert(const SortedMultiKey& key, Row* row);
+    sorted_pos erase(const sorted_pos& pos) {
+        return remove(pos, false);
+    }
+    sorted_pos remove(const sorted_pos& pos, bool release_row);
+    void clear();
+
+    sorted_pos begin() const;
+    sorted_pos end() const {
+        return make_pos(nullptr);
+    }
+    sorted_pos lower_bound(const SortedMultiKey& key) const;
+    sorted_pos upper_bound(const SortedMultiKey& key) const;
+    void next(sorted_pos* pos) const;
+    void prev(sorted_pos* pos) const;
+    Row* row_at(const sorted_pos& pos) const {
+        return ((const node *) pos.node)->row;
+    }
+    bool stored_key(const sorted_pos& pos, blob* key) const {
+        const node* n = (const node *) pos.node;
+        key->data = n->key();
+        key->len = n->key_len;
+        return true;
+    }
+
+    bool concurrent() const {
+        return true;
+    }
+    bool before(const sorted_pos& pos, const sorted_pos& bound) const;
+    bool at_or_after(const sorted_pos& pos, const sorted_pos& bound) const;
+    epoch_manager* epochs() const {
+        return &epochs_;
+    }
+};
+
+} // namespace mdb
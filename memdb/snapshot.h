@@ -2,8 +2,14 @@
 
 #include <inttypes.h>
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "utils.h"
 
@@ -29,33 +35,226 @@ struct versioned_value {
     }
 };
 
+// a version in the chain of its key, see version_chain
+template <class Key, class Value>
+struct chained_version: public versioned_value<Value> {
+    // the key this version was inserted with, equal to the key of its chain
+    const Key key;
+
+    // next version in the same list of the chain
+    chained_version* next;
+
+    chained_version(version_t created, const Key& k, const Value& v)
+        : versioned_value<Value>(created, v), key(k), next(nullptr) {}
+};
+
+// All versions of a key. Live versions are kept newest created first, removed ones latest removed
+// first, so at version v the live list is visible past its versions created after v, and the
+// removed list up to its first version removed at or before v, as all the rest went away earlier.
+// Old versions of a key updated many times are never walked by readers that can not see them.
+// Ranges still return the versions of a key in the order they were inserted (see snapshot_range).
+template <class Key, class Value>
+struct version_chain {
+    typedef chained_version<Key, Value> version_type;
+
+    version_type* live;
+    version_type* removed;
+
+    // the key is in snapshot_group::gc_removed
+    bool gc_queued;
+
+    // position of a walk over the chain
+    struct walk {
+        const version_type* ver;
+        bool in_removed;
+    };
+
+    version_chain(): live(nullptr), removed(nullptr), gc_queued(false) {}
+
+    bool empty() const {
+        return live == nullptr && removed == nullptr;
+    }
+
+    void start(walk* w) const {
+        w->ver = live;
+        w->in_removed = false;
+    }
+
+    // next version visible at v, nullptr once there is none left
+    // versions come in the order of the live list, then of the removed list
+    const version_type* next_visible(walk* w, version_t v) const {
+        for (;;) {
+            if (w->ver == nullptr) {
+                if (w->in_removed) {
+                    return nullptr;
+                }
+                w->ver = removed;
+                w->in_removed = true;
+                continue;
+            }
+            const version_type* ver = w->ver;
+            if (w->in_removed && ver->removed_at <= v) {
+                w->ver = nullptr;
+                return nullptr;
+            }
+            w->ver = ver->next;
+            if (ver->created_at <= v) {
+                return ver;
+            }
+        }
+    }
+};
+
+// key of a chain in the map: points to the key of one of its versions, and is moved to another one
+// before that version is dropped. keys may point into the values (like SortedMultiKey into rows),
+// so the map can not keep a copy that outlives them
+template <class Key>
+struct key_ref {
+    mutable const Key* key;
+
+    explicit key_ref(const Key* k): key(k) {}
+
+    bool operator <(const key_ref& o) const {
+        return *key < *o.key;
+    }
+};
+
+// holds the latch of a concurrent snapshot group (see snapshot_group::concurrent), no-op on nullptr
+class group_latch: public NoCopy {
+    Mutex* m_;
+
+public:
+    explicit group_latch(Mutex* m): m_(m) {
+        if (m_ != nullptr) {
+            m_->lock();
+        }
+    }
+    ~group_latch() {
+        if (m_ != nullptr) {
+            m_->unlock();
+        }
+    }
+};
+
+template <class Iterator>
+struct is_reverse_iterator {
+    static const bool value = false;
+};
+
+template <class Iterator>
+struct is_reverse_iterator<std::reverse_iterator<Iterator>> {
+    static const bool value = true;
+};
+
 template <class Key, class Value, class Iterator, class Snapshot>
 class snapshot_range: public Enumerator<std::pair<const Key&, const Value&>> {
+    typedef typename std::iterator_traits<Iterator>::value_type::second_type chain_type;
+    typedef typename chain_type::version_type version_type;
+
+    enum {
+        // keys read per latch, in concurrent groups
+        BATCH_KEYS = 64,
+    };
+
     Snapshot snapshot_;
     Iterator begin_, end_, next_;
     bool cached_;
     std::pair<const Key*, const Value*> cached_next_;
     int count_;
 
+    // visible versions of the keys read so far, consumed from batch_next_
+    std::vector<std::pair<const Key*, const Value*>> batch_;
+    size_t batch_next_;
+    // versions of the key being read, to put them in order
+    std::vector<const version_type*> key_versions_;
+
+    // whole keys are read at a time, since in concurrent groups the writer may change chains once
+    // the latch is released
     bool prefetch_next() {
         assert(cached_ == false);
-        while (cached_ == false && next_ != end_) {
-            if (next_->second.valid_at(snapshot_.version())) {
-                cached_next_.first = &(next_->first);
-                cached_next_.second = &(next_->second.val);
-                cached_ = true;
+        int batch_keys = (snapshot_.latch() != nullptr) ? BATCH_KEYS : 1;
+        while (batch_next_ == batch_.size() && next_ != end_) {
+            batch_.clear();
+            batch_next_ = 0;
+            group_latch gl(snapshot_.latch());
+            for (int n = 0; n < batch_keys && next_ != end_; n++, ++next_) {
+                read_key(next_->second);
             }
-            ++next_;
+        }
+        if (batch_next_ < batch_.size()) {
+            cached_next_ = batch_[batch_next_++];
+            cached_ = true;
         }
         return cached_;
     }
 
+    // visible versions of chain c, appended to batch_ oldest created first (newest first in reverse
+    // ranges), so equal keys come in insertion order, as they would from a multimap
+    void read_key(const chain_type& c) {
+        typename chain_type::walk w;
+        c.start(&w);
+        key_versions_.clear();
+        const version_type* ver;
+        while ((ver = c.next_visible(&w, snapshot_.version())) != nullptr) {
+            key_versions_.push_back(ver);
+        }
+        if (key_versions_.size() > 1) {
+            // the walk gives live versions newest created first, then removed ones by removal
+            auto live_end = key_versions_.begin();
+            while (live_end != key_versions_.end() && (*live_end)->removed_at == -1) {
+                ++live_end;
+            }
+            std::reverse(key_versions_.begin(), live_end);
+            if (live_end != key_versions_.end()) {
+                std::stable_sort(key_versions_.begin(), key_versions_.end(),
+                                 [] (const version_type* a, const version_type* b) {
+                                     return a->created_at < b->created_at;
+                                 });
+            }
+            if (is_reverse_iterator<Iterator>::value) {
+                std::reverse(key_versions_.begin(), key_versions_.end());
+            }
+        }
+        for (const version_type* v : key_versions_) {
+            batch_.push_back(std::make_pair(&v->key, &v->val));
+        }
+    }
+
 public:
 
     typedef Iterator iterator;
 
+    // the group keeps all versions while ranges are open, so begin, end and next stay valid
     snapshot_range(const Snapshot& snapshot, Iterator it_begin, Iterator it_end)
-        : snapshot_(snapshot), begin_(it_begin), end_(it_end), next_(it_begin), cached_(false), count_(-1) {}
+            : snapshot_(snapshot), begin_(it_begin), end_(it_end), next_(it_begin), cached_(false),
+              count_(-1), batch_next_(0) {
+        snapshot_.gc_pin();
+    }
+    snapshot_range(const snapshot_range& o)
+            : snapshot_(o.snapshot_), begin_(o.begin_), end_(o.end_), next_(o.next_),
+              cached_(o.cached_), cached_next_(o.cached_next_), count_(o.count_),
+              batch_(o.batch_), batch_next_(o.batch_next_) {
+        snapshot_.gc_pin();
+    }
+    ~snapshot_range() {
+        snapshot_.gc_unpin();
+    }
+    const snapshot_range& operator= (const snapshot_range& o) {
+        if (&o != this) {
+            snapshot_.gc_unpin();
+            snapshot_ = o.snapshot_;
+            snapshot_.gc_pin();
+            begin_ = o.begin_;
+            end_ = o.end_;
+            next_ = o.next_;
+            cached_ = o.cached_;
+            cached_next_ = o.cached_next_;
+            count_ = o.count_;
+            batch_ = o.batch_;
+            batch_next_ = o.batch_next_;
+        }
+        return *this;
+    }
 
     Iterator begin() const {
         return begin_;
@@ -85,9 +284,15 @@ public:
             return count_;
         }
         count_ = 0;
-        for (auto it = begin_; it != end_; ++it) {
-            if (it->second.valid_at(snapshot_.version())) {
-                count_++;
+        auto it = begin_;
+        while (it != end_) {
+            group_latch gl(snapshot_.latch());
+            for (int n = 0; n < BATCH_KEYS && it != end_; n++, ++it) {
+                typename chain_type::walk w;
+                it->second.start(&w);
+                while (it->second.next_visible(&w, snapshot_.version()) != nullptr) {
+                    count_++;
+                }
             }
         }
         return count_;
@@ -98,48 +303,103 @@ public:
 // A group of snapshots. Each snapshot in the group points to it, so they can share data.
 // There could be at most one writer in the group. Members are ordered in a doubly linked list:
 // S1 <= S2 <= S3 <= ... <= Sw (increasing version, writer at tail if exists)
+//
+// Garbage collection is incremental (see snapshot_sortedmap::gc_step()). While there is a writer,
+// garbage only comes from versions removed while a snapshot could see them, and their keys are
+// queued in gc_removed in the order of removal, which is also the order they become garbage in, as
+// the oldest snapshot moves forward. Without a writer, versions created after the newest snapshot
+// are garbage as well, and the data is swept from gc_sweep instead.
+//
+// In a concurrent group, members may be used from different threads, as long as only one of them
+// writes (the writer, or whoever creates and destroys it). latch then protects everything in the
+// group, and the list of members. It is held for a single write, or a batch of reads (see
+// snapshot_range): ranges never hold it between calls, and gc waits until they are all closed.
 template <class Key, class Value, class Container, class Snapshot>
 struct snapshot_group: public RefCounted {
+    // key_ref -> version_chain
     Container data;
 
+    // number of versions in data
+    size_t n_versions;
+
     // the writer of the group, nullptr means nobody can write to the group
-    Snapshot* writer;
+    std::atomic<Snapshot*> writer;
 
-    // how many insert/erase has been done since last snapshot
+    bool concurrent;
+    Mutex latch;
+
+    // how many insert has been done since last snapshot
     size_t gc_insert_counter;
-    size_t gc_erase_counter;
 
-    snapshot_group(Snapshot* w): writer(w), gc_insert_counter(0), gc_erase_counter(0) {}
+    // keys with removed versions not collected yet, by version of their oldest removal
+    std::deque<std::pair<version_t, typename Container::iterator>> gc_removed;
+
+    // next key to visit by the sweep, and how many are left to visit, 0 if not sweeping
+    typename Container::iterator gc_sweep;
+    size_t gc_sweep_left;
+
+    // open ranges, gc does not free anything they may point to until they are all closed
+    std::atomic<int> gc_pins;
+
+    snapshot_group(Snapshot* w)
+        : n_versions(0), writer(w), concurrent(false), gc_insert_counter(0), gc_sweep_left(0), gc_pins(0) {}
 
     // protected dtor as required by RefCounted
 protected:
-    ~snapshot_group() {}
+    ~snapshot_group() {
+        for (auto& it : data) {
+            free_versions(it.second.live);
+            free_versions(it.second.removed);
+        }
+    }
+
+public:
+    static size_t free_versions(typename Container::mapped_type::version_type* ver) {
+        size_t n = 0;
+        while (ver != nullptr) {
+            auto next = ver->next;
+            delete ver;
+            ver = next;
+            n++;
+        }
+        return n;
+    }
 };
 
 template <class Key, class Value>
 class snapshot_sortedmap {
+    typedef version_chain<Key, Value> chain_type;
+    typedef typename chain_type::version_type version_type;
+    typedef std::map<key_ref<Key>, chain_type> container_type;
+
 public:
 
     typedef snapshot_range<
         Key,
         Value,
-        typename std::multimap<Key, versioned_value<Value>>::iterator,
+        typename container_type::iterator,
         snapshot_sortedmap> range_type;
 
     typedef snapshot_range<
         Key,
         Value,
-        typename std::multimap<Key, versioned_value<Value>>::reverse_iterator,
+        typename container_type::reverse_iterator,
         snapshot_sortedmap> reverse_range_type;
 
     typedef snapshot_group<
         Key,
         Value,
-        typename std::multimap<Key, versioned_value<Value>>,
+        container_type,
         snapshot_sortedmap> group_type;
 
     typedef typename std::pair<const Key&, const Value&> value_type;
 
+    enum {
+        // versions visited by the gc step piggy-backed on each write, and on each snapshot release
+        GC_STEP_PER_WRITE = 4,
+        GC_STEP_ON_RELEASE = 4096,
+    };
+
     // creating a new snapshot_sortedmap
     snapshot_sortedmap(): ver_(0), prev_(this), next_(this) {
         ssg_ = new group_type(this);
@@ -150,26 +410,31 @@ public:
             // src is a snapshot, make me a snapshot, too
             make_me_snapshot_of(src);
         } else {
-            if (!src.has_writable_snapshot() && (src.ver_ > src.next_->ver_)) {
-                // tiny optimization:
-                // if 1) src does not have writable snapshot in its group,
-                // and 2) src is the snapshot with largest version in its group,
-                // let this become the new writer in src's group
-                ver_ = src.ver_;
-                ssg_ = (group_type *) src.ssg_->ref_copy();
-                // note that we are adding this to the right side of src in the group list
-                prev_ = &src;
-                next_ = src.next_;
-                src.next_ = this;
-                next_->prev_ = this;
-                assert(debug_group_sanity_check());
-            } else {
+            {
+                group_latch gl(src.latch());
+                if (!src.has_writable_snapshot() && (src.ver_ > src.next_->ver_)) {
+                    // tiny optimization:
+                    // if 1) src does not have writable snapshot in its group,
+                    // and 2) src is the snapshot with largest version in its group,
+                    // let this become the new writer in src's group
+                    ver_ = src.ver_;
+                    ssg_ = (group_type *) src.ssg_->ref_copy();
+                    // note that we are adding this to the right side of src in the group list
+                    prev_ = &src;
+                    next_ = src.next_;
+                    src.next_ = this;
+                    next_->prev_ = this;
+                    assert(debug_group_sanity_check());
+                }
+            }
+            if (ssg_ == nullptr) {
                 // otherwise: just copy everything!
                 ver_ = 0;
                 ssg_ = new group_type(this);
                 prev_ = this;
                 next_ = this;
                 insert(src.all());
+                ssg_->concurrent = src.ssg_->concurrent;
             }
         }
     }
@@ -201,8 +466,6 @@ public:
     const snapshot_sortedmap& operator= (const snapshot_sortedmap& src) {
         assert(src.ver_ != -1);
         assert(src.ssg_ != nullptr);
-        assert(src.prev_ != nullptr);
-        assert(src.next_ != nullptr);
         if (&src != this) {
             destroy_me();
             if (src.readonly()) {
@@ -217,12 +480,11 @@ public:
                 prev_ = this;
                 next_ = this;
                 insert(src.all());
+                ssg_->concurrent = src.ssg_->concurrent;
             }
         }
         assert(ver_ != -1);
         assert(ssg_ != nullptr);
-        assert(prev_ != nullptr);
-        assert(next_ != nullptr);
         return *this;
     }
 
@@ -242,6 +504,7 @@ public:
     }
 
     size_t snapshot_count() const {
+        group_latch gl(latch());
         size_t count = 0;
         const snapshot_sortedmap* p = this;
         const snapshot_sortedmap* q = this;
@@ -252,260 +515,474 @@ public:
         return count;
     }
 
+    // lets snapshots of this map be read from other threads while this one keeps writing, see
+    // snapshot_group. NOTE: call on the writer, before any other snapshot is taken
+    void set_concurrent(bool concurrent) {
+        verify(writable() && snapshot_count() == 1);
+        ssg_->concurrent = concurrent;
+    }
+    bool concurrent() const {
+        return ssg_->concurrent;
+    }
+
     snapshot_sortedmap snapshot() const {
+        // prev_ and next_ are checked under the latch
         assert(ver_ != -1);
         assert(ssg_ != nullptr);
-        assert(prev_ != nullptr);
-        assert(next_ != nullptr);
         return snapshot_sortedmap(*this, snapshot_marker());
     }
 
     void insert(const Key& key, const Value& value) {
         verify(writable());
+        group_latch gl(latch());
         ver_++;
-        versioned_value<Value> vv(ver_, value);
-        insert_into_map(ssg_->data, key, vv);
-        ssg_->gc_insert_counter++;
+        add_version(ssg_->data.lower_bound(key_ref<Key>(&key)), key, value);
+        gc_after_write(1);
     }
 
     void insert(const value_type& kv_pair) {
+        insert(kv_pair.first, kv_pair.second);
+    }
+
+    template <class Iterator>
+    void insert(Iterator begin, Iterator end) {
         verify(writable());
+        group_latch gl(latch());
         ver_++;
-        versioned_value<Value> vv(ver_, kv_pair.second);
-        insert_into_map(ssg_->data, kv_pair.first, vv);
-        ssg_->gc_insert_counter++;
+        size_t n = 0;
+        while (begin != end) {
+            add_version(ssg_->data.lower_bound(key_ref<Key>(&begin->first)), begin->first, begin->second);
+            ++begin;
+            n++;
+        }
+        gc_after_write(n);
     }
 
+    // same as insert(begin, end), but pairs come in key order: each one that is not smaller
+    // than the last key in the map is put at the end in amortized O(1), without a search
     template <class Iterator>
-    void insert(Iterator begin, Iterator end) {
+    void insert_sorted(Iterator begin, Iterator end) {
         verify(writable());
+        group_latch gl(latch());
         ver_++;
+        auto& data = ssg_->data;
+        size_t n = 0;
         while (begin != end) {
-            versioned_value<Value> vv(ver_, begin->second);
-            insert_into_map(ssg_->data, begin->first, vv);
-            ssg_->gc_insert_counter++;
+            const Key& key = begin->first;
+            auto it = data.end();
+            if (data.empty() || *data.rbegin()->first.key < key) {
+                // appended with it as hint
+            } else if (!(key < *data.rbegin()->first.key)) {
+                // same key as the last one
+                --it;
+            } else {
+                it = data.lower_bound(key_ref<Key>(&key));
+            }
+            add_version(it, key, begin->second);
             ++begin;
+            n++;
         }
+        gc_after_write(n);
     }
 
+    // range is read without the latch, it may come from this map as well
     template <class RangeType>
     void insert(RangeType range) {
         verify(writable());
-        ver_++;
+        {
+            group_latch gl(latch());
+            ver_++;
+        }
         while (range) {
             value_type kv_pair = range.next();
-            versioned_value<Value> vv(ver_, kv_pair.second);
-            insert_into_map(ssg_->data, kv_pair.first, vv);
-            ssg_->gc_insert_counter++;
+            group_latch gl(latch());
+            add_version(ssg_->data.lower_bound(key_ref<Key>(&kv_pair.first)), kv_pair.first, kv_pair.second);
+            gc_after_write(1);
         }
     }
 
+    // removes the live values of key, or only the first one scans return if first_match_only
     void erase(const Key& key, bool first_match_only = false) {
         verify(writable());
-        version_t orig_ver = ver_;
+        group_latch gl(latch());
         ver_++;
-        if (has_readonly_snapshot()) {
-            for (auto it = ssg_->data.lower_bound(key); it != ssg_->data.upper_bound(key); ++it) {
-                // only remove visible values
-                if (!it->second.valid_at(orig_ver)) {
-                    continue;
-                }
-                assert(key == it->first);
-                it->second.remove(ver_);
-                ssg_->gc_erase_counter++;
-                if (first_match_only) {
-                    break;
-                }
-            }
-        } else {
-            // no body can observe the removed keys, so directly erase them
-            if (first_match_only) {
-                ssg_->data.erase(ssg_->data.lower_bound(key));
-            } else {
-                ssg_->data.erase(key);
-            }
+        size_t n = 0;
+        auto it = ssg_->data.lower_bound(key_ref<Key>(&key));
+        auto it_end = ssg_->data.upper_bound(key_ref<Key>(&key));
+        while (it != it_end && !(first_match_only && n > 0)) {
+            it = remove_live(it, [] (const Value&) { return true; }, first_match_only, &n);
         }
+        gc_after_write(n);
     }
 
     void erase(const Key& key, const Value& value, bool first_match_only = false) {
         verify(writable());
-        version_t orig_ver = ver_;
+        group_latch gl(latch());
         ver_++;
-        if (has_readonly_snapshot()) {
-            for (auto it = ssg_->data.lower_bound(key); it != ssg_->data.upper_bound(key); ++it) {
-                // only remove visible values
-                if (!it->second.valid_at(orig_ver)) {
-                    continue;
-                }
-                assert(key == it->first);
-                if (value == it->second.val) {
-                    it->second.remove(ver_);
-                    ssg_->gc_erase_counter++;
-                    if (first_match_only) {
-                        break;
-                    }
-                }
-            }
-        } else {
-            // no body can observe the removed key value pair, so directly erase it
-            auto it = ssg_->data.lower_bound(key);
-            while (it != ssg_->data.upper_bound(key)) {
-                assert(key == it->first);
-                if (value == it->second.val) {
-                    it = ssg_->data.erase(it);
-                    if (first_match_only) {
-                        break;
-                    }
-                } else {
-                    ++it;
-                }
-            }
+        size_t n = 0;
+        auto it = ssg_->data.lower_bound(key_ref<Key>(&key));
+        auto it_end = ssg_->data.upper_bound(key_ref<Key>(&key));
+        while (it != it_end && !(first_match_only && n > 0)) {
+            it = remove_live(it, [&value] (const Value& v) { return value == v; }, first_match_only, &n);
         }
+        gc_after_write(n);
     }
 
     void erase(const range_type& range) {
         verify(writable());
-        typename range_type::iterator begin = range.begin();
-        typename range_type::iterator end = range.end();
-        version_t orig_ver = ver_;
+        group_latch gl(latch());
         ver_++;
-        if (has_readonly_snapshot()) {
-            auto it = begin;
-            while (it != end) {
-                if (it->second.valid_at(orig_ver)) {
-                    // only remove visible values
-                    it->second.remove(ver_);
-                }
-                ++it;
-            }
-        } else {
-            // nobody can observe the removed range, so directly erase it
-            ssg_->data.erase(begin, end);
+        size_t n = 0;
+        auto it = range.begin();
+        while (it != range.end()) {
+            it = remove_live(it, [] (const Value&) { return true; }, false, &n);
         }
+        gc_after_write(n);
     }
 
     void erase(const reverse_range_type& range) {
         verify(writable());
-        typename reverse_range_type::iterator begin = range.begin();
-        typename reverse_range_type::iterator end = range.end();
-        version_t orig_ver = ver_;
+        group_latch gl(latch());
         ver_++;
-        if (has_readonly_snapshot()) {
-            auto it = begin;
-            while (it != end) {
-                if (it->second.valid_at(orig_ver)) {
-                    // only remove visible values
-                    it->second.remove(ver_);
-                }
-                ++it;
-            }
-        } else {
-            // nobody can observe the removed range, so directly erase it
-            ssg_->data.erase(end.base(), begin.base());
+        size_t n = 0;
+        auto it = range.end().base();
+        while (it != range.begin().base()) {
+            it = remove_live(it, [] (const Value&) { return true; }, false, &n);
         }
+        gc_after_write(n);
     }
 
     range_type all() const {
-        return range_type(this->snapshot(), this->ssg_->data.begin(), this->ssg_->data.end());
+        return make_range<range_type>([this] (iterator* begin, iterator* end) {
+            *begin = data().begin();
+            *end = data().end();
+        });
     }
 
     reverse_range_type reverse_all() const {
-        return reverse_range_type(this->snapshot(), this->ssg_->data.rbegin(), this->ssg_->data.rend());
+        return make_range<reverse_range_type>([this] (reverse_iterator* begin, reverse_iterator* end) {
+            *begin = data().rbegin();
+            *end = data().rend();
+        });
     }
 
     range_type query(const Key& key) const {
-        return range_type(this->snapshot(), this->ssg_->data.lower_bound(key), this->ssg_->data.upper_bound(key));
+        return make_range<range_type>([this, &key] (iterator* begin, iterator* end) {
+            *begin = data().lower_bound(key_ref<Key>(&key));
+            *end = data().upper_bound(key_ref<Key>(&key));
+        });
     }
 
     reverse_range_type reverse_query(const Key& key) const {
-        return reverse_range_type(this->snapshot(),
-                                  typename reverse_range_type::iterator(this->ssg_->data.upper_bound(key)),
-                                  typename reverse_range_type::iterator(this->ssg_->data.lower_bound(key)));
+        return make_range<reverse_range_type>([this, &key] (reverse_iterator* begin, reverse_iterator* end) {
+            *begin = reverse_iterator(data().upper_bound(key_ref<Key>(&key)));
+            *end = reverse_iterator(data().lower_bound(key_ref<Key>(&key)));
+        });
     }
 
     range_type query_lt(const Key& key) const {
-        return range_type(this->snapshot(), this->ssg_->data.begin(), this->ssg_->data.lower_bound(key));
+        return make_range<range_type>([this, &key] (iterator* begin, iterator* end) {
+            *begin = data().begin();
+            *end = data().lower_bound(key_ref<Key>(&key));
+        });
     }
 
     reverse_range_type reverse_query_lt(const Key& key) const {
-        return reverse_range_type(this->snapshot(),
-                                  typename reverse_range_type::iterator(this->ssg_->data.lower_bound(key)),
-                                  this->ssg_->data.rend());
+        return make_range<reverse_range_type>([this, &key] (reverse_iterator* begin, reverse_iterator* end) {
+            *begin = reverse_iterator(data().lower_bound(key_ref<Key>(&key)));
+            *end = data().rend();
+        });
     }
 
     range_type query_gt(const Key& key) const {
-        return range_type(this->snapshot(), this->ssg_->data.upper_bound(key), this->ssg_->data.end());
+        return make_range<range_type>([this, &key] (iterator* begin, iterator* end) {
+            *begin = data().upper_bound(key_ref<Key>(&key));
+            *end = data().end();
+        });
     }
 
     reverse_range_type reverse_query_gt(const Key& key) const {
-        return reverse_range_type(this->snapshot(),
-                                  this->ssg_->data.rbegin(),
-                                  typename reverse_range_type::iterator(this->ssg_->data.upper_bound(key)));
+        return make_range<reverse_range_type>([this, &key] (reverse_iterator* begin, reverse_iterator* end) {
+            *begin = data().rbegin();
+            *end = reverse_iterator(data().upper_bound(key_ref<Key>(&key)));
+        });
     }
 
     // (low, high) not inclusive
     range_type query_in(const Key& low, const Key& high) const {
-        return range_type(this->snapshot(), this->ssg_->data.upper_bound(low), this->ssg_->data.lower_bound(high));
+        return make_range<range_type>([this, &low, &high] (iterator* begin, iterator* end) {
+            *begin = data().upper_bound(key_ref<Key>(&low));
+            *end = data().lower_bound(key_ref<Key>(&high));
+        });
     }
 
     // (low, high) not inclusive
     reverse_range_type reverse_query_in(const Key& low, const Key& high) const {
-        return reverse_range_type(this->snapshot(),
-                                  typename reverse_range_type::iterator(this->ssg_->data.lower_bound(high)),
-                                  typename reverse_range_type::iterator(this->ssg_->data.upper_bound(low)));
+        return make_range<reverse_range_type>([this, &low, &high] (reverse_iterator* begin, reverse_iterator* end) {
+            *begin = reverse_iterator(data().lower_bound(key_ref<Key>(&high)));
+            *end = reverse_iterator(data().upper_bound(key_ref<Key>(&low)));
+        });
     }
 
+    // number of versions kept, of all keys
     size_t gc_size() const {
-        return this->ssg_->data.size();
+        group_latch gl(latch());
+        return this->ssg_->n_versions;
     }
 
+    // what gc may still have to visit: versions inserted since last snapshot, keys with removed versions
+    // not collected yet, and keys left to sweep
     size_t gc_counter() const {
-        return this->ssg_->gc_insert_counter + this->ssg_->gc_erase_counter;
+        group_latch gl(latch());
+        return this->ssg_->gc_insert_counter + this->ssg_->gc_removed.size() + this->ssg_->gc_sweep_left;
+    }
+
+    // incremental garbage collection, visiting at most about budget versions, returns how many were
+    // dropped. a version is garbage once created_at > ver_high || (removed_at != -1 && removed_at < ver_low),
+    // of the versions of all snapshots in the group. writes and snapshot releases run small steps on their
+    // own, this is for driving gc further from idle time. nothing is dropped while ranges are open
+    // function marked as const so it can be called from const ref/ptr
+    size_t gc_step(size_t budget) const {
+        group_latch gl(latch());
+        return gc_step_locked(budget);
     }
 
-    // explicit garbage collection
+    // explicit garbage collection, drops all garbage
     // function marked as const so it can be called from const ref/ptr
     void gc_run() const {
-        version_t ver_low = this->ver_;
-        version_t ver_high = -1;
+        group_latch gl(latch());
+        if (ssg_->writer == nullptr) {
+            gc_restart_sweep();
+        }
+        gc_step_locked(std::numeric_limits<size_t>::max());
+    }
+
+    // used by ranges, see snapshot_group::gc_pins
+    void gc_pin() const {
+        ssg_->gc_pins++;
+    }
+    void gc_unpin() const {
+        verify(--ssg_->gc_pins >= 0);
+    }
+
+    // latch of a concurrent group, nullptr otherwise
+    Mutex* latch() const {
+        return ssg_->concurrent ? &ssg_->latch : nullptr;
+    }
+
+private:
+
+    typedef typename container_type::iterator iterator;
+    typedef typename container_type::reverse_iterator reverse_iterator;
+
+    // empty struct, used to mark a ctor as snapshotting
+    struct snapshot_marker {};
+
+    version_t ver_;
+    group_type* ssg_;
+
+    // doubly linked list of all snapshots in a group
+    mutable const snapshot_sortedmap* prev_;
+    mutable const snapshot_sortedmap* next_;
+
+    container_type& data() const {
+        return ssg_->data;
+    }
+
+    // range over a new snapshot of this, from *begin to *end as set by bounds(begin, end)
+    // snapshots are made and dropped without the latch, and the bounds are found under it
+    template <class Range, class Bounds>
+    Range make_range(const Bounds& bounds) const {
+        snapshot_sortedmap snap = this->snapshot();
+        // gc must not drop the bounds before the range pins them
+        gc_pin();
+        typename Range::iterator begin, end;
+        {
+            group_latch gl(latch());
+            bounds(&begin, &end);
+        }
+        Range range(snap, begin, end);
+        gc_unpin();
+        return range;
+    }
+
+    // see gc_step(), requires the latch
+    size_t gc_step_locked(size_t budget) const {
+        group_type* g = ssg_;
+        size_t dropped = 0;
+        if (g->gc_pins > 0) {
+            return dropped;
+        }
+        if (g->writer != nullptr) {
+            // the writer is the newest, and the oldest is right after it
+            version_t ver_low = g->writer.load()->next_->ver_;
+            while (budget > 0 && !g->gc_removed.empty() && g->gc_removed.front().first < ver_low) {
+                auto it = g->gc_removed.front().second;
+                g->gc_removed.pop_front();
+                chain_type& c = it->second;
+                c.gc_queued = false;
+                // removed versions past the first one removed before ver_low went away even earlier
+                size_t visited = 0;
+                version_t oldest_kept = -1;
+                version_type** p = &c.removed;
+                while (*p != nullptr && (*p)->removed_at >= ver_low) {
+                    oldest_kept = (*p)->removed_at;
+                    p = &(*p)->next;
+                    visited++;
+                }
+                version_type* garbage = *p;
+                *p = nullptr;
+                if (c.removed != nullptr) {
+                    c.gc_queued = true;
+                    g->gc_removed.push_back(std::make_pair(oldest_kept, it));
+                }
+                size_t n = drop_versions(it, garbage);
+                dropped += n;
+                budget -= std::min(budget, std::max<size_t>(visited + n, 1));
+            }
+        } else if (g->gc_sweep_left > 0) {
+            version_t ver_low, ver_high;
+            version_range(&ver_low, &ver_high);
+            while (budget > 0 && g->gc_sweep_left > 0) {
+                chain_type& c = g->gc_sweep->second;
+                c.gc_queued = false;
+                size_t visited = 0;
+                version_type* garbage = nullptr;
+                for (version_type** list : { &c.live, &c.removed }) {
+                    version_type** p = list;
+                    while (*p != nullptr) {
+                        version_type* ver = *p;
+                        visited++;
+                        if (ver->created_at > ver_high || (ver->removed_at != -1 && ver->removed_at < ver_low)) {
+                            *p = ver->next;
+                            ver->next = garbage;
+                            garbage = ver;
+                        } else {
+                            p = &ver->next;
+                        }
+                    }
+                }
+                auto it = g->gc_sweep++;
+                dropped += drop_versions(it, garbage);
+                g->gc_sweep_left--;
+                budget -= std::min(budget, std::max<size_t>(visited, 1));
+            }
+        }
+        return dropped;
+    }
+
+    // lowest and highest version in the group
+    void version_range(version_t* ver_low, version_t* ver_high) const {
+        *ver_low = this->ver_;
+        *ver_high = -1;
         const snapshot_sortedmap* p = this;
         const snapshot_sortedmap* q = this;
         do {
-            if (q->ver_ < ver_low) {
-                ver_low = q->ver_;
+            if (q->ver_ < *ver_low) {
+                *ver_low = q->ver_;
             }
-            if (q->ver_ > ver_high) {
-                ver_high = q->ver_;
+            if (q->ver_ > *ver_high) {
+                *ver_high = q->ver_;
             }
             q = q->next_;
         } while(q != p);
+    }
+
+    // new version of key at ver_, it is lower_bound of key, or where to insert the key right before
+    void add_version(typename container_type::iterator it, const Key& key, const Value& value) {
+        version_type* ver = new version_type(ver_, key, value);
+        if (it == ssg_->data.end() || key < *it->first.key) {
+            it = ssg_->data.insert(it, std::make_pair(key_ref<Key>(&ver->key), chain_type()));
+        }
+        ver->next = it->second.live;
+        it->second.live = ver;
+        ssg_->n_versions++;
+        ssg_->gc_insert_counter++;
+    }
 
-        // found ver_low and ver_high, drop keys that
-        // created_at > ver_high || (removed_at == -1 && removed_at < ver_low)
-        auto it = ssg_->data.begin();
-        while (it != ssg_->data.end()) {
-            const versioned_value<Value>& vv = it->second;
-            if (vv.created_at > ver_high || (vv.removed_at != -1 && vv.removed_at < ver_low)) {
-                it = ssg_->data.erase(it);
+    // remove live versions of the key at it with match(value), only the oldest one if first_match_only
+    // they are kept as removed versions while some snapshot may still see them, or erased right away
+    // returns the iterator after it, as it is erased if nothing is left
+    template <class Match>
+    typename container_type::iterator remove_live(typename container_type::iterator it, const Match& match,
+                                                  bool first_match_only, size_t* n) {
+        chain_type& c = it->second;
+        bool keep = has_readonly_snapshot();
+        version_type* garbage = nullptr;
+        bool removed = false;
+        auto unlink = [&] (version_type** p) {
+            version_type* ver = *p;
+            *p = ver->next;
+            if (keep) {
+                ver->remove(ver_);
+                ver->next = c.removed;
+                c.removed = ver;
             } else {
-                ++it;
+                ver->next = garbage;
+                garbage = ver;
+            }
+            removed = true;
+            (*n)++;
+        };
+        // the live list is newest first, so the oldest match is the last one
+        version_type** oldest = nullptr;
+        version_type** p = &c.live;
+        while (*p != nullptr) {
+            if (!match((*p)->val)) {
+                p = &(*p)->next;
+            } else if (first_match_only) {
+                oldest = p;
+                p = &(*p)->next;
+            } else {
+                unlink(p);
             }
         }
-        ssg_->gc_insert_counter = 0;
-        ssg_->gc_erase_counter = 0;
+        if (oldest != nullptr) {
+            unlink(oldest);
+        }
+        if (keep && removed && !c.gc_queued) {
+            c.gc_queued = true;
+            ssg_->gc_removed.push_back(std::make_pair(ver_, it));
+        }
+        auto next = it;
+        ++next;
+        drop_versions(it, garbage);
+        return next;
     }
 
-private:
-
-    // empty struct, used to mark a ctor as snapshotting
-    struct snapshot_marker {};
+    // free garbage, which was unlinked from the chain at it, and erase the key if nothing is left
+    // returns how many versions were freed
+    size_t drop_versions(typename container_type::iterator it, version_type* garbage) const {
+        if (garbage == nullptr) {
+            return 0;
+        }
+        const chain_type& c = it->second;
+        if (c.empty()) {
+            assert(!c.gc_queued);
+            ssg_->data.erase(it);
+        } else {
+            // the key might be one of the garbage
+            it->first.key = &(c.live != nullptr ? c.live : c.removed)->key;
+        }
+        size_t n = group_type::free_versions(garbage);
+        ssg_->n_versions -= n;
+        return n;
+    }
 
-    version_t ver_;
-    group_type* ssg_;
+    // n writes were done, run a gc step in proportion
+    void gc_after_write(size_t n) {
+        if (!ssg_->gc_removed.empty()) {
+            gc_step_locked(GC_STEP_PER_WRITE * std::max<size_t>(n, 1));
+        }
+    }
 
-    // doubly linked list of all snapshots in a group
-    mutable const snapshot_sortedmap* prev_;
-    mutable const snapshot_sortedmap* next_;
+    // sweep all the data again, without a writer garbage may be anywhere
+    void gc_restart_sweep() const {
+        ssg_->gc_removed.clear();
+        ssg_->gc_insert_counter = 0;
+        ssg_->gc_sweep = ssg_->data.begin();
+        ssg_->gc_sweep_left = ssg_->data.size();
+    }
 
 
     // creating a snapshot
@@ -516,6 +993,7 @@ private:
 
 
     void make_me_snapshot_of(const snapshot_sortedmap& src) {
+        group_latch gl(src.latch());
         assert(ver_ < 0);
         ver_ = src.ver_;
         assert(ssg_ == nullptr);
@@ -535,20 +1013,28 @@ private:
 
         if (src.writable()) {
             src.ssg_->gc_insert_counter = 0;
-            src.ssg_->gc_erase_counter = 0;
         }
     }
 
     void destroy_me() {
+        {
+            group_latch gl(latch());
+            leave_group();
+        }
+        ssg_->release();
+        ssg_ = nullptr;
+        ver_ = -1;
+    }
+
+    // requires the latch
+    void leave_group() {
         assert(debug_group_sanity_check());
-        bool auto_gc = false;
+        // without a writer, garbage appears when the oldest or the newest snapshot goes away
+        bool restart_sweep = (ssg_->writer == this)
+            || (ssg_->writer == nullptr && ((prev_->ver_ > ver_ && next_->ver_ > ver_)
+                                            || (prev_->ver_ < ver_ && next_->ver_ < ver_)));
 
         if (ssg_->writer == this) {
-            // try to do auto-gc
-            if (gc_counter() >= 16 && gc_counter() >= gc_size() / 2) {
-                // more than 16 elements, and more than half of content are garbage
-                auto_gc = true;
-            }
             // remove writer in snapshot group
             ssg_->writer = nullptr;
         }
@@ -558,17 +1044,15 @@ private:
             prev_->next_ = this->next_;
             next_->prev_ = this->prev_;
 
-            // auto gc on next item
-            if (auto_gc) {
-                next_->gc_run();
+            // a bounded gc step on next item, instead of a full gc
+            if (restart_sweep) {
+                next_->gc_restart_sweep();
             }
+            next_->gc_step_locked(GC_STEP_ON_RELEASE);
         }
 
         this->prev_ = nullptr;
         this->next_ = nullptr;
-        ssg_->release();
-        ssg_ = nullptr;
-        ver_ = -1;
     }
 
     bool debug_group_sanity_check() {
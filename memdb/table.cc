@@ -1,23 +1,178 @@
+#include <algorithm>
+#include <thread>
+
 #include "utils.h"
 #include "table.h"
+#include "art.h"
+#include "btree.h"
+#include "skiplist.h"
 
 using namespace std;
 
 namespace mdb {
 
+static void append_big_endian(uint64_t v, int n_bytes, std::string* out) {
+    for (int i = n_bytes - 1; i >= 0; i--) {
+        out->push_back((char) (v >> (8 * i)));
+    }
+}
+
+void SortedMultiKey::normalize(const MultiBlob& mb, const Schema* schema, std::string* out) {
+    const std::vector<int>& key_cols = schema->key_columns_id();
+    out->clear();
+    for (int i = 0; i < mb.count(); i++) {
+        const Schema::column_info* info = schema->get_column_info(key_cols[i]);
+        switch (info->type) {
+        case Value::I32:
+            {
+                uint32_t v;
+                assert(mb[i].len == (int) sizeof(i32));
+                memcpy(&v, mb[i].data, sizeof(v));
+                append_big_endian(v ^ (uint32_t(1) << 31), sizeof(v), out);
+            }
+            break;
+        case Value::I64:
+            {
+                uint64_t v;
+                assert(mb[i].len == (int) sizeof(i64));
+                memcpy(&v, mb[i].data, sizeof(v));
+                append_big_endian(v ^ (uint64_t(1) << 63), sizeof(v), out);
+            }
+            break;
+        case Value::DOUBLE:
+            {
+                double d;
+                uint64_t v;
+                assert(mb[i].len == (int) sizeof(double));
+                memcpy(&d, mb[i].data, sizeof(d));
+                if (d == 0.0) {
+                    // -0.0 == 0.0
+                    d = 0.0;
+                }
+                memcpy(&v, &d, sizeof(v));
+                if (v >> 63) {
+                    v = ~v;
+                } else {
+                    v ^= uint64_t(1) << 63;
+                }
+                append_big_endian(v, sizeof(v), out);
+            }
+            break;
+        case Value::STR:
+            {
+                // a length prefix would break lexicographical order, so use an escaped terminator
+                for (int j = 0; j < mb[i].len; j++) {
+                    out->push_back(mb[i].data[j]);
+                    if (mb[i].data[j] == '\0') {
+                        out->push_back('\xFF');
+                    }
+                }
+                out->push_back('\0');
+                out->push_back('\x01');
+            }
+            break;
+        default:
+            Log::fatal("unexpected column type %d", info->type);
+            verify(0);
+        }
+    }
+}
+
+static uint64_t read_big_endian(const char* p, int n_bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < n_bytes; i++) {
+        v = (v << 8) | (uint8_t) p[i];
+    }
+    return v;
+}
+
+void SortedMultiKey::denormalize(const blob& key, const Schema* schema, std::vector<Value>* out) {
+    const std::vector<int>& key_cols = schema->key_columns_id();
+    const char* p = key.data;
+    const char* end = key.data + key.len;
+    for (size_t i = 0; i < key_cols.size() && p < end; i++) {
+        const Schema::column_info* info = schema->get_column_info(key_cols[i]);
+        switch (info->type) {
+        case Value::I32:
+            out->push_back(Value((i32) (read_big_endian(p, sizeof(i32)) ^ (uint32_t(1) << 31))));
+            p += sizeof(i32);
+            break;
+        case Value::I64:
+            out->push_back(Value((i64) (read_big_endian(p, sizeof(i64)) ^ (uint64_t(1) << 63))));
+            p += sizeof(i64);
+            break;
+        case Value::DOUBLE:
+            {
+                uint64_t v = read_big_endian(p, sizeof(double));
+                if (v >> 63) {
+                    v ^= uint64_t(1) << 63;
+                } else {
+                    v = ~v;
+                }
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                out->push_back(Value(d));
+                p += sizeof(double);
+            }
+            break;
+        case Value::STR:
+            {
+                std::string s;
+                // 0x00 0xFF is an escaped 0x00, 0x00 0x01 the terminator
+                while (!(p[0] == '\0' && p[1] == '\x01')) {
+                    s.push_back(p[0]);
+                    p += (p[0] == '\0') ? 2 : 1;
+                }
+                p += 2;
+                out->push_back(Value(std::move(s)));
+            }
+            break;
+        default:
+            Log::fatal("unexpected column type %d", info->type);
+            verify(0);
+        }
+    }
+    verify(p == end);
+}
+
 int SortedMultiKey::compare(const SortedMultiKey& o) const {
     verify(schema_ == o.schema_);
-    const std::vector<int>& key_cols = schema_->key_columns_id();
-    for (size_t i = 0; i < key_cols.size(); i++) {
-        const Schema::column_info* info = schema_->get_column_info(key_cols[i]);
+    if (schema_->normalized_key()) {
+        // single memcmp on the normalized form
+        size_t min_size = std::min(normalized_.size(), o.normalized_.size());
+        int cmp = memcmp(normalized_.data(), o.normalized_.data(), min_size);
+        if (cmp < 0) {
+            return -1;
+        } else if (cmp > 0) {
+            return 1;
+        }
+        // full keys are never a byte prefix of each other, so the shorter one is a key prefix
+        if (partial() || o.partial()) {
+            return 0;
+        }
+        if (normalized_.size() < o.normalized_.size()) {
+            return -1;
+        } else if (normalized_.size() > o.normalized_.size()) {
+            return 1;
+        }
+        return 0;
+    }
+    return compare(mb_, o.mb_, schema_);
+}
+
+int SortedMultiKey::compare(const MultiBlob& mb, const MultiBlob& o_mb, const Schema* schema) {
+    const std::vector<int>& key_cols = schema->key_columns_id();
+    int n_cols = std::min(mb.count(), o_mb.count());
+    for (int i = 0; i < n_cols; i++) {
+        const Schema::column_info* info = schema->get_column_info(key_cols[i]);
         verify(info->indexed);
         switch (info->type) {
         case Value::I32:
             {
-                i32 mine = *(i32 *) mb_[i].data;
-                i32 other = *(i32 *) o.mb_[i].data;
-                assert(mb_[i].len == (int) sizeof(i32));
-                assert(o.mb_[i].len == (int) sizeof(i32));
+                i32 mine = *(i32 *) mb[i].data;
+                i32 other = *(i32 *) o_mb[i].data;
+                assert(mb[i].len == (int) sizeof(i32));
+                assert(o_mb[i].len == (int) sizeof(i32));
                 if (mine < other) {
                     return -1;
                 } else if (mine > other) {
@@ -27,10 +182,10 @@ int SortedMultiKey::compare(const SortedMultiKey& o) const {
             break;
         case Value::I64:
             {
-                i64 mine = *(i64 *) mb_[i].data;
-                i64 other = *(i64 *) o.mb_[i].data;
-                assert(mb_[i].len == (int) sizeof(i64));
-                assert(o.mb_[i].len == (int) sizeof(i64));
+                i64 mine = *(i64 *) mb[i].data;
+                i64 other = *(i64 *) o_mb[i].data;
+                assert(mb[i].len == (int) sizeof(i64));
+                assert(o_mb[i].len == (int) sizeof(i64));
                 if (mine < other) {
                     return -1;
                 } else if (mine > other) {
@@ -40,10 +195,10 @@ int SortedMultiKey::compare(const SortedMultiKey& o) const {
             break;
         case Value::DOUBLE:
             {
-                double mine = *(double *) mb_[i].data;
-                double other = *(double *) o.mb_[i].data;
-                assert(mb_[i].len == (int) sizeof(double));
-                assert(o.mb_[i].len == (int) sizeof(double));
+                double mine = *(double *) mb[i].data;
+                double other = *(double *) o_mb[i].data;
+                assert(mb[i].len == (int) sizeof(double));
+                assert(o_mb[i].len == (int) sizeof(double));
                 if (mine < other) {
                     return -1;
                 } else if (mine > other) {
@@ -53,17 +208,17 @@ int SortedMultiKey::compare(const SortedMultiKey& o) const {
             break;
         case Value::STR:
             {
-                int min_size = std::min(mb_[i].len, o.mb_[i].len);
-                int cmp = memcmp(mb_[i].data, o.mb_[i].data, min_size);
+                int min_size = std::min(mb[i].len, o_mb[i].len);
+                int cmp = memcmp(mb[i].data, o_mb[i].data, min_size);
                 if (cmp < 0) {
                     return -1;
                 } else if (cmp > 0) {
                     return 1;
                 }
                 // now check who's longer
-                if (mb_[i].len < o.mb_[i].len) {
+                if (mb[i].len < o_mb[i].len) {
                     return -1;
-                } else if (mb_[i].len > o.mb_[i].len) {
+                } else if (mb[i].len > o_mb[i].len) {
                     return 1;
                 }
             }
@@ -77,35 +232,372 @@ int SortedMultiKey::compare(const SortedMultiKey& o) const {
 }
 
 
+// run fn(0) .. fn(n - 1), each in its own thread (fn(0) in the calling thread)
+template <class Fn>
+static void run_parallel(int n, const Fn& fn) {
+    vector<thread> threads;
+    for (int i = 1; i < n; i++) {
+        threads.emplace_back(fn, i);
+    }
+    fn(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// number of threads and their slices of n rows, slice i is [bounds[i], bounds[i + 1])
+static int split_rows(size_t n, int n_threads, vector<size_t>* bounds) {
+    // not worth starting threads for small inputs
+    const size_t min_rows_per_thread = 16 * 1024;
+    if (n_threads <= 0) {
+        n_threads = std::min(std::max((int) thread::hardware_concurrency(), 1), 8);
+    }
+    n_threads = (int) std::max<size_t>(std::min<size_t>(n_threads, n / min_rows_per_thread), 1);
+    for (int i = 0; i <= n_threads; i++) {
+        bounds->push_back(n * i / n_threads);
+    }
+    return n_threads;
+}
+
+void key_rows(const std::vector<Row*>& rows, const Schema* schema, std::vector<keyed_row>* out,
+              int n_threads /* =? */, const std::vector<column_id_t>* key_cols /* =? */) {
+    vector<size_t> bounds;
+    n_threads = split_rows(rows.size(), n_threads, &bounds);
+    vector<keyed_row>& keyed = *out;
+    keyed.clear();
+    keyed.resize(rows.size());
+    run_parallel(n_threads, [&] (int i) {
+        for (size_t j = bounds[i]; j < bounds[i + 1]; j++) {
+            keyed_row& kr = keyed[j];
+            kr.row = rows[j];
+            if (key_cols == nullptr) {
+                SortedMultiKey::normalize(rows[j]->get_key(), schema, &kr.key);
+            } else {
+                MultiBlob mb(key_cols->size());
+                for (size_t k = 0; k < key_cols->size(); k++) {
+                    mb[k] = rows[j]->get_blob((*key_cols)[k]);
+                }
+                SortedMultiKey::normalize(mb, schema, &kr.key);
+            }
+            kr.prefix = 0;
+            for (size_t k = 0; k < sizeof(uint64_t); k++) {
+                kr.prefix = (kr.prefix << 8) | ((k < kr.key.size()) ? (uint8_t) kr.key[k] : 0);
+            }
+        }
+    });
+}
+
+void sort_keyed_rows(std::vector<keyed_row>* rows, int n_threads /* =? */) {
+    vector<size_t> bounds;
+    n_threads = split_rows(rows->size(), n_threads, &bounds);
+    vector<keyed_row> keyed;
+    keyed.swap(*rows);
+
+    // sort (prefix, input position) pairs, which are much cheaper to move around than keyed rows
+    // input position breaks ties, so equal keys keep their order without a stable sort
+    typedef pair<uint64_t, size_t> sort_item;
+    auto less = [&keyed] (const sort_item& a, const sort_item& b) {
+        if (a.first != b.first) {
+            return a.first < b.first;
+        }
+        int cmp = keyed[a.second].key.compare(keyed[b.second].key);
+        return (cmp != 0) ? (cmp < 0) : (a.second < b.second);
+    };
+    vector<sort_item> items(keyed.size());
+    run_parallel(n_threads, [&] (int i) {
+        for (size_t j = bounds[i]; j < bounds[i + 1]; j++) {
+            items[j] = sort_item(keyed[j].prefix, j);
+        }
+        std::sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], less);
+    });
+
+    // merge neighbouring runs of slices, each round halves the number of runs
+    for (int width = 1; width < n_threads; width *= 2) {
+        vector<int> firsts;
+        for (int i = 0; i + width < n_threads; i += 2 * width) {
+            firsts.push_back(i);
+        }
+        run_parallel(firsts.size(), [&] (int m) {
+            int i = firsts[m];
+            std::inplace_merge(items.begin() + bounds[i], items.begin() + bounds[i + width],
+                               items.begin() + bounds[std::min(i + 2 * width, n_threads)], less);
+        });
+    }
+
+    rows->resize(keyed.size());
+    run_parallel(n_threads, [&] (int i) {
+        for (size_t j = bounds[i]; j < bounds[i + 1]; j++) {
+            (*rows)[j] = std::move(keyed[items[j].second]);
+        }
+    });
+}
+
+void sort_by_key(const std::vector<Row*>& rows, const Schema* schema, bool presorted,
+                 std::vector<keyed_row>* out, int n_threads /* =? */,
+                 const std::vector<column_id_t>* key_cols /* =? */) {
+    key_rows(rows, schema, out, n_threads, key_cols);
+    if (presorted) {
+        verify(std::is_sorted(out->begin(), out->end()));
+    } else {
+        sort_keyed_rows(out, n_threads);
+    }
+}
+
+MultiBlob sorted_engine::key_of(const Row* row) const {
+    if (key_cols_.empty()) {
+        return row->get_key();
+    }
+    MultiBlob mb(key_cols_.size());
+    for (size_t i = 0; i < key_cols_.size(); i++) {
+        mb[i] = row->get_blob(key_cols_[i]);
+    }
+    return mb;
+}
+
+
+// std::multimap backed engine, positions hold the map iterator
+class rbtree_engine: public sorted_engine {
+    typedef std::multimap<SortedMultiKey, Row*> map_type;
+    typedef map_type::const_iterator iterator;
+
+    const Schema* schema_;
+    map_type rows_;
+
+    static_assert(sizeof(iterator) == sizeof(void*), "map iterator must fit into sorted_pos");
+
+    static sorted_pos to_pos(iterator it) {
+        sorted_pos pos;
+        memcpy(&pos.node, &it, sizeof(it));
+        pos.slot = 0;
+        return pos;
+    }
+    static iterator to_iterator(const sorted_pos& pos) {
+        iterator it;
+        memcpy((void *) &it, &pos.node, sizeof(it));
+        return it;
+    }
+
+public:
+
+    explicit rbtree_engine(const Schema* schema): schema_(schema) {}
+
+    symbol_t rtti() const {
+        return symbol_t::ENG_RBTREE;
+    }
+    size_t size() const {
+        return rows_.size();
+    }
+
+    void insert(const SortedMultiKey& key, Row* row) {
+        insert_into_map(rows_, key, row);
+    }
+    sorted_pos erase(const sorted_pos& pos) {
+        return to_pos(rows_.erase(to_iterator(pos)));
+    }
+    void clear() {
+        rows_.clear();
+    }
+    bool bulk_load(const std::vector<keyed_row>& rows) {
+        // hinted at end(), each insert is amortized O(1) and goes after equal keys
+        for (auto& kr : rows) {
+            rows_.insert(rows_.end(), map_type::value_type(SortedMultiKey(key_of(kr.row), schema_), kr.row));
+        }
+        return true;
+    }
+
+    sorted_pos begin() const {
+        return to_pos(rows_.begin());
+    }
+    sorted_pos end() const {
+        return to_pos(rows_.end());
+    }
+    bool stored_key(const sorted_pos& pos, blob* key) const {
+        if (!schema_->normalized_key()) {
+            return false;
+        }
+        const std::string& normalized = to_iterator(pos)->first.normalized();
+        key->data = normalized.data();
+        key->len = normalized.size();
+        return true;
+    }
+    sorted_pos lower_bound(const SortedMultiKey& key) const {
+        return to_pos(rows_.lower_bound(key));
+    }
+    sorted_pos upper_bound(const SortedMultiKey& key) const {
+        return to_pos(rows_.upper_bound(key));
+    }
+    void next(sorted_pos* pos) const {
+        iterator it = to_iterator(*pos);
+        *pos = to_pos(++it);
+    }
+    void prev(sorted_pos* pos) const {
+        iterator it = to_iterator(*pos);
+        *pos = to_pos(--it);
+    }
+    Row* row_at(const sorted_pos& pos) const {
+        return to_iterator(pos)->second;
+    }
+};
+
+size_t sorted_engine::rank(const sorted_pos& pos) const {
+    size_t rank = 0;
+    for (sorted_pos it = begin(); before(it, pos); next(&it)) {
+        rank++;
+    }
+    return rank;
+}
+
+sorted_pos sorted_engine::select(size_t rank) const {
+    sorted_pos pos = begin();
+    for (size_t i = 0; i < rank && pos != end(); i++) {
+        next(&pos);
+    }
+    return pos;
+}
+
+sorted_engine* sorted_engine::create(symbol_t kind, const Schema* schema) {
+    switch (kind) {
+    case symbol_t::ENG_RBTREE:
+        return new rbtree_engine(schema);
+    case symbol_t::ENG_BTREE:
+        return new btree_engine(schema);
+    case symbol_t::ENG_SKIPLIST:
+        return new skiplist_engine(schema);
+    case symbol_t::ENG_ART:
+        return new art_engine(schema);
+    default:
+        Log::fatal("unexpected sorted engine %d", kind);
+        verify(0);
+    }
+    return nullptr;
+}
+
+
+// the schema's allocator, if n_rows rows may be all that is allocated from it, so they can be
+// handed back at once (see Row::only_block_from), nullptr otherwise
+static RowAllocator* bulk_release_allocator(const Schema* schema, size_t n_rows) {
+    RowAllocator* allocator = schema->allocator();
+    if (allocator == nullptr || n_rows == 0 || allocator->live_blocks() != n_rows) {
+        return nullptr;
+    }
+    return allocator;
+}
+
 SortedTable::~SortedTable() {
-    for (auto& it: rows_) {
-        it.second->release();
+    release_all_rows();
+    delete rows_;
+}
+
+void SortedTable::release_all_rows() {
+    RowAllocator* allocator = bulk_release_allocator(schema_, rows_->size());
+    for (auto it = make_iterator(rows_->begin()); allocator != nullptr && it != make_iterator(rows_->end()); ++it) {
+        if (!it.row()->only_block_from(allocator)) {
+            allocator = nullptr;
+        }
+    }
+    if (allocator == nullptr) {
+        for (auto it = make_iterator(rows_->begin()); it != make_iterator(rows_->end()); ++it) {
+            it.row()->release();
+        }
+    }
+    rows_->clear();
+    if (allocator != nullptr) {
+        // every row is in there, and nothing else
+        allocator->release_all();
     }
 }
 
-void SortedTable::clear() {
-    for (auto& it: rows_) {
-        it.second->release();
+SortedTable::Cursor SortedTable::query_prefix(const std::string& prefix, symbol_t order /* =? */) const {
+    verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
+    verify(schema_->key_columns_id().size() == 1);
+    verify(schema_->get_column_info(schema_->key_columns_id()[0])->type == Value::STR);
+
+    // smallest string after every string starting with prefix, none if prefix is all 0xFF
+    string after = prefix;
+    while (!after.empty() && (unsigned char) after.back() == 0xFF) {
+        after.pop_back();
     }
-    rows_.clear();
+    if (!after.empty()) {
+        after.back() = (char) ((unsigned char) after.back() + 1);
+    }
+
+    blob low;
+    low.data = prefix.data();
+    low.len = prefix.size();
+    epoch_guard guard(rows_->epochs());
+    sorted_pos begin = rows_->lower_bound(SortedMultiKey(MultiBlob(low), schema_));
+    sorted_pos end = rows_->end();
+    if (!after.empty()) {
+        blob high;
+        high.data = after.data();
+        high.len = after.size();
+        end = rows_->lower_bound(SortedMultiKey(MultiBlob(high), schema_));
+    }
+    return Cursor(make_iterator(begin), make_iterator(end), order == symbol_t::ORD_DESC, guard);
+}
+
+vector<SortedTable::Cursor> SortedTable::multi_query(const vector<MultiBlob>& keys) const {
+    epoch_guard guard(rows_->epochs());
+    vector<SortedMultiKey> smks;
+    smks.reserve(keys.size());
+    vector<size_t> order(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        smks.push_back(SortedMultiKey(keys[i], schema_));
+        order[i] = i;
+    }
+    // a key prefix goes before the longer keys it equals, so its range starts no later than theirs
+    std::sort(order.begin(), order.end(), [&smks] (size_t a, size_t b) {
+        int cmp = smks[a].compare(smks[b]);
+        if (cmp != 0) {
+            return cmp < 0;
+        }
+        return smks[a].get_multi_blob().count() < smks[b].get_multi_blob().count();
+    });
+
+    iterator end = make_iterator(rows_->end());
+    vector<Cursor> results(keys.size(), Cursor(end, end, false, guard));
+    const SortedMultiKey* last_key = nullptr;
+    sorted_pos low, high;
+    for (size_t i : order) {
+        const SortedMultiKey& key = smks[i];
+        bool same_key = last_key != nullptr && key == *last_key
+            && key.get_multi_blob().count() == last_key->get_multi_blob().count();
+        if (!same_key) {
+            rows_->equal_range_from((last_key == nullptr) ? rows_->begin() : low, key, &low, &high);
+        }
+        results[i] = Cursor(make_iterator(low), make_iterator(high), false, guard);
+        last_key = &key;
+    }
+    return results;
 }
 
-void SortedTable::remove(const SortedMultiKey& smk) {
-    auto query_range = rows_.equal_range(smk);
-    iterator it = query_range.first;
-    while (it != query_range.second) {
-        it = remove(it);
+void SortedTable::bulk_load(const std::vector<Row*>& rows, bool presorted /* =? */) {
+    for (Row* row : rows) {
+        verify(row->schema() == schema_);
+        row->set_table(this);
+    }
+    vector<keyed_row> sorted;
+    sort_by_key(rows, schema_, presorted, &sorted);
+    // otherwise sorted rows still insert faster than unsorted ones, as the search path stays in cache
+    if (rows_->size() == 0 && rows_->bulk_load(sorted)) {
+        return;
+    }
+    for (auto& kr : sorted) {
+        rows_->insert(SortedMultiKey(kr.row->get_key(), schema_), kr.row);
     }
 }
 
+void SortedTable::clear() {
+    release_all_rows();
+}
+
 void SortedTable::remove(Row* row, bool do_free /* =? */) {
-    SortedMultiKey smk = SortedMultiKey(row->get_key(), schema_);
-    auto query_range = rows_.equal_range(smk);
-    iterator it = query_range.first;
-    while (it != query_range.second) {
-        if (it->second == row) {
-            it->second->set_table(nullptr);
-            it = remove(it, do_free);
+    Cursor cur = query(row->get_key());
+    iterator it = cur.begin();
+    while (it.before(cur.end())) {
+        if (it.row() == row) {
+            row->set_table(nullptr);
+            remove(it, do_free);
             break;
         } else {
             ++it;
@@ -115,184 +607,491 @@ void SortedTable::remove(Row* row, bool do_free /* =? */) {
 
 void SortedTable::remove(Cursor cur) {
     iterator it = cur.begin();
-    while (it != cur.end()) {
+    if (it.concurrent()) {
+        // positions stay valid, but other threads may change the number of rows meanwhile
+        while (it.before(cur.end())) {
+            it = this->remove(it);
+        }
+        return;
+    }
+    // erase() invalidates cur.end(), so count the rows first
+    int n = cur.count();
+    for (int i = 0; i < n; i++) {
         it = this->remove(it);
     }
 }
 
 SortedTable::iterator SortedTable::remove(iterator it, bool do_free /* =? */) {
-    if (it != rows_.end()) {
-        if (do_free) {
-            it->second->release();
-        }
-        return rows_.erase(it);
+    if (it != make_iterator(rows_->end())) {
+        return make_iterator(rows_->remove(it.pos(), do_free));
     } else {
-        return rows_.end();
+        return it;
     }
 }
 
 UnsortedTable::~UnsortedTable() {
-    for (auto& it: rows_) {
-        it.second->release();
-    }
+    release_all_rows();
 }
 
-void UnsortedTable::clear() {
-    for (auto& it: rows_) {
-        it.second->release();
+void UnsortedTable::release_all_rows() {
+    RowAllocator* allocator = bulk_release_allocator(schema_, rows_.size());
+    for (Cursor cur = all(); allocator != nullptr && cur; ) {
+        if (!cur.next()->only_block_from(allocator)) {
+            allocator = nullptr;
+        }
+    }
+    if (allocator == nullptr) {
+        for (Cursor cur = all(); cur; ) {
+            cur.next()->release();
+        }
     }
     rows_.clear();
+    if (allocator != nullptr) {
+        // every row is in there, and nothing else
+        allocator->release_all();
+    }
+}
+
+void UnsortedTable::bulk_load(const std::vector<Row*>& rows, bool presorted /* =? */) {
+    rows_.reserve(rows_.size() + rows.size());
+    for (Row* row : rows) {
+        insert(row);
+    }
+}
+
+vector<UnsortedTable::Cursor> UnsortedTable::multi_query(const vector<MultiBlob>& keys) const {
+    vector<Cursor> results(keys.size());
+    rows_.find_batch(keys.data(), keys.size(), [&results] (size_t i, Row* row) {
+        results[i].add_match(row);
+    });
+    return results;
+}
+
+void UnsortedTable::clear() {
+    release_all_rows();
 }
 
 void UnsortedTable::remove(const MultiBlob& key) {
-    auto query_range = rows_.equal_range(key);
-    iterator it = query_range.first;
-    while (it != query_range.second) {
-        it = remove(it);
+    // matches are collected before any removal
+    Cursor cur = query(key);
+    while (cur) {
+        remove(cur.next());
     }
 }
 
 void UnsortedTable::remove(Row* row, bool do_free /* =? */) {
-    auto query_range = rows_.equal_range(row->get_key());
-    iterator it = query_range.first;
-    while (it != query_range.second) {
-        if (it->second == row) {
-            it->second->set_table(nullptr);
-            it = remove(it, do_free);
-            break;
-        } else {
-            ++it;
+    if (rows_.remove(row)) {
+        row->set_table(nullptr);
+        if (do_free) {
+            row->release();
         }
     }
 }
 
-UnsortedTable::iterator UnsortedTable::remove(iterator it, bool do_free /* =? */) {
-    if (it != rows_.end()) {
-        if (do_free) {
-            it->second->release();
+
+void SnapshotTable::bulk_load(const std::vector<Row*>& rows, bool presorted /* =? */) {
+    for (Row* row : rows) {
+        verify(row->schema() == schema_);
+        row->set_table(this);
+        row->make_readonly();
+    }
+    vector<keyed_row> sorted;
+    sort_by_key(rows, schema_, presorted, &sorted);
+    if (cow_ != nullptr) {
+        // keys come normalized already, and only the first inserts copy nodes shared with snapshots
+        for (auto& kr : sorted) {
+            cow_->insert(kr.key, kr.row);
         }
-        return rows_.erase(it);
-    } else {
-        return rows_.end();
+        return;
+    }
+    vector<pair<SortedMultiKey, RefCountedRow>> pairs;
+    pairs.reserve(sorted.size());
+    for (auto& kr : sorted) {
+        // pairs own the table's reference until the map takes its own copy
+        pairs.push_back(make_pair(SortedMultiKey(kr.row->get_key(), schema_), RefCountedRow(kr.row)));
+    }
+    rows_.insert_sorted(pairs.begin(), pairs.end());
+}
+
+void SnapshotTable::remove_cow_range(const cow_btree::cursor& range) {
+    // the copy keeps its version of the tree, and so the rows, until all of them are removed
+    cow_btree::cursor cur = range;
+    cur.rewind();
+    while (cur.has_next()) {
+        Row* row = cur.next();
+        cow_->erase(cow_key(SortedMultiKey(row->get_key(), schema_)), row);
+    }
+}
+
+SecondaryIndex::SecondaryIndex(const Schema* key_schema, const std::vector<column_id_t>& cols, symbol_t engine,
+                               bool covering /* =? */)
+        : SortedTable(key_schema, engine), cols_(cols) {
+    verify(key_schema->key_columns_id().size() == cols.size());
+    rows_->set_key_columns(cols);
+    if (covering) {
+        rows_->store_keys();
+    }
+}
+
+void SecondaryIndex::bulk_load(const std::vector<Row*>& rows, bool presorted /* =? */) {
+    vector<keyed_row> sorted;
+    sort_by_key(rows, schema_, presorted, &sorted, 0, &cols_);
+    load(sorted);
+}
+
+void SecondaryIndex::load(const std::vector<keyed_row>& sorted) {
+    if (rows_->size() == 0 && rows_->bulk_load(sorted)) {
+        return;
+    }
+    for (auto& kr : sorted) {
+        rows_->insert(SortedMultiKey(rows_->key_of(kr.row), schema_), kr.row);
+    }
+}
+
+void SecondaryIndex::remove(Row* row, bool do_free /* =? */) {
+    verify(!do_free);
+    SortedMultiKey key(rows_->key_of(row), schema_);
+    sorted_pos pos = rows_->lower_bound(key);
+    sorted_pos high = rows_->upper_bound(key);
+    while (rows_->before(pos, high)) {
+        if (rows_->row_at(pos) == row) {
+            rows_->erase(pos);
+            return;
+        }
+        rows_->next(&pos);
     }
+    Log::fatal("row is not in secondary index");
+    verify(0);
 }
 
+bool HashIndex::conflicts(const Row* row) const {
+    bool conflict = false;
+    if (unique_) {
+        rows_.find(rows_.key_of(row), [row, &conflict] (Row* other) {
+            conflict = conflict || (other != row);
+        });
+    }
+    return conflict;
+}
 
 const Schema* Index::get_schema() const {
     return idx_tbl_->index_schemas_[idx_id_];
 }
 
-SortedTable* Index::get_index_table() const {
+SecondaryIndex* Index::get_index_table() const {
     return idx_tbl_->indices_[idx_id_];
 }
 
+HashIndex* Index::get_hash_index() const {
+    return idx_tbl_->hash_indices_[idx_id_];
+}
+
+SecondaryIndex* Index::range_index() const {
+    SecondaryIndex* idx = get_index_table();
+    if (idx == nullptr) {
+        Log::fatal("range query on hash index %d", idx_id_);
+        verify(0);
+    }
+    return idx;
+}
+
+const std::vector<column_id_t>& Index::entry_columns() const {
+    HashIndex* hidx = get_hash_index();
+    if (hidx != nullptr) {
+        return hidx->columns();
+    }
+    return get_index_table()->columns();
+}
+
+void Index::Cursor::next_values(std::vector<Value>* values) {
+    values->clear();
+    const Row* row = nullptr;
+    if (hashed_) {
+        row = hash_cur_.next();
+    } else {
+        SortedTable::iterator it = base_cur_.next_pos();
+        blob key;
+        if (it.stored_key(&key)) {
+            SortedMultiKey::denormalize(key, entry_schema_, values);
+            return;
+        }
+        row = it.row();
+    }
+    for (auto& col_id : *cols_) {
+        values->push_back(row->get_column(col_id));
+    }
+}
+
 Index::Cursor Index::query(const SortedMultiKey& smk) const {
-    return Index::Cursor(get_index_table()->query(smk));
+    HashIndex* hidx = get_hash_index();
+    if (hidx != nullptr) {
+        return Index::Cursor(hidx->query(smk.get_multi_blob()), get_schema(), &hidx->columns());
+    }
+    SecondaryIndex* idx = get_index_table();
+    return Index::Cursor(idx->query(smk), get_schema(), &idx->columns());
 }
 
 Index::Cursor Index::query_lt(const SortedMultiKey& smk, symbol_t order /* =? */) const {
-    return Index::Cursor(get_index_table()->query_lt(smk, order));
+    SecondaryIndex* idx = range_index();
+    return Index::Cursor(idx->query_lt(smk, order), get_schema(), &idx->columns());
 }
 
 Index::Cursor Index::query_gt(const SortedMultiKey& smk, symbol_t order /* =? */) const {
-    return Index::Cursor(get_index_table()->query_gt(smk, order));
+    SecondaryIndex* idx = range_index();
+    return Index::Cursor(idx->query_gt(smk, order), get_schema(), &idx->columns());
 }
 
 Index::Cursor Index::query_in(const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order /* =? */) const {
-    return Index::Cursor(get_index_table()->query_in(low, high, order));
+    SecondaryIndex* idx = range_index();
+    return Index::Cursor(idx->query_in(low, high, order), get_schema(), &idx->columns());
+}
+
+Index::Cursor Index::query_prefix(const SortedMultiKey& smk, symbol_t order /* =? */) const {
+    SecondaryIndex* idx = range_index();
+    return Index::Cursor(idx->query_prefix(smk, order), get_schema(), &idx->columns());
 }
 
 Index::Cursor Index::all(symbol_t order /* =? */) const {
-    return Index::Cursor(get_index_table()->all());
+    HashIndex* hidx = get_hash_index();
+    if (hidx != nullptr) {
+        return Index::Cursor(hidx->all(), get_schema(), &hidx->columns());
+    }
+    SecondaryIndex* idx = get_index_table();
+    return Index::Cursor(idx->all(order), get_schema(), &idx->columns());
 }
 
-void IndexedTable::destroy_secondary_indices(master_index* master_idx) {
-    // we stop at id = master_idx->size() - 1, since master_idx.back() is the original Row*
-    for (size_t id = 0; id < master_idx->size() - 1; id++) {
-        Row* row = master_idx->at(id);
-        Table* tbl = const_cast<Table *>(row->get_table());
-        if (tbl == nullptr) {
-            row->release();
+IndexedTable::IndexedTable(const IndexedSchema* _schema, symbol_t engine /* =? */)
+        : SortedTable(_schema, engine), column_indices_(_schema->columns_count()), updating_(nullptr),
+          building_(nullptr) {
+    int idx_id = 0;
+    for (auto idx = _schema->index_begin(); idx != _schema->index_end(); ++idx, ++idx_id) {
+        symbol_t kind = _schema->get_index_kind(idx_id);
+        if (kind == symbol_t::IDX_SORTED) {
+            const vector<column_id_t>& include = _schema->get_index_include(idx_id);
+            vector<column_id_t> cols;
+            Schema* idx_schema = sorted_index_schema(*idx, include, &cols);
+            for (auto& col_id : cols) {
+                column_indices_[col_id].push_back(idx_id);
+            }
+            index_schemas_.push_back(idx_schema);
+            indices_.push_back(new SecondaryIndex(idx_schema, cols, engine, !include.empty()));
+            hash_indices_.push_back(nullptr);
         } else {
-            tbl->remove(row, true);
+            Schema* idx_schema = new Schema;
+            for (auto& col_id : *idx) {
+                auto col_info = _schema->get_column_info(col_id);
+                idx_schema->add_key_column(col_info->name.c_str(), col_info->type);
+                column_indices_[col_id].push_back(idx_id);
+            }
+            index_schemas_.push_back(idx_schema);
+            indices_.push_back(nullptr);
+            hash_indices_.push_back(new HashIndex(*idx, kind == symbol_t::IDX_UNIQUE_HASH));
         }
     }
-    delete master_idx;
 }
 
-
-Row* IndexedTable::make_index_row(Row* base, int idx_id, master_index* master_idx) {
-    vector<Value> idx_keys;
-
-    // pick columns from base row into the index
-    for (column_id_t col_id : ((IndexedSchema *) schema_)->get_index(idx_id)) {
-        Value picked_value = base->get_column(col_id);
-        idx_keys.push_back(picked_value);
+Schema* IndexedTable::sorted_index_schema(const std::vector<column_id_t>& cols,
+                                          const std::vector<column_id_t>& include,
+                                          std::vector<column_id_t>* entry_cols) const {
+    *entry_cols = cols;
+    // followed by the primary key, so the entry of a row is found by key instead of by a scan
+    // over every row with the same indexed values, and queries on the index are key prefixes
+    for (auto& col_id : schema_->key_columns_id()) {
+        if (std::find(entry_cols->begin(), entry_cols->end(), col_id) == entry_cols->end()) {
+            entry_cols->push_back(col_id);
+        }
+    }
+    // then the include columns, which only order rows with equal index and primary keys
+    for (auto& col_id : include) {
+        if (std::find(entry_cols->begin(), entry_cols->end(), col_id) == entry_cols->end()) {
+            entry_cols->push_back(col_id);
+        }
     }
+    Schema* idx_schema = new Schema;
+    for (auto& col_id : *entry_cols) {
+        auto col_info = schema_->get_column_info(col_id);
+        idx_schema->add_key_column(col_info->name.c_str(), col_info->type);
+    }
+    // entries keep their own key bytes, base rows may move var columns around on update
+    idx_schema->set_normalized_key(true);
+    return idx_schema;
+}
 
-    // append pointer to master index on Rows in index table
-    idx_keys.push_back(Value((i64) master_idx));
+void IndexedTable::begin_create_index(const char* name, const std::vector<column_id_t>& cols,
+                                      int n_threads /* =? */) {
+    IndexedSchema* idx_schema = mutable_schema();
+    verify(building_ == nullptr);
+    verify(!idx_schema->has_index(name));
 
-    // create index row and insert them into index table
-    Schema* idx_schema = index_schemas_[idx_id];
-    Row* idx_row = Row::create(idx_schema, idx_keys);
+    building_ = new index_build;
+    building_->name = name;
+    building_->cols = cols;
+    for (auto& col_id : cols) {
+        if (!idx_schema->get_column_info(col_id)->indexed) {
+            building_->marked.push_back(col_id);
+        }
+    }
+    // updates of the columns have to reach notify_before_update() while the index is not there yet
+    idx_schema->mark_indexed(cols);
+    building_->idx_schema = sorted_index_schema(cols, vector<column_id_t>(), &building_->entry_cols);
+    building_->covers.resize(schema_->columns_count(), false);
+    for (auto& col_id : building_->entry_cols) {
+        building_->covers[col_id] = true;
+    }
+    building_->sorted = false;
+    building_->cleared = false;
 
-    // register the index row in master_idx
-    verify((*master_idx)[idx_id] == nullptr);
-    (*master_idx)[idx_id] = idx_row;
+    vector<Row*> rows;
+    rows.reserve(size());
+    Cursor cur = all();
+    while (cur) {
+        rows.push_back(cur.next());
+    }
+    key_rows(rows, building_->idx_schema, &building_->keyed, n_threads, &building_->entry_cols);
+}
 
-    return idx_row;
+void IndexedTable::sort_created_index(int n_threads /* =? */) {
+    verify(building_ != nullptr && !building_->sorted);
+    sort_keyed_rows(&building_->keyed, n_threads);
+    building_->sorted = true;
 }
 
+int IndexedTable::finish_create_index() {
+    index_build* build = building_;
+    verify(build != nullptr && build->sorted);
+    building_ = nullptr;
 
-IndexedTable::IndexedTable(const IndexedSchema* _schema): SortedTable(_schema) {
-    for (auto idx = _schema->index_begin(); idx != _schema->index_end(); ++idx) {
-        Schema* idx_schema = new Schema;
-        for (auto& col_id : *idx) {
-            auto col_info = _schema->get_column_info(col_id);
-            idx_schema->add_key_column(col_info->name.c_str(), col_info->type);
+    vector<keyed_row>& keyed = build->keyed;
+    if (build->cleared) {
+        keyed.clear();
+    } else if (!build->touched.empty()) {
+        auto& touched = build->touched;
+        keyed.erase(std::remove_if(keyed.begin(), keyed.end(), [&touched] (const keyed_row& kr) {
+            return touched.find(kr.row) != touched.end();
+        }), keyed.end());
+    }
+    SecondaryIndex* idx = new SecondaryIndex(build->idx_schema, build->entry_cols, engine());
+    idx->load(keyed);
+    for (auto& it : build->touched) {
+        if (it.second) {
+            idx->insert(it.first);
         }
-        verify(idx_schema->add_column(".hidden", Value::I64) >= 0);
-        SortedTable* idx_tbl = new SortedTable(idx_schema);
-        index_schemas_.push_back(idx_schema);
-        indices_.push_back(idx_tbl);
     }
+
+    int idx_id = mutable_schema()->add_index(build->name.c_str(), build->cols);
+    verify(idx_id == (int) indices_.size());
+    indices_.push_back(idx);
+    hash_indices_.push_back(nullptr);
+    index_schemas_.push_back(build->idx_schema);
+    for (auto& col_id : build->entry_cols) {
+        column_indices_[col_id].push_back(idx_id);
+    }
+    delete build;
+    return idx_id;
+}
+
+void IndexedTable::abort_create_index() {
+    verify(building_ != nullptr);
+    mutable_schema()->unmark_indexed(building_->marked);
+    delete building_->idx_schema;
+    delete building_;
+    building_ = nullptr;
 }
 
 IndexedTable::~IndexedTable() {
-    for (auto& it: rows_) {
-        // get rid of the index
-        Value ptr_value = it.second->get_column(index_column_id());
-        master_index* idx = (master_index *) ptr_value.get_i64();
-        delete idx;
+    if (building_ != nullptr) {
+        abort_create_index();
     }
     for (auto& idx_table : indices_) {
         delete idx_table;
     }
+    for (auto& hash_idx : hash_indices_) {
+        delete hash_idx;
+    }
     for (auto& idx_schema : index_schemas_) {
         delete idx_schema;
     }
     // NOTE: ~SortedTable() will be called, releasing Rows in table
 }
 
-void IndexedTable::insert(Row* row) {
-    Value ptr_value = row->get_column(index_column_id());
-    if (ptr_value.get_i64() == 0) {
-        master_index* master_idx = new master_index(indices_.size() + 1);
+void IndexedTable::index_insert(int idx_id, Row* row) {
+    if (indices_[idx_id] != nullptr) {
+        indices_[idx_id]->insert(row);
+    } else {
+        hash_indices_[idx_id]->insert(row);
+    }
+}
 
-        // the last element in master index points back to the base Row
-        master_idx->back() = row;
+void IndexedTable::index_remove(int idx_id, Row* row) {
+    if (indices_[idx_id] != nullptr) {
+        indices_[idx_id]->remove(row);
+    } else {
+        hash_indices_[idx_id]->remove(row);
+    }
+}
 
-        for (size_t idx_id = 0; idx_id < master_idx->size() - 1; idx_id++) {
-            // pointer slots in master_idx will also be updated
-            Row* idx_row = make_index_row(row, idx_id, master_idx);
+void IndexedTable::insert(Row* row) {
+    if (!try_insert(row)) {
+        Log::fatal("row conflicts with another one on a unique index");
+        verify(0);
+    }
+}
 
-            SortedTable* idx_tbl = indices_[idx_id];
-            idx_tbl->insert(idx_row);
+bool IndexedTable::try_insert(Row* row) {
+    if (row != updating_) {
+        // check every unique index before adding any entry
+        for (auto& hash_idx : hash_indices_) {
+            if (hash_idx != nullptr && hash_idx->conflicts(row)) {
+                return false;
+            }
+        }
+        for (size_t idx_id = 0; idx_id < indices_.size(); idx_id++) {
+            index_insert(idx_id, row);
         }
-        row->update(index_column_id(), (i64) master_idx);
+        touch(row, true);
     }
     this->SortedTable::insert(row);
+    return true;
+}
+
+void IndexedTable::clear() {
+    for (size_t idx_id = 0; idx_id < indices_.size(); idx_id++) {
+        if (indices_[idx_id] != nullptr) {
+            indices_[idx_id]->clear();
+        } else {
+            hash_indices_[idx_id]->clear();
+        }
+    }
+    if (building_ != nullptr) {
+        building_->cleared = true;
+        building_->touched.clear();
+    }
+    this->SortedTable::clear();
+}
+
+void IndexedTable::bulk_load(const std::vector<Row*>& rows, bool presorted /* =? */) {
+    // hash indexes first, they are the ones to reject a row
+    for (auto& hash_idx : hash_indices_) {
+        if (hash_idx != nullptr) {
+            hash_idx->reserve(hash_idx->size() + rows.size());
+            for (Row* row : rows) {
+                if (hash_idx->conflicts(row)) {
+                    Log::fatal("row conflicts with another one on a unique index");
+                    verify(0);
+                }
+                hash_idx->insert(row);
+            }
+        }
+    }
+    for (auto& idx_tbl : indices_) {
+        if (idx_tbl != nullptr) {
+            idx_tbl->bulk_load(rows);
+        }
+    }
+    for (Row* row : rows) {
+        touch(row, true);
+    }
+    this->SortedTable::bulk_load(rows, presorted);
 }
 
 void IndexedTable::remove(Index::Cursor idx_cursor) {
@@ -307,78 +1106,47 @@ void IndexedTable::remove(Index::Cursor idx_cursor) {
 }
 
 IndexedTable::iterator IndexedTable::remove(iterator it, bool do_free /* =? */) {
-    if (it != rows_.end()) {
-        if (do_free) {
-            Row* row = it->second;
-            Value ptr_value = row->get_column(index_column_id());
-            master_index* idx = (master_index *) ptr_value.get_i64();
-            destroy_secondary_indices(idx);
-            row->release();
+    if (it != make_iterator(rows_->end())) {
+        Row* row = it.row();
+        if (row != updating_) {
+            for (size_t idx_id = 0; idx_id < indices_.size(); idx_id++) {
+                index_remove(idx_id, row);
+            }
+            touch(row, false);
         }
-        return rows_.erase(it);
+        return make_iterator(rows_->remove(it.pos(), do_free));
     } else {
-        return rows_.end();
+        return it;
     }
 }
 
 void IndexedTable::notify_before_update(Row* row, int updated_column_id) {
     verify(row->get_table() == this);
+    verify(updating_ == nullptr);
+    updating_ = row;
 
-    Value ptr_value = row->get_column(index_column_id());
-    master_index* master_idx = (master_index *) ptr_value.get_i64();
-    verify(master_idx != nullptr);
-
-    // remove the affected secondary indices
-    for (size_t idx_id = 0; idx_id < indices_.size(); idx_id++) {
-        bool affected = false;
-        for (column_id_t col_id : ((IndexedSchema *) schema_)->get_index(idx_id)) {
-            if (updated_column_id == col_id) {
-                affected = true;
-                break;
-            }
-        }
-        if (!affected) {
-            continue;
-        }
-        Row* affected_index_row = master_idx->at(idx_id);
-        verify(affected_index_row != nullptr);
-
-        // erase affected index row
-        SortedTable* idx_tbl = indices_[idx_id];
-        idx_tbl->remove(affected_index_row, true);
-
-        // also remove the pointer
-        (*master_idx)[idx_id] = nullptr;
+    // remove the affected entries while they still have the old values
+    for (int idx_id : column_indices_[updated_column_id]) {
+        index_remove(idx_id, row);
+    }
+    if (building_ != nullptr && building_->covers[updated_column_id]) {
+        touch(row, true);
     }
 }
 
 void IndexedTable::notify_after_update(Row* row, int updated_column_id) {
     verify(row->get_table() == this);
+    verify(updating_ == row);
+    updating_ = nullptr;
 
-    Value ptr_value = row->get_column(index_column_id());
-    master_index* master_idx = (master_index *) ptr_value.get_i64();
-    verify(master_idx != nullptr);
-
-    // re-insert the affected secondary indices
-    for (size_t idx_id = 0; idx_id < indices_.size(); idx_id++) {
-        bool affected = false;
-        for (column_id_t col_id : ((IndexedSchema *) schema_)->get_index(idx_id)) {
-            if (updated_column_id == col_id) {
-                affected = true;
-                break;
-            }
-        }
-        if (!affected) {
-            continue;
+    // re-insert the affected entries with the new values
+    for (int idx_id : column_indices_[updated_column_id]) {
+        HashIndex* hash_idx = hash_indices_[idx_id];
+        if (hash_idx != nullptr && hash_idx->conflicts(row)) {
+            Log::fatal("update makes row conflict with another one on unique index %d", idx_id);
+            verify(0);
         }
-
-        // NOTE: master index pointers will be updated by make_index_row, so we don't need to explicitly write it
-        Row* reconstructed_index_row = make_index_row(row, idx_id, master_idx);
-        verify(master_idx->at(idx_id) != nullptr);
-
-        // re-insert reconstructed index row
-        SortedTable* idx_tbl = indices_[idx_id];
-        idx_tbl->insert(reconstructed_index_row);
+        index_insert(idx_id, row);
     }
 }
 
@@ -3,14 +3,18 @@
 #include <string>
 #include <list>
 #include <unordered_map>
+#include <vector>
 
 #include "value.h"
 #include "row.h"
 #include "schema.h"
 #include "utils.h"
 #include "blob.h"
+#include "flat_hash.h"
+#include "epoch.h"
 
 #include "snapshot.h"
+#include "cow_btree.h"
 
 
 namespace mdb {
@@ -45,12 +49,42 @@ public:
     virtual symbol_t rtti() const = 0;
 };
 
+// a key may give only its first few columns (a key prefix, e.g. tenant_id of (tenant_id, ts)),
+// which then compares equal to every key starting with it: lower_bound() and upper_bound()
+// find the first and the last of these keys, so all key queries work on prefixes as well
 class SortedMultiKey {
     MultiBlob mb_;
     const Schema* schema_;
+
+    // memcmp-comparable form of the key, only if schema->normalized_key()
+    std::string normalized_;
+
 public:
     SortedMultiKey(const MultiBlob& mb, const Schema* schema): mb_(mb), schema_(schema) {
-        verify(mb_.count() == (int) schema->key_columns_id().size());
+        verify(mb_.count() <= (int) schema->key_columns_id().size());
+        if (schema->normalized_key()) {
+            normalize(mb_, schema_, &normalized_);
+        }
+    }
+    SortedMultiKey(MultiBlob&& mb, const Schema* schema): mb_(std::move(mb)), schema_(schema) {
+        verify(mb_.count() <= (int) schema->key_columns_id().size());
+        if (schema->normalized_key()) {
+            normalize(mb_, schema_, &normalized_);
+        }
+    }
+
+    // encode key into a byte string, which orders the same as compare() under memcmp:
+    //   i32, i64: big-endian, with sign bit flipped
+    //   double: big-endian IEEE 754 bits, all bits flipped if negative, otherwise sign bit flipped
+    //   str: 0x00 escaped as 0x00 0xFF, terminated by 0x00 0x01
+    // every column is self delimiting, so a key prefix encodes into a byte prefix of the full key
+    static void normalize(const MultiBlob& mb, const Schema* schema, std::string* out);
+    // the other way around, appends the value of each key column encoded in key to out
+    static void denormalize(const blob& key, const Schema* schema, std::vector<Value>* out);
+
+    // true if only a prefix of the key columns is given
+    bool partial() const {
+        return mb_.count() < (int) schema_->key_columns_id().size();
     }
 
     // -1: this < o, 0: this == o, 1: this > o
@@ -58,6 +92,10 @@ public:
     // both side should have same kind
     int compare(const SortedMultiKey& o) const;
 
+    // column by column comparison of two keys under schema, same result as compare()
+    // only the columns given by both sides are compared
+    static int compare(const MultiBlob& mb, const MultiBlob& o_mb, const Schema* schema);
+
     bool operator ==(const SortedMultiKey& o) const {
         return compare(o) == 0;
     }
@@ -80,36 +118,241 @@ public:
     const MultiBlob& get_multi_blob() const {
         return mb_;
     }
+
+    // empty if schema does not use normalized key
+    const std::string& normalized() const {
+        return normalized_;
+    }
+};
+
+// position inside a sorted_engine, meaning of the fields is up to the engine
+struct sorted_pos {
+    void* node;
+    intptr_t slot;
+
+    bool operator ==(const sorted_pos& o) const {
+        return node == o.node && slot == o.slot;
+    }
+    bool operator !=(const sorted_pos& o) const {
+        return !(*this == o);
+    }
+};
+
+// row with its normalized key (see SortedMultiKey::normalize), input of bulk loads
+struct keyed_row {
+    // first 8 bytes of key, big-endian and zero padded, so most comparisons are a single compare
+    uint64_t prefix;
+    std::string key;
+    Row* row;
+
+    bool operator <(const keyed_row& o) const {
+        if (prefix != o.prefix) {
+            return prefix < o.prefix;
+        }
+        return key < o.key;
+    }
+};
+
+// normalized keys of rows into out, sorted by key unless presorted (then only checked)
+// rows with equal keys keep their input order. big inputs are normalized and sorted in
+// n_threads slices at the same time, then merged, n_threads = 0 means one per core (up to 8)
+// rows are keyed by key_cols of them if given (see sorted_engine::set_key_columns)
+void sort_by_key(const std::vector<Row*>& rows, const Schema* schema, bool presorted,
+                 std::vector<keyed_row>* out, int n_threads = 0,
+                 const std::vector<column_id_t>* key_cols = nullptr);
+// the two halves of sort_by_key(): normalizing the keys of rows, which reads them, and sorting the
+// keyed rows, which does not, so rows may change in between
+void key_rows(const std::vector<Row*>& rows, const Schema* schema, std::vector<keyed_row>* out,
+              int n_threads = 0, const std::vector<column_id_t>* key_cols = nullptr);
+void sort_keyed_rows(std::vector<keyed_row>* rows, int n_threads = 0);
+
+// ordered storage of (key, Row*) pairs behind SortedTable
+//
+// rows with equal keys are kept in insertion order. erase() invalidates all positions
+// except the one it returns, insert() invalidates all positions (except on concurrent engines).
+class sorted_engine: public NoCopy {
+protected:
+    // see set_key_columns(), empty if rows are keyed by their own key
+    std::vector<column_id_t> key_cols_;
+
+public:
+    virtual ~sorted_engine() {}
+
+    // order rows by these columns of them instead of their own key, for engines holding rows of
+    // another table (see SecondaryIndex). types of the columns are given by the engine's schema
+    // NOTE: must be called before any row is inserted
+    void set_key_columns(const std::vector<column_id_t>& cols) {
+        verify(size() == 0);
+        key_cols_ = cols;
+    }
+    // key of a stored row, under the engine's schema
+    MultiBlob key_of(const Row* row) const;
+
+    // engines not keeping the whole normalized key of every row start doing so, see stored_key()
+    // NOTE: must be called before any row is inserted
+    virtual void store_keys() {}
+    // normalized key kept by the engine for the row at pos, false if it only has the key in the row
+    virtual bool stored_key(const sorted_pos& pos, blob* key) const {
+        return false;
+    }
+
+    virtual symbol_t rtti() const = 0;
+    virtual size_t size() const = 0;
+
+    virtual void insert(const SortedMultiKey& key, Row* row) = 0;
+    // returns position of the next row
+    virtual sorted_pos erase(const sorted_pos& pos) = 0;
+    // erase, and drop the table's reference on the row if release_row
+    // concurrent engines only release the row once no reader can still see it
+    virtual sorted_pos remove(const sorted_pos& pos, bool release_row) {
+        if (release_row) {
+            row_at(pos)->release();
+        }
+        return erase(pos);
+    }
+    // NOTE: does not release rows
+    virtual void clear() = 0;
+    // fill an empty engine with rows sorted by key (see sort_by_key), false if the engine
+    // has nothing faster than insert() for it, and the caller should insert rows one by one
+    virtual bool bulk_load(const std::vector<keyed_row>& rows) {
+        return false;
+    }
+
+    virtual sorted_pos begin() const = 0;
+    virtual sorted_pos end() const = 0;
+    virtual sorted_pos lower_bound(const SortedMultiKey& key) const = 0;
+    virtual sorted_pos upper_bound(const SortedMultiKey& key) const = 0;
+    // lower_bound() and upper_bound() of key, whose rows are known to start at or after hint, so
+    // lookups of keys in ascending order may search on from the last result instead of the top
+    virtual void equal_range_from(const sorted_pos& hint, const SortedMultiKey& key,
+                                  sorted_pos* low, sorted_pos* high) const {
+        *low = lower_bound(key);
+        *high = upper_bound(key);
+    }
+    virtual void next(sorted_pos* pos) const = 0;
+    virtual void prev(sorted_pos* pos) const = 0;
+    virtual Row* row_at(const sorted_pos& pos) const = 0;
+
+    // true if rank() and select() are O(log n), otherwise they walk from begin()
+    virtual bool counted() const {
+        return false;
+    }
+    // number of rows before pos
+    virtual size_t rank(const sorted_pos& pos) const;
+    // position of the row with given rank, end() if rank >= size()
+    virtual sorted_pos select(size_t rank) const;
+
+    // true if all operations may run from many threads at the same time, and positions stay
+    // valid (with epochs() pinned) while other threads insert and erase
+    virtual bool concurrent() const {
+        return false;
+    }
+    // true if pos comes before bound, where bound is reachable from pos by next()
+    // concurrent engines compare by order, as bound may be erased while walking towards it
+    virtual bool before(const sorted_pos& pos, const sorted_pos& bound) const {
+        return pos != bound;
+    }
+    // true if pos is at or after bound, where pos is reachable from bound by next()
+    // concurrent engines answer both conservatively for bounds from lower_bound() or upper_bound():
+    // rows inserted next to the bound after it was found are neither before nor after it
+    virtual bool at_or_after(const sorted_pos& pos, const sorted_pos& bound) const {
+        return !before(pos, bound);
+    }
+    // epochs to pin while holding positions, nullptr if not needed
+    virtual epoch_manager* epochs() const {
+        return nullptr;
+    }
+
+    // kind: ENG_RBTREE, ENG_BTREE, ENG_SKIPLIST or ENG_ART
+    static sorted_engine* create(symbol_t kind, const Schema* schema);
 };
 
 class SortedTable: public Table {
+public:
+
+    class iterator {
+        const sorted_engine* engine_;
+        sorted_pos pos_;
+    public:
+        iterator(): engine_(nullptr) {
+            pos_.node = nullptr;
+            pos_.slot = 0;
+        }
+        iterator(const sorted_engine* engine, const sorted_pos& pos): engine_(engine), pos_(pos) {}
+
+        const sorted_pos& pos() const {
+            return pos_;
+        }
+        Row* row() const {
+            return engine_->row_at(pos_);
+        }
+        size_t rank() const {
+            return engine_->rank(pos_);
+        }
+        // iterator to the row with given rank
+        iterator seek(size_t rank) const {
+            return iterator(engine_, engine_->select(rank));
+        }
+        bool counted() const {
+            return engine_->counted();
+        }
+        bool concurrent() const {
+            return engine_->concurrent();
+        }
+        bool before(const iterator& bound) const {
+            return engine_->before(pos_, bound.pos_);
+        }
+        bool at_or_after(const iterator& bound) const {
+            return engine_->at_or_after(pos_, bound.pos_);
+        }
+        bool stored_key(blob* key) const {
+            return engine_->stored_key(pos_, key);
+        }
+        iterator& operator ++() {
+            engine_->next(&pos_);
+            return *this;
+        }
+        iterator& operator --() {
+            engine_->prev(&pos_);
+            return *this;
+        }
+        bool operator ==(const iterator& o) const {
+            return pos_ == o.pos_;
+        }
+        bool operator !=(const iterator& o) const {
+            return pos_ != o.pos_;
+        }
+    };
+
 protected:
-    typedef std::multimap<SortedMultiKey, Row*>::const_iterator iterator;
-    typedef std::multimap<SortedMultiKey, Row*>::const_reverse_iterator reverse_iterator;
 
     virtual iterator remove(iterator it, bool do_free = true);
 
     // indexed by key values
-    std::multimap<SortedMultiKey, Row*> rows_;
+    sorted_engine* rows_;
+
+    iterator make_iterator(const sorted_pos& pos) const {
+        return iterator(rows_, pos);
+    }
+
+    // drop the table's reference on every row, and empty rows_
+    void release_all_rows();
 
 public:
 
-    class Cursor: public Enumerator<const Row*> {
+    class Cursor: public RowCursor {
         iterator begin_, end_, next_;
-        reverse_iterator r_begin_, r_end_, r_next_;
         int count_;
         bool reverse_;
+        // keeps positions valid on concurrent engines
+        epoch_guard guard_;
     public:
-        Cursor(const iterator& _begin, const iterator& _end): count_(-1), reverse_(false) {
-            begin_ = _begin;
-            end_ = _end;
-            next_ = _begin;
-        }
-        Cursor(const reverse_iterator& _begin, const reverse_iterator& _end): count_(-1), reverse_(true) {
-            r_begin_ = _begin;
-            r_end_ = _end;
-            r_next_ = _begin;
-        }
+        // [begin, end), walked backwards if reverse
+        // guard must have been pinned before begin and end were looked up
+        Cursor(const iterator& _begin, const iterator& _end, bool reverse = false,
+               const epoch_guard& guard = epoch_guard())
+                : begin_(_begin), end_(_end), next_(reverse ? _end : _begin), count_(-1), reverse_(reverse),
+                  guard_(guard) {}
 
         const iterator& begin() const {
             return begin_;
@@ -117,53 +360,91 @@ public:
         const iterator& end() const {
             return end_;
         }
-        const reverse_iterator& rbegin() const {
-            return r_begin_;
-        }
-        const reverse_iterator& rend() const {
-            return r_end_;
+        bool is_reverse() const {
+            return reverse_;
         }
         bool has_next() {
             if (reverse_) {
-                return r_next_ != r_end_;
+                if (next_ == begin_) {
+                    return false;
+                }
+                if (!next_.concurrent()) {
+                    return true;
+                }
+                // begin may have been erased, check the row before next is still in range
+                iterator prev = next_;
+                --prev;
+                return prev.at_or_after(begin_);
             } else {
-                return next_ != end_;
+                return next_.before(end_);
             }
         }
         operator bool () {
             return has_next();
         }
         Row* next() {
+            verify(has_next());
             Row* row = nullptr;
             if (reverse_) {
-                verify(r_next_ != r_end_);
-                row = r_next_->second;
-                ++r_next_;
+                --next_;
+                row = next_.row();
             } else {
-                verify(next_ != end_);
-                row = next_->second;
+                row = next_.row();
                 ++next_;
             }
             return row;
         }
+        // same as next(), but the position of the row instead, to read what the engine keeps with it
+        iterator next_pos() {
+            verify(has_next());
+            if (reverse_) {
+                --next_;
+                return next_;
+            }
+            iterator pos = next_;
+            ++next_;
+            return pos;
+        }
+        // number of rows in the whole range, O(log n) if the engine keeps counts
         int count() {
             if (count_ < 0) {
-                count_ = 0;
-                if (reverse_) {
-                    for (auto it = r_begin_; it != r_end_; ++it) {
-                        count_++;
-                    }
+                if (begin_.counted()) {
+                    count_ = end_.rank() - begin_.rank();
                 } else {
-                    for (auto it = begin_; it != end_; ++it) {
+                    count_ = 0;
+                    for (auto it = begin_; it.before(end_); ++it) {
                         count_++;
                     }
                 }
             }
             return count_;
         }
+        // skip the next n rows (or all that are left), O(log n) if the engine keeps counts
+        void skip(int n) {
+            verify(n >= 0);
+            if (next_.counted()) {
+                if (reverse_) {
+                    size_t low = begin_.rank();
+                    size_t rank = next_.rank();
+                    next_ = next_.seek((rank - low > (size_t) n) ? rank - n : low);
+                } else {
+                    size_t high = end_.rank();
+                    size_t rank = next_.rank();
+                    next_ = next_.seek((high - rank > (size_t) n) ? rank + n : high);
+                }
+            } else {
+                for (int i = 0; i < n && has_next(); i++) {
+                    next();
+                }
+            }
+        }
     };
 
-    SortedTable(const Schema* _schema): Table(_schema) {}
+    // engine: ENG_RBTREE (std::multimap), ENG_BTREE (B+tree, see btree.h), ENG_ART (radix tree,
+    // see art.h), or ENG_SKIPLIST (lock-free skiplist, see skiplist.h), which allows insert, remove
+    // and queries from many threads at the same time
+    SortedTable(const Schema* _schema, symbol_t engine = symbol_t::ENG_RBTREE)
+        : Table(_schema), rows_(sorted_engine::create(engine, _schema)) {}
 
     ~SortedTable();
 
@@ -171,13 +452,42 @@ public:
         return TBL_SORTED;
     }
 
+    symbol_t engine() const {
+        return rows_->rtti();
+    }
+
+    size_t size() const {
+        return rows_->size();
+    }
+
+    // number of rows with key < kv, O(log n) if the engine keeps counts (ENG_BTREE)
+    size_t rank(const Value& kv) const {
+        return rank(kv.get_blob());
+    }
+    size_t rank(const MultiBlob& mb) const {
+        return rank(SortedMultiKey(mb, schema_));
+    }
+    size_t rank(const SortedMultiKey& smk) const {
+        epoch_guard guard(rows_->epochs());
+        return rows_->rank(rows_->lower_bound(smk));
+    }
+
     void insert(Row* row) {
         SortedMultiKey key = SortedMultiKey(row->get_key(), schema_);
         verify(row->schema() == schema_);
         row->set_table(this);
-        insert_into_map(rows_, key, row);
+        rows_->insert(key, row);
     }
 
+    // insert rows in [begin, end), much cheaper than insert() per row on big batches
+    // rows are sorted first, unless presorted says they are already in key order. an empty
+    // table is built from sorted rows in one go (bottom-up in O(n) with ENG_BTREE)
+    template <class Iterator>
+    void bulk_load(Iterator begin, Iterator end, bool presorted = false) {
+        bulk_load(std::vector<Row*>(begin, end), presorted);
+    }
+    virtual void bulk_load(const std::vector<Row*>& rows, bool presorted = false);
+
     Cursor query(const Value& kv) const {
         return query(kv.get_blob());
     }
@@ -185,8 +495,8 @@ public:
         return query(SortedMultiKey(mb, schema_));
     }
     Cursor query(const SortedMultiKey& smk) const {
-        auto range = rows_.equal_range(smk);
-        return Cursor(range.first, range.second);
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->lower_bound(smk)), make_iterator(rows_->upper_bound(smk)), false, guard);
     }
 
     Cursor query_lt(const Value& kv, symbol_t order = symbol_t::ORD_ASC) const {
@@ -197,12 +507,9 @@ public:
     }
     Cursor query_lt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        auto bound = rows_.lower_bound(smk);
-        if (order == symbol_t::ORD_DESC) {
-            return Cursor(reverse_iterator(bound), rows_.rend());
-        } else {
-            return Cursor(rows_.begin(), bound);
-        }
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->begin()), make_iterator(rows_->lower_bound(smk)),
+                      order == symbol_t::ORD_DESC, guard);
     }
 
     Cursor query_gt(const Value& kv, symbol_t order = symbol_t::ORD_ASC) const {
@@ -213,12 +520,9 @@ public:
     }
     Cursor query_gt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        auto bound = rows_.upper_bound(smk);
-        if (order == symbol_t::ORD_DESC) {
-            return Cursor(rows_.rbegin(), reverse_iterator(bound));
-        } else {
-            return Cursor(bound, rows_.end());
-        }
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->upper_bound(smk)), make_iterator(rows_->end()),
+                      order == symbol_t::ORD_DESC, guard);
     }
 
     // (low, high) not inclusive
@@ -231,22 +535,34 @@ public:
     Cursor query_in(const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
         verify(low < high);
-        auto low_bound = rows_.upper_bound(low);
-        auto high_bound = rows_.lower_bound(high);
-        if (order == symbol_t::ORD_DESC) {
-            return Cursor(reverse_iterator(high_bound), reverse_iterator(low_bound));
-        } else {
-            return Cursor(low_bound, high_bound);
-        }
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->upper_bound(low)), make_iterator(rows_->lower_bound(high)),
+                      order == symbol_t::ORD_DESC, guard);
     }
 
+    // query() on each key, results[i] for keys[i]. keys are looked up in sorted order, each search
+    // going on from the result of the one before (on ENG_BTREE, through the rest of its leaf, or
+    // down from the lowest subtree holding both), so a batch walks the tree once, not once per key
+    std::vector<Cursor> multi_query(const std::vector<MultiBlob>& keys) const;
+
+    // rows whose first key columns equal prefix (see SortedMultiKey), same as query() with a key
+    // prefix, in either order. seeks to the first match and stops at the first row after
+    Cursor query_prefix(const MultiBlob& prefix, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_prefix(SortedMultiKey(prefix, schema_), order);
+    }
+    Cursor query_prefix(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
+        verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->lower_bound(smk)), make_iterator(rows_->upper_bound(smk)),
+                      order == symbol_t::ORD_DESC, guard);
+    }
+    // rows whose key starts with prefix bytes, the key must be a single STR column
+    Cursor query_prefix(const std::string& prefix, symbol_t order = symbol_t::ORD_ASC) const;
+
     Cursor all(symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        if (order == symbol_t::ORD_DESC) {
-            return Cursor(rows_.rbegin(), rows_.rend());
-        } else {
-            return Cursor(std::begin(rows_), std::end(rows_));
-        }
+        epoch_guard guard(rows_->epochs());
+        return Cursor(make_iterator(rows_->begin()), make_iterator(rows_->end()), order == symbol_t::ORD_DESC, guard);
     }
 
     void clear();
@@ -257,47 +573,110 @@ public:
     void remove(const MultiBlob& mb) {
         remove(SortedMultiKey(mb, schema_));
     }
-    void remove(const SortedMultiKey& smk);
+    void remove(const SortedMultiKey& smk) {
+        remove(query(smk));
+    }
     void remove(Row* row, bool do_free = true);
     void remove(Cursor cur);
 };
 
 
 class UnsortedTable: public Table {
-    typedef std::unordered_multimap<MultiBlob, Row*, MultiBlob::hash>::const_iterator iterator;
-
 public:
 
-    class Cursor: public Enumerator<const Row*> {
-        iterator begin_, end_, next_;
+    class Cursor: public RowCursor {
+        // walking all rows: slots of the hash map
+        const flat_row_map* map_;
+        size_t next_slot_;
+
+        // key lookups: rows matched up front, so the common single row result needs no allocation
+        Row* first_match_;
+        std::vector<Row*> more_matches_;
+        size_t next_match_;
+
         int count_;
+
+        Row* match_at(size_t i) const {
+            return (i == 0) ? first_match_ : more_matches_[i - 1];
+        }
+        void add_match(Row* row) {
+            if (first_match_ == nullptr) {
+                first_match_ = row;
+            } else {
+                more_matches_.push_back(row);
+            }
+        }
+
+        friend class UnsortedTable;
+        size_t n_matches() const {
+            return (first_match_ == nullptr) ? 0 : more_matches_.size() + 1;
+        }
+
     public:
-        Cursor(const iterator& begin, const iterator& end): begin_(begin), end_(end), next_(begin), count_(-1) {}
+        // all rows in map
+        explicit Cursor(const flat_row_map* map)
+            : map_(map), next_slot_(map->next_used(0)), first_match_(nullptr), next_match_(0), count_(-1) {}
+
+        // rows with given key
+        Cursor(const flat_row_map* map, const MultiBlob& key)
+                : map_(nullptr), next_slot_(0), first_match_(nullptr), next_match_(0), count_(-1) {
+            map->find(key, [this] (Row* row) {
+                add_match(row);
+            });
+        }
+
+        // no rows
+        Cursor(): map_(nullptr), next_slot_(0), first_match_(nullptr), next_match_(0), count_(-1) {}
 
         bool has_next() {
-            return next_ != end_;
+            if (map_ != nullptr) {
+                return next_slot_ < map_->end_slot();
+            } else {
+                return next_match_ < n_matches();
+            }
         }
         operator bool () {
             return has_next();
         }
         Row* next() {
-            verify(next_ != end_);
-            Row* row = next_->second;
-            ++next_;
+            verify(has_next());
+            Row* row = nullptr;
+            if (map_ != nullptr) {
+                row = map_->row_at(next_slot_);
+                next_slot_ = map_->next_used(next_slot_ + 1);
+            } else {
+                row = match_at(next_match_);
+                next_match_++;
+            }
             return row;
         }
         int count() {
             if (count_ < 0) {
-                count_ = 0;
-                for (auto it = begin_; it != end_; ++it) {
-                    count_++;
+                if (map_ != nullptr) {
+                    count_ = map_->size();
+                } else {
+                    count_ = n_matches();
                 }
             }
             return count_;
         }
+        // skip the next n rows (or all that are left), without walking them on key lookups
+        void skip(int n) {
+            verify(n >= 0);
+            if (map_ != nullptr) {
+                RowCursor::skip(n);
+            } else {
+                next_match_ = std::min(next_match_ + n, n_matches());
+            }
+        }
     };
 
-    UnsortedTable(const Schema* _schema): Table(_schema) {}
+    // expected_size: number of rows to make room for up front
+    UnsortedTable(const Schema* _schema, size_t expected_size = 0): Table(_schema) {
+        if (expected_size > 0) {
+            rows_.reserve(expected_size);
+        }
+    }
 
     ~UnsortedTable();
 
@@ -305,22 +684,46 @@ public:
         return TBL_UNSORTED;
     }
 
+    size_t size() const {
+        return rows_.size();
+    }
+
+    // make room for n rows, inserting up to n rows will not rehash
+    void reserve(size_t n) {
+        rows_.reserve(n);
+    }
+
+    // when growing, move rows to the bigger hash map a few at a time on each insert,
+    // instead of in a single insert, to keep insert latency bounded on big tables
+    void set_incremental_resize(bool incremental) {
+        rows_.set_incremental_resize(incremental);
+    }
+
     void insert(Row* row) {
-        MultiBlob key = row->get_key();
         verify(row->schema() == schema_);
         row->set_table(this);
-        insert_into_map(rows_, key, row);
+        rows_.insert(row);
+    }
+
+    // insert rows in [begin, end), making room for all of them up front
+    // presorted is only there to match the other tables, order does not matter here
+    template <class Iterator>
+    void bulk_load(Iterator begin, Iterator end, bool presorted = false) {
+        bulk_load(std::vector<Row*>(begin, end), presorted);
     }
+    void bulk_load(const std::vector<Row*>& rows, bool presorted = false);
 
     Cursor query(const Value& kv) const {
         return query(kv.get_blob());
     }
     Cursor query(const MultiBlob& key) const {
-        auto range = rows_.equal_range(key);
-        return Cursor(range.first, range.second);
+        return Cursor(&rows_, key);
     }
+    // query() on each key, results[i] for keys[i]. all keys are hashed up front, and the buckets
+    // of keys further on are prefetched while probing, so their cache misses overlap
+    std::vector<Cursor> multi_query(const std::vector<MultiBlob>& keys) const;
     Cursor all() const {
-        return Cursor(std::begin(rows_), std::end(rows_));
+        return Cursor(&rows_);
     }
 
     void clear();
@@ -333,10 +736,11 @@ public:
 
 private:
 
-    iterator remove(iterator it, bool do_free = true);
-
     // indexed by key values
-    std::unordered_multimap<MultiBlob, Row*, MultiBlob::hash> rows_;
+    flat_row_map rows_;
+
+    // drop the table's reference on every row, and empty rows_
+    void release_all_rows();
 };
 
 
@@ -358,6 +762,10 @@ public:
     Row* get() const {
         return row_;
     }
+    // same row, not just same key
+    bool operator ==(const RefCountedRow& o) const {
+        return row_ == o.row_;
+    }
 };
 
 
@@ -365,19 +773,38 @@ class SnapshotTable: public Table {
     // indexed by key values
     typedef snapshot_sortedmap<SortedMultiKey, RefCountedRow> table_type;
     table_type rows_;
+    // used instead of rows_ with ENG_BTREE, nullptr otherwise
+    cow_btree* cow_;
+
+    // normalized form of key, as cow_ stores it
+    std::string cow_key(const SortedMultiKey& key) const {
+        if (schema_->normalized_key()) {
+            return key.normalized();
+        }
+        std::string normalized;
+        SortedMultiKey::normalize(key.get_multi_blob(), schema_, &normalized);
+        return normalized;
+    }
+
+    // every row in the whole range, found by key among the current rows
+    void remove_cow_range(const cow_btree::cursor& range);
 
 public:
 
-    class Cursor: public Enumerator<const Row*> {
+    class Cursor: public RowCursor {
         table_type::range_type* range_;
         table_type::reverse_range_type* reverse_range_;
+        cow_btree::cursor* cow_;
     public:
-        Cursor(const table_type::range_type& range): reverse_range_(nullptr) {
+        Cursor(const table_type::range_type& range): reverse_range_(nullptr), cow_(nullptr) {
             range_ = new table_type::range_type(range);
         }
-        Cursor(const table_type::reverse_range_type& range): range_(nullptr) {
+        Cursor(const table_type::reverse_range_type& range): range_(nullptr), cow_(nullptr) {
             reverse_range_ = new table_type::reverse_range_type(range);
         }
+        Cursor(const cow_btree::cursor& cursor): range_(nullptr), reverse_range_(nullptr) {
+            cow_ = new cow_btree::cursor(cursor);
+        }
         ~Cursor() {
             if (range_ != nullptr) {
                 delete range_;
@@ -385,49 +812,92 @@ public:
             if (reverse_range_ != nullptr) {
                 delete reverse_range_;
             }
+            if (cow_ != nullptr) {
+                delete cow_;
+            }
         }
         virtual bool has_next() {
             if (range_ != nullptr) {
                 return range_->has_next();
-            } else {
+            } else if (reverse_range_ != nullptr) {
                 return reverse_range_->has_next();
+            } else {
+                return cow_->has_next();
             }
         }
         virtual const Row* next() {
             verify(has_next());
             if (range_ != nullptr) {
                 return range_->next().second.get();
-            } else {
+            } else if (reverse_range_ != nullptr) {
                 return reverse_range_->next().second.get();
+            } else {
+                return cow_->next();
             }
         }
         int count() {
             if (range_ != nullptr) {
                 return range_->count();
-            } else {
+            } else if (reverse_range_ != nullptr) {
                 return reverse_range_->count();
+            } else {
+                return cow_->count();
             }
         }
         bool is_reverse() const {
             return reverse_range_ != nullptr;
         }
+        bool is_cow() const {
+            return cow_ != nullptr;
+        }
         const table_type::range_type& get_range() const {
             return *range_;
         }
         const table_type::reverse_range_type& get_reverse_range() const {
             return *reverse_range_;
         }
+        const cow_btree::cursor& get_cow_range() const {
+            return *cow_;
+        }
     };
 
-    SnapshotTable(const Schema* sch): Table(sch) {}
+    // engine: ENG_RBTREE (versioned std::map, see snapshot.h), or ENG_BTREE (copy-on-write B+tree,
+    // see cow_btree.h), where reads never skip over versions of other snapshots, and a snapshot is
+    // freed as soon as it is released, at the cost of copying a few nodes on the first writes after
+    // taking one
+    SnapshotTable(const Schema* sch, symbol_t engine = symbol_t::ENG_RBTREE): Table(sch), cow_(nullptr) {
+        verify(engine == symbol_t::ENG_RBTREE || engine == symbol_t::ENG_BTREE);
+        if (engine == symbol_t::ENG_BTREE) {
+            cow_ = new cow_btree;
+        }
+    }
+    ~SnapshotTable() {
+        if (cow_ != nullptr) {
+            delete cow_;
+        }
+    }
 
     virtual symbol_t rtti() const {
         return TBL_SNAPSHOT;
     }
+    symbol_t engine() const {
+        return (cow_ != nullptr) ? symbol_t::ENG_BTREE : symbol_t::ENG_RBTREE;
+    }
+
+    // snapshots may then be read from other threads while this table is written (by a single thread)
+    // NOTE: call before taking any snapshot
+    // ENG_BTREE snapshots never share anything which is written, so they always may
+    void set_concurrent(bool concurrent) {
+        rows_.set_concurrent(concurrent);
+    }
 
     SnapshotTable* snapshot() const {
-        SnapshotTable* copy = new SnapshotTable(schema_);
-        copy->rows_ = rows_.snapshot();
+        SnapshotTable* copy = new SnapshotTable(schema_, engine());
+        if (cow_ != nullptr) {
+            *copy->cow_ = *cow_;
+        } else {
+            copy->rows_ = rows_.snapshot();
+        }
         return copy;
     }
 
@@ -439,8 +909,21 @@ public:
         // make the row readonly, to gaurante snapshot is not changed
         row->make_readonly();
 
-        insert_into_map(rows_, key, RefCountedRow(row));
+        if (cow_ != nullptr) {
+            cow_->insert(cow_key(key), row);
+        } else {
+            insert_into_map(rows_, key, RefCountedRow(row));
+        }
     }
+
+    // insert rows in [begin, end) as a single version, sorted first unless presorted
+    // rows are appended at the end of the map where keys allow, instead of searched from the root
+    template <class Iterator>
+    void bulk_load(Iterator begin, Iterator end, bool presorted = false) {
+        bulk_load(std::vector<Row*>(begin, end), presorted);
+    }
+    void bulk_load(const std::vector<Row*>& rows, bool presorted = false);
+
     Cursor query(const Value& kv) const {
         return query(kv.get_blob());
     }
@@ -448,6 +931,9 @@ public:
         return query(SortedMultiKey(mb, schema_));
     }
     Cursor query(const SortedMultiKey& smk) const {
+        if (cow_ != nullptr) {
+            return Cursor(cow_->query(cow_key(smk), smk.partial()));
+        }
         return Cursor(rows_.query(smk));
     }
 
@@ -459,7 +945,9 @@ public:
     }
     Cursor query_lt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        if (order == symbol_t::ORD_DESC) {
+        if (cow_ != nullptr) {
+            return Cursor(cow_->query_lt(cow_key(smk), smk.partial(), order == symbol_t::ORD_DESC));
+        } else if (order == symbol_t::ORD_DESC) {
             return Cursor(rows_.reverse_query_lt(smk));
         } else {
             return Cursor(rows_.query_lt(smk));
@@ -474,7 +962,9 @@ public:
     }
     Cursor query_gt(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        if (order == symbol_t::ORD_DESC) {
+        if (cow_ != nullptr) {
+            return Cursor(cow_->query_gt(cow_key(smk), smk.partial(), order == symbol_t::ORD_DESC));
+        } else if (order == symbol_t::ORD_DESC) {
             return Cursor(rows_.reverse_query_gt(smk));
         } else {
             return Cursor(rows_.query_gt(smk));
@@ -491,16 +981,36 @@ public:
     Cursor query_in(const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
         verify(low < high);
-        if (order == symbol_t::ORD_DESC) {
+        if (cow_ != nullptr) {
+            return Cursor(cow_->query_in(cow_key(low), low.partial(), cow_key(high), high.partial(),
+                                         order == symbol_t::ORD_DESC));
+        } else if (order == symbol_t::ORD_DESC) {
             return Cursor(rows_.reverse_query_in(low, high));
         } else {
             return Cursor(rows_.query_in(low, high));
         }
     }
 
+    // rows whose first key columns equal prefix (see SortedMultiKey), in either order
+    Cursor query_prefix(const MultiBlob& prefix, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_prefix(SortedMultiKey(prefix, schema_), order);
+    }
+    Cursor query_prefix(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const {
+        verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
+        if (cow_ != nullptr) {
+            return Cursor(cow_->query(cow_key(smk), smk.partial(), order == symbol_t::ORD_DESC));
+        } else if (order == symbol_t::ORD_DESC) {
+            return Cursor(rows_.reverse_query(smk));
+        } else {
+            return Cursor(rows_.query(smk));
+        }
+    }
+
     Cursor all(symbol_t order = symbol_t::ORD_ASC) const {
         verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
-        if (order == symbol_t::ORD_DESC) {
+        if (cow_ != nullptr) {
+            return Cursor(cow_->all(order == symbol_t::ORD_DESC));
+        } else if (order == symbol_t::ORD_DESC) {
             return Cursor(rows_.reverse_all());
         } else {
             return Cursor(rows_.all());
@@ -508,7 +1018,23 @@ public:
     }
 
     void clear() {
+        if (cow_ != nullptr) {
+            cow_->clear();
+            return;
+        }
+        bool concurrent = rows_.concurrent();
         rows_ = table_type();
+        rows_.set_concurrent(concurrent);
+    }
+
+    // drop at most budget row versions no snapshot can see anymore, from idle time
+    // writes and snapshot releases already collect a few each (see snapshot_sortedmap::gc_step)
+    // ENG_BTREE frees old versions right when they are released, and has nothing to collect
+    size_t gc_step(size_t budget) {
+        if (cow_ != nullptr) {
+            return 0;
+        }
+        return rows_.gc_step(budget);
     }
 
     void remove(const Value& kv) {
@@ -518,7 +1044,11 @@ public:
         remove(SortedMultiKey(mb, schema_));
     }
     void remove(const SortedMultiKey& smk) {
-        rows_.erase(smk);
+        if (cow_ != nullptr) {
+            cow_->erase(cow_key(smk), smk.partial());
+        } else {
+            rows_.erase(smk);
+        }
     }
 
     void remove(Row* row, bool do_free = true) {
@@ -526,11 +1056,18 @@ public:
         verify(do_free); // SnapshotTable only allow do_free == true, because there won't be any updates
         SortedMultiKey key = SortedMultiKey(row->get_key(), schema_);
         verify(row->schema() == schema_);
-        rows_.erase(key, row);
+        if (cow_ != nullptr) {
+            cow_->erase(cow_key(key), row);
+        } else {
+            // a plain Row* would convert to first_match_only, removing whichever row comes first
+            rows_.erase(key, RefCountedRow((Row *) row->ref_copy()));
+        }
     }
 
     void remove(const Cursor& cur) {
-        if (cur.is_reverse()) {
+        if (cur.is_cow()) {
+            remove_cow_range(cur.get_cow_range());
+        } else if (cur.is_reverse()) {
             rows_.erase(cur.get_reverse_range());
         } else {
             rows_.erase(cur.get_range());
@@ -538,44 +1075,145 @@ public:
     }
 };
 
+// secondary index of an IndexedTable, holding the base rows themselves, ordered by the indexed
+// columns. the engine keeps the normalized bytes of those (or the 8 byte prefix of them in
+// ENG_BTREE, reading the rest from the base row), so an entry has no row of its own
+class SecondaryIndex: public SortedTable {
+    // indexed columns of base rows, in index key order, then the primary key columns not among them,
+    // then the include columns of covering indexes
+    std::vector<column_id_t> cols_;
+
+public:
+    // key_schema has one key column for each of cols, with the same type
+    // entries of covering indexes keep their whole key, so it can be read without the base row
+    SecondaryIndex(const Schema* key_schema, const std::vector<column_id_t>& cols, symbol_t engine,
+                   bool covering = false);
+
+    // entries do not hold references on base rows
+    ~SecondaryIndex() {
+        rows_->clear();
+    }
+
+    const std::vector<column_id_t>& columns() const {
+        return cols_;
+    }
+
+    // add an entry for base row, it is not moved into this table
+    void insert(Row* row) {
+        rows_->insert(SortedMultiKey(rows_->key_of(row), schema_), row);
+    }
+    void bulk_load(const std::vector<Row*>& rows, bool presorted = false);
+    // base rows keyed by cols (see key_rows()), in key order
+    void load(const std::vector<keyed_row>& sorted);
+
+    // remove the entry of base row, which must still have the column values it was added with
+    void remove(Row* row, bool do_free = false);
+    void clear() {
+        rows_->clear();
+    }
+};
+
+// hash index of an IndexedTable (see IndexedSchema::add_hash_index), holding the base rows
+// themselves in a flat_row_map keyed by the indexed columns. equality lookups only
+class HashIndex: public NoCopy {
+    std::vector<column_id_t> cols_;
+    bool unique_;
+    flat_row_map rows_;
+
+public:
+    HashIndex(const std::vector<column_id_t>& cols, bool unique): cols_(cols), unique_(unique) {
+        rows_.set_key_columns(cols);
+    }
+
+    const std::vector<column_id_t>& columns() const {
+        return cols_;
+    }
+    bool unique() const {
+        return unique_;
+    }
+    size_t size() const {
+        return rows_.size();
+    }
+
+    // true if unique and another row has the same indexed values as row
+    bool conflicts(const Row* row) const;
+
+    void reserve(size_t n) {
+        rows_.reserve(n);
+    }
+    void insert(Row* row) {
+        rows_.insert(row);
+    }
+    // remove the entry of base row, which must still have the indexed values it was added with
+    void remove(Row* row) {
+        verify(rows_.remove(row));
+    }
+    void clear() {
+        rows_.clear();
+    }
+
+    // key must have a value for every indexed column
+    UnsortedTable::Cursor query(const MultiBlob& key) const {
+        verify(key.count() == (int) cols_.size());
+        return UnsortedTable::Cursor(&rows_, key);
+    }
+    UnsortedTable::Cursor all() const {
+        return UnsortedTable::Cursor(&rows_);
+    }
+};
+
 // forward declaration
 class IndexedTable;
 
-typedef std::vector<Row*> master_index;
-
 class Index {
     const IndexedTable* idx_tbl_;
     int idx_id_;
 
     const Schema* get_schema() const;
-    SortedTable* get_index_table() const;
+    // nullptr if the index is not of that kind
+    SecondaryIndex* get_index_table() const;
+    HashIndex* get_hash_index() const;
+    // get_index_table(), fails on hash indexes
+    SecondaryIndex* range_index() const;
 
 public:
 
-    class Cursor: public Enumerator<const Row*> {
+    class Cursor: public RowCursor {
+        // only one of them is used, by hashed_
         SortedTable::Cursor base_cur_;
+        UnsortedTable::Cursor hash_cur_;
+        bool hashed_;
+        // entry columns of the index (see entry_columns()), and the key schema describing them
+        const Schema* entry_schema_;
+        const std::vector<column_id_t>* cols_;
     public:
-        Cursor(const SortedTable::Cursor& base): base_cur_(base) {}
+        Cursor(const SortedTable::Cursor& base, const Schema* entry_schema, const std::vector<column_id_t>* cols)
+            : base_cur_(base), hashed_(false), entry_schema_(entry_schema), cols_(cols) {}
+        Cursor(const UnsortedTable::Cursor& hashed, const Schema* entry_schema, const std::vector<column_id_t>* cols)
+            : base_cur_(SortedTable::iterator(), SortedTable::iterator()), hash_cur_(hashed), hashed_(true),
+              entry_schema_(entry_schema), cols_(cols) {}
         bool has_next() {
-            return base_cur_.has_next();
+            return hashed_ ? hash_cur_.has_next() : base_cur_.has_next();
         }
         operator bool () {
             return has_next();
         }
         int count() {
-            return base_cur_.count();
+            return hashed_ ? hash_cur_.count() : base_cur_.count();
+        }
+        void skip(int n) {
+            if (hashed_) {
+                hash_cur_.skip(n);
+            } else {
+                base_cur_.skip(n);
+            }
         }
         const Row* next() {
-            Row* index_row = base_cur_.next();
-            column_id_t last_column_id = index_row->schema()->columns_count() - 1;
-            verify(last_column_id >= 0);
-            Value pointer_value = index_row->get_column(last_column_id);
-            master_index* master_idx = (master_index *) pointer_value.get_i64();
-            verify(master_idx != nullptr);
-            const Row* base_row = master_idx->back();
-            verify(base_row != nullptr);
-            return base_row;
+            return hashed_ ? hash_cur_.next() : base_cur_.next();
         }
+        // moves on like next(), but sets values to the entry columns of the row instead, read from the
+        // index entry when the engine keeps its key (covering indexes), from the base row otherwise
+        void next_values(std::vector<Value>* values);
     };
 
     Index(const IndexedTable* idx_tbl, int idx_id): idx_tbl_(idx_tbl), idx_id_(idx_id) {
@@ -588,6 +1226,13 @@ public:
     int id() {
         return idx_id_;
     }
+    // true for hash indexes, which only take query() on all their columns, and all()
+    bool hashed() const {
+        return get_hash_index() != nullptr;
+    }
+    // columns Cursor::next_values() returns: the indexed ones, then on sorted indexes the primary key
+    // columns not among them and the include columns (see IndexedSchema::add_index)
+    const std::vector<column_id_t>& entry_columns() const;
 
     Cursor query(const Value& kv) const {
         return query(kv.get_blob());
@@ -622,31 +1267,96 @@ public:
     }
     Cursor query_in(const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC) const;
 
+    // rows whose first index columns equal prefix (see SortedMultiKey), in either order
+    Cursor query_prefix(const Value& kv, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_prefix(kv.get_blob(), order);
+    }
+    Cursor query_prefix(const MultiBlob& prefix, symbol_t order = symbol_t::ORD_ASC) const {
+        return query_prefix(SortedMultiKey(prefix, get_schema()), order);
+    }
+    Cursor query_prefix(const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) const;
+
+    // in no particular order on hash indexes
     Cursor all(symbol_t order = symbol_t::ORD_ASC) const;
 };
 
 class IndexedTable: public SortedTable {
     friend class Index;
 
-    // all the secondary indices and their schemas
-    std::vector<SortedTable*> indices_;
+    // all the secondary indices by id, in indices_ if sorted and in hash_indices_ if hashed (nullptr in
+    // the other), and the key schemas they take queries in
+    std::vector<SecondaryIndex*> indices_;
+    std::vector<HashIndex*> hash_indices_;
     std::vector<Schema*> index_schemas_;
 
-    int index_column_id() const {
-        return ((IndexedSchema *) schema_)->index_column_id();
+    // ids of the secondary indices covering each column, so updates only touch those
+    std::vector<std::vector<int>> column_indices_;
+
+    // row between notify_before_update() and notify_after_update(), its entries in indices not
+    // affected by the update stay in place while Row::update() takes it out and puts it back
+    Row* updating_;
+
+    // sorted index being created on the populated table, see begin_create_index()
+    struct index_build {
+        std::string name;
+        std::vector<column_id_t> cols;
+        std::vector<column_id_t> entry_cols;
+        Schema* idx_schema;
+        // by column id, true if in entry_cols, so updates of other columns are not tracked
+        std::vector<bool> covers;
+        // rows of the table at begin_create_index(), keyed by entry_cols
+        std::vector<keyed_row> keyed;
+        bool sorted;
+        // rows inserted, removed or updated on entry_cols since then, and whether they are in the table
+        // now. their entries in keyed are out of date, and removed rows may have been freed (or their
+        // memory reused by new rows, which is fine as only the latest state of a pointer matters)
+        std::unordered_map<Row*, bool> touched;
+        // the table was cleared since, none of keyed is left
+        bool cleared;
+        // columns of cols that were not indexed before, unmarked again if the build is aborted
+        std::vector<column_id_t> marked;
+    };
+    index_build* building_;
+
+    // the schema is changed by index creation, which is why it must not be shared with other tables
+    IndexedSchema* mutable_schema() {
+        return (IndexedSchema *) schema_;
     }
 
-    void destroy_secondary_indices(master_index* master_idx);
+    void touch(Row* row, bool present) {
+        if (building_ != nullptr) {
+            building_->touched[row] = present;
+        }
+    }
 
+    // removes entries of the row as well, unless it is being updated
     virtual iterator remove(iterator it, bool do_free = true);
 
-    Row* make_index_row(Row* base, int idx_id, master_index* master_idx);
+    // add or remove the entry of row in index idx_id, whichever kind it is
+    void index_insert(int idx_id, Row* row);
+    void index_remove(int idx_id, Row* row);
+
+    // key schema of a sorted index on cols, and its entry columns (see Index::entry_columns())
+    Schema* sorted_index_schema(const std::vector<column_id_t>& cols, const std::vector<column_id_t>& include,
+                                std::vector<column_id_t>* entry_cols) const;
 
 public:
-    IndexedTable(const IndexedSchema* schema);
+    // engine is used by both the base table and the secondary indices
+    IndexedTable(const IndexedSchema* schema, symbol_t engine = symbol_t::ENG_RBTREE);
     ~IndexedTable();
 
+    // fails on rows conflicting with another one on a unique index, see try_insert()
     void insert(Row* row);
+    // false, and the row is not inserted, if a unique index already has a row with its values
+    // NOTE: updates making a row conflict on a unique index fail as well, rows should be removed
+    // and re-inserted with try_insert() where that may happen
+    bool try_insert(Row* row);
+
+    void clear();
+
+    // base rows and every secondary index are each built with one sort (see SortedTable::bulk_load)
+    void bulk_load(const std::vector<Row*>& rows, bool presorted = false);
+    using SortedTable::bulk_load;
 
     void remove(Index::Cursor idx_cursor);
 
@@ -656,6 +1366,28 @@ public:
     virtual void notify_before_update(Row* row, int updated_column_id);
     virtual void notify_after_update(Row* row, int updated_column_id);
 
+    // adds sorted index name on cols to the populated table, and returns its id. the index is built
+    // from the rows in the table, with a parallel sort (see sort_by_key), instead of inserting rows
+    // one by one into a new table. the steps may also be run one by one:
+    //   begin_create_index(): keys the rows of the table, in n_threads
+    //   sort_created_index(): sorts them, in n_threads, only reading the keys taken by the first step,
+    //     so writers may keep changing the table meanwhile, and the changes are tracked by row
+    //   finish_create_index(): loads the sorted entries, catches up with the rows changed since the
+    //     first step, then adds the index to the schema, where get_index() finds it from then on
+    // abort_create_index() drops the index instead, any time before the last step
+    // NOTE: the first and the last step need the same exclusion from writers as any other change to
+    // the table, only one index is created at a time, and the schema must not be shared with
+    // other tables
+    int create_index(const char* name, const std::vector<column_id_t>& cols, int n_threads = 0) {
+        begin_create_index(name, cols, n_threads);
+        sort_created_index(n_threads);
+        return finish_create_index();
+    }
+    void begin_create_index(const char* name, const std::vector<column_id_t>& cols, int n_threads = 0);
+    void sort_created_index(int n_threads = 0);
+    int finish_create_index();
+    void abort_create_index();
+
     Index get_index(int idx_id) const {
         return Index(this, idx_id);
     }
@@ -3,6 +3,7 @@
 #include "row.h"
 #include "table.h"
 #include "txn.h"
+#include "sharded.h"
 
 using namespace std;
 
@@ -24,6 +25,46 @@ SnapshotTable* Txn::get_snapshot_table(const std::string& tbl_name) const {
     return mgr_->get_snapshot_table(tbl_name);
 }
 
+ShardedTable* Txn::get_sharded_table(const std::string& tbl_name) const {
+    return mgr_->get_sharded_table(tbl_name);
+}
+
+bool Txn::read_typed(Row* row, column_id_t col_id, Value::kind type, blob* b) {
+    // write_column() stages values of any kind, so the callers check the blob size as well
+    verify(row->schema()->get_column_info(col_id)->type == type);
+    return read_blob(row, col_id, b);
+}
+
+bool Txn::read_i32(Row* row, column_id_t col_id, i32* v) {
+    blob b;
+    if (!read_typed(row, col_id, Value::I32, &b)) {
+        return false;
+    }
+    verify(b.len == sizeof(i32));
+    memcpy(v, b.data, sizeof(i32));
+    return true;
+}
+
+bool Txn::read_i64(Row* row, column_id_t col_id, i64* v) {
+    blob b;
+    if (!read_typed(row, col_id, Value::I64, &b)) {
+        return false;
+    }
+    verify(b.len == sizeof(i64));
+    memcpy(v, b.data, sizeof(i64));
+    return true;
+}
+
+bool Txn::read_double(Row* row, column_id_t col_id, double* v) {
+    blob b;
+    if (!read_typed(row, col_id, Value::DOUBLE, &b)) {
+        return false;
+    }
+    verify(b.len == sizeof(double));
+    memcpy(v, b.data, sizeof(double));
+    return true;
+}
+
 ResultSet Txn::query_lt(Table* tbl, const MultiBlob& mb, symbol_t order /* =? */) {
     return query_lt(tbl, SortedMultiKey(mb, tbl->schema()), order);
 }
@@ -36,6 +77,20 @@ ResultSet Txn::query_in(Table* tbl, const MultiBlob& low, const MultiBlob& high,
     return query_in(tbl, SortedMultiKey(low, tbl->schema()), SortedMultiKey(high, tbl->schema()), order);
 }
 
+vector<ResultSet> Txn::multi_query(Table* tbl, const vector<MultiBlob>& keys) {
+    vector<ResultSet> results;
+    results.reserve(keys.size());
+    for (auto& key : keys) {
+        results.push_back(query(tbl, key));
+    }
+    return results;
+}
+
+ResultSet Txn::query_prefix(Table* tbl, const MultiBlob& prefix) {
+    verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+    return query(tbl, prefix);
+}
+
 
 Txn* TxnMgr::start_nested(Txn* base) {
     return new TxnNested(this, base);
@@ -65,6 +120,14 @@ SnapshotTable* TxnMgr::get_snapshot_table(const std::string& tbl_name) const {
     return (SnapshotTable *) tbl;
 }
 
+ShardedTable* TxnMgr::get_sharded_table(const std::string& tbl_name) const {
+    Table* tbl = get_table(tbl_name);
+    if (tbl != nullptr) {
+        verify(tbl->rtti() == TBL_SHARDED);
+    }
+    return (ShardedTable *) tbl;
+}
+
 
 
 bool TxnUnsafe::read_column(Row* row, column_id_t col_id, Value* value) {
@@ -73,6 +136,12 @@ bool TxnUnsafe::read_column(Row* row, column_id_t col_id, Value* value) {
     return true;
 }
 
+bool TxnUnsafe::read_blob(Row* row, column_id_t col_id, blob* b) {
+    *b = row->get_blob(col_id);
+    // always allowed
+    return true;
+}
+
 bool TxnUnsafe::write_column(Row* row, column_id_t col_id, const Value& value) {
     row->update(col_id, value);
     // always allowed
@@ -105,12 +174,55 @@ ResultSet TxnUnsafe::query(Table* tbl, const MultiBlob& mb) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         SnapshotTable::Cursor* cursor = new SnapshotTable::Cursor(t->query(mb));
         return ResultSet(cursor);
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        ShardedTable::Cursor* cursor = new ShardedTable::Cursor(t->query(mb));
+        return ResultSet(cursor);
     } else {
-        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT
+               || tbl->rtti() == TBL_SHARDED);
         return ResultSet(nullptr);
     }
 }
 
+// raw table cursors of query() on each key, in one batch on unsorted and sorted tables
+static void table_multi_query(Table* tbl, const vector<MultiBlob>& keys, vector<RowCursor*>* cursors) {
+    cursors->reserve(keys.size());
+    if (tbl->rtti() == TBL_UNSORTED) {
+        for (auto& cur : ((UnsortedTable *) tbl)->multi_query(keys)) {
+            cursors->push_back(new UnsortedTable::Cursor(cur));
+        }
+    } else if (tbl->rtti() == TBL_SORTED) {
+        for (auto& cur : ((SortedTable *) tbl)->multi_query(keys)) {
+            cursors->push_back(new SortedTable::Cursor(cur));
+        }
+    } else if (tbl->rtti() == TBL_SNAPSHOT) {
+        SnapshotTable* t = (SnapshotTable *) tbl;
+        for (auto& key : keys) {
+            cursors->push_back(new SnapshotTable::Cursor(t->query(key)));
+        }
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        for (auto& key : keys) {
+            cursors->push_back(new ShardedTable::Cursor(t->query(key)));
+        }
+    } else {
+        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT
+               || tbl->rtti() == TBL_SHARDED);
+    }
+}
+
+vector<ResultSet> TxnUnsafe::multi_query(Table* tbl, const vector<MultiBlob>& keys) {
+    vector<RowCursor*> cursors;
+    table_multi_query(tbl, keys, &cursors);
+    vector<ResultSet> results;
+    results.reserve(cursors.size());
+    for (auto* cursor : cursors) {
+        results.push_back(ResultSet(cursor));
+    }
+    return results;
+}
+
 ResultSet TxnUnsafe::query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order /* =? */) {
     // always sendback query result from raw table
     if (tbl->rtti() == TBL_SORTED) {
@@ -121,9 +233,13 @@ ResultSet TxnUnsafe::query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         SnapshotTable* t = (SnapshotTable *) tbl;
         SnapshotTable::Cursor* cursor = new SnapshotTable::Cursor(t->query_lt(smk, order));
         return ResultSet(cursor);
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        ShardedTable::Cursor* cursor = new ShardedTable::Cursor(t->query_lt(smk, order));
+        return ResultSet(cursor);
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
         return ResultSet(nullptr);
     }
 }
@@ -138,9 +254,13 @@ ResultSet TxnUnsafe::query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         SnapshotTable* t = (SnapshotTable *) tbl;
         SnapshotTable::Cursor* cursor = new SnapshotTable::Cursor(t->query_gt(smk, order));
         return ResultSet(cursor);
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        ShardedTable::Cursor* cursor = new ShardedTable::Cursor(t->query_gt(smk, order));
+        return ResultSet(cursor);
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
         return ResultSet(nullptr);
     }
 }
@@ -155,9 +275,13 @@ ResultSet TxnUnsafe::query_in(Table* tbl, const SortedMultiKey& low, const Sorte
         SnapshotTable* t = (SnapshotTable *) tbl;
         SnapshotTable::Cursor* cursor = new SnapshotTable::Cursor(t->query_in(low, high, order));
         return ResultSet(cursor);
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        ShardedTable::Cursor* cursor = new ShardedTable::Cursor(t->query_in(low, high, order));
+        return ResultSet(cursor);
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
         return ResultSet(nullptr);
     }
 }
@@ -179,8 +303,13 @@ ResultSet TxnUnsafe::all(Table* tbl, symbol_t order /* =? */) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         SnapshotTable::Cursor* cursor = new SnapshotTable::Cursor(t->all(order));
         return ResultSet(cursor);
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        ShardedTable::Cursor* cursor = new ShardedTable::Cursor(t->all(order));
+        return ResultSet(cursor);
     } else {
-        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT
+               || tbl->rtti() == TBL_SHARDED);
         return ResultSet(nullptr);
     }
 }
@@ -296,25 +425,17 @@ bool Txn2PL::commit() {
     return true;
 }
 
-bool Txn2PL::read_column(Row* row, column_id_t col_id, Value* value) {
-    assert(debug_check_row_valid(row));
-    verify(outcome_ == symbol_t::NONE);
-
-    if (row->get_table() == nullptr) {
-        // row not inserted into table, just read from staging area
-        *value = row->get_column(col_id);
-        return true;
-    }
-
+const Value* Txn2PL::staged_update(Row* row, column_id_t col_id) const {
     auto eq_range = updates_.equal_range(row);
     for (auto it = eq_range.first; it != eq_range.second; ++it) {
         if (it->second.first == col_id) {
-            *value = it->second.second;
-            return true;
+            return &it->second.second;
         }
     }
+    return nullptr;
+}
 
-    // reading from actual table data, needs locking
+bool Txn2PL::rlock_for_read(Row* row, column_id_t col_id) {
     if (row->rtti() == symbol_t::ROW_COARSE) {
         CoarseLockedRow* coarse_row = (CoarseLockedRow *) row;
         if (!coarse_row->rlock_row_by(this->id())) {
@@ -331,11 +452,59 @@ bool Txn2PL::read_column(Row* row, column_id_t col_id, Value* value) {
         // row must either be FineLockedRow or CoarseLockedRow
         verify(row->rtti() == symbol_t::ROW_COARSE || row->rtti() == symbol_t::ROW_FINE);
     }
+    return true;
+}
+
+bool Txn2PL::read_column(Row* row, column_id_t col_id, Value* value) {
+    assert(debug_check_row_valid(row));
+    verify(outcome_ == symbol_t::NONE);
+
+    if (row->get_table() == nullptr) {
+        // row not inserted into table, just read from staging area
+        *value = row->get_column(col_id);
+        return true;
+    }
+
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *value = *staged;
+        return true;
+    }
+
+    // reading from actual table data, needs locking
+    if (!rlock_for_read(row, col_id)) {
+        return false;
+    }
     *value = row->get_column(col_id);
 
     return true;
 }
 
+bool Txn2PL::read_blob(Row* row, column_id_t col_id, blob* b) {
+    assert(debug_check_row_valid(row));
+    verify(outcome_ == symbol_t::NONE);
+
+    if (row->get_table() == nullptr) {
+        // row not inserted into table, just read from staging area
+        *b = row->get_blob(col_id);
+        return true;
+    }
+
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *b = staged->get_blob();
+        return true;
+    }
+
+    // reading from actual table data, needs locking
+    if (!rlock_for_read(row, col_id)) {
+        return false;
+    }
+    *b = row->get_blob(col_id);
+
+    return true;
+}
+
 bool Txn2PL::write_column(Row* row, column_id_t col_id, const Value& value) {
     assert(debug_check_row_valid(row));
     verify(outcome_ == symbol_t::NONE);
@@ -443,20 +612,58 @@ public:
 
 
 // merge query result in staging area and real table data
-class MergedCursor: public Enumerator<const Row*> {
+class MergedCursor: public RowCursor {
     Table* tbl_;
-    Enumerator<const Row*>* cursor_;
+    RowCursor* cursor_;
 
     bool reverse_order_;
     std::multiset<table_row_pair>::const_iterator inserts_next_, inserts_end_;
     std::multiset<table_row_pair>::const_reverse_iterator r_inserts_next_, r_inserts_end_;
 
+    // staged inserts in the whole range, for count()
+    std::multiset<table_row_pair>::const_iterator inserts_first_, inserts_last_;
+
     const std::unordered_set<table_row_pair, table_row_pair::hash>& removes_;
 
+    // bounds of the query, to tell which staged removes are in range
+    bool has_low_, has_high_;
+    bool low_inclusive_, high_inclusive_;
+    key_copy low_, high_;
+
     bool cached_;
     const Row* cached_next_;
     const Row* next_candidate_;
 
+    bool in_range(Row* row) const {
+        table_row_pair p(tbl_, row);
+        if (has_low_) {
+            KeyOnlySearchRow low_row(tbl_->schema(), &low_.get());
+            table_row_pair low(tbl_, &low_row);
+            if (low_inclusive_ ? (p < low) : !(low < p)) {
+                return false;
+            }
+        }
+        if (has_high_) {
+            KeyOnlySearchRow high_row(tbl_->schema(), &high_.get());
+            table_row_pair high(tbl_, &high_row);
+            if (high_inclusive_ ? (high < p) : !(p < high)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // staged removes of rows in range, which the base cursor still returns
+    int removes_in_range() const {
+        int n = 0;
+        for (auto& it : removes_) {
+            if (it.table == tbl_ && in_range(it.row)) {
+                n++;
+            }
+        }
+        return n;
+    }
+
     bool insert_has_next() {
         if (reverse_order_) {
             return r_inserts_next_ != r_inserts_end_;
@@ -506,7 +713,10 @@ class MergedCursor: public Enumerator<const Row*> {
             // check which is next: next_candidate_, or next in inserts_
             cached_ = true;
             if (insert_has_next()) {
-                if (next_candidate_ < insert_get_next()) {
+                const Row* insert_next = insert_get_next();
+                bool candidate_first = reverse_order_ ? !(*next_candidate_ < *insert_next)
+                                                      : !(*insert_next < *next_candidate_);
+                if (candidate_first) {
                     cached_next_ = next_candidate_;
                     next_candidate_ = nullptr;
                 } else {
@@ -528,21 +738,25 @@ class MergedCursor: public Enumerator<const Row*> {
 
 public:
     MergedCursor(Table* tbl,
-                 Enumerator<const Row*>* cursor,
+                 RowCursor* cursor,
                  const std::multiset<table_row_pair>::const_iterator& inserts_begin,
                  const std::multiset<table_row_pair>::const_iterator& inserts_end,
                  const std::unordered_set<table_row_pair, table_row_pair::hash>& removes)
         : tbl_(tbl), cursor_(cursor), reverse_order_(false),
-          inserts_next_(inserts_begin), inserts_end_(inserts_end), removes_(removes),
+          inserts_next_(inserts_begin), inserts_end_(inserts_end),
+          inserts_first_(inserts_begin), inserts_last_(inserts_end), removes_(removes),
+          has_low_(false), has_high_(false), low_inclusive_(false), high_inclusive_(false),
           cached_(false), cached_next_(nullptr), next_candidate_(nullptr) {}
 
     MergedCursor(Table* tbl,
-                 Enumerator<const Row*>* cursor,
+                 RowCursor* cursor,
                  const std::multiset<table_row_pair>::const_reverse_iterator& inserts_rbegin,
                  const std::multiset<table_row_pair>::const_reverse_iterator& inserts_rend,
                  const std::unordered_set<table_row_pair, table_row_pair::hash>& removes)
         : tbl_(tbl), cursor_(cursor), reverse_order_(true),
-          r_inserts_next_(inserts_rbegin), r_inserts_end_(inserts_rend), removes_(removes),
+          r_inserts_next_(inserts_rbegin), r_inserts_end_(inserts_rend),
+          inserts_first_(inserts_rend.base()), inserts_last_(inserts_rbegin.base()), removes_(removes),
+          has_low_(false), has_high_(false), low_inclusive_(false), high_inclusive_(false),
           cached_(false), cached_next_(nullptr), next_candidate_(nullptr) {}
 
     ~MergedCursor() {
@@ -564,6 +778,34 @@ public:
         cached_ = false;
         return cached_next_;
     }
+
+    // bounds of the query, nullptr means unbounded (the default, as on all())
+    void set_range(const MultiBlob* low, bool low_inclusive, const MultiBlob* high, bool high_inclusive) {
+        has_low_ = (low != nullptr);
+        if (has_low_) {
+            low_.assign(*low);
+            low_inclusive_ = low_inclusive;
+        }
+        has_high_ = (high != nullptr);
+        if (has_high_) {
+            high_.assign(*high);
+            high_inclusive_ = high_inclusive;
+        }
+    }
+
+    int count() {
+        return cursor_->count() + std::distance(inserts_first_, inserts_last_) - removes_in_range();
+    }
+
+    // the base cursor skips on its own once nothing staged is left to merge in
+    void skip(int n) {
+        verify(n >= 0);
+        if (n > 0 && !cached_ && next_candidate_ == nullptr && !insert_has_next() && removes_in_range() == 0) {
+            cursor_->skip(n);
+            return;
+        }
+        RowCursor::skip(n);
+    }
 };
 
 
@@ -574,7 +816,7 @@ ResultSet Txn2PL::do_query(Table* tbl, const MultiBlob& mb) {
     auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, &key_search_row));
     auto inserts_end = inserts_.upper_bound(table_row_pair(tbl, &key_search_row));
 
-    Enumerator<const Row*>* cursor = nullptr;
+    RowCursor* cursor = nullptr;
     if (tbl->rtti() == TBL_UNSORTED) {
         UnsortedTable* t = (UnsortedTable *) tbl;
         cursor = new UnsortedTable::Cursor(t->query(mb));
@@ -584,28 +826,52 @@ ResultSet Txn2PL::do_query(Table* tbl, const MultiBlob& mb) {
     } else if (tbl->rtti() == TBL_SNAPSHOT) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         cursor = new SnapshotTable::Cursor(t->query(mb));
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        cursor = new ShardedTable::Cursor(t->query(mb));
     } else {
-        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT
+               || tbl->rtti() == TBL_SHARDED);
     }
     merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
 
+    merged_cursor->set_range(&mb, true, &mb, true);
     return ResultSet(merged_cursor);
 }
 
 
+vector<ResultSet> Txn2PL::do_multi_query(Table* tbl, const vector<MultiBlob>& keys) {
+    vector<RowCursor*> cursors;
+    table_multi_query(tbl, keys, &cursors);
+    vector<ResultSet> results;
+    results.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        KeyOnlySearchRow key_search_row(tbl->schema(), &keys[i]);
+        auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, &key_search_row));
+        auto inserts_end = inserts_.upper_bound(table_row_pair(tbl, &key_search_row));
+        MergedCursor* merged_cursor = new MergedCursor(tbl, cursors[i], inserts_begin, inserts_end, removes_);
+        merged_cursor->set_range(&keys[i], true, &keys[i], true);
+        results.push_back(ResultSet(merged_cursor));
+    }
+    return results;
+}
+
 ResultSet Txn2PL::do_query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = nullptr;
+    RowCursor* cursor = nullptr;
     if (tbl->rtti() == TBL_SORTED) {
         SortedTable* t = (SortedTable *) tbl;
         cursor = new SortedTable::Cursor(t->query_lt(smk, order));
     } else if (tbl->rtti() == TBL_SNAPSHOT) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         cursor = new SnapshotTable::Cursor(t->query_lt(smk, order));
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        cursor = new ShardedTable::Cursor(t->query_lt(smk, order));
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
     }
 
     KeyOnlySearchRow key_search_row(tbl->schema(), &smk.get_multi_blob());
@@ -622,22 +888,26 @@ ResultSet Txn2PL::do_query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(nullptr, false, &smk.get_multi_blob(), false);
     return ResultSet(merged_cursor);
 }
 
 ResultSet Txn2PL::do_query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = nullptr;
+    RowCursor* cursor = nullptr;
     if (tbl->rtti() == TBL_SORTED) {
         SortedTable* t = (SortedTable *) tbl;
         cursor = new SortedTable::Cursor(t->query_gt(smk, order));
     } else if (tbl->rtti() == TBL_SNAPSHOT) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         cursor = new SnapshotTable::Cursor(t->query_gt(smk, order));
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        cursor = new ShardedTable::Cursor(t->query_gt(smk, order));
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
     }
 
     KeyOnlySearchRow key_search_row(tbl->schema(), &smk.get_multi_blob());
@@ -654,22 +924,26 @@ ResultSet Txn2PL::do_query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(&smk.get_multi_blob(), false, nullptr, false);
     return ResultSet(merged_cursor);
 }
 
 ResultSet Txn2PL::do_query_in(Table* tbl, const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = nullptr;
+    RowCursor* cursor = nullptr;
     if (tbl->rtti() == TBL_SORTED) {
         SortedTable* t = (SortedTable *) tbl;
         cursor = new SortedTable::Cursor(t->query_in(low, high, order));
     } else if (tbl->rtti() == TBL_SNAPSHOT) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         cursor = new SnapshotTable::Cursor(t->query_in(low, high, order));
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        cursor = new ShardedTable::Cursor(t->query_in(low, high, order));
     } else {
-        // range query only works on sorted and snapshot table
-        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        // range query only works on sorted, snapshot and sharded table
+        verify(tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT || tbl->rtti() == TBL_SHARDED);
     }
 
     MergedCursor* merged_cursor = nullptr;
@@ -687,6 +961,7 @@ ResultSet Txn2PL::do_query_in(Table* tbl, const SortedMultiKey& low, const Sorte
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(&low.get_multi_blob(), false, &high.get_multi_blob(), false);
     return ResultSet(merged_cursor);
 }
 
@@ -694,7 +969,7 @@ ResultSet Txn2PL::do_query_in(Table* tbl, const SortedMultiKey& low, const Sorte
 ResultSet Txn2PL::do_all(Table* tbl, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = nullptr;
+    RowCursor* cursor = nullptr;
     if (tbl->rtti() == TBL_UNSORTED) {
         // unsorted tables only accept ORD_ANY
         verify(order == symbol_t::ORD_ANY);
@@ -706,8 +981,12 @@ ResultSet Txn2PL::do_all(Table* tbl, symbol_t order /* =? */) {
     } else if (tbl->rtti() == TBL_SNAPSHOT) {
         SnapshotTable* t = (SnapshotTable *) tbl;
         cursor = new SnapshotTable::Cursor(t->all(order));
+    } else if (tbl->rtti() == TBL_SHARDED) {
+        ShardedTable* t = (ShardedTable *) tbl;
+        cursor = new ShardedTable::Cursor(t->all(order));
     } else {
-        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT);
+        verify(tbl->rtti() == TBL_UNSORTED || tbl->rtti() == TBL_SORTED || tbl->rtti() == TBL_SNAPSHOT
+               || tbl->rtti() == TBL_SHARDED);
     }
 
     MergedCursor* merged_cursor = nullptr;
@@ -940,6 +1219,18 @@ void TxnOCC::commit_confirm() {
 }
 
 
+void TxnOCC::track_read_version(Row* row, column_id_t col_id) {
+    if (row->rtti() == symbol_t::ROW_VERSIONED) {
+        VersionedRow* v_row = (VersionedRow *) row;
+        insert_into_map(ver_check_read_, row_column_pair(v_row, col_id), v_row->get_column_ver(col_id));
+        // increase row reference count because later we are going to check its version
+        incr_row_refcount(row);
+
+    } else {
+        verify(row->rtti() == symbol_t::ROW_VERSIONED);
+    }
+}
+
 bool TxnOCC::read_column(Row* row, column_id_t col_id, Value* value) {
     if (is_readonly()) {
         *value = row->get_column(col_id);
@@ -955,25 +1246,43 @@ bool TxnOCC::read_column(Row* row, column_id_t col_id, Value* value) {
         return true;
     }
 
-    auto eq_range = updates_.equal_range(row);
-    for (auto it = eq_range.first; it != eq_range.second; ++it) {
-        if (it->second.first == col_id) {
-            *value = it->second.second;
-            return true;
-        }
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *value = *staged;
+        return true;
     }
 
     // reading from actual table data, track version
-    if (row->rtti() == symbol_t::ROW_VERSIONED) {
-        VersionedRow* v_row = (VersionedRow *) row;
-        insert_into_map(ver_check_read_, row_column_pair(v_row, col_id), v_row->get_column_ver(col_id));
-        // increase row reference count because later we are going to check its version
-        incr_row_refcount(row);
+    track_read_version(row, col_id);
+    *value = row->get_column(col_id);
 
-    } else {
-        verify(row->rtti() == symbol_t::ROW_VERSIONED);
+    return true;
+}
+
+bool TxnOCC::read_blob(Row* row, column_id_t col_id, blob* b) {
+    if (is_readonly()) {
+        *b = row->get_blob(col_id);
+        return true;
+    }
+
+    assert(debug_check_row_valid(row));
+    verify(outcome_ == symbol_t::NONE);
+
+    if (row->get_table() == nullptr) {
+        // row not inserted into table, just read from staging area
+        *b = row->get_blob(col_id);
+        return true;
+    }
+
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *b = staged->get_blob();
+        return true;
     }
-    *value = row->get_column(col_id);
+
+    // reading from actual table data, track version
+    track_read_version(row, col_id);
+    *b = row->get_blob(col_id);
 
     return true;
 }
@@ -1113,18 +1422,36 @@ bool TxnNested::read_column(Row* row, column_id_t col_id, Value* value) {
         return true;
     }
 
-    auto eq_range = updates_.equal_range(row);
-    for (auto it = eq_range.first; it != eq_range.second; ++it) {
-        if (it->second.first == col_id) {
-            *value = it->second.second;
-            return true;
-        }
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *value = *staged;
+        return true;
     }
 
     // reading from base transaction
     return base_->read_column(row, col_id, value);
 }
 
+bool TxnNested::read_blob(Row* row, column_id_t col_id, blob* b) {
+    assert(debug_check_row_valid(row));
+    verify(outcome_ == symbol_t::NONE);
+
+    // same as read_column(), rows inserted by this nested txn are read directly
+    if (row_inserts_.find(row) != row_inserts_.end()) {
+        *b = row->get_blob(col_id);
+        return true;
+    }
+
+    const Value* staged = staged_update(row, col_id);
+    if (staged != nullptr) {
+        *b = staged->get_blob();
+        return true;
+    }
+
+    // reading from base transaction
+    return base_->read_blob(row, col_id, b);
+}
+
 bool TxnNested::write_column(Row* row, column_id_t col_id, const Value& value) {
     assert(debug_check_row_valid(row));
     verify(outcome_ == symbol_t::NONE);
@@ -1195,16 +1522,34 @@ ResultSet TxnNested::query(Table* tbl, const MultiBlob& mb) {
     auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, &key_search_row));
     auto inserts_end = inserts_.upper_bound(table_row_pair(tbl, &key_search_row));
 
-    Enumerator<const Row*>* cursor = base_->query(tbl, mb).unbox();
+    RowCursor* cursor = base_->query(tbl, mb).unbox();
     MergedCursor* merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
+    merged_cursor->set_range(&mb, true, &mb, true);
     return ResultSet(merged_cursor);
 }
 
 
+vector<ResultSet> TxnNested::multi_query(Table* tbl, const vector<MultiBlob>& keys) {
+    vector<ResultSet> base_results = base_->multi_query(tbl, keys);
+    vector<ResultSet> results;
+    results.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        KeyOnlySearchRow key_search_row(tbl->schema(), &keys[i]);
+        auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, &key_search_row));
+        auto inserts_end = inserts_.upper_bound(table_row_pair(tbl, &key_search_row));
+        RowCursor* cursor = base_results[i].unbox();
+        MergedCursor* merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
+        merged_cursor->set_range(&keys[i], true, &keys[i], true);
+        results.push_back(ResultSet(merged_cursor));
+    }
+    return results;
+}
+
+
 ResultSet TxnNested::query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = base_->query_lt(tbl, smk, order).unbox();
+    RowCursor* cursor = base_->query_lt(tbl, smk, order).unbox();
 
     KeyOnlySearchRow key_search_row(tbl->schema(), &smk.get_multi_blob());
     auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, table_row_pair::ROW_MIN));
@@ -1220,13 +1565,14 @@ ResultSet TxnNested::query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(nullptr, false, &smk.get_multi_blob(), false);
     return ResultSet(merged_cursor);
 }
 
 ResultSet TxnNested::query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = base_->query_gt(tbl, smk, order).unbox();
+    RowCursor* cursor = base_->query_gt(tbl, smk, order).unbox();
 
     KeyOnlySearchRow key_search_row(tbl->schema(), &smk.get_multi_blob());
     auto inserts_begin = inserts_.upper_bound(table_row_pair(tbl, &key_search_row));
@@ -1242,13 +1588,14 @@ ResultSet TxnNested::query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t or
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(&smk.get_multi_blob(), false, nullptr, false);
     return ResultSet(merged_cursor);
 }
 
 ResultSet TxnNested::query_in(Table* tbl, const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = base_->query_in(tbl, low, high, order).unbox();
+    RowCursor* cursor = base_->query_in(tbl, low, high, order).unbox();
 
     MergedCursor* merged_cursor = nullptr;
     KeyOnlySearchRow key_search_row_low(tbl->schema(), &low.get_multi_blob());
@@ -1265,6 +1612,7 @@ ResultSet TxnNested::query_in(Table* tbl, const SortedMultiKey& low, const Sorte
         merged_cursor = new MergedCursor(tbl, cursor, inserts_begin, inserts_end, removes_);
     }
 
+    merged_cursor->set_range(&low.get_multi_blob(), false, &high.get_multi_blob(), false);
     return ResultSet(merged_cursor);
 }
 
@@ -1272,7 +1620,7 @@ ResultSet TxnNested::query_in(Table* tbl, const SortedMultiKey& low, const Sorte
 ResultSet TxnNested::all(Table* tbl, symbol_t order /* =? */) {
     verify(order == symbol_t::ORD_ASC || order == symbol_t::ORD_DESC || order == symbol_t::ORD_ANY);
 
-    Enumerator<const Row*>* cursor = base_->all(tbl, order).unbox();
+    RowCursor* cursor = base_->all(tbl, order).unbox();
 
     MergedCursor* merged_cursor = nullptr;
     auto inserts_begin = inserts_.lower_bound(table_row_pair(tbl, table_row_pair::ROW_MIN));
@@ -9,15 +9,16 @@
 
 #include "utils.h"
 #include "value.h"
+#include "row.h"
 
 namespace mdb {
 
 // forward declaration
-class Row;
 class Table;
 class UnsortedTable;
 class SortedTable;
 class SnapshotTable;
+class ShardedTable;
 class TxnMgr;
 class SortedMultiKey;
 
@@ -31,7 +32,7 @@ class ResultSet: public Enumerator<Row*> {
 
     int* refcnt_;
     bool unboxed_;
-    Enumerator<const Row*>* rows_;
+    RowCursor* rows_;
 
     void decr_ref() {
         (*refcnt_)--;
@@ -44,21 +45,22 @@ class ResultSet: public Enumerator<Row*> {
     }
 
     // only called by TxnNested
-    Enumerator<const Row*>* unbox() {
+    RowCursor* unbox() {
         verify(!unboxed_);
         unboxed_ = true;
         return rows_;
     }
 
 public:
-    ResultSet(Enumerator<const Row*>* rows): refcnt_(new int(1)), unboxed_(false), rows_(rows) {}
-    ResultSet(const ResultSet& o): refcnt_(o.refcnt_), rows_(o.rows_) {
+    ResultSet(RowCursor* rows): refcnt_(new int(1)), unboxed_(false), rows_(rows) {}
+    ResultSet(const ResultSet& o): refcnt_(o.refcnt_), unboxed_(o.unboxed_), rows_(o.rows_) {
         (*refcnt_)++;
     }
     const ResultSet& operator =(const ResultSet& o) {
         if (this != &o) {
             decr_ref();
             refcnt_ = o.refcnt_;
+            unboxed_ = o.unboxed_;
             rows_ = o.rows_;
             (*refcnt_)++;
         }
@@ -74,6 +76,19 @@ public:
     Row* next() {
         return const_cast<Row*>(rows_->next());
     }
+
+    // number of rows in the whole result, including the ones already returned
+    // O(log n) on SortedTables with ENG_BTREE, staged inserts and removes in range are added on top
+    int count() {
+        return rows_->count();
+    }
+
+    // skip the next n rows (or all that are left)
+    // O(log n) on SortedTables with ENG_BTREE when no staged insert or remove is left in range,
+    // otherwise rows are walked
+    void skip(int n) {
+        rows_->skip(n);
+    }
 };
 
 class Txn: public NoCopy {
@@ -82,6 +97,8 @@ protected:
     txn_id_t txnid_;
     Txn(const TxnMgr* mgr, txn_id_t txnid): mgr_(mgr), txnid_(txnid) {}
 
+    bool read_typed(Row* row, column_id_t col_id, Value::kind type, blob* b);
+
 public:
     virtual ~Txn() {}
     virtual symbol_t rtti() const = 0;
@@ -93,6 +110,7 @@ public:
     SortedTable* get_sorted_table(const std::string& tbl_name) const;
     UnsortedTable* get_unsorted_table(const std::string& tbl_name) const;
     SnapshotTable* get_snapshot_table(const std::string& tbl_name) const;
+    ShardedTable* get_sharded_table(const std::string& tbl_name) const;
 
     virtual void abort() = 0;
     virtual bool commit() = 0;
@@ -110,6 +128,18 @@ public:
     virtual bool insert_row(Table* tbl, Row* row) = 0;
     virtual bool remove_row(Table* tbl, Row* row) = 0;
 
+    // same as read_column, but the blob points to row data (or the update staged in txn) instead
+    // of making a copy. it is only valid until the column is written, or the txn is finished
+    virtual bool read_blob(Row* row, column_id_t col_id, blob* b) = 0;
+
+    // typed reads, no Value construction nor heap allocation
+    bool read_i32(Row* row, column_id_t col_id, i32* v);
+    bool read_i64(Row* row, column_id_t col_id, i64* v);
+    bool read_double(Row* row, column_id_t col_id, double* v);
+    bool read_str_view(Row* row, column_id_t col_id, blob* v) {
+        return read_typed(row, col_id, Value::STR, v);
+    }
+
     bool read_columns(Row* row, const std::vector<column_id_t>& col_ids, std::vector<Value>* values) {
         for (auto col_id : col_ids) {
             Value v;
@@ -155,6 +185,17 @@ public:
     ResultSet query_in(Table* tbl, const MultiBlob& low, const MultiBlob& high, symbol_t order = symbol_t::ORD_ASC);
     virtual ResultSet query_in(Table* tbl, const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC) = 0;
 
+    // query() on each key, results[i] for keys[i]. lookups on unsorted and sorted tables go
+    // through their multi_query(), which overlaps the cache misses of a batch
+    virtual std::vector<ResultSet> multi_query(Table* tbl, const std::vector<MultiBlob>& keys);
+
+    // rows whose first key columns equal prefix, on sorted and snapshot tables, where query(),
+    // query_lt(), query_gt() and query_in() take key prefixes as well (see SortedMultiKey)
+    ResultSet query_prefix(Table* tbl, const Value& kv) {
+        return query_prefix(tbl, kv.get_blob());
+    }
+    ResultSet query_prefix(Table* tbl, const MultiBlob& prefix);
+
     virtual ResultSet all(Table* tbl, symbol_t order = symbol_t::ORD_ANY) = 0;
 };
 
@@ -186,6 +227,7 @@ public:
     UnsortedTable* get_unsorted_table(const std::string& tbl_name) const;
     SortedTable* get_sorted_table(const std::string& tbl_name) const;
     SnapshotTable* get_snapshot_table(const std::string& tbl_name) const;
+    ShardedTable* get_sharded_table(const std::string& tbl_name) const;
 };
 
 
@@ -203,11 +245,13 @@ public:
         return true;
     }
     virtual bool read_column(Row* row, column_id_t col_id, Value* value);
+    virtual bool read_blob(Row* row, column_id_t col_id, blob* b);
     virtual bool write_column(Row* row, column_id_t col_id, const Value& value);
     virtual bool insert_row(Table* tbl, Row* row);
     virtual bool remove_row(Table* tbl, Row* row);
 
     ResultSet query(Table* tbl, const MultiBlob& mb);
+    virtual std::vector<ResultSet> multi_query(Table* tbl, const std::vector<MultiBlob>& keys);
 
     virtual ResultSet query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
     virtual ResultSet query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
@@ -275,7 +319,14 @@ protected:
         return true;
     }
 
+    // the update staged in this txn, nullptr if the column is not updated yet
+    const Value* staged_update(Row* row, column_id_t col_id) const;
+
+    // read lock the column (or the whole row) before reading from actual table data
+    bool rlock_for_read(Row* row, column_id_t col_id);
+
     ResultSet do_query(Table* tbl, const MultiBlob& mb);
+    std::vector<ResultSet> do_multi_query(Table* tbl, const std::vector<MultiBlob>& keys);
 
     ResultSet do_query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
     ResultSet do_query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
@@ -295,6 +346,7 @@ public:
     void abort();
     bool commit();
     virtual bool read_column(Row* row, column_id_t col_id, Value* value);
+    virtual bool read_blob(Row* row, column_id_t col_id, blob* b);
     virtual bool write_column(Row* row, column_id_t col_id, const Value& value);
     virtual bool insert_row(Table* tbl, Row* row);
     virtual bool remove_row(Table* tbl, Row* row);
@@ -302,6 +354,9 @@ public:
     ResultSet query(Table* tbl, const MultiBlob& mb) {
         return do_query(tbl, mb);
     }
+    virtual std::vector<ResultSet> multi_query(Table* tbl, const std::vector<MultiBlob>& keys) {
+        return do_multi_query(tbl, keys);
+    }
     virtual ResultSet query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) {
         return do_query_lt(tbl, smk, order);
     }
@@ -368,6 +423,7 @@ class TxnOCC: public Txn2PL {
     std::set<Table*> snapshot_tables_;
 
     void incr_row_refcount(Row* r);
+    void track_read_version(Row* row, column_id_t col_id);
     bool version_check();
     bool version_check(const std::unordered_map<row_column_pair, version_t, row_column_pair::hash>& ver_info);
     void release_resource();
@@ -418,6 +474,7 @@ public:
     }
 
     virtual bool read_column(Row* row, column_id_t col_id, Value* value);
+    virtual bool read_blob(Row* row, column_id_t col_id, blob* b);
     virtual bool write_column(Row* row, column_id_t col_id, const Value& value);
     virtual bool insert_row(Table* tbl, Row* row);
     virtual bool remove_row(Table* tbl, Row* row);
@@ -431,6 +488,10 @@ public:
         verify(!is_readonly() || snapshot_tables_.find(tbl) != snapshot_tables_.end());
         return do_query(tbl, mb);
     }
+    virtual std::vector<ResultSet> multi_query(Table* tbl, const std::vector<MultiBlob>& keys) {
+        verify(!is_readonly() || snapshot_tables_.find(tbl) != snapshot_tables_.end());
+        return do_multi_query(tbl, keys);
+    }
     virtual ResultSet query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC) {
         verify(!is_readonly() || snapshot_tables_.find(tbl) != snapshot_tables_.end());
         return do_query_lt(tbl, smk, order);
@@ -480,11 +541,13 @@ public:
     virtual bool commit();
 
     virtual bool read_column(Row* row, column_id_t col_id, Value* value);
+    virtual bool read_blob(Row* row, column_id_t col_id, blob* b);
     virtual bool write_column(Row* row, column_id_t col_id, const Value& value);
     virtual bool insert_row(Table* tbl, Row* row);
     virtual bool remove_row(Table* tbl, Row* row);
 
     ResultSet query(Table* tbl, const MultiBlob& mb);
+    std::vector<ResultSet> multi_query(Table* tbl, const std::vector<MultiBlob>& keys);
     ResultSet query_lt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
     ResultSet query_gt(Table* tbl, const SortedMultiKey& smk, symbol_t order = symbol_t::ORD_ASC);
     ResultSet query_in(Table* tbl, const SortedMultiKey& low, const SortedMultiKey& high, symbol_t order = symbol_t::ORD_ASC);
@@ -11,6 +11,8 @@ namespace mdb {
 using base::i32;
 using base::i64;
 using base::NoCopy;
+using base::Mutex;
+using base::ScopedLock;
 using base::RefCounted;
 using base::Enumerator;
 using base::Log;
@@ -31,6 +33,12 @@ typedef enum {
     TBL_SORTED,
     TBL_UNSORTED,
     TBL_SNAPSHOT,
+    TBL_SHARDED,
+
+    ENG_RBTREE,
+    ENG_BTREE,
+    ENG_SKIPLIST,
+    ENG_ART,
 
     TXN_UNSAFE,
     TXN_NESTED,
@@ -45,7 +53,11 @@ typedef enum {
     ORD_DESC,
 
     OCC_EAGER,
-    OCC_LAZY
+    OCC_LAZY,
+
+    IDX_SORTED,
+    IDX_HASH,
+    IDX_UNIQUE_HASH
 } symbol_t;
 
 uint32_t stringhash32(const void* data, int len);
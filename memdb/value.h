@@ -2,6 +2,7 @@
 
 #include <ostream>
 #include <string>
+#include <utility>
 
 #include "blob.h"
 #include "utils.h"
@@ -26,6 +27,7 @@ public:
     explicit Value(i64 v): k_(I64), i64_(v) {}
     explicit Value(double v): k_(DOUBLE), double_(v) {}
     explicit Value(const std::string& s): k_(STR), p_str_(new std::string(s)) {}
+    explicit Value(std::string&& s): k_(STR), p_str_(new std::string(std::move(s))) {}
     explicit Value(const char* str): k_(STR), p_str_(new std::string(str)) {}
 
     Value(const Value& o) {
@@ -38,6 +40,18 @@ public:
         }
     }
 
+    // moving a STR value steals its string, leaving the source UNKNOWN
+    Value(Value&& o) noexcept {
+        k_ = o.k_;
+        i32_ = o.i32_;
+        i64_ = o.i64_;
+        double_ = o.double_;
+        if (k_ == STR) {
+            p_str_ = o.p_str_;
+            o.k_ = UNKNOWN;
+        }
+    }
+
     ~Value() {
         if (k_ == STR) {
             delete p_str_;
@@ -59,6 +73,22 @@ public:
         }
         return *this;
     }
+    const Value& operator= (Value&& o) noexcept {
+        if (this != &o) {
+            if (k_ == STR) {
+                delete p_str_;
+            }
+            k_ = o.k_;
+            i32_ = o.i32_;
+            i64_ = o.i64_;
+            double_ = o.double_;
+            if (k_ == STR) {
+                p_str_ = o.p_str_;
+                o.k_ = UNKNOWN;
+            }
+        }
+        return *this;
+    }
     const Value& operator= (i32 v) {
         this->set_i32(v);
         return *this;
@@ -0,0 +1,146 @@
+#include <vector>
+
+#include "memdb/allocator.h"
+#include "memdb/row.h"
+#include "memdb/table.h"
+#include "base/all.h"
+
+using namespace base;
+using namespace mdb;
+using namespace std;
+
+TEST(allocator, heap_blocks) {
+    void* p = RowAllocator::allocate(nullptr, 100);
+    EXPECT_NEQ(p, (void *) nullptr);
+    memset(p, 0xab, 100);
+    RowAllocator::deallocate(p);
+
+    RowAllocator alloc;
+    // too large for slabs, goes to heap
+    p = RowAllocator::allocate(&alloc, 100 * 1000);
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+    EXPECT_EQ(alloc.slab_count(), 0u);
+    RowAllocator::deallocate(p);
+}
+
+TEST(allocator, recycle_blocks) {
+    RowAllocator alloc(64 * 1024);
+    void* p1 = RowAllocator::allocate(&alloc, 40);
+    void* p2 = RowAllocator::allocate(&alloc, 40);
+    EXPECT_EQ(alloc.live_blocks(), 2u);
+    EXPECT_EQ(alloc.slab_count(), 1u);
+    EXPECT_EQ((uintptr_t) p1 % sizeof(void *), 0u);
+    EXPECT_EQ((uintptr_t) p2 % sizeof(void *), 0u);
+
+    RowAllocator::deallocate(p1);
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    void* p3 = RowAllocator::allocate(&alloc, 35);
+    EXPECT_EQ(p3, p1);  // same size class, recycled
+
+    RowAllocator::deallocate(p2);
+    RowAllocator::deallocate(p3);
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+    EXPECT_EQ(alloc.bytes_used(), 0u);
+    // last slab of a size class is kept around
+    EXPECT_EQ(alloc.slab_count(), 1u);
+}
+
+TEST(allocator, release_slabs) {
+    RowAllocator alloc(64 * 1024);
+    vector<void*> blocks;
+    for (int i = 0; i < 100000; i++) {
+        blocks.push_back(RowAllocator::allocate(&alloc, 24 + i % 100));
+    }
+    EXPECT_EQ(alloc.live_blocks(), 100000u);
+    EXPECT_TRUE(alloc.bytes_used() <= alloc.bytes_reserved());
+    EXPECT_TRUE(alloc.bytes_used() * 2 > alloc.bytes_reserved());
+    size_t n_slabs = alloc.slab_count();
+    EXPECT_TRUE(n_slabs > 10u);
+
+    for (auto& p : blocks) {
+        RowAllocator::deallocate(p);
+    }
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+    EXPECT_TRUE(alloc.slab_count() < n_slabs);
+    Log::debug("allocator: %d slabs before free, %d after", (int) n_slabs, (int) alloc.slab_count());
+}
+
+TEST(allocator, table_rows) {
+    RowAllocator alloc;
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("balance", Value::DOUBLE);
+    schema->add_index_by_column_names("name_idx", {"name"});
+    schema->set_allocator(&alloc);
+
+    IndexedTable* tbl = new IndexedTable(schema);
+    for (i32 i = 0; i < 1000; i++) {
+        Row* row = Row::create(schema, vector<Value>({ Value(i), Value("row " + to_string(i)), Value(1.0 * i) }));
+        tbl->insert(row);
+    }
+    // base rows only, index entries are not rows
+    EXPECT_EQ(alloc.live_blocks(), 1000u);
+
+    Row* row = tbl->query(Value(i32(7))).next()->copy();
+    EXPECT_EQ(row->schema()->allocator(), &alloc);
+    EXPECT_EQ(alloc.live_blocks(), 1001u);
+    EXPECT_EQ(row->get_column("name"), Value("row 7"));
+    row->update("name", string("a longer name for row 7"));
+    row->release();
+    EXPECT_EQ(alloc.live_blocks(), 1000u);
+
+    delete tbl;
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+    EXPECT_EQ(alloc.bytes_used(), 0u);
+    delete schema;
+}
+
+TEST(allocator, clear_in_bulk) {
+    RowAllocator alloc;
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->set_allocator(&alloc);
+
+    SortedTable* sorted = new SortedTable(schema, symbol_t::ENG_BTREE);
+    UnsortedTable* unsorted = new UnsortedTable(schema);
+    auto fill = [schema] (Table* tbl, int n) {
+        for (i32 i = 0; i < n; i++) {
+            tbl->insert(Row::create(schema, vector<Value>({ Value(i), Value("row " + to_string(i)) })));
+        }
+    };
+
+    // the only rows from the allocator: slabs go back at once, and the tables are usable again
+    for (Table* tbl : vector<Table*>({ sorted, unsorted })) {
+        fill(tbl, 10000);
+        EXPECT_EQ(alloc.live_blocks(), 10000u);
+        if (tbl == sorted) {
+            sorted->clear();
+        } else {
+            unsorted->clear();
+        }
+        EXPECT_EQ(alloc.live_blocks(), 0u);
+        EXPECT_EQ(alloc.slab_count(), 0u);
+    }
+    fill(sorted, 100);
+    EXPECT_EQ(sorted->query(Value(i32(42))).next()->get_column("name"), Value("row 42"));
+
+    // rows of the other table, or referenced from elsewhere, are released one by one
+    fill(unsorted, 100);
+    sorted->clear();
+    EXPECT_EQ(alloc.live_blocks(), 100u);
+    Row* kept = (Row *) unsorted->query(Value(i32(7))).next()->ref_copy();
+    unsorted->clear();
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    EXPECT_EQ(kept->get_column("name"), Value("row 7"));
+    kept->release();
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+
+    fill(sorted, 100);
+    delete sorted;
+    delete unsorted;
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+    EXPECT_EQ(alloc.slab_count(), 0u);
+    delete schema;
+}
@@ -1,4 +1,7 @@
+#include <atomic>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "memdb/table.h"
 #include "base/all.h"
@@ -39,6 +42,75 @@ TEST(bench, table_insert) {
     delete schema;
 }
 
+TEST(bench, table_query_unsorted) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    UnsortedTable* ut = new UnsortedTable(schema);
+    const int n_rows = 1000000;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("dummy!") };
+        ut->insert(Row::create(schema, row));
+    }
+
+    const int batch_size = 100000;
+    int n_batches = 0;
+    int n_found = 0;
+    Timer timer;
+    timer.start();
+    for (;;) {
+        for (int i = 0; i < batch_size; i++) {
+            n_found += ut->query(Value((i32) (rand() % n_rows))).count();
+        }
+        n_batches++;
+        if (timer.elapsed() > 2.0) {
+            break;
+        }
+    }
+    timer.stop();
+    report_qps("point query (UnsortedTable)", n_batches * batch_size, timer.elapsed());
+    EXPECT_EQ(n_found, n_batches * batch_size);
+
+    delete ut;
+    delete schema;
+}
+
+TEST(bench, table_insert_unsorted_latency) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    for (bool incremental : { false, true }) {
+        UnsortedTable* ut = new UnsortedTable(schema);
+        ut->set_incremental_resize(incremental);
+
+        // slowest batch shows the cost of growing the hash map
+        const int n_rows = 4000000;
+        const int batch_size = 1000;
+        double max_batch = 0.0;
+        Timer total;
+        total.start();
+        for (int i = 0; i < n_rows; i += batch_size) {
+            Timer timer;
+            timer.start();
+            for (int j = i; j < i + batch_size; j++) {
+                vector<Value> row = { Value((i32) j), Value("dummy!") };
+                ut->insert(Row::create(schema, row));
+            }
+            timer.stop();
+            max_batch = std::max(max_batch, timer.elapsed());
+        }
+        total.stop();
+        report_qps(incremental ? "inserting (UnsortedTable, incremental resize) rows" : "inserting (UnsortedTable) rows",
+                   n_rows, total.elapsed());
+        Log::info("slowest batch of %d inserts took %.2lf ms", batch_size, max_batch * 1000);
+
+        delete ut;
+    }
+    delete schema;
+}
+
 TEST(bench, table_insert_sorted) {
     Schema* schema = new Schema;
     schema->add_key_column("id", Value::I32);
@@ -69,6 +141,420 @@ TEST(bench, table_insert_sorted) {
     delete schema;
 }
 
+TEST(bench, table_query_sorted) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_ART }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree"
+                                : (engine == symbol_t::ENG_ART) ? "art" : "rbtree";
+        SortedTable* st = new SortedTable(schema, engine);
+        const int n_rows = 1000000;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) rand()), Value("dummy!") };
+            st->insert(Row::create(schema, row));
+        }
+
+        const int batch_size = 100000;
+        int n_batches = 0;
+        Timer timer;
+        timer.start();
+        for (;;) {
+            for (int i = 0; i < batch_size; i++) {
+                st->query(Value((i32) rand())).has_next();
+            }
+            n_batches++;
+            if (timer.elapsed() > 2.0) {
+                break;
+            }
+        }
+        timer.stop();
+        report_qps((string("point query (SortedTable, ") + engine_name + ")").c_str(),
+                   n_batches * batch_size, timer.elapsed());
+
+        int n_scans = 0;
+        Timer scan_timer;
+        scan_timer.start();
+        for (;;) {
+            enumerator_count(st->all());
+            n_scans++;
+            if (scan_timer.elapsed() > 2.0) {
+                break;
+            }
+        }
+        scan_timer.stop();
+        report_qps((string("full scan rows (SortedTable, ") + engine_name + ")").c_str(),
+                   n_scans * n_rows, scan_timer.elapsed());
+
+        delete st;
+    }
+    delete schema;
+}
+
+TEST(bench, table_count_sorted) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree" : "rbtree";
+        SortedTable* st = new SortedTable(schema, engine);
+        const int n_rows = 1000000;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) i), Value("dummy!") };
+            st->insert(Row::create(schema, row));
+        }
+
+        // page header: count rows after a key, then skip to a deep page
+        int n_queries = 0;
+        Timer timer;
+        timer.start();
+        for (;;) {
+            SortedTable::Cursor cur = st->query_gt(Value((i32) (rand() % n_rows)));
+            int n = cur.count();
+            cur.skip(n / 2);
+            n_queries++;
+            if (timer.elapsed() > 2.0) {
+                break;
+            }
+        }
+        timer.stop();
+        report_qps((string("count and skip (SortedTable, ") + engine_name + ")").c_str(),
+                   n_queries, timer.elapsed());
+
+        delete st;
+    }
+    delete schema;
+}
+
+TEST(bench, table_bulk_load_sorted) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    // same random batch, through insert() per row and through bulk_load()
+    const int n_rows = 1000000;
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree" : "rbtree";
+        for (bool bulk : { false, true }) {
+            vector<Row*> batch;
+            for (int i = 0; i < n_rows; i++) {
+                vector<Value> row = { Value((i32) rand()), Value("dummy!") };
+                batch.push_back(Row::create(schema, row));
+            }
+            SortedTable* st = new SortedTable(schema, engine);
+            Timer timer;
+            timer.start();
+            if (bulk) {
+                st->bulk_load(batch);
+            } else {
+                for (Row* row : batch) {
+                    st->insert(row);
+                }
+            }
+            timer.stop();
+            report_qps((string(bulk ? "bulk load" : "insert per row") + " (SortedTable, " + engine_name + ")").c_str(),
+                       n_rows, timer.elapsed());
+            delete st;
+        }
+    }
+    delete schema;
+}
+
+TEST(bench, table_multi_query) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    // batches of 200 random keys over a table far bigger than cache, query() per key against multi_query()
+    const int n_rows = 2000000;
+    const int batch_size = 200;
+    const int n_batches = 2000;
+    UnsortedTable* ut = new UnsortedTable(schema);
+    SortedTable* st = new SortedTable(schema, symbol_t::ENG_BTREE);
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("dummy!") };
+        ut->insert(Row::create(schema, row));
+        st->insert(Row::create(schema, row));
+    }
+    // every batch falls in a window of 20000 ids, like the rows of one user
+    vector<Value> ids;
+    for (int b = 0; b < n_batches; b++) {
+        int window = rand() % (n_rows - 20000);
+        for (int i = 0; i < batch_size; i++) {
+            ids.push_back(Value((i32) (window + rand() % 20000)));
+        }
+    }
+    vector<vector<MultiBlob>> batches(n_batches);
+    for (int i = 0; i < batch_size * n_batches; i++) {
+        batches[i / batch_size].push_back(ids[i].get_blob());
+    }
+
+    for (bool batched : { false, true }) {
+        const char* how = batched ? "multi_query" : "query per key";
+        int n_found = 0;
+        Timer timer;
+        timer.start();
+        for (auto& keys : batches) {
+            if (batched) {
+                for (auto& cur : ut->multi_query(keys)) {
+                    n_found += cur.count();
+                }
+            } else {
+                for (auto& key : keys) {
+                    n_found += ut->query(key).count();
+                }
+            }
+        }
+        timer.stop();
+        EXPECT_EQ(n_found, batch_size * n_batches);
+        report_qps((string(how) + " (UnsortedTable)").c_str(), batch_size * n_batches, timer.elapsed());
+
+        n_found = 0;
+        timer.reset();
+        timer.start();
+        for (auto& keys : batches) {
+            if (batched) {
+                for (auto& cur : st->multi_query(keys)) {
+                    n_found += cur.has_next() ? 1 : 0;
+                }
+            } else {
+                for (auto& key : keys) {
+                    n_found += st->query(key).has_next() ? 1 : 0;
+                }
+            }
+        }
+        timer.stop();
+        EXPECT_EQ(n_found, batch_size * n_batches);
+        report_qps((string(how) + " (SortedTable, btree)").c_str(), batch_size * n_batches, timer.elapsed());
+    }
+    delete ut;
+    delete st;
+    delete schema;
+}
+
+TEST(bench, indexed_table_update) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("status", Value::I32);
+    schema->add_index("i_name", {1});
+    schema->add_index("i_status", {2});
+
+    const int n_rows = 1000000;
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree" : "rbtree";
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) i), Value("name_" + to_string(i)), Value((i32) 0) };
+            rows.push_back(Row::create(schema, row));
+        }
+        idxtbl->bulk_load(rows);
+
+        // only i_status covers the column, the base rows and i_name stay untouched
+        Timer timer;
+        timer.start();
+        for (int i = 0; i < n_rows; i++) {
+            rows[rand() % n_rows]->update(2, Value((i32) (i % 4 + 1)));
+        }
+        timer.stop();
+        report_qps((string("updating secondary indexed column (IndexedTable, ") + engine_name + ")").c_str(),
+                   n_rows, timer.elapsed());
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(bench, indexed_table_hash_query) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("email", Value::STR);
+    schema->add_column("ext", Value::I64);
+    schema->add_index("i_ext", {2});
+    schema->add_hash_index("h_ext", {2}, true);
+
+    const int n_rows = 1000000;
+    IndexedTable* idxtbl = new IndexedTable(schema);
+    vector<Row*> rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("user" + to_string(i) + "@example.com"), Value((i64) i * 7919) };
+        rows.push_back(Row::create(schema, row));
+    }
+    idxtbl->bulk_load(rows);
+
+    // same equality lookups, through the rbtree index and through the hash index
+    for (auto idx_name : { "i_ext", "h_ext" }) {
+        Index idx = idxtbl->get_index(idx_name);
+        int n_found = 0;
+        Timer timer;
+        timer.start();
+        for (int i = 0; i < n_rows; i++) {
+            Index::Cursor cur = idx.query(Value((i64) (rand() % n_rows) * 7919));
+            n_found += cur.has_next() ? 1 : 0;
+        }
+        timer.stop();
+        EXPECT_EQ(n_found, n_rows);
+        report_qps((string("querying ") + (idx.hashed() ? "hash" : "sorted") + " index (IndexedTable)").c_str(),
+                   n_rows, timer.elapsed());
+    }
+    delete idxtbl;
+    delete schema;
+}
+
+TEST(bench, indexed_table_covering_scan) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("region", Value::I32);
+    schema->add_column("amount", Value::DOUBLE);
+    schema->add_column("payload", Value::STR);
+    schema->add_index("i_region", {1});
+    schema->add_index("i_region_amount", {1}, {2});
+
+    const int n_rows = 1000000;
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree" : "rbtree";
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) i), Value((i32) (rand() % 1000)), Value(i * 0.5),
+                                  Value(string(100, 'x')) };
+            rows.push_back(Row::create(schema, row));
+        }
+        idxtbl->bulk_load(rows);
+
+        // sum amount per region over the whole index, from base rows and from covering entries
+        double expected = 0.0;
+        {
+            Timer timer;
+            timer.start();
+            Index::Cursor cur = idxtbl->get_index("i_region").all();
+            while (cur) {
+                expected += cur.next()->get_double(2);
+            }
+            timer.stop();
+            report_qps((string("scanning index, reading base rows (") + engine_name + ")").c_str(),
+                       n_rows, timer.elapsed());
+        }
+        {
+            double sum = 0.0;
+            vector<Value> values;
+            Timer timer;
+            timer.start();
+            Index::Cursor cur = idxtbl->get_index("i_region_amount").all();
+            while (cur) {
+                cur.next_values(&values);
+                sum += values[2].get_double();
+            }
+            timer.stop();
+            EXPECT_EQ(sum, expected);
+            report_qps((string("scanning covering index, index-only (") + engine_name + ")").c_str(),
+                       n_rows, timer.elapsed());
+        }
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(bench, indexed_table_create_index) {
+    const int n_rows = 1000000;
+    vector<IndexedSchema*> schemas;
+    for (int i = 0; i < 2; i++) {
+        IndexedSchema* schema = new IndexedSchema;
+        schema->add_key_column("id", Value::I32);
+        schema->add_column("email", Value::STR);
+        schema->add_column("ext", Value::I64);
+        schema->add_index("i_email", {1});
+        schemas.push_back(schema);
+    }
+    // the index declared up front on the second schema, where the table is rebuilt
+    schemas[1]->add_index("i_ext", {2});
+
+    IndexedTable* idxtbl = new IndexedTable(schemas[0]);
+    vector<Row*> rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("user" + to_string(i) + "@example.com"), Value((i64) rand()) };
+        rows.push_back(Row::create(schemas[0], row));
+    }
+    idxtbl->bulk_load(rows);
+
+    Timer timer;
+    timer.start();
+    IndexedTable* rebuilt = new IndexedTable(schemas[1]);
+    Index::Cursor cur = idxtbl->get_index("i_email").all();
+    while (cur) {
+        const Row* row = cur.next();
+        vector<Value> values = { row->get_column(0), row->get_column(1), row->get_column(2) };
+        rebuilt->insert(Row::create(schemas[1], values));
+    }
+    timer.stop();
+    report_qps("adding index i_ext, rebuilding the table (IndexedTable)", n_rows, timer.elapsed());
+    delete rebuilt;
+
+    timer.reset();
+    timer.start();
+    idxtbl->create_index("i_ext", {2});
+    timer.stop();
+    EXPECT_EQ(idxtbl->get_index("i_ext").all().count(), n_rows);
+    report_qps("adding index i_ext, create_index() (IndexedTable)", n_rows, timer.elapsed());
+
+    delete idxtbl;
+    for (auto& schema : schemas) {
+        delete schema;
+    }
+}
+
+TEST(bench, table_concurrent_sorted) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    // 4 threads doing 1 insert for every 4 point queries, skiplist against a latched B+tree
+    const int n_threads = 4;
+    const int n_ops = 250000;
+    for (auto engine : { symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST }) {
+        const char* engine_name = (engine == symbol_t::ENG_BTREE) ? "btree + mutex" : "skiplist";
+        bool latched = (engine != symbol_t::ENG_SKIPLIST);
+        SortedTable* st = new SortedTable(schema, engine);
+        Mutex latch;
+
+        Timer timer;
+        timer.start();
+        vector<std::thread> threads;
+        for (int t = 0; t < n_threads; t++) {
+            threads.push_back(std::thread([=, &latch] {
+                for (int i = 0; i < n_ops; i++) {
+                    if (i % 5 == 0) {
+                        vector<Value> row = { Value((i32) rand()), Value("dummy!") };
+                        Row* r = Row::create(schema, row);
+                        if (latched) {
+                            ScopedLock sl(latch);
+                            st->insert(r);
+                        } else {
+                            st->insert(r);
+                        }
+                    } else if (latched) {
+                        ScopedLock sl(latch);
+                        st->query(Value((i32) rand())).has_next();
+                    } else {
+                        st->query(Value((i32) rand())).has_next();
+                    }
+                }
+            }));
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+        timer.stop();
+        report_qps((string("mixed ops, 4 threads (SortedTable, ") + engine_name + ")").c_str(),
+                   n_threads * n_ops, timer.elapsed());
+
+        delete st;
+    }
+    delete schema;
+}
+
 TEST(bench, table_insert_snapshot) {
     Schema* schema = new Schema;
     schema->add_key_column("id", Value::I32);
@@ -99,6 +585,231 @@ TEST(bench, table_insert_snapshot) {
     delete schema;
 }
 
+TEST(bench, table_snapshot_release) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    for (bool incremental : { false, true }) {
+        SnapshotTable* st = new SnapshotTable(schema);
+        const int n_rows = 2000000;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) i), Value("dummy!") };
+            st->insert(Row::create(schema, row));
+        }
+        SnapshotTable* snap = st->snapshot();
+        for (int i = 0; i < n_rows; i += 2) {
+            st->remove(Value((i32) i));
+        }
+
+        Timer timer;
+        timer.start();
+        delete snap;
+        timer.stop();
+        Log::info("releasing a snapshot with %d removed rows took %.2lf ms", n_rows / 2, timer.elapsed() * 1000);
+
+        // all the garbage at once, as a release used to, or in steps
+        size_t budget = incremental ? 4096 : (size_t) -1;
+        double max_step = 0.0;
+        size_t n_dropped = 0;
+        Timer total;
+        total.start();
+        for (;;) {
+            timer.reset();
+            timer.start();
+            size_t dropped = st->gc_step(budget);
+            timer.stop();
+            if (dropped == 0) {
+                break;
+            }
+            n_dropped += dropped;
+            max_step = std::max(max_step, timer.elapsed());
+        }
+        total.stop();
+        report_qps(incremental ? "collecting (SnapshotTable, gc_step) versions" : "collecting (SnapshotTable, full gc) versions",
+                   n_dropped, total.elapsed());
+        Log::info("longest gc pause took %.2lf ms", max_step * 1000);
+
+        delete st;
+    }
+    delete schema;
+}
+
+TEST(bench, table_snapshot_hot_keys) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    SnapshotTable* st = new SnapshotTable(schema);
+    const int n_rows = 1000;
+    vector<Row*> rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("dummy!") };
+        rows.push_back(Row::create(schema, row));
+        st->insert(rows.back());
+    }
+    // the snapshot keeps every old version of the updated keys
+    SnapshotTable* snap = st->snapshot();
+    const int n_hot = 10;
+    const int n_updates = 2000;
+    for (int u = 0; u < n_updates; u++) {
+        for (int i = 0; i < n_hot; i++) {
+            vector<Value> row = { Value((i32) i), Value("update " + to_string(u)) };
+            Row* r = Row::create(schema, row);
+            st->remove(rows[i]);
+            st->insert(r);
+            rows[i] = r;
+        }
+    }
+
+    const int n_queries = 100000;
+    Timer timer;
+    timer.start();
+    int found = 0;
+    for (int i = 0; i < n_queries; i++) {
+        found += st->query(Value((i32) (i % n_hot))).count();
+    }
+    timer.stop();
+    EXPECT_EQ(found, n_queries);
+    report_qps("querying hot keys (SnapshotTable)", n_queries, timer.elapsed());
+
+    timer.reset();
+    timer.start();
+    int n_scanned = 0;
+    for (int i = 0; i < 100; i++) {
+        n_scanned += st->all().count();
+    }
+    timer.stop();
+    EXPECT_EQ(n_scanned, 100 * n_rows);
+    report_qps("scanning with hot keys (SnapshotTable) rows", n_scanned, timer.elapsed());
+
+    delete snap;
+    delete st;
+    delete schema;
+}
+
+TEST(bench, table_snapshot_short_lived) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    // a long running snapshot keeps every dead version, while short lived ones come and go with a
+    // few updates and a range scan each, versioned map against copy-on-write B+tree
+    const int n_rows = 10000;
+    const int n_snapshots = 20000;
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        const char* engine_name = (engine == symbol_t::ENG_RBTREE) ? "versioned rbtree" : "cow btree";
+        SnapshotTable* st = new SnapshotTable(schema, engine);
+        vector<Row*> rows;
+        for (int i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value((i32) i), Value("dummy!") };
+            rows.push_back(Row::create(schema, row));
+            st->insert(rows.back());
+        }
+        SnapshotTable* long_running = st->snapshot();
+
+        Timer timer;
+        timer.start();
+        int n_scanned = 0;
+        for (int s = 0; s < n_snapshots; s++) {
+            SnapshotTable* snap = st->snapshot();
+            for (int u = 0; u < 5; u++) {
+                int i = rand() % n_rows;
+                vector<Value> row = { Value((i32) i), Value("update " + to_string(s)) };
+                Row* r = Row::create(schema, row);
+                st->remove(rows[i]);
+                st->insert(r);
+                rows[i] = r;
+            }
+            i32 low = rand() % (n_rows - 100);
+            for (auto cur = snap->query_in(Value(low), Value((i32) (low + 101))); cur.has_next(); cur.next()) {
+                n_scanned++;
+            }
+            delete snap;
+        }
+        timer.stop();
+        EXPECT_EQ(n_scanned, 100 * n_snapshots);
+        report_qps((string("short lived snapshots (SnapshotTable, ") + engine_name + ")").c_str(),
+                   n_snapshots, timer.elapsed());
+
+        timer.reset();
+        timer.start();
+        n_scanned = 0;
+        for (int i = 0; i < 100; i++) {
+            for (auto cur = long_running->all(); cur.has_next(); cur.next()) {
+                n_scanned++;
+            }
+            for (auto cur = st->all(); cur.has_next(); cur.next()) {
+                n_scanned++;
+            }
+        }
+        timer.stop();
+        EXPECT_EQ(n_scanned, 200 * n_rows);
+        report_qps((string("scanning with dead versions (SnapshotTable, ") + engine_name + ") rows").c_str(),
+                   n_scanned, timer.elapsed());
+
+        delete long_running;
+        delete st;
+    }
+    delete schema;
+}
+
+TEST(bench, table_snapshot_concurrent_scan) {
+    Schema* schema = new Schema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+
+    SnapshotTable* st = new SnapshotTable(schema);
+    st->set_concurrent(true);
+    const int n_rows = 100000;
+    vector<Row*> rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value((i32) i), Value("dummy!") };
+        rows.push_back(Row::create(schema, row));
+        st->insert(rows.back());
+    }
+
+    // 3 readers scanning their own snapshot over and over, while the writer keeps updating rows
+    const int n_readers = 3;
+    std::atomic<bool> done(false);
+    std::atomic<long> n_scanned(0);
+    vector<std::thread> readers;
+    for (int t = 0; t < n_readers; t++) {
+        SnapshotTable* snap = st->snapshot();
+        readers.push_back(std::thread([snap, &done, &n_scanned] {
+            while (!done) {
+                n_scanned += snap->all().count();
+            }
+            delete snap;
+        }));
+    }
+
+    Timer timer;
+    timer.start();
+    int n_updates = 0;
+    while (timer.elapsed() < 2.0) {
+        for (int i = 0; i < 10000; i++) {
+            int k = (n_updates + i) % n_rows;
+            vector<Value> row = { Value((i32) k), Value("update") };
+            Row* r = Row::create(schema, row);
+            st->remove(rows[k]);
+            st->insert(r);
+            rows[k] = r;
+        }
+        n_updates += 10000;
+    }
+    done = true;
+    for (auto& th : readers) {
+        th.join();
+    }
+    timer.stop();
+    report_qps("updating with 3 concurrent snapshot readers (SnapshotTable) rows", n_updates, timer.elapsed());
+    report_qps("scanning snapshots from 3 threads (SnapshotTable) rows", n_scanned.load(), timer.elapsed());
+
+    delete st;
+    delete schema;
+}
+
 TEST(bench, stringhash32) {
     string str = "hello, world";
     const int batch_size = 100000;
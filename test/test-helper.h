@@ -36,6 +36,7 @@ bool rows_are_sorted(EnumeratorOfRows rows, mdb::symbol_t order = mdb::symbol_t:
                 return false;
             }
         }
+        last = new_one;
     }
     return true;
 }
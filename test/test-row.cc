@@ -1,5 +1,6 @@
 #include "memdb/schema.h"
 #include "memdb/row.h"
+#include "memdb/allocator.h"
 #include "base/all.h"
 
 using namespace base;
@@ -183,6 +184,65 @@ TEST(row, make_sparse) {
 }
 
 
+TEST(row, contiguous_layout) {
+    Schema schema;
+    schema.add_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+    schema.add_column("score", Value::DOUBLE);
+    schema.add_column("email", Value::STR);
+
+    vector<Value> row1 = { Value(1), Value("alice"), Value(4.5), Value("alice@example.com") };
+    Row* r1 = Row::create(&schema, row1);
+    Row* r2 = VersionedRow::create(&schema, row1);
+    Row* r3 = FineLockedRow::create(&schema, row1);
+    for (Row* r : {r1, r2, r3}) {
+        // all column data should sit right behind the Row object, in the same block
+        const char* block_begin = (const char *) r;
+        const char* block_end = block_begin + 512;
+        for (auto& col : schema) {
+            blob b = r->get_blob(col.id);
+            EXPECT_TRUE(b.data > block_begin && b.data + b.len <= block_end);
+        }
+        EXPECT_EQ(r->get_column("name").get_str(), "alice");
+        EXPECT_EQ(r->get_column("email").get_str(), "alice@example.com");
+        EXPECT_EQ(r->get_column("score").get_double(), 4.5);
+
+        r->make_sparse();
+        Row* r_copy = r->copy();
+        EXPECT_EQ(r_copy->rtti(), r->rtti());
+        blob b = r_copy->get_blob("email");
+        EXPECT_TRUE(b.data > (const char *) r_copy && b.data < (const char *) r_copy + 512);
+        EXPECT_EQ(r_copy->get_column("email").get_str(), "alice@example.com");
+        r_copy->release();
+        r->release();
+    }
+}
+
+TEST(row, typed_accessors) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+    schema.add_column("balance", Value::I64);
+    schema.add_column("score", Value::DOUBLE);
+
+    vector<Value> row1 = { Value(7), Value("alice"), Value(i64(1) << 40), Value(4.5) };
+    for (Row* r : { Row::create(&schema, row1), (Row *) VersionedRow::create(&schema, row1) }) {
+        EXPECT_EQ(r->get_i32(0), 7);
+        EXPECT_EQ(r->get_i64("balance"), i64(1) << 40);
+        EXPECT_EQ(r->get_double("score"), 4.5);
+        blob b = r->get_str_view("name");
+        EXPECT_EQ(string(b.data, b.len), "alice");
+
+        r->update("name", string("alice the great"));
+        r->update("balance", i64(-3));
+        b = r->get_str_view(1);
+        EXPECT_EQ(string(b.data, b.len), "alice the great");
+        EXPECT_EQ(r->get_i64(2), -3);
+        EXPECT_EQ(r->get_i32("id"), r->get_column("id").get_i32());
+        r->release();
+    }
+}
+
 TEST(row, update) {
     Schema* schema = new Schema;
     schema->add_key_column("id", Value::I32);
@@ -220,6 +280,75 @@ TEST(row, update_string_same_size) {
     delete schema;
 }
 
+TEST(row, update_string_stays_dense) {
+    RowAllocator alloc;
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+    schema.add_column("status", Value::STR);
+    schema.add_column("note", Value::STR);
+    schema.set_allocator(&alloc);
+
+    vector<Value> row1 = { Value(1), Value("alice"), Value("new"), Value("") };
+    Row* r1 = Row::create(&schema, row1);
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+
+    // shrinking fits in the row block
+    r1->update("status", string("ok"));
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    EXPECT_EQ(r1->get_column("name").get_str(), "alice");
+    EXPECT_EQ(r1->get_column("status").get_str(), "ok");
+    EXPECT_EQ(r1->get_column("note").get_str(), "");
+
+    // growing moves var part out of the row block once, then the slack absorbs small changes
+    r1->update("status", string("processing"));
+    EXPECT_EQ(alloc.live_blocks(), 2u);
+    r1->update("status", string("done"));
+    r1->update("name", string("alice b"));
+    r1->update("note", string("n"));
+    EXPECT_EQ(alloc.live_blocks(), 2u);
+    EXPECT_EQ(r1->get_column("name").get_str(), "alice b");
+    EXPECT_EQ(r1->get_column("status").get_str(), "done");
+    EXPECT_EQ(r1->get_column("note").get_str(), "n");
+
+    for (int i = 0; i < 100; i++) {
+        string s = string(i % 37, 'a' + i % 26);
+        r1->update(1 + i % 3, s);
+        EXPECT_EQ(r1->get_column(1 + i % 3).get_str(), s);
+    }
+    EXPECT_EQ(alloc.live_blocks(), 2u);
+
+    // shrunk back, re-compacting moves it into the row block again
+    r1->update("name", string("al"));
+    r1->update("status", string("x"));
+    r1->update("note", string(""));
+    r1->make_dense();
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    blob b = r1->get_blob("status");
+    EXPECT_TRUE(b.data > (const char *) r1 && b.data < (const char *) r1 + 256);
+    EXPECT_EQ(r1->get_column("name").get_str(), "al");
+    EXPECT_EQ(r1->get_column("status").get_str(), "x");
+    EXPECT_EQ(r1->get_column("note").get_str(), "");
+
+    // sparse rows can be made dense again
+    r1->make_sparse();
+    r1->update("note", string("a much longer note"));
+    r1->make_dense();
+    EXPECT_EQ(alloc.live_blocks(), 2u);
+    EXPECT_EQ(r1->get_column("name").get_str(), "al");
+    EXPECT_EQ(r1->get_column("status").get_str(), "x");
+    EXPECT_EQ(r1->get_column("note").get_str(), "a much longer note");
+    r1->update("note", string("short"));
+    r1->make_sparse();
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    r1->make_dense();
+    EXPECT_EQ(alloc.live_blocks(), 1u);
+    EXPECT_EQ(r1->get_column("note").get_str(), "short");
+
+    r1->release();
+    EXPECT_EQ(alloc.live_blocks(), 0u);
+}
+
 TEST(row, update_string_key_column) {
     Schema* schema = new Schema;
     schema->add_column("id", Value::I32);
@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "memdb/schema.h"
+#include "memdb/sharded.h"
+#include "memdb/txn.h"
+#include "base/all.h"
+
+#include "test-helper.h"
+
+using namespace base;
+using namespace mdb;
+using namespace std;
+
+template <class CursorType>
+static vector<i64> collect_seq(CursorType cur) {
+    vector<i64> seq;
+    while (cur.has_next()) {
+        seq.push_back(cur.next()->get_column("seq").get_i64());
+    }
+    return seq;
+}
+
+// same rows in a plain SortedTable and a ShardedTable, checked with random queries
+static bool same_as_sorted(ShardedTable* sharded, const Schema* schema, int key_range) {
+    SortedTable sorted(schema);
+    for (i64 seq = 0; seq < 5000; seq++) {
+        vector<Value> row = { Value(i32(rand() % key_range)), Value(seq) };
+        sorted.insert(Row::create(schema, row));
+        sharded->insert(Row::create(schema, row));
+    }
+    for (int i = 0; i < 500; i++) {
+        Value key = Value(i32(rand() % key_range));
+        sorted.remove(key);
+        sharded->remove(key);
+    }
+
+    bool same = (sorted.size() == sharded->size());
+    same = same && collect_seq(sorted.all()) == collect_seq(sharded->all());
+    same = same && collect_seq(sorted.all(symbol_t::ORD_DESC)) == collect_seq(sharded->all(symbol_t::ORD_DESC));
+    vector<i64> any_order = collect_seq(sharded->all(symbol_t::ORD_ANY));
+    std::sort(any_order.begin(), any_order.end());
+    vector<i64> all_seq = collect_seq(sorted.all());
+    std::sort(all_seq.begin(), all_seq.end());
+    same = same && any_order == all_seq;
+
+    for (int i = 0; i < 200; i++) {
+        Value key = Value(i32(rand() % key_range));
+        symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+        same = same && collect_seq(sorted.query(key)) == collect_seq(sharded->query(key));
+        same = same && collect_seq(sorted.query_lt(key, order)) == collect_seq(sharded->query_lt(key, order));
+        same = same && collect_seq(sorted.query_gt(key, order)) == collect_seq(sharded->query_gt(key, order));
+        Value high = Value(i32(key.get_i32() + 1 + rand() % (key_range / 4)));
+        same = same && collect_seq(sorted.query_in(key, high, order))
+                    == collect_seq(sharded->query_in(key, high, order));
+        same = same && sorted.query(key).count() == sharded->query(key).count();
+        same = same && sorted.query_lt(key, order).count() == sharded->query_lt(key, order).count();
+        same = same && sorted.query_gt(key, order).count() == sharded->query_gt(key, order).count();
+        same = same && sorted.query_in(key, high, order).count() == sharded->query_in(key, high, order).count();
+    }
+
+    // count() covers the whole range, even once batches have been copied
+    ShardedTable::Cursor cur = sharded->all(symbol_t::ORD_DESC);
+    for (int i = 0; i < 200 && cur.has_next(); i++) {
+        cur.next();
+    }
+    same = same && cur.count() == (int) sorted.size();
+    return same;
+}
+
+TEST(sharded, hash_partitioned) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    ShardedTable sharded(&schema, 8, symbol_t::ENG_BTREE);
+    EXPECT_EQ(sharded.n_shards(), 8);
+    EXPECT_FALSE(sharded.range_partitioned());
+    // 100 rows per key on average, longer than a cursor batch
+    EXPECT_TRUE(same_as_sorted(&sharded, &schema, 50));
+    sharded.clear();
+    EXPECT_EQ(sharded.size(), 0u);
+    EXPECT_TRUE(same_as_sorted(&sharded, &schema, 100000));
+}
+
+TEST(sharded, range_partitioned) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    vector<Value> split_vals = { Value(i32(10)), Value(i32(20)), Value(i32(35)) };
+    vector<MultiBlob> split;
+    for (auto& v : split_vals) {
+        split.push_back(v.get_blob());
+    }
+    ShardedTable sharded(&schema, split);
+    EXPECT_EQ(sharded.n_shards(), 4);
+    EXPECT_TRUE(sharded.range_partitioned());
+    EXPECT_TRUE(same_as_sorted(&sharded, &schema, 50));
+}
+
+TEST(sharded, update_key) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    ShardedTable sharded(&schema, 4);
+    for (i32 i = 0; i < 100; i++) {
+        vector<Value> row = { Value(i), Value(i64(i)) };
+        sharded.insert(Row::create(&schema, row));
+    }
+    ShardedTable::Cursor cur = sharded.query(Value(i32(7)));
+    Row* row = cur.next();
+    EXPECT_EQ(row->get_table(), &sharded);
+
+    // most likely moves the row to another shard
+    row->update(0, Value(i32(1007)));
+    EXPECT_EQ(row->get_table(), &sharded);
+    EXPECT_FALSE(sharded.query(Value(i32(7))).has_next());
+    EXPECT_EQ(sharded.query(Value(i32(1007))).next(), row);
+    EXPECT_EQ(sharded.size(), 100u);
+
+    sharded.remove(row);
+    EXPECT_EQ(sharded.size(), 99u);
+}
+
+TEST(sharded, rows_outlive_remove) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    ShardedTable sharded(&schema, 4);
+    for (i32 i = 0; i < 1000; i++) {
+        vector<Value> row = { Value(i), Value(i64(i)) };
+        sharded.insert(Row::create(&schema, row));
+    }
+    ShardedTable::Cursor cur = sharded.all();
+    for (i64 i = 0; i < 10; i++) {
+        EXPECT_EQ(cur.next()->get_column("seq").get_i64(), i);
+    }
+    Row* row = cur.next();
+    // cursor still holds the row, and its batch
+    for (i32 i = 0; i < 500; i++) {
+        sharded.remove(Value(i));
+    }
+    EXPECT_EQ(row->get_column("seq").get_i64(), 10);
+    int n_left = 0;
+    while (cur) {
+        cur.next();
+        n_left++;
+    }
+    // rest of the batch already copied from each shard, then rows not removed
+    EXPECT_TRUE(n_left >= 500 && n_left < 500 + 4 * 64);
+}
+
+// keys copied out while walking, rows before the last one may be gone already
+static bool keys_are_sorted(ShardedTable::Cursor cur) {
+    i32 last = std::numeric_limits<i32>::min();
+    while (cur) {
+        i32 key = cur.next()->get_i32(0);
+        if (key < last) {
+            return false;
+        }
+        last = key;
+    }
+    return true;
+}
+
+TEST(sharded, concurrent) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    ShardedTable sharded(&schema, 16, symbol_t::ENG_BTREE);
+    const int n_threads = 4;
+    const int n_rows = 20000;
+    vector<int> sorted_scans(n_threads, 0);
+    vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.push_back(std::thread([&sharded, &schema, &sorted_scans, t] {
+            for (i32 i = t; i < n_rows; i += n_threads) {
+                vector<Value> row = { Value(i), Value(i64(i)) };
+                sharded.insert(Row::create(&schema, row));
+                if (i % 100 == t) {
+                    verify(sharded.query(Value(i)).has_next());
+                }
+                if (i % 5000 == t) {
+                    sorted_scans[t] += keys_are_sorted(sharded.all()) ? 1 : 0;
+                }
+            }
+            // remove every other row
+            for (i32 i = t; i < n_rows; i += 2 * n_threads) {
+                sharded.remove(Value(i));
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    for (int t = 0; t < n_threads; t++) {
+        EXPECT_EQ(sorted_scans[t], n_rows / 5000);
+    }
+    EXPECT_EQ(sharded.size(), size_t(n_rows / 2));
+    EXPECT_TRUE(keys_are_sorted(sharded.all()));
+}
+
+TEST(sharded, txn_query) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    ShardedTable* sharded = new ShardedTable(&schema, 4);
+    for (i32 i = 0; i < 100; i++) {
+        vector<Value> row = { Value(i), Value(i64(i)) };
+        sharded->insert(Row::create(&schema, row));
+    }
+
+    TxnMgrUnsafe mgr;
+    mgr.reg_table("sharded", sharded);
+    EXPECT_EQ(mgr.get_sharded_table("sharded"), sharded);
+    Txn* txn = mgr.start(1);
+    ResultSet rs = txn->query_in(sharded, Value(i32(10)), Value(i32(20)), symbol_t::ORD_DESC);
+    EXPECT_EQ(rs.next()->get_i32(0), 19);
+    int n = 1;
+    while (rs) {
+        rs.next();
+        n++;
+    }
+    EXPECT_EQ(n, 9);
+    EXPECT_EQ(enumerator_count(txn->query(sharded, Value(i32(42)))), 1);
+    txn->commit_or_abort();
+    delete txn;
+
+    delete sharded;
+}
@@ -1,4 +1,6 @@
+#include <atomic>
 #include <string>
+#include <thread>
 
 #include "base/all.h"
 #include "memdb/snapshot.h"
@@ -433,6 +435,164 @@ TEST(snapshot, remove_writer_gc) {
     EXPECT_EQ(snap.all().count(), 1);
 }
 
+TEST(snapshot, incremental_gc) {
+    snapshot_sortedmap<int, string> ss;
+    for (int i = 0; i < 10000; i++) {
+        ss.insert(i, to_string(i));
+    }
+    snapshot_sortedmap<int, string>* snap = new snapshot_sortedmap<int, string>(ss.snapshot());
+    for (int i = 0; i < 5000; i++) {
+        ss.erase(i);
+    }
+    // still seen by snap, writes cannot drop anything
+    EXPECT_EQ(ss.gc_size(), 10000u);
+    EXPECT_EQ(ss.all().count(), 5000);
+    EXPECT_EQ(snap->all().count(), 10000);
+    {
+        // open ranges hold gc off
+        auto range = ss.all();
+        delete snap;
+        EXPECT_EQ(ss.gc_step(10), 0u);
+        EXPECT_EQ(ss.gc_size(), 10000u);
+        EXPECT_EQ(range.next().first, 5000);
+    }
+    // releasing the range's snapshot, writes and explicit steps all drop a bounded number of versions
+    EXPECT_EQ(ss.gc_size(), 10000u - ss.GC_STEP_ON_RELEASE);
+    EXPECT_EQ(ss.gc_step(10), 10u);
+    EXPECT_EQ(ss.gc_size(), 10000u - ss.GC_STEP_ON_RELEASE - 10);
+    ss.insert(10000, "10000");
+    EXPECT_EQ(ss.gc_size(), 10000u - ss.GC_STEP_ON_RELEASE - 10 - ss.GC_STEP_PER_WRITE + 1);
+    ss.gc_run();
+    EXPECT_EQ(ss.gc_size(), 5001u);
+    EXPECT_EQ(ss.gc_step(10), 0u);
+    EXPECT_EQ(ss.all().count(), 5001);
+}
+
+TEST(snapshot, version_chains) {
+    snapshot_sortedmap<int, string> ss;
+    ss.insert(1, "v0");
+    ss.insert(2, "a");
+    ss.insert(2, "b");
+    {
+        auto snap = ss.snapshot();
+        // a hot key, with a long chain of removed versions
+        for (int i = 1; i <= 1000; i++) {
+            ss.erase(1);
+            ss.insert(1, "v" + to_string(i));
+        }
+        ss.erase(2, string("a"));
+        EXPECT_EQ(ss.gc_size(), 1003u);
+
+        auto range = ss.query(1);
+        EXPECT_EQ(range.count(), 1);
+        EXPECT_EQ(range.next().second, "v1000");
+        range = snap.query(1);
+        EXPECT_EQ(range.count(), 1);
+        EXPECT_EQ(range.next().second, "v0");
+
+        EXPECT_EQ(ss.query(2).count(), 1);
+        EXPECT_EQ(ss.query(2).next().second, "b");
+        EXPECT_EQ(snap.query(2).count(), 2);
+        EXPECT_EQ(ss.all().count(), 2);
+        EXPECT_EQ(snap.all().count(), 3);
+        EXPECT_EQ(snap.reverse_all().count(), 3);
+    }
+    ss.insert(3, "c");
+    ss.gc_run();
+    EXPECT_EQ(ss.gc_size(), 3u);
+    EXPECT_EQ(ss.all().count(), 3);
+    EXPECT_EQ(ss.query(1).next().second, "v1000");
+}
+
+TEST(snapshot, equal_keys_in_insertion_order) {
+    snapshot_sortedmap<int, string> ss;
+    ss.insert(1, "a");
+    ss.insert(1, "b");
+    ss.insert(1, "c");
+    auto snap = ss.snapshot();
+    ss.erase(1, string("a"));
+    ss.insert(1, "d");
+
+    // removed versions go back in place among the live ones
+    auto values = [] (snapshot_sortedmap<int, string>::range_type r) {
+        string s;
+        while (r.has_next()) {
+            s += r.next().second;
+        }
+        return s;
+    };
+    auto reverse_values = [] (snapshot_sortedmap<int, string>::reverse_range_type r) {
+        string s;
+        while (r.has_next()) {
+            s += r.next().second;
+        }
+        return s;
+    };
+    EXPECT_EQ(values(snap.all()), "abc");
+    EXPECT_EQ(reverse_values(snap.reverse_all()), "cba");
+    EXPECT_EQ(values(ss.query(1)), "bcd");
+    EXPECT_EQ(reverse_values(ss.reverse_all()), "dcb");
+
+    // the first match is the first one scans return
+    ss.erase(1, true);
+    EXPECT_EQ(values(ss.all()), "cd");
+    EXPECT_EQ(values(snap.all()), "abc");
+}
+
+TEST(snapshot, concurrent_readers) {
+    const int n = 10000;
+    snapshot_sortedmap<int, string> ss;
+    ss.set_concurrent(true);
+    for (int i = 0; i < n; i++) {
+        ss.insert(i, to_string(i));
+    }
+
+    // readers scan their snapshot, and release it, while the writer keeps updating every key
+    const int n_readers = 4;
+    vector<snapshot_sortedmap<int, string>*> snaps;
+    for (int r = 0; r < n_readers; r++) {
+        snaps.push_back(new snapshot_sortedmap<int, string>(ss.snapshot()));
+    }
+    std::atomic<int> failures(0);
+    vector<std::thread> threads;
+    for (int r = 0; r < n_readers; r++) {
+        threads.push_back(std::thread([&snaps, &failures, r] {
+            for (int round = 0; round < 20; round++) {
+                int count = 0;
+                int last = -1;
+                auto range = (round % 2 == 0) ? snaps[r]->all() : snaps[r]->query_gt(-1);
+                while (range) {
+                    auto kv_pair = range.next();
+                    if (kv_pair.first <= last || kv_pair.second != to_string(kv_pair.first)) {
+                        failures++;
+                    }
+                    last = kv_pair.first;
+                    count++;
+                }
+                if (count != n || snaps[r]->query(r).count() != 1) {
+                    failures++;
+                }
+            }
+            delete snaps[r];
+        }));
+    }
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < n; i++) {
+            ss.erase(i);
+            ss.insert(i, "round " + to_string(round));
+        }
+        auto snap = ss.snapshot();
+        EXPECT_EQ(snap.query(0).next().second, "round " + to_string(round));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(failures, 0);
+    EXPECT_EQ(ss.snapshot_count(), 1u);
+    ss.gc_run();
+    EXPECT_EQ(ss.gc_size(), (size_t) n);
+}
+
 TEST(snapshot, benchmark) {
     multimap<int, string> baseline;
     snapshot_sortedmap<int, string> ssmap;
@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <vector>
 #include <sstream>
+#include <thread>
 
 #include "memdb/schema.h"
 #include "memdb/table.h"
@@ -131,6 +135,221 @@ TEST(table, compound_key) {
     delete schema;
 }
 
+TEST(table, unsorted_table_flat_hash) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    UnsortedTable* ut = new UnsortedTable(&schema);
+    EXPECT_FALSE(ut->all().has_next());
+    EXPECT_EQ(ut->query(Value(i32(1))).count(), 0);
+
+    // reference counts of rows per key
+    map<i32, int> expected;
+    vector<Row*> rows;
+    const int n_rows = 50000;
+    for (int i = 0; i < n_rows; i++) {
+        i32 id = rand() % 20000;
+        vector<Value> row = { Value(id), Value(i64(i)) };
+        rows.push_back(Row::create(&schema, row));
+        ut->insert(rows.back());
+        expected[id]++;
+    }
+    EXPECT_EQ(ut->size(), (size_t) n_rows);
+    EXPECT_EQ(ut->all().count(), n_rows);
+
+    auto same_counts = [&] () {
+        for (i32 id = -10; id < 20010; id++) {
+            UnsortedTable::Cursor cur = ut->query(Value(id));
+            int n = 0;
+            while (cur) {
+                if (cur.next()->get_i32(0) != id) {
+                    return false;
+                }
+                n++;
+            }
+            if (n != expected[id] || cur.count() != n) {
+                return false;
+            }
+        }
+        return true;
+    };
+    EXPECT_TRUE(same_counts());
+
+    // remove by row and by key
+    for (int i = 0; i < n_rows; i += 2) {
+        expected[rows[i]->get_i32(0)]--;
+        ut->remove(rows[i]);
+        rows[i] = nullptr;
+    }
+    for (i32 id = 0; id < 20000; id += 7) {
+        ut->remove(Value(id));
+        expected[id] = 0;
+    }
+    int n_left = 0;
+    for (auto& it : expected) {
+        n_left += it.second;
+    }
+    EXPECT_EQ(ut->size(), (size_t) n_left);
+    EXPECT_EQ(ut->all().count(), n_left);
+    EXPECT_TRUE(same_counts());
+
+    // insert and remove churn leaves DELETED slots, which should not grow the map
+    flat_row_map churn_map;
+    size_t capacity = 0;
+    for (int round = 0; round < 20; round++) {
+        vector<Row*> churn;
+        for (int i = 0; i < 10000; i++) {
+            vector<Value> row = { Value(i32(round * 10000 + i)), Value(i64(-1)) };
+            churn.push_back(Row::create(&schema, row));
+            churn_map.insert(churn.back());
+        }
+        for (auto& row : churn) {
+            EXPECT_TRUE(churn_map.remove(row));
+            EXPECT_FALSE(churn_map.remove(row));
+            row->release();
+        }
+        if (round == 0) {
+            capacity = churn_map.capacity();
+        }
+    }
+    EXPECT_EQ(churn_map.size(), 0u);
+    EXPECT_EQ(churn_map.capacity(), capacity);
+
+    ut->clear();
+    EXPECT_EQ(ut->size(), 0u);
+    EXPECT_FALSE(ut->all().has_next());
+    delete ut;
+}
+
+TEST(table, unsorted_table_incremental_resize) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    // reserved capacity is not exceeded
+    flat_row_map reserved;
+    reserved.reserve(10000);
+    size_t capacity = reserved.capacity();
+    vector<Row*> rows;
+    for (int i = 0; i < 10000; i++) {
+        vector<Value> row = { Value(i32(i)), Value(i64(i)) };
+        rows.push_back(Row::create(&schema, row));
+        reserved.insert(rows.back());
+    }
+    EXPECT_EQ(reserved.capacity(), capacity);
+    EXPECT_FALSE(reserved.resizing());
+
+    // all rows can be found and removed while being moved to new arrays
+    flat_row_map m;
+    m.set_incremental_resize(true);
+    int n_resizing = 0;
+    size_t n_inserted = 0;
+    for (auto& row : rows) {
+        m.insert(row);
+        n_inserted++;
+        if (!m.resizing()) {
+            continue;
+        }
+        n_resizing++;
+        if (n_resizing % 50 != 0) {
+            continue;
+        }
+        size_t n_walked = 0;
+        for (size_t slot = m.next_used(0); slot < m.end_slot(); slot = m.next_used(slot + 1)) {
+            n_walked++;
+        }
+        EXPECT_EQ(n_walked, n_inserted);
+        int n_found = 0;
+        for (size_t i = 0; i < n_inserted; i++) {
+            m.find(rows[i]->get_key(), [&n_found] (Row* r) {
+                n_found++;
+            });
+        }
+        EXPECT_EQ(n_found, (int) n_inserted);
+    }
+    EXPECT_TRUE(n_resizing > 0);
+    for (auto& row : rows) {
+        if (row->get_i32(0) % 2 == 0) {
+            EXPECT_TRUE(m.remove(row));
+        }
+    }
+    EXPECT_EQ(m.size(), rows.size() / 2);
+
+    // turning incremental resize off finishes any resize in flight
+    m.set_incremental_resize(false);
+    EXPECT_FALSE(m.resizing());
+    for (auto& row : rows) {
+        int n_found = 0;
+        m.find(row->get_key(), [&n_found] (Row* r) {
+            n_found++;
+        });
+        EXPECT_EQ(n_found, (row->get_i32(0) % 2 == 0) ? 0 : 1);
+    }
+
+    UnsortedTable* ut = new UnsortedTable(&schema, 1000);
+    ut->set_incremental_resize(true);
+    for (auto& row : rows) {
+        ut->insert(row);
+    }
+    EXPECT_EQ(ut->all().count(), (int) rows.size());
+    EXPECT_EQ(ut->query(Value(i32(1234))).count(), 1);
+    // rows are released here
+    delete ut;
+}
+
+TEST(table, unsorted_table_bulk_load) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    UnsortedTable ut(&schema);
+    vector<Row*> batch;
+    for (i32 i = 0; i < 20000; i++) {
+        vector<Value> row = { Value(i % 10000), Value("name_" + to_string(i)) };
+        batch.push_back(Row::create(&schema, row));
+    }
+    ut.bulk_load(batch.begin(), batch.end());
+    EXPECT_EQ(ut.size(), 20000u);
+    EXPECT_EQ(ut.query(Value(i32(1234))).count(), 2);
+    EXPECT_EQ(ut.all().count(), 20000);
+}
+
+TEST(table, unsorted_table_multi_query) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    UnsortedTable ut(&schema);
+    for (i32 i = 0; i < 20000; i++) {
+        vector<Value> row = { Value(i % 10000), Value("name_" + to_string(i)) };
+        ut.insert(Row::create(&schema, row));
+    }
+    // hits with 2 rows each, misses, and keys repeated in the batch
+    vector<Value> ids;
+    for (i32 i = 0; i < 500; i++) {
+        ids.push_back(Value(i32(rand() % 12000)));
+    }
+    ids.push_back(ids[0]);
+    vector<MultiBlob> keys;
+    for (auto& id : ids) {
+        keys.push_back(id.get_blob());
+    }
+    vector<UnsortedTable::Cursor> results = ut.multi_query(keys);
+    EXPECT_EQ(results.size(), keys.size());
+    bool same = true;
+    for (size_t i = 0; i < keys.size(); i++) {
+        UnsortedTable::Cursor expected = ut.query(keys[i]);
+        same = same && results[i].count() == expected.count();
+        while (expected.has_next() && results[i].has_next()) {
+            same = same && results[i].next() == expected.next();
+        }
+        same = same && !expected.has_next() && !results[i].has_next();
+    }
+    EXPECT_TRUE(same);
+    EXPECT_EQ(ut.multi_query(vector<MultiBlob>()).size(), 0u);
+}
+
 TEST(table, sorted_table_create) {
     Schema* schema = new Schema;
     schema->add_key_column("id", Value::I32);
@@ -307,6 +526,70 @@ TEST(table, sorted_table_queries) {
     delete schema;
 }
 
+TEST(table, update_string_before_string_key) {
+    Schema schema;
+    schema.add_column("name", Value::STR);
+    schema.add_key_column("email", Value::STR);
+
+    SortedTable* st = new SortedTable(&schema);
+    UnsortedTable* ut = new UnsortedTable(&schema);
+    for (Table* tbl : { (Table *) st, (Table *) ut }) {
+        vector<Value> row1 = { Value("alice"), Value("alice@example.com") };
+        vector<Value> row2 = { Value("bob"), Value("bob@example.com") };
+        Row* r1 = Row::create(&schema, row1);
+        tbl->insert(r1);
+        tbl->insert(Row::create(&schema, row2));
+
+        // key column data is shifted, row has to be found by its key afterwards
+        r1->update("name", string("alice with a much longer name"));
+        r1->update("name", string("al"));
+        EXPECT_EQ(r1->get_table(), tbl);
+    }
+    EXPECT_EQ(st->query(Value("alice@example.com")).count(), 1);
+    EXPECT_EQ(ut->query(Value("alice@example.com")).count(), 1);
+    EXPECT_EQ(st->query(Value("alice@example.com")).next()->get_column("name"), Value("al"));
+    EXPECT_TRUE(rows_are_sorted(st->all()));
+    st->remove(Value("alice@example.com"));
+    ut->remove(Value("alice@example.com"));
+    EXPECT_EQ(st->all().count(), 1);
+    EXPECT_EQ(ut->all().count(), 1);
+
+    delete st;
+    delete ut;
+}
+
+TEST(table, make_dense_with_string_key) {
+    Schema schema;
+    schema.add_column("name", Value::STR);
+    schema.add_key_column("email", Value::STR);
+
+    SortedTable* st = new SortedTable(&schema, symbol_t::ENG_RBTREE);
+    vector<Value> row1 = { Value("alice"), Value("alice@example.com") };
+    vector<Value> row2 = { Value("bob"), Value("bob@example.com") };
+    Row* r1 = Row::create(&schema, row1);
+    st->insert(r1);
+    st->insert(Row::create(&schema, row2));
+
+    // the var part grows out of the row block, then moves back in, freeing the outlined one
+    r1->update("name", string("alice with a much longer name"));
+    r1->update("name", string("al"));
+    r1->make_dense();
+    EXPECT_EQ(r1->get_table(), st);
+    EXPECT_EQ(st->query(Value("alice@example.com")).count(), 1);
+    EXPECT_EQ(st->query(Value("alice@example.com")).next()->get_column("name"), Value("al"));
+
+    // sparse strings are moved back into the row block
+    r1->make_sparse();
+    r1->make_dense();
+    EXPECT_EQ(st->query(Value("alice@example.com")).count(), 1);
+    EXPECT_EQ(st->query(Value("bob@example.com")).count(), 1);
+    EXPECT_TRUE(rows_are_sorted(st->all()));
+    st->remove(Value("alice@example.com"));
+    EXPECT_EQ(st->all().count(), 1);
+
+    delete st;
+}
+
 TEST(table, sorted_multi_key_cmp) {
     {
         Schema* schema = new Schema;
@@ -455,6 +738,771 @@ TEST(table, sorted_multi_key_cmp) {
     }
 }
 
+TEST(table, sorted_multi_key_normalized) {
+    Schema plain;
+    plain.add_key_column("id", Value::I32);
+    plain.add_key_column("name", Value::STR);
+    plain.add_key_column("ts", Value::I64);
+    plain.add_key_column("score", Value::DOUBLE);
+    Schema normalized;
+    normalized.add_key_column("id", Value::I32);
+    normalized.add_key_column("name", Value::STR);
+    normalized.add_key_column("ts", Value::I64);
+    normalized.add_key_column("score", Value::DOUBLE);
+    normalized.set_normalized_key(true);
+
+    vector<i32> ids = { -2147483647 - 1, -1, 0, 1, 2147483647 };
+    vector<string> names = { "", string("\0", 1), string("a\0", 2), string("a\0b", 3), "a", "ab", "b", "\xff", "\xff\xff" };
+    vector<i64> tss = { -(i64(1) << 62), -1, 0, 1, i64(1) << 40 };
+    vector<double> scores = { -1e300, -1.5, -0.0, 0.0, 1e-300, 2.5, 1e300 };
+
+    vector<vector<Value>> keys;
+    for (int i = 0; i < 2000; i++) {
+        keys.push_back({ Value(ids[rand() % ids.size()]), Value(names[rand() % names.size()]),
+                         Value(tss[rand() % tss.size()]), Value(scores[rand() % scores.size()]) });
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        size_t j = rand() % keys.size();
+        MultiBlob mb1(4), mb2(4);
+        for (int k = 0; k < 4; k++) {
+            mb1[k] = keys[i][k].get_blob();
+            mb2[k] = keys[j][k].get_blob();
+        }
+        EXPECT_TRUE(SortedMultiKey(mb1, &normalized).normalized().size() > 0);
+        EXPECT_EQ(SortedMultiKey(mb1, &plain).normalized().size(), 0u);
+        EXPECT_EQ(SortedMultiKey(mb1, &normalized).compare(SortedMultiKey(mb2, &normalized)),
+                  SortedMultiKey(mb1, &plain).compare(SortedMultiKey(mb2, &plain)));
+    }
+
+    // range queries return the same rows in the same order
+    SortedTable* st_plain = new SortedTable(&plain);
+    SortedTable* st_normalized = new SortedTable(&normalized);
+    for (auto& key : keys) {
+        st_plain->insert(Row::create(&plain, key));
+        st_normalized->insert(Row::create(&normalized, key));
+    }
+    EXPECT_TRUE(rows_are_sorted(st_normalized->all()));
+    MultiBlob low(4), high(4);
+    Value low_vals[] = { Value(i32(-1)), Value("a"), Value(i64(0)), Value(0.0) };
+    Value high_vals[] = { Value(i32(1)), Value("ab"), Value(i64(-1)), Value(-1.5) };
+    for (int k = 0; k < 4; k++) {
+        low[k] = low_vals[k].get_blob();
+        high[k] = high_vals[k].get_blob();
+    }
+    for (auto order : { symbol_t::ORD_ASC, symbol_t::ORD_DESC }) {
+        SortedTable::Cursor c1 = st_plain->query_in(low, high, order);
+        SortedTable::Cursor c2 = st_normalized->query_in(low, high, order);
+        int n = 0;
+        while (c1.has_next()) {
+            EXPECT_TRUE(c2.has_next());
+            const Row* r1 = c1.next();
+            const Row* r2 = c2.next();
+            for (int k = 0; k < 4; k++) {
+                EXPECT_EQ(r1->get_column(k), r2->get_column(k));
+            }
+            n++;
+        }
+        EXPECT_FALSE(c2.has_next());
+        EXPECT_TRUE(n > 0);
+    }
+    delete st_plain;
+    delete st_normalized;
+}
+
+static vector<i64> collect_seq(SortedTable::Cursor cur) {
+    vector<i64> seq;
+    while (cur.has_next()) {
+        seq.push_back(cur.next()->get_column("seq").get_i64());
+    }
+    return seq;
+}
+
+TEST(table, sorted_table_btree) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    // same rows in a std::multimap backed table and a B+tree backed one
+    SortedTable* rb = new SortedTable(&schema);
+    SortedTable* bt = new SortedTable(&schema, symbol_t::ENG_BTREE);
+    EXPECT_EQ(rb->engine(), symbol_t::ENG_RBTREE);
+    EXPECT_EQ(bt->engine(), symbol_t::ENG_BTREE);
+
+    vector<string> names = { "", "a", string("a\0b", 3), "alice", "alice_and_bob", "bob" };
+    const int n_rows = 20000;
+    vector<Row*> rb_rows, bt_rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value(i32(rand() % 2000 - 1000)), Value(names[rand() % names.size()]), Value(i64(i)) };
+        rb_rows.push_back(Row::create(&schema, row));
+        bt_rows.push_back(Row::create(&schema, row));
+        rb->insert(rb_rows.back());
+        bt->insert(bt_rows.back());
+    }
+    EXPECT_EQ(bt->size(), (size_t) n_rows);
+
+    // key blobs point into *vals
+    auto random_key = [&names] (vector<Value>* vals) {
+        *vals = { Value(i32(rand() % 2200 - 1100)), Value(names[rand() % names.size()]) };
+        MultiBlob mb(2);
+        mb[0] = (*vals)[0].get_blob();
+        mb[1] = (*vals)[1].get_blob();
+        return mb;
+    };
+    auto same_results = [&] () {
+        bool same = true;
+        same = same && collect_seq(rb->all()) == collect_seq(bt->all());
+        same = same && collect_seq(rb->all(symbol_t::ORD_DESC)) == collect_seq(bt->all(symbol_t::ORD_DESC));
+        for (int i = 0; i < 200; i++) {
+            vector<Value> key_vals, low_vals;
+            MultiBlob key = random_key(&key_vals);
+            symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+            same = same && collect_seq(rb->query(key)) == collect_seq(bt->query(key));
+            same = same && collect_seq(rb->query_lt(key, order)) == collect_seq(bt->query_lt(key, order));
+            same = same && collect_seq(rb->query_gt(key, order)) == collect_seq(bt->query_gt(key, order));
+            MultiBlob low = random_key(&low_vals);
+            MultiBlob high(2);
+            Value high_id = Value(low_vals[0].get_i32() + 1 + rand() % 50);
+            high[0] = high_id.get_blob();
+            high[1] = low[1];
+            same = same && collect_seq(rb->query_in(low, high, order)) == collect_seq(bt->query_in(low, high, order));
+        }
+        return same && rb->size() == bt->size();
+    };
+    EXPECT_TRUE(same_results());
+    EXPECT_TRUE(rows_are_sorted(bt->all()));
+    EXPECT_TRUE(rows_are_sorted(bt->all(symbol_t::ORD_DESC), symbol_t::ORD_DESC));
+
+    // remove by row
+    for (int i = 0; i < n_rows; i += 3) {
+        rb->remove(rb_rows[i]);
+        bt->remove(bt_rows[i]);
+    }
+    EXPECT_TRUE(same_results());
+
+    // remove by key
+    for (int i = 0; i < 300; i++) {
+        vector<Value> key_vals;
+        MultiBlob key = random_key(&key_vals);
+        rb->remove(key);
+        bt->remove(key);
+    }
+    EXPECT_TRUE(same_results());
+
+    // remove by cursor, in both directions
+    for (int i = 0; i < 20; i++) {
+        vector<Value> key_vals;
+        MultiBlob key = random_key(&key_vals);
+        symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+        if (i % 4 < 2) {
+            rb->remove(rb->query_gt(key, order));
+            bt->remove(bt->query_gt(key, order));
+        } else {
+            rb->remove(rb->query_lt(key, order));
+            bt->remove(bt->query_lt(key, order));
+        }
+        EXPECT_TRUE(same_results());
+    }
+
+    // empty the tree, then use it again
+    bt->remove(bt->all(symbol_t::ORD_DESC));
+    rb->remove(rb->all());
+    EXPECT_EQ(bt->size(), 0u);
+    EXPECT_FALSE(bt->all().has_next());
+    for (int i = 0; i < 1000; i++) {
+        vector<Value> row = { Value(i32(rand() % 100)), Value(names[rand() % names.size()]), Value(i64(i)) };
+        rb->insert(Row::create(&schema, row));
+        bt->insert(Row::create(&schema, row));
+    }
+    EXPECT_TRUE(same_results());
+
+    bt->clear();
+    EXPECT_EQ(bt->size(), 0u);
+    EXPECT_FALSE(bt->all(symbol_t::ORD_DESC).has_next());
+
+    delete rb;
+    delete bt;
+}
+
+TEST(table, sorted_table_rank) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        SortedTable* st = new SortedTable(&schema, engine);
+        vector<Row*> rows;
+        for (int i = 0; i < 10000; i++) {
+            vector<Value> row = { Value(i32(rand() % 3000)), Value(i64(i)) };
+            rows.push_back(Row::create(&schema, row));
+            st->insert(rows.back());
+        }
+        // some removes, so counts are also maintained on erase
+        for (int i = 0; i < 10000; i += 4) {
+            st->remove(rows[i]);
+        }
+
+        for (int i = 0; i < 100; i++) {
+            Value key = Value(i32(rand() % 3100 - 50));
+            Value high = Value(i32(key.get_i32() + rand() % 500 + 1));
+            EXPECT_EQ(st->rank(key), (size_t) enumerator_count(st->query_lt(key)));
+            EXPECT_EQ(st->query_lt(key).count(), enumerator_count(st->query_lt(key)));
+            EXPECT_EQ(st->query_gt(key).count(), enumerator_count(st->query_gt(key)));
+            EXPECT_EQ(st->query_in(key, high).count(), enumerator_count(st->query_in(key, high)));
+            EXPECT_EQ(st->query(key).count(), enumerator_count(st->query(key)));
+
+            // skip k rows, then the rest equals walking past k rows
+            for (auto order : { symbol_t::ORD_ASC, symbol_t::ORD_DESC }) {
+                SortedTable::Cursor walked = st->query_gt(key, order);
+                int n = walked.count();
+                int k = (n == 0) ? 0 : rand() % (n + 2);
+                for (int j = 0; j < k && walked.has_next(); j++) {
+                    walked.next();
+                }
+                SortedTable::Cursor skipped = st->query_gt(key, order);
+                skipped.skip(k);
+                EXPECT_EQ(collect_seq(skipped), collect_seq(walked));
+
+                // pagination: skip twice
+                SortedTable::Cursor paged = st->query_gt(key, order);
+                paged.skip(k / 2);
+                paged.skip(k - k / 2);
+                EXPECT_EQ(enumerator_count(paged), max(n - k, 0));
+            }
+        }
+        EXPECT_EQ(st->all().count(), (int) st->size());
+        delete st;
+    }
+}
+
+TEST(table, sorted_table_skiplist) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    // same rows in a std::multimap backed table and a skiplist backed one
+    SortedTable* rb = new SortedTable(&schema);
+    SortedTable* sl = new SortedTable(&schema, symbol_t::ENG_SKIPLIST);
+    EXPECT_EQ(sl->engine(), symbol_t::ENG_SKIPLIST);
+
+    vector<string> names = { "", "a", string("a\0b", 3), "alice", "bob" };
+    const int n_rows = 10000;
+    vector<Row*> rb_rows, sl_rows;
+    for (int i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value(i32(rand() % 1000 - 500)), Value(names[rand() % names.size()]), Value(i64(i)) };
+        rb_rows.push_back(Row::create(&schema, row));
+        sl_rows.push_back(Row::create(&schema, row));
+        rb->insert(rb_rows.back());
+        sl->insert(sl_rows.back());
+    }
+
+    auto same_results = [&] () {
+        bool same = rb->size() == sl->size();
+        same = same && collect_seq(rb->all()) == collect_seq(sl->all());
+        same = same && collect_seq(rb->all(symbol_t::ORD_DESC)) == collect_seq(sl->all(symbol_t::ORD_DESC));
+        for (int i = 0; i < 100; i++) {
+            vector<Value> vals = { Value(i32(rand() % 1100 - 550)), Value(names[rand() % names.size()]) };
+            MultiBlob key(2);
+            key[0] = vals[0].get_blob();
+            key[1] = vals[1].get_blob();
+            Value high_id = Value(vals[0].get_i32() + 1 + rand() % 50);
+            MultiBlob high(2);
+            high[0] = high_id.get_blob();
+            high[1] = key[1];
+            symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+            same = same && collect_seq(rb->query(key)) == collect_seq(sl->query(key));
+            same = same && collect_seq(rb->query_lt(key, order)) == collect_seq(sl->query_lt(key, order));
+            same = same && collect_seq(rb->query_gt(key, order)) == collect_seq(sl->query_gt(key, order));
+            same = same && collect_seq(rb->query_in(key, high, order)) == collect_seq(sl->query_in(key, high, order));
+        }
+        return same;
+    };
+    EXPECT_TRUE(same_results());
+
+    for (int i = 0; i < n_rows; i += 3) {
+        rb->remove(rb_rows[i]);
+        sl->remove(sl_rows[i]);
+    }
+    for (int i = 0; i < 100; i++) {
+        vector<Value> vals = { Value(i32(rand() % 1000 - 500)), Value(names[rand() % names.size()]) };
+        MultiBlob key(2);
+        key[0] = vals[0].get_blob();
+        key[1] = vals[1].get_blob();
+        rb->remove(key);
+        sl->remove(key);
+    }
+    EXPECT_TRUE(same_results());
+
+    // remove by cursor, in both directions
+    vector<Value> high_vals = { Value(i32(400)), Value("") }, low_vals = { Value(i32(-400)), Value("") };
+    MultiBlob high(2), low(2);
+    for (int i = 0; i < 2; i++) {
+        high[i] = high_vals[i].get_blob();
+        low[i] = low_vals[i].get_blob();
+    }
+    rb->remove(rb->query_gt(high, symbol_t::ORD_DESC));
+    sl->remove(sl->query_gt(high, symbol_t::ORD_DESC));
+    rb->remove(rb->query_lt(low));
+    sl->remove(sl->query_lt(low));
+    EXPECT_TRUE(same_results());
+
+    sl->clear();
+    EXPECT_EQ(sl->size(), 0u);
+    EXPECT_FALSE(sl->all(symbol_t::ORD_DESC).has_next());
+    delete rb;
+    delete sl;
+}
+
+TEST(table, sorted_table_art) {
+    // single i64 key, single string key, and a composite key
+    Schema i64_schema;
+    i64_schema.add_key_column("id", Value::I64);
+    i64_schema.add_column("seq", Value::I64);
+    Schema str_schema;
+    str_schema.add_key_column("name", Value::STR);
+    str_schema.add_column("seq", Value::I64);
+    Schema pair_schema;
+    pair_schema.add_key_column("id", Value::I32);
+    pair_schema.add_key_column("name", Value::STR);
+    pair_schema.add_column("seq", Value::I64);
+
+    // long shared prefixes go past the bytes kept in radix tree nodes
+    vector<string> names = { "", "a", string("a\0b", 3), "\xff", "\xff\xff", "user_000000000000_1",
+                             "user_000000000000_2", "user_000000000001", "user_0000000000000000000000_3" };
+    auto random_name = [&names] () {
+        return names[rand() % names.size()] + ((rand() % 2 == 0) ? "" : to_string(rand() % 50));
+    };
+    auto random_i64 = [] () {
+        // dense small ids, and sparse ids sharing high bytes
+        return (rand() % 2 == 0) ? i64(rand() % 3000 - 1500) : (i64(rand() % 4) << 40) + rand();
+    };
+
+    for (Schema* schema : { &i64_schema, &str_schema, &pair_schema }) {
+        auto random_key = [&] () {
+            if (schema == &i64_schema) {
+                return vector<Value>({ Value(random_i64()) });
+            } else if (schema == &str_schema) {
+                return vector<Value>({ Value(random_name()) });
+            } else {
+                return vector<Value>({ Value(i32(rand() % 40)), Value(random_name()) });
+            }
+        };
+        auto to_blobs = [] (const vector<Value>& vals) {
+            MultiBlob mb(vals.size());
+            for (size_t i = 0; i < vals.size(); i++) {
+                mb[i] = vals[i].get_blob();
+            }
+            return mb;
+        };
+
+        SortedTable* rb = new SortedTable(schema);
+        SortedTable* art = new SortedTable(schema, symbol_t::ENG_ART);
+        EXPECT_EQ(art->engine(), symbol_t::ENG_ART);
+        vector<Row*> rb_rows, art_rows;
+        for (int i = 0; i < 20000; i++) {
+            vector<Value> row = random_key();
+            row.push_back(Value(i64(i)));
+            rb_rows.push_back(Row::create(schema, row));
+            art_rows.push_back(Row::create(schema, row));
+            rb->insert(rb_rows.back());
+            art->insert(art_rows.back());
+        }
+
+        auto same_results = [&] () {
+            bool same = rb->size() == art->size();
+            same = same && collect_seq(rb->all()) == collect_seq(art->all());
+            same = same && collect_seq(rb->all(symbol_t::ORD_DESC)) == collect_seq(art->all(symbol_t::ORD_DESC));
+            for (int i = 0; i < 200; i++) {
+                vector<Value> key_vals = random_key(), high_vals = random_key();
+                MultiBlob key = to_blobs(key_vals), high = to_blobs(high_vals);
+                symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+                same = same && collect_seq(rb->query(key)) == collect_seq(art->query(key));
+                same = same && collect_seq(rb->query_lt(key, order)) == collect_seq(art->query_lt(key, order));
+                same = same && collect_seq(rb->query_gt(key, order)) == collect_seq(art->query_gt(key, order));
+                if (SortedMultiKey::compare(key, high, schema) < 0) {
+                    same = same && collect_seq(rb->query_in(key, high, order))
+                                == collect_seq(art->query_in(key, high, order));
+                }
+            }
+            return same;
+        };
+        EXPECT_TRUE(same_results());
+
+        for (int i = 0; i < 20000; i += 3) {
+            rb->remove(rb_rows[i]);
+            art->remove(art_rows[i]);
+        }
+        for (int i = 0; i < 1000; i++) {
+            vector<Value> key_vals = random_key();
+            rb->remove(to_blobs(key_vals));
+            art->remove(to_blobs(key_vals));
+        }
+        EXPECT_TRUE(same_results());
+
+        vector<Value> key_vals = random_key();
+        rb->remove(rb->query_gt(to_blobs(key_vals), symbol_t::ORD_DESC));
+        art->remove(art->query_gt(to_blobs(key_vals), symbol_t::ORD_DESC));
+        EXPECT_TRUE(same_results());
+
+        // empty the tree, then use it again
+        art->remove(art->all());
+        rb->remove(rb->all());
+        EXPECT_EQ(art->size(), 0u);
+        EXPECT_FALSE(art->all(symbol_t::ORD_DESC).has_next());
+        for (int i = 0; i < 1000; i++) {
+            vector<Value> row = random_key();
+            row.push_back(Value(i64(i)));
+            rb->insert(Row::create(schema, row));
+            art->insert(Row::create(schema, row));
+        }
+        EXPECT_TRUE(same_results());
+
+        delete rb;
+        delete art;
+    }
+}
+
+TEST(table, sorted_table_query_prefix) {
+    Schema schema;
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    vector<string> names = { "", "a", "ab", "abc", "abd", "ac", string("ab\0", 3), "ab\xff", "ab\xff\xff",
+                             "b", "\xff", "\xff\xfe", "\xff\xff" };
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_ART }) {
+        SortedTable st(&schema, engine);
+        for (size_t i = 0; i < names.size(); i++) {
+            vector<Value> row = { Value(names[i]), Value(i64(i)) };
+            st.insert(Row::create(&schema, row));
+        }
+        for (auto& prefix : names) {
+            vector<i64> expected;
+            for (size_t i = 0; i < names.size(); i++) {
+                if (names[i].compare(0, prefix.size(), prefix) == 0) {
+                    expected.push_back(i);
+                }
+            }
+            vector<i64> found = collect_seq(st.query_prefix(prefix));
+            std::sort(found.begin(), found.end());
+            EXPECT_EQ(found, expected);
+            EXPECT_TRUE(rows_are_sorted(st.query_prefix(prefix, symbol_t::ORD_DESC), symbol_t::ORD_DESC));
+        }
+        EXPECT_EQ(st.query_prefix("ab").count(), 6);
+    }
+}
+
+TEST(table, sorted_table_key_prefix) {
+    // (tenant, ts) keys: fixed size ones fit the B+tree's 8 byte prefix, string ones do not
+    Schema int_keys, int_keys_normalized, str_keys, str_keys_normalized;
+    for (Schema* schema : { &int_keys, &int_keys_normalized }) {
+        schema->add_key_column("tenant", Value::I32);
+        schema->add_key_column("ts", Value::I32);
+        schema->add_column("seq", Value::I64);
+    }
+    for (Schema* schema : { &str_keys, &str_keys_normalized }) {
+        schema->add_key_column("tenant", Value::STR);
+        schema->add_key_column("ts", Value::I64);
+        schema->add_column("seq", Value::I64);
+    }
+    int_keys_normalized.set_normalized_key(true);
+    str_keys_normalized.set_normalized_key(true);
+
+    // extreme tenants encode to all 0x00 or all 0xFF bytes
+    vector<Value> int_tenants = { Value(i32(-2147483647 - 1)), Value(i32(-1)), Value(i32(0)), Value(i32(7)),
+                                  Value(i32(2147483647)) };
+    vector<Value> int_tss = { Value(i32(-2147483647 - 1)), Value(i32(-3)), Value(i32(0)), Value(i32(5)),
+                              Value(i32(2147483647)) };
+    vector<Value> str_tenants = { Value(""), Value(string("\0", 1)), Value("a"), Value(string("a\0", 2)),
+                                  Value("ab"), Value("\xff"), Value("\xff\xff") };
+    vector<Value> str_tss = { Value(INT64_MIN), Value(i64(-1)), Value(i64(0)), Value(i64(1) << 40),
+                              Value(INT64_MAX) };
+
+    for (Schema* schema : { &int_keys, &int_keys_normalized, &str_keys, &str_keys_normalized }) {
+        bool str = (schema == &str_keys || schema == &str_keys_normalized);
+        const vector<Value>& tenants = str ? str_tenants : int_tenants;
+        const vector<Value>& tss = str ? str_tss : int_tss;
+        for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+            SortedTable st(schema, engine);
+            for (int i = 0; i < 3000; i++) {
+                vector<Value> row = { tenants[rand() % tenants.size()], tss[rand() % tss.size()], Value(i64(i)) };
+                st.insert(Row::create(schema, row));
+            }
+
+            // expected results are taken from a full scan, filtered by tenant
+            auto scan = [&st] (std::function<bool(const Value&)> match) {
+                vector<i64> seq;
+                for (SortedTable::Cursor cur = st.all(); cur; ) {
+                    const Row* row = cur.next();
+                    if (match(row->get_column("tenant"))) {
+                        seq.push_back(row->get_column("seq").get_i64());
+                    }
+                }
+                return seq;
+            };
+            auto reversed = [] (vector<i64> seq) {
+                std::reverse(seq.begin(), seq.end());
+                return seq;
+            };
+            bool same = true;
+            for (auto& t : tenants) {
+                vector<i64> eq = scan([&t] (const Value& v) { return v == t; });
+                same = same && collect_seq(st.query(t)) == eq;
+                same = same && collect_seq(st.query_prefix(t.get_blob())) == eq;
+                same = same && collect_seq(st.query_prefix(t.get_blob(), symbol_t::ORD_DESC)) == reversed(eq);
+                same = same && collect_seq(st.query_lt(t)) == scan([&t] (const Value& v) { return v < t; });
+                same = same && collect_seq(st.query_gt(t, symbol_t::ORD_DESC))
+                            == reversed(scan([&t] (const Value& v) { return v > t; }));
+                for (auto& high : tenants) {
+                    if (t < high) {
+                        same = same && collect_seq(st.query_in(t, high))
+                                    == scan([&] (const Value& v) { return t < v && v < high; });
+                    }
+                }
+                // a full key next to its prefix: rows of tenant t with ts > tss[2]
+                MultiBlob full(2);
+                full[0] = t.get_blob();
+                full[1] = tss[2].get_blob();
+                int n_after = 0;
+                for (SortedTable::Cursor cur = st.query_prefix(t.get_blob()); cur; ) {
+                    n_after += (cur.next()->get_column("ts") > tss[2]) ? 1 : 0;
+                }
+                same = same && st.query_gt(full).count() - st.query_gt(t).count() == n_after;
+            }
+            same = same && collect_seq(st.query_prefix(MultiBlob(0))) == collect_seq(st.all());
+            EXPECT_TRUE(same);
+        }
+    }
+}
+
+// many threads insert, remove and scan a skiplist backed table at the same time
+TEST(table, sorted_table_skiplist_concurrent) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    SortedTable* st = new SortedTable(&schema, symbol_t::ENG_SKIPLIST);
+    const int n_threads = 4;
+    const int n_rows = 40000;
+    vector<int> bad_scans(n_threads, 0);
+    vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.push_back(std::thread([st, &schema, &bad_scans, t] {
+            for (i32 i = t; i < n_rows; i += n_threads) {
+                vector<Value> row = { Value(i), Value(i64(i)) };
+                st->insert(Row::create(&schema, row));
+                verify(st->query(Value(i)).has_next());
+                if (i % 1000 == t) {
+                    // ranges stay sorted, and within bounds, while rows come and go
+                    for (auto order : { symbol_t::ORD_ASC, symbol_t::ORD_DESC }) {
+                        i32 low = i / 2, high = i / 2 + 500;
+                        i32 last = (order == symbol_t::ORD_ASC) ? low : high;
+                        for (auto cur = st->query_in(Value(low), Value(high), order); cur; ) {
+                            i32 key = cur.next()->get_i32(0);
+                            bool in_order = (order == symbol_t::ORD_ASC) ? key > last : key < last;
+                            if (!in_order || key <= low || key >= high) {
+                                bad_scans[t]++;
+                            }
+                            last = key;
+                        }
+                    }
+                }
+            }
+            // every other row removed by key, and the first quarter by range
+            for (i32 i = t; i < n_rows; i += 2 * n_threads) {
+                st->remove(Value(i));
+            }
+            st->remove(st->query_lt(Value(i32(n_rows / 4))));
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    for (int t = 0; t < n_threads; t++) {
+        EXPECT_EQ(bad_scans[t], 0);
+    }
+
+    vector<i64> expected;
+    for (i32 i = n_rows / 4; i < n_rows; i++) {
+        if (i % (2 * n_threads) >= n_threads) {
+            expected.push_back(i);
+        }
+    }
+    EXPECT_EQ(st->size(), expected.size());
+    EXPECT_EQ(collect_seq(st->all()), expected);
+    std::reverse(expected.begin(), expected.end());
+    EXPECT_EQ(collect_seq(st->all(symbol_t::ORD_DESC)), expected);
+    delete st;
+}
+
+TEST(table, sort_by_key) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("seq", Value::I64);
+
+    vector<Row*> rows;
+    for (int i = 0; i < 100000; i++) {
+        vector<Value> row = { Value(i32(rand() % 5000)), Value(i64(i)) };
+        rows.push_back(Row::create(&schema, row));
+    }
+    // more slices than the machine has cores, odd counts leave a run out of a merge round
+    for (int n_threads : { 1, 3, 4 }) {
+        vector<keyed_row> sorted;
+        sort_by_key(rows, &schema, false, &sorted, n_threads);
+        EXPECT_EQ(sorted.size(), rows.size());
+        bool in_order = true;
+        for (size_t i = 1; i < sorted.size(); i++) {
+            int cmp = SortedMultiKey::compare(sorted[i - 1].row->get_key(), sorted[i].row->get_key(), &schema);
+            in_order = in_order && (cmp < 0 || (cmp == 0 && sorted[i - 1].row->get_column("seq").get_i64()
+                                                           < sorted[i].row->get_column("seq").get_i64()));
+        }
+        EXPECT_TRUE(in_order);
+    }
+    for (Row* row : rows) {
+        row->release();
+    }
+}
+
+TEST(table, sorted_table_bulk_load) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        for (bool presorted : { false, true }) {
+            SortedTable* rb = new SortedTable(&schema);
+            SortedTable* st = new SortedTable(&schema, engine);
+            vector<Row*> batch;
+            for (int i = 0; i < 30000; i++) {
+                // presorted batches go up by id, with runs of equal keys
+                i32 id = presorted ? i / 3 : rand() % 10000;
+                vector<Value> row = { Value(id), Value("name_" + to_string(id % 7)), Value(i64(i)) };
+                rb->insert(Row::create(&schema, row));
+                batch.push_back(Row::create(&schema, row));
+            }
+            st->bulk_load(batch.begin(), batch.end(), presorted);
+            EXPECT_EQ(st->size(), rb->size());
+            EXPECT_TRUE(collect_seq(st->all()) == collect_seq(rb->all()));
+            EXPECT_TRUE(collect_seq(st->all(symbol_t::ORD_DESC)) == collect_seq(rb->all(symbol_t::ORD_DESC)));
+
+            // the loaded structure keeps working with single row changes and further bulk loads
+            for (int i = 0; i < 5000; i++) {
+                i32 id = rand() % 10000;
+                vector<Value> row = { Value(id), Value("name_" + to_string(id % 7)), Value(i64(30000 + i)) };
+                rb->insert(Row::create(&schema, row));
+                st->insert(Row::create(&schema, row));
+                MultiBlob key(2);
+                Value name("name_" + to_string(i % 7));
+                Value removed(i32(rand() % 10000));
+                key[0] = removed.get_blob();
+                key[1] = name.get_blob();
+                rb->remove(key);
+                st->remove(key);
+            }
+            batch.clear();
+            for (int i = 0; i < 5000; i++) {
+                i32 id = rand() % 10000;
+                vector<Value> row = { Value(id), Value("name_" + to_string(id % 7)), Value(i64(40000 + i)) };
+                rb->insert(Row::create(&schema, row));
+                batch.push_back(Row::create(&schema, row));
+            }
+            st->bulk_load(batch);
+            EXPECT_TRUE(collect_seq(st->all()) == collect_seq(rb->all()));
+            Value low_id(i32(2000)), high_id(i32(2001)), name("name_0");
+            MultiBlob low(2), high(2);
+            low[0] = low_id.get_blob();
+            high[0] = high_id.get_blob();
+            low[1] = high[1] = name.get_blob();
+            EXPECT_EQ(st->rank(low), rb->rank(low));
+            EXPECT_EQ(st->query_in(low, high).count(), rb->query_in(low, high).count());
+
+            delete rb;
+            delete st;
+        }
+    }
+}
+
+TEST(table, sorted_table_multi_query) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        SortedTable* st = new SortedTable(&schema, engine);
+        for (int i = 0; i < 30000; i++) {
+            i32 id = rand() % 5000;
+            vector<Value> row = { Value(id), Value("name_" + to_string(i % 3)), Value(i64(i)) };
+            st->insert(Row::create(&schema, row));
+        }
+        // leave stale separators and sparse leaves behind in the B+tree
+        for (i32 id = 0; id < 5000; id += 3) {
+            st->remove(Value(id));
+        }
+
+        // full keys, key prefixes next to full keys starting with them, misses, and repeats
+        vector<Value> ids, names;
+        vector<MultiBlob> keys;
+        for (int i = 0; i < 600; i++) {
+            ids.push_back(Value(i32(rand() % 5200 - 100)));
+            names.push_back(Value("name_" + to_string(rand() % 4)));
+        }
+        for (int i = 0; i < 600; i++) {
+            if (i % 4 == 0) {
+                keys.push_back(ids[i].get_blob());
+            } else {
+                MultiBlob key(2);
+                key[0] = ids[i % 4 == 1 ? i - 1 : i].get_blob();
+                key[1] = names[i].get_blob();
+                keys.push_back(key);
+            }
+        }
+        keys.push_back(keys[1]);
+        keys.push_back(keys[0]);
+
+        {
+            vector<SortedTable::Cursor> results = st->multi_query(keys);
+            EXPECT_EQ(results.size(), keys.size());
+            bool same = true;
+            for (size_t i = 0; i < keys.size(); i++) {
+                same = same && collect_seq(results[i]) == collect_seq(st->query(keys[i]));
+            }
+            EXPECT_TRUE(same);
+        }
+        delete st;
+    }
+
+    // a range erased before the query leaves inner nodes of the B+tree without separators, which the
+    // search from the previous result has to climb over
+    Schema i64_schema;
+    i64_schema.add_key_column("id", Value::I64);
+    i64_schema.add_column("seq", Value::I64);
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        bool same = true;
+        for (i64 start = 1; start < 4000; start += 70) {
+            SortedTable* st = new SortedTable(&i64_schema, engine);
+            for (i64 i = 0; i < 6000; i++) {
+                vector<Value> row = { Value(INT64_MIN + i), Value(i) };
+                st->insert(Row::create(&i64_schema, row));
+            }
+            for (i64 i = start; i < 4000; i++) {
+                st->remove(Value(INT64_MIN + i));
+            }
+            vector<Value> ids = { Value(INT64_MIN + start - 1), Value(INT64_MIN + 4500) };
+            vector<MultiBlob> keys = { ids[0].get_blob(), ids[1].get_blob() };
+            {
+                vector<SortedTable::Cursor> results = st->multi_query(keys);
+                for (size_t i = 0; i < keys.size(); i++) {
+                    same = same && collect_seq(results[i]) == collect_seq(st->query(keys[i]));
+                }
+            }
+            delete st;
+        }
+        EXPECT_TRUE(same);
+    }
+}
+
 TEST(table, create_snapshot_table) {
     // the schema will be accessed both by SnapshotTable and Cursors
     Schema schema;
@@ -612,6 +1660,243 @@ TEST(table, snapshot_table_remove_range) {
 }
 
 
+TEST(table, snapshot_table_key_prefix) {
+    Schema schema;
+    schema.add_key_column("tenant", Value::I32);
+    schema.add_key_column("ts", Value::I64);
+    schema.add_column("name", Value::STR);
+
+    SnapshotTable* st = new SnapshotTable(&schema);
+    for (i32 tenant = 0; tenant < 10; tenant++) {
+        for (i64 ts = 0; ts < 20; ts++) {
+            vector<Value> row = { Value(tenant), Value(ts), Value("name_" + to_string(ts)) };
+            st->insert(Row::create(&schema, row));
+        }
+    }
+    SnapshotTable* before = st->snapshot();
+    st->remove(Value(i32(3)));
+
+    EXPECT_EQ(st->query_prefix(Value(i32(4)).get_blob()).count(), 20);
+    EXPECT_EQ(st->query(Value(i32(3))).count(), 0);
+    EXPECT_EQ(before->query_prefix(Value(i32(3)).get_blob()).count(), 20);
+    EXPECT_TRUE(rows_are_sorted(st->query_prefix(Value(i32(4)).get_blob(), symbol_t::ORD_DESC), symbol_t::ORD_DESC));
+    EXPECT_EQ(st->query_lt(Value(i32(5))).count(), 80);
+    EXPECT_EQ(st->query_gt(Value(i32(5)), symbol_t::ORD_DESC).count(), 80);
+    EXPECT_EQ(st->query_in(Value(i32(1)), Value(i32(5))).count(), 40);
+    EXPECT_EQ(st->all().count(), 180);
+
+    delete before;
+    delete st;
+}
+
+TEST(table, snapshot_table_bulk_load) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    SnapshotTable* st = new SnapshotTable(&schema);
+    vector<Value> row0 = { Value(i32(5000)), Value("first") };
+    st->insert(Row::create(&schema, row0));
+    SnapshotTable* before = st->snapshot();
+
+    // a few keys are below the last one in the table, and can not be appended
+    vector<Row*> batch;
+    for (i32 i = 0; i < 10000; i++) {
+        vector<Value> row = { Value(i), Value("name_" + to_string(i)) };
+        batch.push_back(Row::create(&schema, row));
+    }
+    st->bulk_load(batch, true);
+    EXPECT_EQ(st->all().count(), 10001);
+    EXPECT_EQ(st->query(Value(i32(5000))).count(), 2);
+    EXPECT_TRUE(st->query(Value(i32(42))).next()->readonly());
+    EXPECT_EQ(st->query_lt(Value(i32(100))).count(), 100);
+    EXPECT_EQ(before->all().count(), 1);
+
+    SnapshotTable::Cursor cur = st->all();
+    i32 last = -1;
+    bool in_order = true;
+    while (cur) {
+        i32 id = cur.next()->get_column(0).get_i32();
+        in_order = in_order && (id >= last);
+        last = id;
+    }
+    EXPECT_TRUE(in_order);
+
+    delete before;
+    delete st;
+}
+
+static vector<i64> collect_seq(SnapshotTable::Cursor&& cur) {
+    vector<i64> seq;
+    while (cur.has_next()) {
+        seq.push_back(cur.next()->get_column("seq").get_i64());
+    }
+    return seq;
+}
+
+TEST(table, snapshot_table_cow_btree) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_key_column("name", Value::STR);
+    schema.add_column("seq", Value::I64);
+
+    // few distinct keys, so equal keys span several leaves
+    vector<string> names = { "", "a", "bob", "carol", string("d\0e", 3) };
+    auto random_key = [&names] () {
+        return vector<Value>({ Value(i32(rand() % 50)), Value(names[rand() % names.size()]) });
+    };
+    auto to_blobs = [] (const vector<Value>& vals) {
+        MultiBlob mb(vals.size());
+        for (size_t i = 0; i < vals.size(); i++) {
+            mb[i] = vals[i].get_blob();
+        }
+        return mb;
+    };
+
+    SnapshotTable* rb = new SnapshotTable(&schema);
+    SnapshotTable* cow = new SnapshotTable(&schema, symbol_t::ENG_BTREE);
+    EXPECT_EQ(cow->engine(), symbol_t::ENG_BTREE);
+    vector<Row*> rb_rows, cow_rows;
+    i64 seq = 0;
+    auto insert_rows = [&] (int n) {
+        for (int i = 0; i < n; i++) {
+            vector<Value> row = random_key();
+            row.push_back(Value(seq++));
+            rb_rows.push_back(Row::create(&schema, row));
+            cow_rows.push_back(Row::create(&schema, row));
+            rb->insert(rb_rows.back());
+            cow->insert(cow_rows.back());
+        }
+    };
+
+    auto same_results = [&] (SnapshotTable* a, SnapshotTable* b) {
+        bool same = collect_seq(a->all()) == collect_seq(b->all());
+        same = same && collect_seq(a->all(symbol_t::ORD_DESC)) == collect_seq(b->all(symbol_t::ORD_DESC));
+        same = same && a->all().count() == b->all().count();
+        for (int i = 0; i < 100; i++) {
+            vector<Value> key_vals = random_key(), high_vals = random_key();
+            vector<Value> prefix_vals = { key_vals[0] };
+            MultiBlob key = to_blobs(key_vals), high = to_blobs(high_vals), prefix = to_blobs(prefix_vals);
+            symbol_t order = (i % 2 == 0) ? symbol_t::ORD_ASC : symbol_t::ORD_DESC;
+            same = same && collect_seq(a->query(key)) == collect_seq(b->query(key));
+            same = same && a->query(key).count() == b->query(key).count();
+            same = same && collect_seq(a->query_prefix(prefix, order)) == collect_seq(b->query_prefix(prefix, order));
+            same = same && collect_seq(a->query_lt(key, order)) == collect_seq(b->query_lt(key, order));
+            same = same && collect_seq(a->query_gt(prefix, order)) == collect_seq(b->query_gt(prefix, order));
+            if (SortedMultiKey::compare(key, high, &schema) < 0) {
+                same = same && collect_seq(a->query_in(key, high, order)) == collect_seq(b->query_in(key, high, order));
+            }
+        }
+        return same;
+    };
+
+    insert_rows(5000);
+    EXPECT_TRUE(same_results(rb, cow));
+    SnapshotTable* rb_snap = rb->snapshot();
+    SnapshotTable* cow_snap = cow->snapshot();
+    vector<i64> before = collect_seq(cow_snap->all());
+
+    // single rows, whole keys, key prefixes and ranges, with more rows in between
+    for (int i = 0; i < 5000; i += 3) {
+        rb->remove(rb_rows[i]);
+        cow->remove(cow_rows[i]);
+    }
+    insert_rows(2000);
+    for (int i = 0; i < 100; i++) {
+        vector<Value> key_vals = random_key();
+        rb->remove(to_blobs(key_vals));
+        cow->remove(to_blobs(key_vals));
+    }
+    rb->remove(Value(i32(7)));
+    cow->remove(Value(i32(7)));
+    vector<Value> key_vals = random_key();
+    rb->remove(rb->query_gt(to_blobs(key_vals), symbol_t::ORD_DESC));
+    cow->remove(cow->query_gt(to_blobs(key_vals), symbol_t::ORD_DESC));
+    EXPECT_TRUE(same_results(rb, cow));
+    EXPECT_TRUE(same_results(rb_snap, cow_snap));
+    EXPECT_TRUE(collect_seq(cow_snap->all()) == before);
+    EXPECT_EQ(cow->gc_step(1000), 0u);
+
+    // snapshots of snapshots, and writes after the snapshot is gone
+    SnapshotTable* cow_snap2 = cow_snap->snapshot();
+    delete cow_snap;
+    delete rb_snap;
+    EXPECT_TRUE(collect_seq(cow_snap2->all()) == before);
+    delete cow_snap2;
+    insert_rows(1000);
+    EXPECT_TRUE(same_results(rb, cow));
+
+    rb->remove(rb->all());
+    cow->remove(cow->all());
+    EXPECT_EQ(cow->all().count(), 0);
+    EXPECT_FALSE(cow->all(symbol_t::ORD_DESC).has_next());
+    insert_rows(100);
+    EXPECT_TRUE(same_results(rb, cow));
+    cow->clear();
+    EXPECT_EQ(cow->all().count(), 0);
+
+    delete rb;
+    delete cow;
+}
+
+TEST(table, snapshot_table_cow_btree_readers) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("version", Value::I32);
+
+    SnapshotTable* st = new SnapshotTable(&schema, symbol_t::ENG_BTREE);
+    const int n_rows = 10000;
+    vector<Row*> rows;
+    for (i32 i = 0; i < n_rows; i++) {
+        vector<Value> row = { Value(i), Value(i32(0)) };
+        rows.push_back(Row::create(&schema, row));
+    }
+    st->bulk_load(rows);
+
+    // each reader scans a snapshot of version v, which must see every row at version v
+    const int n_readers = 4;
+    std::atomic<int> failures(0);
+    vector<std::thread> readers;
+    for (i32 version = 0; version < n_readers; version++) {
+        SnapshotTable* snap = st->snapshot();
+        readers.push_back(std::thread([snap, version, &failures] {
+            for (int round = 0; round < 10; round++) {
+                SnapshotTable::Cursor cur = snap->all(round % 2 == 0 ? symbol_t::ORD_ASC : symbol_t::ORD_DESC);
+                int n = 0;
+                while (cur.has_next()) {
+                    if (cur.next()->get_column(1).get_i32() != version) {
+                        failures++;
+                    }
+                    n++;
+                }
+                if (n != n_rows || snap->query(Value(i32(n_rows / 2))).count() != 1) {
+                    failures++;
+                }
+            }
+            delete snap;
+        }));
+        for (i32 i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value(i), Value(version + 1) };
+            Row* r = Row::create(&schema, row);
+            st->remove(rows[i]);
+            st->insert(r);
+            rows[i] = r;
+        }
+    }
+    for (auto& th : readers) {
+        th.join();
+    }
+    EXPECT_EQ(failures.load(), 0);
+
+    // a cursor keeps its version, even past the table
+    SnapshotTable::Cursor cur = st->query(Value(i32(42)));
+    delete st;
+    EXPECT_EQ(cur.count(), 1);
+    const Row* row = cur.next();
+    EXPECT_TRUE(row->readonly());
+    EXPECT_EQ(row->get_column(1).get_i32(), n_readers);
+}
+
 TEST(table, indexed_table_create) {
     IndexedSchema* schema = new IndexedSchema;
     schema->add_key_column("id", Value::I32);
@@ -857,3 +2142,527 @@ TEST(table, indexed_table_queries_on_index) {
     delete idxtbl;
     delete schema;
 }
+
+TEST(table, indexed_table_btree) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_index("i_name", {1});
+
+    for (auto engine : { symbol_t::ENG_BTREE, symbol_t::ENG_ART }) {
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        for (i32 i = 0; i < 1000; i++) {
+            vector<Value> row = { Value(i), Value("name_" + to_string(i % 100)) };
+            idxtbl->insert(Row::create(schema, row));
+        }
+        EXPECT_EQ(idxtbl->engine(), engine);
+        EXPECT_TRUE(rows_are_sorted(idxtbl->all()));
+
+        Index idx = idxtbl->get_index("i_name");
+        EXPECT_EQ(idx.query(Value("name_7")).count(), 10);
+
+        idxtbl->remove(idxtbl->query_in(Value((i32) 99), Value((i32) 900)));
+        EXPECT_EQ(idxtbl->all().count(), 200);
+        EXPECT_EQ(idx.query(Value("name_7")).count(), 2);
+
+        Index::Cursor paged = idx.all();
+        paged.skip(150);
+        EXPECT_EQ(enumerator_count(paged), 50);
+
+        idxtbl->remove(idx.query_lt(Value("name_5")));
+        EXPECT_TRUE(rows_are_sorted(idxtbl->all()));
+        EXPECT_EQ(idx.all().count(), idxtbl->all().count());
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_bulk_load) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("age", Value::I32);
+    schema->add_index("i_name", {1});
+    schema->add_index("i_age_name", {2, 1});
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        IndexedTable* loaded = new IndexedTable(schema, engine);
+        IndexedTable* inserted = new IndexedTable(schema, engine);
+        vector<Row*> batch;
+        for (i32 i = 0; i < 20000; i++) {
+            i32 id = rand() % 5000;
+            vector<Value> row = { Value(id), Value("name_" + to_string(id % 100)), Value(i32(i % 60)) };
+            batch.push_back(Row::create(schema, row));
+            inserted->insert(Row::create(schema, row));
+        }
+        loaded->bulk_load(batch.begin(), batch.end());
+        EXPECT_EQ(loaded->size(), inserted->size());
+
+        // same rows, in the same order, through the base table and both indexes
+        auto same_rows = [] (Enumerator<const Row*>&& a, Enumerator<const Row*>&& b) {
+            bool same = true;
+            while (a.has_next() && b.has_next()) {
+                const Row* ra = a.next();
+                const Row* rb = b.next();
+                same = same && ra->get_column(0).get_i32() == rb->get_column(0).get_i32()
+                            && ra->get_column(1).get_str() == rb->get_column(1).get_str()
+                            && ra->get_column(2).get_i32() == rb->get_column(2).get_i32();
+            }
+            return same && !a.has_next() && !b.has_next();
+        };
+        EXPECT_TRUE(same_rows(loaded->all(), inserted->all()));
+        for (auto idx_name : { "i_name", "i_age_name" }) {
+            Index li = loaded->get_index(idx_name);
+            Index ii = inserted->get_index(idx_name);
+            EXPECT_TRUE(same_rows(li.all(), ii.all()));
+            EXPECT_TRUE(same_rows(li.all(symbol_t::ORD_DESC), ii.all(symbol_t::ORD_DESC)));
+        }
+        EXPECT_EQ(loaded->get_index("i_name").query(Value("name_7")).count(),
+                  inserted->get_index("i_name").query(Value("name_7")).count());
+
+        // removal finds the index entries made by bulk_load
+        loaded->remove(loaded->get_index("i_name").query_lt(Value("name_5")));
+        inserted->remove(inserted->get_index("i_name").query_lt(Value("name_5")));
+        EXPECT_EQ(loaded->size(), inserted->size());
+        EXPECT_TRUE(same_rows(loaded->get_index("i_age_name").all(), inserted->get_index("i_age_name").all()));
+
+        delete loaded;
+        delete inserted;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_update) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("note", Value::STR);
+    schema->add_column("city", Value::STR);
+    schema->add_index("i_city", {3});
+    schema->add_index("i_name_id", {1, 0});
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (i32 i = 0; i < 500; i++) {
+            vector<Value> row = { Value(i), Value("name_" + to_string(i % 50)), Value(""),
+                                  Value("city_" + to_string(i % 7)) };
+            rows.push_back(Row::create(schema, row));
+            idxtbl->insert(rows.back());
+        }
+        Index i_city = idxtbl->get_index("i_city");
+        Index i_name_id = idxtbl->get_index("i_name_id");
+
+        // grows and shrinks note, moving city around inside the rows
+        for (i32 i = 0; i < 500; i++) {
+            rows[i]->update("note", string(i % 13 * 10, 'x'));
+        }
+        EXPECT_EQ(i_city.query(Value("city_3")).count(), 71);
+        for (i32 i = 0; i < 500; i += 3) {
+            rows[i]->update("note", string());
+        }
+        EXPECT_EQ(i_city.query(Value("city_3")).count(), 71);
+
+        // only i_name_id is affected
+        for (i32 i = 0; i < 500; i += 2) {
+            rows[i]->update("name", "renamed_" + to_string(i % 4));
+        }
+        EXPECT_EQ(i_name_id.query_prefix(Value("renamed_2")).count(), 125);
+        EXPECT_EQ(i_name_id.query_prefix(Value("name_1")).count(), 10);
+        EXPECT_EQ(i_city.all().count(), 500);
+
+        for (i32 i = 0; i < 500; i += 5) {
+            rows[i]->update("city", "moved");
+        }
+        EXPECT_EQ(i_city.query(Value("moved")).count(), 100);
+        {
+            Index::Cursor moved = i_city.query(Value("moved"));
+            while (moved.has_next()) {
+                EXPECT_EQ(moved.next()->get_column("id").get_i32() % 5, 0);
+            }
+        }
+        EXPECT_EQ(i_name_id.all().count(), 500);
+
+        idxtbl->remove(i_city.query(Value("moved")));
+        EXPECT_EQ(idxtbl->size(), 400u);
+        EXPECT_EQ(i_name_id.all().count(), 400);
+        EXPECT_EQ(i_city.query(Value("city_3")).count(), 57);
+        idxtbl->clear();
+        EXPECT_EQ(i_city.all().count(), 0);
+        EXPECT_EQ(i_name_id.all().count(), 0);
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_update_keeps_base_order) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("status", Value::I32);
+    schema->add_column("tag", Value::STR);
+    schema->add_index("i_status", {1});
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (i32 i = 0; i < 10; i++) {
+            vector<Value> row = { Value(i32(1)), Value(i32(0)), Value("t" + to_string(i)) };
+            rows.push_back(Row::create(schema, row));
+            idxtbl->insert(rows.back());
+        }
+        // rows with equal keys stay in insertion order, a re-insert would move rows[0] last
+        rows[0]->update("status", Value(i32(1)));
+        rows[3]->update("tag", string("a longer tag"));
+        Index i_status = idxtbl->get_index("i_status");
+        EXPECT_EQ(i_status.query(Value(i32(1))).count(), 1);
+        EXPECT_EQ(i_status.query(Value(i32(0))).count(), 9);
+        {
+            SortedTable::Cursor cur = idxtbl->all();
+            for (i32 i = 0; i < 10; i++) {
+                EXPECT_TRUE(cur.next() == rows[i]);
+            }
+        }
+
+        // a key update still moves the row
+        rows[0]->update("id", Value(i32(2)));
+        EXPECT_EQ(idxtbl->query(Value(i32(2))).count(), 1);
+        EXPECT_EQ(idxtbl->query(Value(i32(1))).count(), 9);
+        EXPECT_EQ(i_status.query(Value(i32(1))).count(), 1);
+        EXPECT_EQ(i_status.all().count(), 10);
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_hash_index) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("email", Value::STR);
+    schema->add_column("ext", Value::I64);
+    schema->add_column("status", Value::I32);
+    schema->add_hash_index("h_email", {1}, true);
+    schema->add_hash_index("h_ext", {2});
+    schema->add_index("i_status", {3});
+    EXPECT_EQ(schema->get_index_kind(0), symbol_t::IDX_UNIQUE_HASH);
+    EXPECT_EQ(schema->get_index_kind(1), symbol_t::IDX_HASH);
+    EXPECT_EQ(schema->get_index_kind(2), symbol_t::IDX_SORTED);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE }) {
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (i32 i = 0; i < 1000; i++) {
+            vector<Value> row = { Value(i), Value("user" + to_string(i) + "@example.com"), Value(i64(i % 100)),
+                                  Value(i32(i % 3)) };
+            rows.push_back(Row::create(schema, row));
+            idxtbl->insert(rows.back());
+        }
+        Index h_email = idxtbl->get_index("h_email");
+        Index h_ext = idxtbl->get_index("h_ext");
+        Index i_status = idxtbl->get_index("i_status");
+        EXPECT_TRUE(h_email.hashed());
+        EXPECT_FALSE(i_status.hashed());
+        EXPECT_EQ(h_email.query(Value("user7@example.com")).count(), 1);
+        EXPECT_EQ(h_email.query(Value("nobody@example.com")).count(), 0);
+        EXPECT_EQ(h_ext.query(Value(i64(7))).count(), 10);
+        EXPECT_EQ(h_ext.all().count(), 1000);
+
+        // rejected before any index is touched
+        vector<Value> dup = { Value(i32(5000)), Value("user7@example.com"), Value(i64(7)), Value(i32(0)) };
+        Row* dup_row = Row::create(schema, dup);
+        EXPECT_FALSE(idxtbl->try_insert(dup_row));
+        EXPECT_EQ(idxtbl->size(), 1000u);
+        EXPECT_EQ(h_ext.query(Value(i64(7))).count(), 10);
+        EXPECT_EQ(i_status.query(Value(i32(0))).count(), 334);
+        dup_row->update("email", string("user5000@example.com"));
+        EXPECT_TRUE(idxtbl->try_insert(dup_row));
+        EXPECT_EQ(h_email.query(Value("user5000@example.com")).count(), 1);
+
+        rows[7]->update("email", string("renamed@example.com"));
+        EXPECT_EQ(h_email.query(Value("user7@example.com")).count(), 0);
+        EXPECT_EQ(h_email.query(Value("renamed@example.com")).count(), 1);
+        rows[7]->update("ext", Value(i64(1000)));
+        EXPECT_EQ(h_ext.query(Value(i64(7))).count(), 10);
+        EXPECT_EQ(h_ext.query(Value(i64(1000))).count(), 1);
+
+        idxtbl->remove(h_ext.query(Value(i64(7))));
+        EXPECT_EQ(idxtbl->size(), 991u);
+        EXPECT_EQ(h_email.all().count(), 991);
+        EXPECT_EQ(i_status.all().count(), 991);
+
+        // bulk_load() fills the hash indexes as well
+        IndexedTable* loaded = new IndexedTable(schema, engine);
+        vector<Row*> batch;
+        for (i32 i = 0; i < 1000; i++) {
+            vector<Value> row = { Value(i), Value("user" + to_string(i) + "@example.com"), Value(i64(i % 100)),
+                                  Value(i32(i % 3)) };
+            batch.push_back(Row::create(schema, row));
+        }
+        loaded->bulk_load(batch);
+        EXPECT_EQ(loaded->get_index("h_email").query(Value("user7@example.com")).count(), 1);
+        EXPECT_EQ(loaded->get_index("h_ext").query(Value(i64(7))).count(), 10);
+        loaded->clear();
+        EXPECT_EQ(loaded->get_index("h_ext").all().count(), 0);
+
+        delete loaded;
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_covering) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("region", Value::STR);
+    schema->add_column("amount", Value::DOUBLE);
+    schema->add_column("delta", Value::I64);
+    schema->add_column("note", Value::STR);
+    schema->add_index("i_region", {1}, {2, 3});
+    EXPECT_EQ(schema->get_index_include(0).size(), 2u);
+
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        vector<Row*> rows;
+        for (i32 i = 0; i < 1000; i++) {
+            // a 0x00 in the middle of region, negative values in included columns
+            string region = string("r\0", 2) + to_string(i % 7);
+            vector<Value> row = { Value(i), Value(region), Value(i * -0.5), Value(i64(500 - i)), Value("n") };
+            rows.push_back(Row::create(schema, row));
+            idxtbl->insert(rows.back());
+        }
+        Index idx = idxtbl->get_index("i_region");
+        vector<column_id_t> entry_cols = { 1, 0, 2, 3 };
+        EXPECT_TRUE(idx.entry_columns() == entry_cols);
+
+        // every entry reads the same values as its base row
+        {
+            int n = 0;
+            vector<Value> values;
+            Index::Cursor cur = idx.all();
+            Index::Cursor rows_cur = idx.all();
+            while (cur) {
+                cur.next_values(&values);
+                const Row* row = rows_cur.next();
+                EXPECT_EQ(values.size(), entry_cols.size());
+                for (size_t i = 0; i < entry_cols.size(); i++) {
+                    EXPECT_EQ(values[i], row->get_column(entry_cols[i]));
+                }
+                n++;
+            }
+            EXPECT_EQ(n, 1000);
+        }
+
+        // updates of included columns are seen on the index
+        rows[14]->update("amount", Value(123.25));
+        rows[14]->update("delta", Value(i64(-7)));
+        rows[15]->update("note", string("not covered"));
+        {
+            vector<Value> values;
+            Index::Cursor cur = idx.query(Value(string("r\0", 2) + "0"));
+            EXPECT_EQ(cur.count(), 143);
+            bool found = false;
+            while (cur) {
+                cur.next_values(&values);
+                if (values[1].get_i32() == 14) {
+                    EXPECT_EQ(values[2].get_double(), 123.25);
+                    EXPECT_EQ(values[3].get_i64(), -7);
+                    found = true;
+                }
+            }
+            EXPECT_TRUE(found);
+        }
+
+        IndexedTable* loaded = new IndexedTable(schema, engine);
+        vector<Row*> batch;
+        for (i32 i = 0; i < 1000; i++) {
+            vector<Value> row = { Value(i), Value("r" + to_string(i % 7)), Value(i * 0.25), Value(i64(i)), Value("n") };
+            batch.push_back(Row::create(schema, row));
+        }
+        loaded->bulk_load(batch);
+        {
+            vector<Value> values;
+            Index::Cursor cur = loaded->get_index("i_region").query_prefix(Value("r3"), symbol_t::ORD_DESC);
+            i32 last_id = 1000;
+            while (cur) {
+                cur.next_values(&values);
+                EXPECT_EQ(values[0].get_str(), "r3");
+                EXPECT_LT(values[1].get_i32(), last_id);
+                last_id = values[1].get_i32();
+                EXPECT_EQ(values[2].get_double(), last_id * 0.25);
+                EXPECT_EQ(values[3].get_i64(), last_id);
+            }
+        }
+
+        delete loaded;
+        delete idxtbl;
+    }
+    delete schema;
+}
+
+TEST(table, indexed_table_create_index) {
+    for (auto engine : { symbol_t::ENG_RBTREE, symbol_t::ENG_BTREE, symbol_t::ENG_SKIPLIST, symbol_t::ENG_ART }) {
+        // the schema gets the new indexes, one per table
+        IndexedSchema* schema = new IndexedSchema;
+        schema->add_key_column("id", Value::I32);
+        schema->add_column("name", Value::STR);
+        schema->add_column("score", Value::I32);
+        schema->add_column("note", Value::STR);
+        schema->add_index("i_name", {1});
+
+        IndexedTable* idxtbl = new IndexedTable(schema, engine);
+        const i32 n_rows = 40000;
+        vector<Row*> rows;
+        for (i32 i = 0; i < n_rows; i++) {
+            vector<Value> row = { Value(i), Value("name_" + to_string(i % 100)), Value(i32(i % 97)), Value("n") };
+            rows.push_back(Row::create(schema, row));
+            idxtbl->insert(rows.back());
+        }
+
+        EXPECT_EQ(idxtbl->create_index("i_score", {2}, 4), 1);
+        Index i_score = idxtbl->get_index("i_score");
+        EXPECT_EQ(i_score.query(Value(i32(5))).count(), 413);
+        EXPECT_EQ(i_score.all().count(), n_rows);
+        rows[5]->update("score", Value(i32(1000)));
+        EXPECT_EQ(i_score.query(Value(i32(5))).count(), 412);
+        EXPECT_EQ(i_score.query(Value(i32(1000))).count(), 1);
+
+        // the table keeps changing between the steps
+        idxtbl->begin_create_index("i_score_name", {2, 1}, 4);
+        EXPECT_FALSE(schema->has_index("i_score_name"));
+        for (i32 i = n_rows; i < n_rows + 100; i++) {
+            vector<Value> row = { Value(i), Value("late"), Value(i32(7)), Value("n") };
+            idxtbl->insert(Row::create(schema, row));
+        }
+        idxtbl->remove(idxtbl->get_index("i_name").query(Value("name_3")));
+        idxtbl->sort_created_index(4);
+        rows[10]->update("score", Value(i32(7)));
+        rows[11]->update("name", string("renamed"));
+        rows[12]->update("note", string("not indexed"));
+        rows[13]->update("id", Value(i32(-13)));
+        rows[14]->update("score", Value(i32(-1)));
+        idxtbl->remove(rows[14]);
+        for (i32 i = 0; i < 10; i++) {
+            vector<Value> row = { Value(n_rows + 1000 + i), Value("latest"), Value(i32(7)), Value("n") };
+            idxtbl->insert(Row::create(schema, row));
+        }
+        EXPECT_EQ(idxtbl->finish_create_index(), 2);
+
+        // same entries as the base rows, in index order
+        Index idx = idxtbl->get_index("i_score_name");
+        EXPECT_EQ(idx.all().count(), (int) idxtbl->size());
+        {
+            vector<Value> values;
+            vector<Value> last;
+            int n = 0;
+            Index::Cursor cur = idx.all();
+            Index::Cursor rows_cur = idx.all();
+            while (cur) {
+                cur.next_values(&values);
+                const Row* row = rows_cur.next();
+                EXPECT_EQ(values[0], row->get_column(2));
+                EXPECT_EQ(values[1], row->get_column(1));
+                EXPECT_EQ(values[2], row->get_column(0));
+                EXPECT_FALSE(values < last);
+                last = values;
+                n++;
+            }
+            EXPECT_EQ(n, (int) idxtbl->size());
+        }
+        Value seven(i32(7)), late("late"), eleven(i32(11)), renamed("renamed");
+        MultiBlob mb(2);
+        mb[0] = seven.get_blob();
+        mb[1] = late.get_blob();
+        EXPECT_EQ(idx.query(mb).count(), 100);
+        mb[0] = eleven.get_blob();
+        mb[1] = renamed.get_blob();
+        EXPECT_EQ(idx.query(mb).count(), 1);
+        EXPECT_EQ(idx.query_prefix(seven).count(), 100 + 10 + 413 - 4 + 1);
+        EXPECT_EQ(idx.query(Value(i32(-1))).count(), 0);
+
+        // cleared while the index was being created
+        idxtbl->begin_create_index("i_note", {3});
+        idxtbl->clear();
+        vector<Value> row = { Value(i32(1)), Value("a"), Value(i32(1)), Value("after clear") };
+        idxtbl->insert(Row::create(schema, row));
+        idxtbl->sort_created_index();
+        idxtbl->finish_create_index();
+        EXPECT_EQ(idxtbl->get_index("i_note").all().count(), 1);
+        EXPECT_EQ(idxtbl->get_index("i_note").query(Value("after clear")).count(), 1);
+
+        delete idxtbl;
+        delete schema;
+    }
+}
+
+TEST(table, indexed_table_abort_create_index) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("score", Value::I32);
+    schema->add_column("note", Value::STR);
+    schema->add_index("i_name", {1});
+
+    IndexedTable* idxtbl = new IndexedTable(schema, symbol_t::ENG_BTREE);
+    for (i32 i = 0; i < 1000; i++) {
+        vector<Value> row = { Value(i), Value("name_" + to_string(i % 10)), Value(i32(i % 7)), Value("n") };
+        idxtbl->insert(Row::create(schema, row));
+    }
+
+    idxtbl->begin_create_index("i_name_score", {1, 2});
+    EXPECT_TRUE(schema->get_column_info(2)->indexed);
+    idxtbl->sort_created_index();
+    idxtbl->abort_create_index();
+    EXPECT_FALSE(schema->has_index("i_name_score"));
+    EXPECT_TRUE(schema->get_column_info(1)->indexed);
+    EXPECT_FALSE(schema->get_column_info(2)->indexed);
+
+    // the table works as before, and the index can still be created
+    Row* row = idxtbl->query(Value(i32(3))).next();
+    row->update("name", string("renamed"));
+    row->update("score", Value(i32(100)));
+    EXPECT_EQ(idxtbl->get_index("i_name").query(Value("renamed")).count(), 1);
+    EXPECT_EQ(idxtbl->create_index("i_name_score", {1, 2}), 1);
+    EXPECT_EQ(idxtbl->get_index("i_name_score").query_prefix(Value("renamed")).count(), 1);
+
+    // dropped along with the table
+    idxtbl->begin_create_index("i_note", {3});
+    EXPECT_TRUE(schema->get_column_info(3)->indexed);
+    delete idxtbl;
+    EXPECT_FALSE(schema->get_column_info(3)->indexed);
+    EXPECT_FALSE(schema->has_index("i_note"));
+
+    delete schema;
+}
+
+TEST(table, indexed_table_key_prefix) {
+    IndexedSchema* schema = new IndexedSchema;
+    schema->add_key_column("id", Value::I32);
+    schema->add_column("name", Value::STR);
+    schema->add_column("age", Value::I32);
+    schema->add_index("i_name_age", {1, 2});
+
+    IndexedTable* idxtbl = new IndexedTable(schema, symbol_t::ENG_BTREE);
+    for (i32 i = 0; i < 1000; i++) {
+        vector<Value> row = { Value(i), Value("name_" + to_string(i % 10)), Value(i32(i % 37)) };
+        idxtbl->insert(Row::create(schema, row));
+    }
+    Index idx = idxtbl->get_index("i_name_age");
+    EXPECT_EQ(idx.query(Value("name_3")).count(), 100);
+    EXPECT_EQ(idx.query_prefix(Value("name_3")).count(), 100);
+    Index::Cursor desc = idx.query_prefix(Value("name_3"), symbol_t::ORD_DESC);
+    i32 last_age = 37;
+    while (desc.has_next()) {
+        i32 age = desc.next()->get_column("age").get_i32();
+        EXPECT_TRUE(age <= last_age);
+        last_age = age;
+    }
+    EXPECT_EQ(idx.query_lt(Value("name_3")).count(), 300);
+    EXPECT_EQ(idx.query_gt(Value("name_3")).count(), 600);
+    EXPECT_EQ(idx.query_in(Value("name_3"), Value("name_6")).count(), 200);
+
+    idxtbl->remove(idx.query_prefix(Value("name_3")));
+    EXPECT_EQ(idx.query_prefix(Value("name_3")).count(), 0);
+    EXPECT_EQ(idxtbl->all().count(), 900);
+
+    delete idxtbl;
+    delete schema;
+}
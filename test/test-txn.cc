@@ -1,3 +1,5 @@
+#include <functional>
+
 #include "base/all.h"
 #include "memdb/txn.h"
 #include "memdb/table.h"
@@ -156,6 +158,201 @@ TEST(txn, basic_op_occ) {
     delete student_tbl;
 }
 
+TEST(txn, result_set_skip) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    SortedTable* tbl = new SortedTable(&schema, symbol_t::ENG_BTREE);
+    for (i32 i = 0; i < 1000; i++) {
+        vector<Value> row = { Value(i), Value("dummy") };
+        tbl->insert(Row::create(&schema, row));
+    }
+
+    TxnMgrUnsafe unsafe_mgr;
+    TxnMgr2PL mgr_2pl;
+    for (TxnMgr* mgr : { (TxnMgr *) &unsafe_mgr, (TxnMgr *) &mgr_2pl }) {
+        mgr->reg_table("tbl", tbl);
+        Txn* txn = mgr->start(1);
+        ResultSet rs = txn->query_gt(tbl, Value(i32(99)));
+        rs.skip(800);
+        EXPECT_EQ(rs.next()->get_i32(0), 900);
+        ResultSet desc = txn->query_gt(tbl, Value(i32(99)), symbol_t::ORD_DESC);
+        desc.skip(10);
+        EXPECT_EQ(desc.next()->get_i32(0), 989);
+        desc.skip(10000);
+        EXPECT_FALSE(desc.has_next());
+        txn->commit_or_abort();
+        delete txn;
+    }
+
+    delete tbl;
+}
+
+// count() and skip() on each result set must agree with walking it
+static void expect_count_and_skip_match(std::function<ResultSet ()> query) {
+    vector<i32> ids;
+    for (ResultSet rs = query(); rs.has_next(); ) {
+        ids.push_back(rs.next()->get_i32(0));
+    }
+    int n = ids.size();
+    EXPECT_EQ(query().count(), n);
+    for (int k : { 0, 1, 7, 60, n - 1, n, n + 5 }) {
+        for (int walked : { 0, 3 }) {
+            if (k < 0 || walked > n) {
+                continue;
+            }
+            ResultSet rs = query();
+            for (int i = 0; i < walked; i++) {
+                rs.next();
+            }
+            rs.skip(k);
+            if (walked + k < n) {
+                EXPECT_EQ(rs.next()->get_i32(0), ids[walked + k]);
+            } else {
+                EXPECT_FALSE(rs.has_next());
+            }
+            EXPECT_EQ(rs.count(), n);
+        }
+    }
+}
+
+TEST(txn, result_set_count) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    // even ids only, staged inserts below use odd ones; 2PL removes need lockable rows
+    SortedTable* tbl = new SortedTable(&schema, symbol_t::ENG_BTREE);
+    for (i32 i = 0; i < 1000; i += 2) {
+        vector<Value> row = { Value(i), Value("dummy") };
+        tbl->insert(FineLockedRow::create(&schema, row));
+    }
+
+    auto check_queries = [tbl] (Txn* txn) {
+        for (symbol_t order : { symbol_t::ORD_ASC, symbol_t::ORD_DESC }) {
+            expect_count_and_skip_match([=] { return txn->all(tbl, order); });
+            expect_count_and_skip_match([=] { return txn->query_gt(tbl, Value(i32(99)), order); });
+            expect_count_and_skip_match([=] { return txn->query_lt(tbl, Value(i32(300)), order); });
+            expect_count_and_skip_match([=] { return txn->query_in(tbl, Value(i32(100)), Value(i32(302)), order); });
+        }
+        for (i32 id : { 100, 101, 121, 250, 300 }) {
+            expect_count_and_skip_match([=] { return txn->query(tbl, Value(id)); });
+        }
+    };
+
+    TxnMgrUnsafe unsafe_mgr;
+    unsafe_mgr.reg_table("tbl", tbl);
+    Txn* unsafe_txn = unsafe_mgr.start(1);
+    check_queries(unsafe_txn);
+    EXPECT_EQ(unsafe_txn->all(tbl).count(), 500);
+    unsafe_txn->commit_or_abort();
+    delete unsafe_txn;
+
+    TxnMgr2PL mgr_2pl;
+    mgr_2pl.reg_table("tbl", tbl);
+    Txn* txn = mgr_2pl.start(1);
+    for (i32 i = 101; i < 120; i += 2) {
+        vector<Value> row = { Value(i), Value("staged") };
+        txn->insert_row(tbl, FineLockedRow::create(&schema, row));
+    }
+    for (i32 i = 200; i < 300; i += 2) {
+        txn->remove_row(tbl, txn->query(tbl, Value(i)).next());
+    }
+    check_queries(txn);
+    EXPECT_EQ(txn->all(tbl).count(), 500 + 10 - 50);
+    EXPECT_EQ(txn->query(tbl, Value(i32(250))).count(), 0);
+
+    // nested on top: its own inserts and removes, including a row staged by the outer txn
+    Txn* inner = mgr_2pl.start_nested(txn);
+    vector<Value> inner_row = { Value(i32(121)), Value("inner") };
+    inner->insert_row(tbl, FineLockedRow::create(&schema, inner_row));
+    inner->remove_row(tbl, inner->query(tbl, Value(i32(101))).next());
+    inner->remove_row(tbl, inner->query(tbl, Value(i32(300))).next());
+    check_queries(inner);
+    EXPECT_EQ(inner->all(tbl).count(), 500 + 10 - 50 + 1 - 2);
+    inner->commit_or_abort();
+    delete inner;
+
+    txn->commit_or_abort();
+    delete txn;
+    EXPECT_EQ(tbl->size(), 500u + 10 - 50 + 1 - 2);
+
+    delete tbl;
+}
+
+TEST(txn, typed_reads) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+    schema.add_column("balance", Value::DOUBLE);
+
+    {
+        TxnMgr2PL txnmgr;
+        UnsortedTable* tbl = new UnsortedTable(&schema);
+        txnmgr.reg_table("account", tbl);
+        vector<Value> row1 = { Value((i32) 1), Value("alice"), Value(10.0) };
+        FineLockedRow* r1 = FineLockedRow::create(&schema, row1);
+        tbl->insert(r1);
+
+        Txn* txn1 = txnmgr.start(1);
+        i32 id = 0;
+        double balance = 0;
+        blob name_view;
+        EXPECT_TRUE(txn1->read_i32(r1, 0, &id));
+        EXPECT_TRUE(txn1->read_str_view(r1, 1, &name_view));
+        EXPECT_TRUE(txn1->read_double(r1, 2, &balance));
+        EXPECT_EQ(id, 1);
+        EXPECT_EQ(string(name_view.data, name_view.len), "alice");
+        EXPECT_EQ(balance, 10.0);
+
+        // read locked by txn1
+        Txn* txn2 = txnmgr.start(2);
+        EXPECT_FALSE(txn2->write_column(r1, 2, Value(20.0)));
+        txn2->abort();
+        txn1->commit_or_abort();
+
+        // staged updates are visible to typed reads
+        Txn* txn3 = txnmgr.start(3);
+        EXPECT_TRUE(txn3->write_column(r1, 1, Value("bob")));
+        EXPECT_TRUE(txn3->read_str_view(r1, 1, &name_view));
+        EXPECT_EQ(string(name_view.data, name_view.len), "bob");
+        EXPECT_EQ(r1->get_column(1), Value("alice"));
+        txn3->commit_or_abort();
+        name_view = r1->get_str_view(1);
+        EXPECT_EQ(string(name_view.data, name_view.len), "bob");
+
+        delete txn1;
+        delete txn2;
+        delete txn3;
+        delete tbl;
+    }
+
+    {
+        TxnMgrOCC txnmgr;
+        UnsortedTable* tbl = new UnsortedTable(&schema);
+        txnmgr.reg_table("account", tbl);
+        vector<Value> row1 = { Value((i32) 1), Value("alice"), Value(10.0) };
+        VersionedRow* r1 = VersionedRow::create(&schema, row1);
+        tbl->insert(r1);
+
+        // typed reads are version checked, just like read_column
+        Txn* txn1 = txnmgr.start(1);
+        double balance = 0;
+        EXPECT_TRUE(txn1->read_double(r1, 2, &balance));
+        EXPECT_EQ(balance, 10.0);
+
+        Txn* txn2 = txnmgr.start(2);
+        EXPECT_TRUE(txn2->write_column(r1, 2, Value(balance + 1)));
+        EXPECT_TRUE(txn2->commit_or_abort());
+        EXPECT_FALSE(txn1->commit_or_abort());
+
+        delete txn1;
+        delete txn2;
+        delete tbl;
+    }
+}
+
 TEST(txn, 2pl_remove_dup_row_in_staging_area) {
     TxnMgr2PL txnmgr;
     Schema schema;
@@ -291,6 +488,60 @@ TEST(txn, query_in_unsorted_table_staging_area_while_deleting) {
     delete schema;
 }
 
+TEST(txn, multi_query) {
+    Schema schema;
+    schema.add_key_column("id", Value::I32);
+    schema.add_column("name", Value::STR);
+
+    for (auto kind : { TBL_UNSORTED, TBL_SORTED }) {
+        TxnMgr2PL txnmgr;
+        Table* tbl = nullptr;
+        if (kind == TBL_UNSORTED) {
+            tbl = new UnsortedTable(&schema);
+        } else {
+            tbl = new SortedTable(&schema, symbol_t::ENG_BTREE);
+        }
+        txnmgr.reg_table("student", tbl);
+        for (i32 id = 0; id < 100; id++) {
+            vector<Value> row = { Value(id), Value("committed") };
+            tbl->insert(FineLockedRow::create(&schema, row));
+        }
+
+        // staged inserts and removes show up in every result, the same as in query()
+        Txn* txn = txnmgr.start(1);
+        vector<Value> row = { Value(i32(5)), Value("staged") };
+        txn->insert_row(tbl, FineLockedRow::create(&schema, row));
+        row[0] = Value(i32(200));
+        txn->insert_row(tbl, FineLockedRow::create(&schema, row));
+        txn->remove_row(tbl, txn->query(tbl, Value(i32(7))).next());
+
+        vector<Value> ids = { Value(i32(5)), Value(i32(7)), Value(i32(200)), Value(i32(300)), Value(i32(42)) };
+        vector<MultiBlob> keys;
+        for (auto& id : ids) {
+            keys.push_back(id.get_blob());
+        }
+        vector<ResultSet> results = txn->multi_query(tbl, keys);
+        EXPECT_EQ(results.size(), keys.size());
+        EXPECT_EQ(enumerator_count(results[0]), 2);
+        EXPECT_EQ(enumerator_count(results[1]), 0);
+        EXPECT_EQ(enumerator_count(results[2]), 1);
+        EXPECT_EQ(enumerator_count(results[3]), 0);
+        EXPECT_EQ(enumerator_count(results[4]), 1);
+        EXPECT_TRUE(txn->commit());
+        delete txn;
+
+        TxnMgrUnsafe unsafe_mgr;
+        Txn* unsafe = unsafe_mgr.start(2);
+        results = unsafe->multi_query(tbl, keys);
+        EXPECT_EQ(enumerator_count(results[0]), 2);
+        EXPECT_EQ(enumerator_count(results[1]), 0);
+        EXPECT_EQ(enumerator_count(results[2]), 1);
+        results.clear();
+        delete unsafe;
+        delete tbl;
+    }
+}
+
 TEST(txn, query_sorted_table_ordering) {
     TxnMgr2PL txnmgr;
     Schema schema;
@@ -447,6 +698,43 @@ TEST(txn, query_sorted_table_ordering) {
     delete student_tbl;
 }
 
+TEST(txn, query_key_prefix) {
+    TxnMgr2PL txnmgr;
+    Schema schema;
+    schema.add_key_column("tenant", Value::I32);
+    schema.add_key_column("ts", Value::I64);
+    schema.add_column("name", Value::STR);
+
+    Table* events_tbl = new SortedTable(&schema, symbol_t::ENG_BTREE);
+    txnmgr.reg_table("events", events_tbl);
+    for (i32 tenant = 0; tenant < 5; tenant++) {
+        for (i64 ts = 0; ts < 10; ts += 2) {
+            vector<Value> row = { Value(tenant), Value(ts), Value("committed") };
+            events_tbl->insert(FineLockedRow::create(&schema, row));
+        }
+    }
+
+    // staged inserts show up in prefix queries, merged in key order
+    Txn* txn = txnmgr.start(1);
+    for (i64 ts = 1; ts < 10; ts += 2) {
+        vector<Value> row = { Value(i32(2)), Value(ts), Value("staged") };
+        txn->insert_row(events_tbl, FineLockedRow::create(&schema, row));
+    }
+    EXPECT_EQ(enumerator_count(txn->query_prefix(events_tbl, Value(i32(2)))), 10);
+    EXPECT_TRUE(rows_are_sorted(txn->query_prefix(events_tbl, Value(i32(2)))));
+    EXPECT_EQ(enumerator_count(txn->query(events_tbl, Value(i32(3)))), 5);
+    EXPECT_EQ(enumerator_count(txn->query_lt(events_tbl, Value(i32(2)))), 10);
+    EXPECT_EQ(enumerator_count(txn->query_gt(events_tbl, Value(i32(1)))), 20);
+    EXPECT_TRUE(rows_are_sorted(txn->query_gt(events_tbl, Value(i32(1)), symbol_t::ORD_DESC), symbol_t::ORD_DESC));
+    EXPECT_EQ(enumerator_count(txn->query_in(events_tbl, Value(i32(1)), Value(i32(4)))), 15);
+    EXPECT_TRUE(txn->commit());
+    delete txn;
+
+    EXPECT_EQ(enumerator_count(((SortedTable *) events_tbl)->query_prefix(Value(i32(2)).get_blob())), 10);
+
+    delete events_tbl;
+}
+
 TEST(txn, query_snapshot_table_ordering) {
     TxnMgr2PL txnmgr;
     Schema schema;
@@ -1,5 +1,6 @@
 #include <map>
 #include <string>
+#include <vector>
 
 #include "memdb/schema.h"
 #include "base/all.h"
@@ -54,4 +55,58 @@ TEST(value, to_string) {
     EXPECT_EQ(to_string(v4), "STR:hello");
     v4.set_str("hello, world");
     EXPECT_EQ(to_string(v4), "STR:hello, world");
-}
\ No newline at end of file
+}
+
+TEST(value, move) {
+    Value v1("a string which is moved around");
+    const char* str_data = v1.get_str().data();
+    Value v2(std::move(v1));
+    EXPECT_EQ(v1.get_kind(), Value::UNKNOWN);
+    EXPECT_EQ(v2.get_str(), "a string which is moved around");
+    EXPECT_EQ(v2.get_str().data(), str_data);   // no deep copy
+
+    Value v3(42);
+    v3 = std::move(v2);
+    EXPECT_EQ(v3.get_str().data(), str_data);
+    v2 = Value((i64) 7);
+    EXPECT_EQ(v2.get_i64(), 7);
+
+    vector<Value> values;
+    for (int i = 0; i < 100; i++) {
+        values.push_back(Value(to_string(i)));
+    }
+    EXPECT_EQ(values[63].get_str(), "63");
+}
+
+TEST(value, multi_blob) {
+    Value v1(1), v2("two"), v3(3.0), v4((i64) 4), v5("five");
+    MultiBlob small(2);
+    small[0] = v1.get_blob();
+    small[1] = v2.get_blob();
+    MultiBlob small_copy(small);
+    EXPECT_TRUE(small_copy == small);
+    EXPECT_NEQ(&small_copy[0], &small[0]);
+    MultiBlob small_moved(std::move(small_copy));
+    EXPECT_TRUE(small_moved == small);
+    EXPECT_EQ(small_copy.count(), 0);
+
+    MultiBlob large(5);
+    large[0] = v1.get_blob();
+    large[1] = v2.get_blob();
+    large[2] = v3.get_blob();
+    large[3] = v4.get_blob();
+    large[4] = v5.get_blob();
+    blob* large_blobs = &large[0];
+    MultiBlob large_moved(std::move(large));
+    EXPECT_EQ(&large_moved[0], large_blobs);
+    EXPECT_EQ(large_moved.count(), 5);
+    EXPECT_EQ(large.count(), 0);
+
+    small_moved = large_moved;
+    EXPECT_TRUE(small_moved == large_moved);
+    large_moved = small;
+    EXPECT_TRUE(large_moved == small);
+    small = std::move(small_moved);
+    EXPECT_EQ(small.count(), 5);
+    EXPECT_TRUE(small[4] == v5.get_blob());
+}